@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+Broadcast fan-out cost per recipient, packing every message once per client
+(how broadcast_message used to work) against packing it once per broadcast.
+
+Recipients are socketpairs whose far ends are drained between rounds, so the
+timings cover packing, queueing and the send syscalls but never a full socket.
+
+    python3 bench/broadcast_bench.py [--rounds N] [--proto framed|legacy|mixed]
+"""
+import argparse
+import contextlib
+import os
+import socket
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+import server  # noqa: E402
+
+CLIENT_COUNTS = (10, 100, 1000)
+TEXT = "the quick brown fox jumps over the lazy dog while the build is green"
+
+
+def per_client_broadcast(message_type, username, text):
+    """
+    The loop broadcast_message ran before encode-once: one pack_message() per recipient
+    """
+    message = server.Message(message_type, username, text)
+    print(f"[MESSAGE] {message_type}\t{server.datetime.datetime.fromtimestamp(message.timestamp)}\t{username}: {message.message}")
+    with server.clients_lock:
+        for sock, u, ip, proto in server.clients:
+            server.send_all(sock, message.pack_message(proto))
+
+
+def drain(peers):
+    for peer in peers:
+        try:
+            while peer.recv(1 << 20):
+                pass
+        except BlockingIOError:
+            pass
+
+
+def make_clients(n, proto_mode):
+    pairs = []
+    for i in range(n):
+        a, b = socket.socketpair()
+        b.setblocking(False)
+        if proto_mode == "mixed":
+            proto = server.PROTO_FRAMED if i % 2 else server.PROTO_LEGACY
+        else:
+            proto = server.PROTO_LEGACY if proto_mode == "legacy" else server.PROTO_FRAMED
+        pairs.append((a, b, proto))
+    return pairs
+
+
+def time_rounds(fn, peers, rounds):
+    """
+    Best-of-rounds for one broadcast, in seconds; the drain between rounds is not timed
+    """
+    best = float("inf")
+    with open(os.devnull, "w") as devnull, contextlib.redirect_stdout(devnull):
+        for _ in range(rounds):
+            start = time.perf_counter()
+            fn()
+            best = min(best, time.perf_counter() - start)
+            drain(peers)
+    return best
+
+
+def bench_threaded(pairs, rounds):
+    server.clients[:] = [(a, f"u{i}", "127.0.0.1", proto) for i, (a, _, proto) in enumerate(pairs)]
+    peers = [b for _, b, _ in pairs]
+    recv = server.Message.MessageType.MSG_MESSAGE_RECV.value
+    before = time_rounds(lambda: per_client_broadcast(recv, "bench", TEXT), peers, rounds)
+    after = time_rounds(lambda: server.broadcast_message(recv, "bench", TEXT), peers, rounds)
+    server.clients.clear()
+    return before, after
+
+
+def bench_async(pairs, rounds, per_pass):
+    """
+    AsyncServer.broadcast() plus the flush that writes the queues out, as one loop pass would.
+    per_pass broadcasts share each flush; the result is per broadcast
+    """
+    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    srv.bind(("127.0.0.1", 0))
+    srv.listen()
+    engine = server.AsyncServer(srv)
+    for i, (a, _, proto) in enumerate(pairs):
+        a.setblocking(False)
+        c = server.AsyncClient(a, ("127.0.0.1", 0), i)
+        c.username, c.proto, c.logged_in = f"u{i}", proto, True
+        engine.clients[a] = c
+        engine.conns[c.conn] = c
+        engine.users[c.username] = c
+        engine.sel.register(a, server.selectors.EVENT_READ, c)
+
+    def one():
+        for _ in range(per_pass):
+            engine.broadcast(server.Message.MessageType.MSG_MESSAGE_RECV.value, "bench", TEXT)
+        engine.flush_dirty()
+
+    took = time_rounds(one, [b for _, b, _ in pairs], rounds) / per_pass
+    for a, _, _ in pairs:
+        engine.sel.unregister(a)
+        a.setblocking(True)
+    engine.sel.close()
+    server.signal.set_wakeup_fd(-1)
+    srv.close()
+    return took
+
+
+def main():
+    parser = argparse.ArgumentParser(description="broadcast fan-out cost per recipient")
+    parser.add_argument("--rounds", type=int, default=50, help="broadcasts timed per configuration (best is kept)")
+    parser.add_argument("--proto", choices=("framed", "legacy", "mixed"), default="framed",
+                        help="protocol version of the simulated recipients")
+    args = parser.parse_args()
+    with open(os.devnull, "w") as devnull, contextlib.redirect_stdout(devnull):
+        server.raise_fd_limit()
+
+    print(f"{args.proto} recipients, best of {args.rounds} broadcasts, ns per recipient")
+    print(f"{'clients':>8} {'per-client pack':>16} {'encode once':>12} {'speedup':>8} {'async':>8} {'async x10/pass':>15}")
+    for n in CLIENT_COUNTS:
+        pairs = make_clients(n, args.proto)
+        before, after = bench_threaded(pairs, args.rounds)
+        queued = bench_async(pairs, args.rounds, 1)
+        batched = bench_async(pairs, args.rounds, 10)
+        for a, b, _ in pairs:
+            a.close()
+            b.close()
+        print(f"{n:>8} {before / n * 1e9:>16.0f} {after / n * 1e9:>12.0f} {before / after:>7.2f}x {queued / n * 1e9:>8.0f} {batched / n * 1e9:>15.0f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,698 @@
+#!/usr/bin/env python3
+"""
+Load generator and latency benchmarks for mycord.
+
+fanout  N synthetic clients log in to a server (server.py or anything else
+        speaking message_t). Some of them send chat lines at a fixed rate,
+        kept under the server's 5 messages per second limit. Every recipient
+        timestamps the copies it gets back. Reported: delivery and
+        full-fan-out latency (p50/p99/p999), throughput, and server memory
+        per connection when its pid is known. The generator is a single
+        Python process. At high delivery rates it can be the bottleneck;
+        if so, run several with different --prefix values.
+
+render  Plays the server for one local client build running in a pty and
+        sends it MESSAGE_RECV frames. Each frame is timed until its text
+        shows up on the terminal, covering receive, queueing, tui_render
+        and the terminal write.
+
+stall   The same setup, but the terminal is not read until the renderer is
+        blocked in write(). Bursts of frames are then timed until they have
+        left the client's socket, showing the reader keeps reading while
+        its inbound ring has room, and that it waits once the ring is full.
+
+deflate Plays a server that grants deflate to one --headless --compress
+        client and sends it deflate blocks back to back, several to one
+        write. Checks every frame is printed exactly once, in order.
+
+    python3 bench/loadgen.py fanout --spawn --clients 500 --senders 50
+    python3 bench/loadgen.py fanout --spawn --server-args=--async --clients 3000
+    python3 bench/loadgen.py fanout --port 8080 --server-pid 1234
+    python3 bench/loadgen.py render --client ./client --messages 2000 --rate 200
+    python3 bench/loadgen.py render --client ./client --plain -- --quiet
+    python3 bench/loadgen.py stall --client ./client
+    python3 bench/loadgen.py deflate --client ./client
+"""
+import argparse
+import fcntl
+import os
+import pty
+import random
+import re
+import resource
+import select
+import selectors
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import termios
+import time
+
+REPO = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.insert(0, REPO)
+from server import Deflater, DEFLATE_OPTION, Message, PROTO_HELLO  # noqa: E402
+
+LOGIN, MESSAGE_SEND, MESSAGE_RECV = 0, 2, 10
+RATE_LIMIT = 5          # messages per client per second before the server disconnects it
+RATE_CEILING = 4.5      # highest --rate accepted, leaving room for scheduling jitter
+LATENCY_TAG = "lg"      # fanout payloads are "lg <sender> <seq> <send ns>"
+
+
+def percentile(ordered, p):
+    if not ordered:
+        return float("nan")
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p))]
+
+
+def latency_line(label, samples_us):
+    ordered = sorted(samples_us)
+    def fmt(v):
+        return f"{v / 1000:.2f}ms" if v >= 1000 else f"{v:.0f}us"
+    return (f"{label:<22} n={len(ordered):<8} p50={fmt(percentile(ordered, 0.50))}"
+            f" p99={fmt(percentile(ordered, 0.99))} p999={fmt(percentile(ordered, 0.999))}"
+            f" max={fmt(ordered[-1] if ordered else float('nan'))}")
+
+
+def rss_kb(pid):
+    try:
+        with open(f"/proc/{pid}/status") as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return None
+
+
+def raise_fd_limit():
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if hard == resource.RLIM_INFINITY or hard > soft:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (1 << 20 if hard == resource.RLIM_INFINITY else hard, hard))
+
+
+def next_frame(buf, framed):
+    """
+    Decode one frame from the front of buf: returns (type, username, message, size) or None if incomplete
+    """
+    if framed:
+        if len(buf) < Message.HDR_SIZE:
+            return None
+        msg_type, uname_len, msg_len, _ = struct.unpack_from(Message.HDR_FMT, buf)
+        size = Message.HDR_SIZE + uname_len + msg_len
+        if len(buf) < size:
+            return None
+        body = bytes(buf[Message.HDR_SIZE:size])
+        return msg_type, body[:uname_len].decode(errors="ignore"), body[uname_len:].decode(errors="ignore"), size
+    if len(buf) < Message.MSG_SIZE:
+        return None
+    msg = Message.unpack_message(bytes(buf[:Message.MSG_SIZE]))
+    return msg.message_type, msg.username, msg.message, Message.MSG_SIZE
+
+
+# ---------------------------------------------------------------------------
+# fanout
+# ---------------------------------------------------------------------------
+
+class SyntheticClient:
+    __slots__ = ("sock", "name", "inbuf", "framed", "acked", "frames", "sender", "next_send", "seq", "closed")
+
+    def __init__(self, sock, name, offer_framed):
+        self.sock = sock
+        self.name = name
+        self.inbuf = bytearray()
+        self.framed = False
+        self.acked = not offer_framed   # waiting on the MYCORD/2 acknowledgement
+        self.frames = 0
+        self.sender = -1
+        self.next_send = 0.0
+        self.seq = 0
+        self.closed = None              # DISCONNECT reason or error, once the server drops us
+
+
+class Fanout:
+
+    def __init__(self, args):
+        self.args = args
+        self.sel = selectors.DefaultSelector()
+        self.clients = []
+        self.outstanding = {}   # (sender, seq) -> [recipients still expected, send ns, slowest latency us]
+        self.delivery_us = []
+        self.complete_us = []
+        self.sent = 0
+        self.delivered = 0
+        self.bytes_in = 0
+        self.recording = False
+
+    def connect_all(self):
+        a = self.args
+        offer = a.proto == "framed"
+        batch_gap = 1.0 / a.connect_rate if a.connect_rate > 0 else 0
+        for i in range(a.clients):
+            sock = socket.create_connection((a.host, a.port), timeout=10)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            name = f"{a.prefix}{i}"
+            sock.sendall(Message(LOGIN, name, PROTO_HELLO if offer else "", 0).pack_message())
+            sock.setblocking(False)
+            c = SyntheticClient(sock, name, offer)
+            self.clients.append(c)
+            self.sel.register(sock, selectors.EVENT_READ, c)
+            if batch_gap:
+                self.pump(batch_gap)
+            elif i % 64 == 63:
+                self.pump(0)
+
+    def pump(self, timeout):
+        for key, _ in self.sel.select(timeout):
+            self.readable(key.data)
+
+    def readable(self, c):
+        try:
+            data = c.sock.recv(1 << 16)
+        except (BlockingIOError, InterruptedError):
+            return
+        except OSError as e:
+            data, c.closed = b"", str(e)
+        if not data:
+            c.closed = c.closed or "connection closed"
+            self.sel.unregister(c.sock)
+            c.sock.close()
+            return
+        self.bytes_in += len(data)
+        c.inbuf += data
+        now = time.perf_counter_ns()
+        while True:
+            if not c.acked:
+                # the acknowledgement is a legacy-sized LOGIN frame; anything else means a legacy server
+                frame = next_frame(c.inbuf, False)
+                if frame is None:
+                    return
+                c.acked = True
+                if frame[0] == LOGIN and frame[2] == PROTO_HELLO:
+                    c.framed = True
+                    del c.inbuf[:frame[3]]
+                    continue
+            frame = next_frame(c.inbuf, c.framed)
+            if frame is None:
+                return
+            msg_type, _, text, size = frame
+            del c.inbuf[:size]
+            c.frames += 1
+            if msg_type == 12:
+                c.closed = f"DISCONNECT: {text}"
+            elif msg_type == MESSAGE_RECV and text.startswith(LATENCY_TAG + " ") and self.recording:
+                self.delivered_one(text, now)
+
+    def delivered_one(self, text, now):
+        try:
+            _, sender, seq, sent_ns = text.split(" ", 3)
+            key = (int(sender), int(seq))
+            latency = (now - int(sent_ns)) / 1000
+        except ValueError:
+            return
+        self.delivered += 1
+        self.delivery_us.append(latency)
+        pending = self.outstanding.get(key)
+        if pending is None:
+            return
+        pending[0] -= 1
+        pending[2] = max(pending[2], latency)
+        if pending[0] == 0:
+            self.complete_us.append(pending[2])
+            del self.outstanding[key]
+
+    def settle(self, timeout):
+        """
+        Pump until every client has heard from the server (ack, history or welcome) and the line goes quiet
+        """
+        end = time.monotonic() + timeout
+        quiet_since = time.monotonic()
+        last_in = self.bytes_in
+        while time.monotonic() < end:
+            self.pump(0.05)
+            if self.bytes_in != last_in:
+                last_in, quiet_since = self.bytes_in, time.monotonic()
+            heard = all(c.frames or c.closed for c in self.clients)
+            if heard and time.monotonic() - quiet_since > 0.5:
+                return True
+        return False
+
+    def send(self, c, now):
+        recipients = sum(1 for x in self.clients if not x.closed)
+        sent_ns = time.perf_counter_ns()
+        text = f"{LATENCY_TAG} {c.sender} {c.seq} {sent_ns}"
+        self.outstanding[(c.sender, c.seq)] = [recipients, sent_ns, 0.0]
+        frame = Message(MESSAGE_SEND, c.name, text, 0).pack_message(2 if c.framed else 1)
+        try:
+            c.sock.send(frame)   # a frame this small fits unless the server has stopped reading entirely
+        except OSError as e:
+            c.closed = str(e)
+        c.seq += 1
+        self.sent += 1
+        c.next_send += 1.0 / self.args.rate
+
+    def run(self):
+        a = self.args
+        live = [c for c in self.clients if not c.closed]
+        senders = live[:a.senders]
+        start = time.monotonic()
+        for i, c in enumerate(senders):
+            c.sender = i
+            c.next_send = start + random.random() / a.rate   # spread the senders over one interval
+        self.recording = True
+        end = start + a.duration
+        while True:
+            now = time.monotonic()
+            if now >= end:
+                break
+            due = min((c.next_send for c in senders if not c.closed), default=end)
+            if due <= now:
+                for c in senders:
+                    if not c.closed and c.next_send <= now:
+                        self.send(c, now)
+                continue
+            self.pump(min(due, end) - now)
+        sent_window = time.monotonic() - start
+        # collect stragglers
+        drain_end = time.monotonic() + a.drain
+        while self.outstanding and time.monotonic() < drain_end:
+            self.pump(0.05)
+        return sent_window
+
+
+def close_reasons(clients):
+    reasons = {}
+    for c in clients:
+        reasons[c.closed] = reasons.get(c.closed, 0) + 1
+    return ", ".join(f"{n}x {reason}" for reason, n in sorted(reasons.items(), key=lambda r: -r[1]))
+
+
+def spawn_server(args):
+    workdir = tempfile.mkdtemp(prefix="mycord-bench-")
+    with socket.socket() as probe:
+        probe.bind(("127.0.0.1", 0))
+        port = probe.getsockname()[1]
+    cmd = [sys.executable, os.path.join(REPO, "server.py"), str(port)] + args.server_args.split()
+    env = dict(os.environ, USER=os.environ.get("USER", "bench"))
+    log = open(os.path.join(workdir, "server.out"), "w")
+    proc = subprocess.Popen(cmd, cwd=workdir, env=env, stdout=log, stderr=subprocess.STDOUT)
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.2).close()
+            break
+        except OSError:
+            time.sleep(0.05)
+    else:
+        proc.kill()
+        sys.exit(f"server did not start, see {workdir}/server.out")
+    # the probe connection above is a failed LOGIN; give the server a moment to forget it
+    time.sleep(0.2)
+    print(f"spawned {' '.join(cmd[1:])} (pid {proc.pid}, cwd {workdir})")
+    return proc, port
+
+
+def fanout(args):
+    if not 0 < args.rate <= RATE_CEILING:
+        sys.exit(f"--rate must be in (0, {RATE_CEILING}] to stay under the {RATE_LIMIT} msg/s server limit")
+    raise_fd_limit()
+    proc = None
+    pid = args.server_pid
+    if args.spawn:
+        proc, args.port = spawn_server(args)
+        args.host = "127.0.0.1"
+        pid = proc.pid
+    try:
+        rss_idle = rss_kb(pid) if pid else None
+        f = Fanout(args)
+        t = time.monotonic()
+        f.connect_all()
+        settled = f.settle(args.settle)
+        login_s = time.monotonic() - t
+        rss_loaded = rss_kb(pid) if pid else None
+        lost = [c for c in f.clients if c.closed]
+        print(f"{len(f.clients) - len(lost)}/{len(f.clients)} clients logged in in {login_s:.2f}s"
+              f" ({'framed' if any(c.framed for c in f.clients) else 'legacy'} protocol)"
+              + ("" if settled else ", still busy at --settle"))
+        if lost:
+            print(f"{len(lost)} clients were dropped while logging in: {close_reasons(lost)}")
+        if rss_idle and rss_loaded:
+            print(f"server RSS {rss_idle / 1024:.1f} MiB idle -> {rss_loaded / 1024:.1f} MiB loaded,"
+                  f" {(rss_loaded - rss_idle) / max(1, len(f.clients) - len(lost)):.1f} KiB per connection")
+
+        window = f.run()
+        print(f"{f.sent} messages from {min(args.senders, len(f.clients))} senders in {window:.1f}s"
+              f" ({f.sent / window:.1f} msg/s), {f.delivered} deliveries ({f.delivered / window:.0f}/s)")
+        print(latency_line("delivery latency", f.delivery_us))
+        print(latency_line("full fan-out latency", f.complete_us))
+        if f.outstanding:
+            missing = sum(p[0] for p in f.outstanding.values())
+            print(f"{len(f.outstanding)} messages never reached everyone ({missing} deliveries missing)")
+        dropped = [c for c in f.clients if c.closed and c not in lost]
+        if dropped:
+            print(f"{len(dropped)} clients dropped during the run: {close_reasons(dropped)}")
+    finally:
+        if proc:
+            proc.send_signal(signal.SIGINT)
+            try:
+                proc.wait(10)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+
+
+# ---------------------------------------------------------------------------
+# render
+# ---------------------------------------------------------------------------
+
+RENDER_TAG = re.compile(rb"rl(\d{7})")
+
+
+class AttachedClient:
+    """
+    One local client build in a pty, logged in to a listening socket this
+    process plays the server on. Terminal output is collected in self.out
+    whenever read_pty() runs; while nothing calls it the terminal stalls.
+    """
+
+    def __init__(self, args, cmd_args):
+        self.srv = socket.socket()
+        self.srv.bind(("127.0.0.1", 0))
+        self.srv.listen(1)
+        port = self.srv.getsockname()[1]
+        cmd = [args.client, "--port", str(port)] + cmd_args
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            os.execv(cmd[0], cmd)
+        fcntl.ioctl(self.fd, termios.TIOCSWINSZ, struct.pack("HHHH", args.rows, args.cols, 0, 0))
+        self.out = bytearray()
+
+        self.srv.settimeout(10)
+        self.conn, _ = self.srv.accept()
+        login = Message.unpack_message(recv_exact(self.conn, Message.MSG_SIZE))
+        framed = PROTO_HELLO in login.message.split()
+        if framed:
+            self.conn.sendall(Message(LOGIN, "SYSTEM", PROTO_HELLO).pack_message())
+        self.proto = 2 if framed else 1
+
+    def read_pty(self, timeout):
+        r, _, _ = select.select([self.fd], [], [], timeout)
+        if r:
+            try:
+                chunk = os.read(self.fd, 1 << 16)
+            except OSError:
+                return b""
+            self.out.extend(chunk)
+            return chunk
+        return b""
+
+    def settle(self, seconds):
+        end = time.monotonic() + seconds
+        while time.monotonic() < end:
+            self.read_pty(0.05)
+
+    def send(self, msg_type, username, text):
+        self.conn.sendall(Message(msg_type, username, text, int(time.time())).pack_message(self.proto))
+
+    def close(self):
+        rss = rss_kb(self.pid)
+        os.kill(self.pid, signal.SIGTERM)
+        try:
+            os.waitpid(self.pid, 0)
+        except ChildProcessError:
+            pass
+        self.conn.close()
+        self.srv.close()
+        return rss
+
+
+def render(args):
+    c = AttachedClient(args, ([] if args.plain else ["--tui"]) + args.client_args)
+    out, read_pty, settle, conn, proto = c.out, c.read_pty, c.settle, c.conn, c.proto
+    conn.sendall(Message(13, "SYSTEM", "render benchmark attached").pack_message(proto))
+    settle(0.8)
+    if not args.plain:
+        # the TUI opens on a start menu once connected; Enter gets to the chat view
+        os.write(c.fd, b"\r")
+        settle(0.8)
+
+    base = len(out)
+    sent_at = {}
+    seen = {}
+    scan_from = base
+    interval = 1.0 / args.rate if args.rate > 0 else 0
+    next_send = time.monotonic()
+    seq = 0
+    deadline = None
+    while True:
+        now = time.monotonic()
+        if seq < args.messages and now >= next_send:
+            text = f"rl{seq:07d} " + "x" * args.pad
+            sent_at[seq] = time.perf_counter_ns()
+            conn.sendall(Message(MESSAGE_RECV, "bench", text, int(time.time())).pack_message(proto))
+            seq += 1
+            next_send += interval
+            if seq == args.messages:
+                deadline = now + args.drain
+            continue
+        if deadline and (now >= deadline or len(seen) == args.messages):
+            break
+        wait = max(0.0, next_send - now) if seq < args.messages else 0.05
+        if read_pty(min(wait, 0.05)):
+            seen_at = time.perf_counter_ns()
+            # markers can straddle reads, so rescan a few bytes of overlap
+            for m in RENDER_TAG.finditer(out, max(base, scan_from - 16)):
+                k = int(m.group(1))
+                if k in sent_at and k not in seen:
+                    seen[k] = (seen_at - sent_at[k]) / 1000
+            scan_from = len(out)
+
+    client_rss = c.close()
+    mode = "plain" if args.plain else "tui"
+    print(f"{mode} client, {args.messages} messages at {args.rate or 'max'} msg/s,"
+          f" {len(out) - base} terminal bytes ({(len(out) - base) / max(1, args.messages):.0f} per message)")
+    print(latency_line("receive-to-render", list(seen.values())))
+    if len(seen) < args.messages:
+        # a message that scrolls off between two redraws is never drawn at all
+        print(f"{args.messages - len(seen)} messages never appeared on the terminal"
+              + ("" if args.plain else " (scrolled past between redraws)"))
+    if client_rss:
+        print(f"client RSS {client_rss / 1024:.1f} MiB")
+
+
+# ---------------------------------------------------------------------------
+# stall
+# ---------------------------------------------------------------------------
+
+def socket_rx_queue(port):
+    """
+    Bytes the kernel holds for the local socket on 127.0.0.1:port that its
+    process has not read yet, from /proc/net/tcp
+    """
+    want = f"0100007F:{port:04X}"
+    with open("/proc/net/tcp") as f:
+        next(f)
+        for line in f:
+            fields = line.split()
+            if fields[1] == want:
+                return int(fields[4].split(":")[1], 16)
+    return None
+
+
+WRITE_SYSCALL = {"x86_64": 1, "aarch64": 64, "riscv64": 64, "armv7l": 4, "i686": 4}.get(os.uname().machine)
+
+
+def blocked_in_write(pid):
+    """
+    Whether thread pid (the TUI renderer is the main thread) sits in write(2)
+    """
+    try:
+        with open(f"/proc/{pid}/syscall") as f:
+            return int(f.read().split()[0]) == WRITE_SYSCALL
+    except (OSError, ValueError, IndexError):
+        return False
+
+
+def stall(args):
+    c = AttachedClient(args, ["--tui", "--history", "0"] + args.client_args)
+    client_port = c.conn.getpeername()[1]
+    c.send(13, "SYSTEM", "stall benchmark attached")
+    c.settle(0.8)
+    os.write(c.fd, b"\r")
+    c.settle(0.8)
+
+    # Stop reading the terminal and keep the renderer busy until it is
+    # blocked writing to it for a while
+    pad = "x" * args.pad
+    steady, primed = 0, 0
+    while primed < args.prime and steady < 10:
+        if not steady:
+            c.send(MESSAGE_RECV, "bench", f"prime{primed:05d} {pad}")
+            primed += 1
+        time.sleep(0.01)
+        steady = steady + 1 if blocked_in_write(c.pid) else 0
+    print(f"terminal stalled after {primed} frames; renderer"
+          f" {'blocked in write()' if steady >= 10 else 'NOT seen blocked (raise --prime or --rows/--cols)'}")
+
+    # Bursts the ring can take: the reader should empty the socket every time
+    drains = []
+    stuck = []
+    sent = 0
+    for b in range(args.bursts):
+        for i in range(args.burst):
+            c.send(MESSAGE_RECV, "bench", f"burst{b:03d}.{i:04d} {pad}")
+        sent += args.burst
+        t0 = time.perf_counter()
+        deadline = t0 + args.timeout
+        while socket_rx_queue(client_port) and time.perf_counter() < deadline:
+            time.sleep(0.0005)
+        if socket_rx_queue(client_port):
+            stuck.append(b)
+        else:
+            drains.append((time.perf_counter() - t0) * 1e6)
+    print(f"{sent} frames in {args.bursts} bursts of {args.burst} while the terminal stalled")
+    print(latency_line("socket drained", drains))
+    if stuck:
+        print(f"bursts {stuck} still unread after {args.timeout * 1000:.0f}ms: the reader was held up")
+
+    # One burst past the ring's capacity: the reader has to wait for the renderer
+    for i in range(args.overflow):
+        c.send(MESSAGE_RECV, "bench", f"over{i:05d} {pad}")
+    time.sleep(0.3)
+    held = socket_rx_queue(client_port) or 0
+    print(f"{args.overflow} more frames: {held} bytes left in the socket while the ring is full")
+
+    # Resume the terminal; everything queued must come through
+    t0 = time.perf_counter()
+    marker = f"over{args.overflow - 1:05d}".encode()
+    while marker not in c.out and time.perf_counter() - t0 < args.timeout * 20:
+        c.read_pty(0.05)
+    left = socket_rx_queue(client_port)
+    print(f"terminal resumed: last frame drawn after {(time.perf_counter() - t0) * 1000:.0f}ms,"
+          f" {left} bytes left unread" if marker in c.out else "terminal resumed: last frame never drawn")
+    c.close()
+
+
+# ---------------------------------------------------------------------------
+# deflate
+# ---------------------------------------------------------------------------
+
+def deflate(args):
+    srv = socket.socket()
+    srv.bind(("127.0.0.1", 0))
+    srv.listen(1)
+    cmd = [args.client, "--port", str(srv.getsockname()[1]), "--headless", "--compress"] + args.client_args
+    proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    srv.settimeout(10)
+    conn, _ = srv.accept()
+    login = Message.unpack_message(recv_exact(conn, Message.MSG_SIZE))
+    if DEFLATE_OPTION not in login.message.split():
+        sys.exit(f"client did not offer {DEFLATE_OPTION} at LOGIN: {login.message!r}")
+    conn.sendall(Message(LOGIN, "SYSTEM", f"{PROTO_HELLO} {DEFLATE_OPTION}").pack_message())
+
+    # One block per frame, with a single frame first (the login notice's
+    # case), then groups of args.together blocks in one sendall()
+    z = Deflater()
+    texts = [f"dz{i:05d} " + "y" * args.pad for i in range(args.messages)]
+    blocks = [z.encode(Message(MESSAGE_RECV, "bench", t, int(time.time())).pack_message(2)) for t in texts]
+    conn.sendall(blocks[0])
+    for i in range(1, len(blocks), args.together):
+        conn.sendall(b"".join(blocks[i:i + args.together]))
+        time.sleep(0.005)
+    conn.sendall(Message(13, "SYSTEM", "deflate check done").pack_message(2))
+
+    out = bytearray()
+    deadline = time.monotonic() + args.timeout
+    while b"deflate check done" not in out and time.monotonic() < deadline:
+        r, _, _ = select.select([proc.stdout], [], [], 0.05)
+        if r:
+            chunk = os.read(proc.stdout.fileno(), 1 << 16)
+            if not chunk:
+                break
+            out += chunk
+    proc.terminate()
+    proc.wait()
+    conn.close()
+    srv.close()
+
+    got = re.findall(rb'"text":"(dz\d{5}) ', out)
+    want = [t.split()[0].encode() for t in texts]
+    dupes = len(got) - len(set(got))
+    print(f"{len(blocks)} deflate blocks, {args.together} per write: {len(got)} printed,"
+          f" {dupes} repeated, {len(set(want) - set(got))} missing")
+    if got != want:
+        sys.exit("FAIL: inflated frames were not printed exactly once, in order")
+    print("ok")
+
+
+def recv_exact(sock, n):
+    buf = bytearray()
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise ConnectionError("client closed the connection during LOGIN")
+        buf += chunk
+    return bytes(buf)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="mycord load generator and latency benchmarks")
+    sub = parser.add_subparsers(dest="mode", required=True)
+
+    f = sub.add_parser("fanout", help="synthetic clients against a server")
+    f.add_argument("--host", default="127.0.0.1")
+    f.add_argument("--port", type=int, default=8080)
+    f.add_argument("--spawn", action="store_true", help="start server.py on a free port in a scratch directory")
+    f.add_argument("--server-args", default="", help="extra server.py arguments with --spawn, e.g. --server-args=--async")
+    f.add_argument("--server-pid", type=int, help="pid of an external server, for memory per connection")
+    f.add_argument("--clients", type=int, default=100)
+    f.add_argument("--senders", type=int, default=10, help="how many of the clients send")
+    f.add_argument("--rate", type=float, default=2.0, help=f"messages per second per sender (at most {RATE_CEILING})")
+    f.add_argument("--duration", type=float, default=10.0, help="seconds of sending")
+    f.add_argument("--proto", choices=("framed", "legacy"), default="framed", help="framed offers MYCORD/2 at LOGIN")
+    f.add_argument("--connect-rate", type=float, default=0, help="logins per second (default: as fast as possible)")
+    f.add_argument("--settle", type=float, default=30.0, help="max seconds to wait for logins to finish")
+    f.add_argument("--drain", type=float, default=5.0, help="seconds to wait for late deliveries")
+    f.add_argument("--prefix", default="lg", help="username prefix (usernames are PREFIX0, PREFIX1, ...)")
+    f.set_defaults(func=fanout)
+
+    r = sub.add_parser("render", help="receive-to-render latency of a local client build")
+    r.add_argument("--client", default=os.path.join(REPO, "client"), help="client binary")
+    r.add_argument("--plain", action="store_true", help="measure the plain line output instead of the TUI")
+    r.add_argument("--messages", type=int, default=1000)
+    r.add_argument("--rate", type=float, default=100.0, help="messages per second (0 = as fast as possible)")
+    r.add_argument("--pad", type=int, default=40, help="filler characters after each marker")
+    r.add_argument("--rows", type=int, default=40)
+    r.add_argument("--cols", type=int, default=120)
+    r.add_argument("--drain", type=float, default=3.0)
+    r.add_argument("client_args", nargs="*", help="extra client arguments (after --)")
+    r.set_defaults(func=render)
+
+    st = sub.add_parser("stall", help="reader progress while the TUI's terminal is not being read")
+    st.add_argument("--client", default=os.path.join(REPO, "client"), help="client binary")
+    st.add_argument("--prime", type=int, default=500, help="most frames sent to get the renderer blocked in write()")
+    st.add_argument("--bursts", type=int, default=6)
+    st.add_argument("--burst", type=int, default=64, help="frames per burst; keep bursts * burst under the ring's 512")
+    st.add_argument("--overflow", type=int, default=2000, help="frames sent past the ring's capacity at the end")
+    st.add_argument("--timeout", type=float, default=0.25, help="seconds a burst may take to leave the socket")
+    st.add_argument("--pad", type=int, default=80)
+    st.add_argument("--rows", type=int, default=60)
+    st.add_argument("--cols", type=int, default=200)
+    st.add_argument("client_args", nargs="*", help="extra client arguments (after --)")
+    st.set_defaults(func=stall)
+
+    d = sub.add_parser("deflate", help="check a --compress client prints each inflated frame once")
+    d.add_argument("--client", default=os.path.join(REPO, "client"), help="client binary")
+    d.add_argument("--messages", type=int, default=200)
+    d.add_argument("--together", type=int, default=4, help="blocks per write after the first")
+    d.add_argument("--pad", type=int, default=40)
+    d.add_argument("--timeout", type=float, default=10.0)
+    d.add_argument("client_args", nargs="*", help="extra client arguments (after --)")
+    d.set_defaults(func=deflate)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,155 @@
+/*
+ * Mention scanning cost per message: the client's one-pass Aho-Corasick
+ * scanner (mention_scan) against the strstr() loop plain mode used before it,
+ * run once per watched term, for watch lists of 1 to 31 terms.
+ *
+ * The client is compiled in (its main() renamed) so the scanner under test
+ * is the one that ships:
+ *
+ *     gcc -O2 -pthread bench/mention_bench.c -o mention_bench -lz
+ *     ./mention_bench [--messages N] [--rounds N]
+ */
+#define main client_main
+#include "../client.c"
+#undef main
+
+static const char *bench_words[] = {
+    "the", "build", "is", "green", "again", "after", "the", "rollback", "can", "someone",
+    "look", "at", "latency", "on", "the", "east", "cluster", "thanks", "lol", "ok",
+    "deploying", "now", "ping", "me", "if", "the", "dashboard", "goes", "red", "coffee",
+};
+
+/* Watch terms, the username first as main() adds it. */
+static const char *bench_terms[] = {
+    "@root", "@oncall", "@infra", "incident", "outage", "pager", "sev1", "sev2",
+    "@alice", "@bob", "@carol", "@dave", "rollback", "hotfix", "@release", "freeze",
+    "@db-team", "@net-team", "postmortem", "escalate", "@sre", "@security", "cve",
+    "leak", "@frontend", "@backend", "urgent", "blocker", "p0", "revert", "@all",
+};
+
+static uint64_t bench_state = 88172645463325252ull;
+
+static unsigned bench_rand(unsigned n) {
+    bench_state ^= bench_state << 13;
+    bench_state ^= bench_state >> 7;
+    bench_state ^= bench_state << 17;
+    return (unsigned)(bench_state % n);
+}
+
+/* Chat-like lines of 40..300 bytes; one in ten mentions a watched term. */
+static char **bench_corpus(int count, int nterms) {
+    char **msgs = malloc(sizeof(*msgs) * (size_t)count);
+    if (!msgs) return NULL;
+    for (int i = 0; i < count; i++) {
+        char line[sizeof(((message_t *)0)->message)];
+        size_t len = 0, want = 40 + bench_rand(261);
+        int mention = bench_rand(10) == 0;
+        while (len < want) {
+            const char *w = bench_words[bench_rand(sizeof(bench_words) / sizeof(bench_words[0]))];
+            if (mention && bench_rand(4) == 0) {
+                w = bench_terms[bench_rand((unsigned)nterms)];
+                mention = 0;
+            }
+            len += (size_t)snprintf(line + len, sizeof(line) - len, "%s%s", len ? " " : "", w);
+            if (len >= sizeof(line) - 1) len = sizeof(line) - 1;
+        }
+        msgs[i] = strdup(line);
+        if (!msgs[i]) return NULL;
+    }
+    return msgs;
+}
+
+/* What plain mode did for its single @username, once per watched term. */
+static int strstr_scan(const char *text, int nterms) {
+    int found = 0;
+    for (int t = 0; t < nterms; t++) {
+        size_t n = strlen(bench_terms[t]);
+        for (const char *p = text; (p = strstr(p, bench_terms[t])) != NULL; p += n) found++;
+    }
+    return found;
+}
+
+static int ac_scan(const char *text) {
+    mention_span_t spans[64];
+    return mention_scan(text, spans, 64);
+}
+
+static double bench_ns(char **msgs, int count, int rounds, int nterms, int use_ac, long *found) {
+    uint64_t best = UINT64_MAX;
+    for (int r = 0; r < rounds; r++) {
+        long hits = 0;
+        uint64_t t0 = stats_clock_ns();
+        for (int i = 0; i < count; i++) hits += use_ac ? ac_scan(msgs[i]) : strstr_scan(msgs[i], nterms);
+        uint64_t dt = stats_clock_ns() - t0;
+        if (dt < best) best = dt;
+        *found = hits;
+    }
+    return (double)best / count;
+}
+
+/* The overlap rules mention_scan() promises, on a few fixed cases. */
+static int bench_check(void) {
+    static const struct {
+        const char *terms[3];
+        const char *text;
+        const char *want;       /* matched spans, space separated */
+    } cases[] = {
+        { { "ab", "bcd", "cd" }, "abcd", "ab cd" },
+        { { "abc", "bc", "c" }, "zabcz", "abc" },
+        { { "he", "she", "hers" }, "ushers", "she" },
+        { { "@root", "root", NULL }, "hi @root and root", "@root root" },
+    };
+    int bad = 0;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        g_watch_count = 0;
+        for (int t = 0; t < 3 && cases[c].terms[t]; t++) watch_add(cases[c].terms[t]);
+        if (mention_init() != 0) return -1;
+        mention_span_t spans[8];
+        int n = mention_scan(cases[c].text, spans, 8);
+        char got[64] = "";
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            len += (size_t)snprintf(got + len, sizeof(got) - len, "%s%.*s", i ? " " : "",
+                                    spans[i].len, cases[c].text + spans[i].start);
+        }
+        if (strcmp(got, cases[c].want) != 0) {
+            fprintf(stderr, "mention_scan(\"%s\") found \"%s\", want \"%s\"\n", cases[c].text, got, cases[c].want);
+            bad = 1;
+        }
+    }
+    return bad ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int count = 20000, rounds = 5;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--messages") == 0) count = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--rounds") == 0) rounds = atoi(argv[i+1]);
+    }
+    if (count <= 0 || rounds <= 0) {
+        fprintf(stderr, "usage: %s [--messages N] [--rounds N]\n", argv[0]);
+        return 1;
+    }
+    if (bench_check() != 0) return 1;
+
+    static const int sizes[] = { 1, 4, 16, 31 };
+    printf("%d messages, best of %d rounds\n", count, rounds);
+    printf("%-6s %14s %14s %9s %12s\n", "terms", "strstr ns/msg", "scan ns/msg", "speedup", "matches");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int nterms = sizes[s];
+        bench_state = 88172645463325252ull;
+        char **msgs = bench_corpus(count, nterms);
+        if (!msgs) return 1;
+        g_watch_count = 0;
+        for (int t = 0; t < nterms; t++) watch_add(bench_terms[t]);
+        if (mention_init() != 0) return 1;
+
+        long found_strstr = 0, found_ac = 0;
+        double ns_strstr = bench_ns(msgs, count, rounds, nterms, 0, &found_strstr);
+        double ns_ac = bench_ns(msgs, count, rounds, nterms, 1, &found_ac);
+        printf("%-6d %14.1f %14.1f %8.1fx %5ld/%-6ld\n", nterms, ns_strstr, ns_ac, ns_strstr / ns_ac, found_ac, found_strstr);
+        for (int i = 0; i < count; i++) free(msgs[i]);
+        free(msgs);
+    }
+    return 0;
+}
@@ -1,1261 +1,6157 @@
-#include <stdbool.h>
-#include <stdio.h>
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <string.h>
-#include <errno.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <time.h>
-#include <pthread.h>
-#include <signal.h>
-#include <ctype.h>
-#include <stdint.h>
-#include <termios.h>
-#include <sys/ioctl.h>
-#include <sys/select.h>
-
-/* ===================== PROTOCOL ===================== */
-
-enum MessageType {
-    LOGIN = 0,
-    LOGOUT = 1,
-    MESSAGE_SENT = 2,
-    MESSAGE_RECV = 10,
-    DISCONNECT = 12,
-    SYSTEM = 13,
-};
-
-typedef struct __attribute__((packed)) Message {
-    enum MessageType m_type;
-    unsigned int timeStamp;
-    char username[32];
-    char message[1024];
-} message_t;
-
-typedef struct Settings {
-    struct sockaddr_in server;
-    bool quiet;
-    int socket_fd;
-    bool running;
-    char username[32];
-} settings_t;
-
-volatile sig_atomic_t shutdown_requested = 0;
-static char* COLOR_RED  = "\033[31m";
-static char* COLOR_GRAY = "\033[90m";
-static char* COLOR_RESET= "\033[0m";
-static settings_t settings = {0};
-
-/* ===================== UI FLAGS ===================== */
-
-typedef enum {
-    UI_SPARTAN = 0,
-    UI_GRAVEMIND = 1
-} ui_mode_t;
-
-static int g_tui_enabled = 0;
-static ui_mode_t g_ui_mode = UI_SPARTAN;
-
-/* ===================== ANSI COLORS ===================== */
-
-#define ANSI_CLEAR   "\033[2J"
-#define ANSI_HOME    "\033[H"
-#define ANSI_HIDE    "\033[?25l"
-#define ANSI_SHOW    "\033[?25h"
-#define ANSI_RESET   "\033[0m"
-
-#define ANSI_BLACK   "\033[30m"
-#define ANSI_RED     "\033[31m"
-#define ANSI_GREEN   "\033[32m"
-#define ANSI_YELLOW  "\033[33m"
-#define ANSI_BLUE    "\033[34m"
-#define ANSI_MAGENTA "\033[35m"
-#define ANSI_CYAN    "\033[36m"
-#define ANSI_WHITE   "\033[37m"
-#define ANSI_DIM     "\033[90m"
-#define ANSI_BRIGHT_GREEN   "\033[92m"
-#define ANSI_BRIGHT_CYAN    "\033[96m"
-
-/* ===================== TUI TERMINAL RAW MODE ===================== */
-
-static struct termios g_orig_termios;
-static int g_raw_enabled = 0;
-
-static void tui_raw_disable(void) {
-    if (g_raw_enabled) {
-        tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_orig_termios);
-        g_raw_enabled = 0;
-        write(STDOUT_FILENO, ANSI_SHOW, sizeof(ANSI_SHOW)-1);
-    }
-}
-
-static void tui_raw_enable(void) {
-    if (g_raw_enabled) return;
-    tcgetattr(STDIN_FILENO, &g_orig_termios);
-    atexit(tui_raw_disable);
-
-    struct termios raw = g_orig_termios;
-    raw.c_lflag &= (tcflag_t)~(ECHO | ICANON);
-    raw.c_iflag &= (tcflag_t)~(IXON | ICRNL);
-    raw.c_oflag &= (tcflag_t)~(OPOST);
-    raw.c_cc[VMIN]  = 1;
-    raw.c_cc[VTIME] = 0;
-
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
-    g_raw_enabled = 1;
-    write(STDOUT_FILENO, ANSI_HIDE, sizeof(ANSI_HIDE)-1);
-}
-
-/* ===================== TUI STATE ===================== */
-
-#define TUI_MAX_LINES 600
-#define HIST_MAX 64
-
-typedef struct {
-    char timebuf[32];
-    char username[32];
-    char text[1024];
-    int  kind;
-} tui_line_t;
-
-static tui_line_t g_lines[TUI_MAX_LINES];
-static int g_line_count = 0;
-
-static char g_send_hist[HIST_MAX][1024];
-static int  g_send_hist_len = 0;
-
-static pthread_mutex_t g_tui_lock = PTHREAD_MUTEX_INITIALIZER;
-static volatile sig_atomic_t g_tui_dirty = 0;
-
-static int g_scroll = 0;
-static char g_input[1024] = {0};
-static int g_input_len = 0;
-static int g_show_start_menu = 1;
-
-static void tui_set_dirty(void) { g_tui_dirty = 1; }
-
-static void tui_hist_push(const char *s) {
-    if (!s || !*s) return;
-    if (g_send_hist_len > 0 && strcmp(g_send_hist[g_send_hist_len-1], s) == 0) return;
-    if (g_send_hist_len < HIST_MAX) {
-        strncpy(g_send_hist[g_send_hist_len++], s, 1023);
-        g_send_hist[g_send_hist_len-1][1023] = 0;
-    } else {
-        for (int i = 1; i < HIST_MAX; i++) strcpy(g_send_hist[i-1], g_send_hist[i]);
-        strncpy(g_send_hist[HIST_MAX-1], s, 1023);
-        g_send_hist[HIST_MAX-1][1023] = 0;
-    }
-}
-
-static void gravemind_filter(char* out, const char* in, size_t max) {
-    size_t j = 0;
-    for (size_t i = 0; in[i] && j + 1 < max; i++) {
-        char c = (char)tolower((unsigned char)in[i]);
-        out[j++] = c;
-        if (isalnum((unsigned char)c) && (rand() % 6 == 0) && j + 1 < max)
-            out[j++] = '.';
-    }
-    out[j] = '\0';
-}
-
-static void tui_add_line_locked(const char *timebuf, const char *user, const char *text, int kind) {
-    if (g_line_count < TUI_MAX_LINES) {
-        tui_line_t *L = &g_lines[g_line_count++];
-        strncpy(L->timebuf, timebuf ? timebuf : "", sizeof(L->timebuf)-1);
-        strncpy(L->username, user ? user : "", sizeof(L->username)-1);
-        strncpy(L->text, text ? text : "", sizeof(L->text)-1);
-        L->timebuf[sizeof(L->timebuf)-1] = 0;
-        L->username[sizeof(L->username)-1] = 0;
-        L->text[sizeof(L->text)-1] = 0;
-        L->kind = kind;
-    } else {
-        memmove(&g_lines[0], &g_lines[1], sizeof(g_lines[0]) * (TUI_MAX_LINES-1));
-        tui_line_t *L = &g_lines[TUI_MAX_LINES-1];
-        strncpy(L->timebuf, timebuf ? timebuf : "", sizeof(L->timebuf)-1);
-        strncpy(L->username, user ? user : "", sizeof(L->username)-1);
-        strncpy(L->text, text ? text : "", sizeof(L->text)-1);
-        L->timebuf[sizeof(L->timebuf)-1] = 0;
-        L->username[sizeof(L->username)-1] = 0;
-        L->text[sizeof(L->text)-1] = 0;
-        L->kind = kind;
-    }
-}
-
-static void tui_add_line(const char *timebuf, const char *user, const char *text, int kind) {
-    pthread_mutex_lock(&g_tui_lock);
-    tui_add_line_locked(timebuf, user, text, kind);
-    if (g_scroll > 0) g_scroll += 1;
-    pthread_mutex_unlock(&g_tui_lock);
-    tui_set_dirty();
-}
-
-/* ===================== ASCII ART ===================== */
-
-static const char* gravemind_art[] = {
-    "⠀⢸⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⡇⠀",
-    "⠀⠘⢿⣿⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⣿⡿⠃⠀",
-    "⠀⢸⣦⡙⢿⣿⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⣿⡿⢋⣴⡇⠀",
-    "⠀⠈⠻⣿⣦⡙⢿⣿⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣠⣿⡿⢋⣴⣿⠟⠁⠀",
-    "⠀⢸⣷⣌⢿⣿⣦⡙⢿⣷⣄⠀⠀⠀⠀⠀⠀⠀⠀⣠⣾⡿⢋⣴⣿⡿⣡⣾⡇⠀",
-    "⠀⠈⠻⣿⣷⡝⢿⣿⣎⢻⣿⡆⠀⠀⠀⠀⠀⠀⢰⣿⡟⣱⣿⡿⢫⣾⣿⠟⠁⠀",
-    "⠀⢀⡤⣌⢻⣿⣦⢻⣿⡎⣿⣿⡀⠀⠀⠀⠀⢀⣿⣿⢱⣿⡟⣴⣿⠟⣡⢤⡀⠀",
-    "⢀⠘⠶⠟⠀⢹⣿⡇⣿⣿⢸⣿⡇⠀⠀⠀⠀⢸⣿⡇⣿⣿⢸⣿⡏⠀⠻⠶⠃⡀",
-    "⠘⠿⢿⠿⠷⢸⣿⣧⣿⣿⣸⣿⡇⣀⣀⣀⡀⢸⣿⣇⣿⣿⣼⣿⡇⠾⠿⣿⠿⠃",
-    "⠹⣶⣶⣶⣦⢸⣿⣿⡿⠿⢿⣿⠁⢿⣾⣿⡄⠈⣿⡿⠿⢿⣿⣿⡇⣴⣶⣶⣶⠏",
-    "⠀⠀⠀⣠⣤⡘⢿⣿⣧⣀⡀⠀⢀⣼⣿⣿⣧⡀⠀⢀⣀⣼⣿⡿⢃⣤⣄⠀⠀⠀",
-    "⠀⠰⠿⠛⠉⣡⣦⠉⠻⠿⣿⣿⣿⣿⣿⡇⢙⣿⣿⣿⠿⠟⠉⣴⣄⠉⠛⠿⠆⠀",
-    "⠀⠀⠀⠀⠐⠛⠁⠀⡿⠂⣤⡍⢻⣿⣿⣿⣿⡟⢩⣤⠐⢿⠀⠈⠛⠂⠀⠀⠀⠀",
-    "⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢸⣿⣿⣧⣼⡇⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀",
-    "⢠⣷⣤⣀⠀⠀⠀⠀⠀⠀⠀⣾⣿⣿⣿⣿⣿⣿⣇⠀⠀⠀⠀⠀⠀⠀⣀⣤⣾⡄",
-    "⢿⣟⠛⠛⠁⠀⠀⠀⠀⣠⣾⣿⠋⠁⠀⠀⠀⠉⠛⢷⣄⠀⠀⠀⠀⠈⠛⠛⣻⡿",
-    "⢰⣿⣿⣷⣶⣶⡶⢀⣾⣿⣿⠋⠉⠉⠉⠉⠉⠉⠉⠉⠙⣷⡀⣶⣶⣶⣾⣿⣿⡄",
-    "⠸⢿⣿⣿⣯⣀⠀⣾⣿⣿⡧⠤⠤⠤⠤⠤⠤⠤⠤⠤⠤⠼⣷⠀⣈⣽⣿⣿⡿⠇",
-    "⠀⠀⠀⣸⣿⣿⣿⢶⣮⣭⣀⣀⡀⠀⠀⠀⠀⣀⣀⣀⣤⣴⡶⣿⣿⣿⡇⠀⠀⠀",
-    "⠀⠀⠀⢿⣿⣿⡏⢸⣿⢉⣿⠛⠻⡟⢻⡟⠛⣛⢻⣿⠉⣴⡆⢻⣿⣿⡿⠀⠀⠀",
-    "⠀⠀⠀⠀⠈⠙⠻⠶⣦⣼⣿⣀⣦⡁⢸⡗⠒⣂⣈⣿⣧⣴⠶⠟⠋⠁⠀⠀⠀⠀",
-    "⠀⠀⠀⠀⠀⠀⠀⠀⠐⢬⣭⣝⣛⣛⣛⣛⣛⣛⣫⣭⡥⠀⠀⠀⠀⠀⠀⠀⠀⠀",
-    "⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠉⠛⠿⢿⣿⣿⡿⠿⠛⠉⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀",
-    ""
-};
-
-static const char* unsc_logo_art[] = {
-    "   +------------------------------+",
-    "   |    UNSC SECURE NETWORK    |",
-    "   +------------------------------+",
-    ""
-};
-/* ===================== START MENU ===================== */
-/* ===================== START MENU ===================== */
-/* ===================== START MENU ===================== */
-
-static void draw_start_menu(void) {
-    int cols, rows;
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
-        cols = (int)ws.ws_col;
-        rows = (int)ws.ws_row;
-    } else {
-        cols = 80;
-        rows = 30;
-    }
-    
-    const char *theme_color = (g_ui_mode == UI_GRAVEMIND) ? ANSI_GREEN : ANSI_BRIGHT_CYAN;
-    const char *title = (g_ui_mode == UI_GRAVEMIND) ? "GRAVEMIND NETWORK" : "UNSC SECURE NETWORK";
-    const char *quote = (g_ui_mode == UI_GRAVEMIND) ? 
-        "I am a monument to all your sins." : 
-        "Spartans never die...";
-    
-    // Clear screen and hide cursor
-    printf(ANSI_CLEAR);
-    printf(ANSI_HOME);
-    
-    // Calculate center column
-    int center_col = cols / 2;
-    
-    // Calculate starting row (vertically centered)
-    int start_row = (rows - 12) / 2;
-    if (start_row < 2) start_row = 2;
-    
-    int current_row = start_row;
-    
-    // Title box - each line positioned explicitly
-    printf("\033[%d;%dH", current_row++, center_col - 21);
-    printf("%s+==========================================+", theme_color);
-    
-    printf("\033[%d;%dH", current_row++, center_col - 21);
-    printf("|                                          |");
-    
-    printf("\033[%d;%dH", current_row++, center_col - 21);
-    printf("|     HALO COMMUNICATIONS TERMINAL         |");
-    
-    printf("\033[%d;%dH", current_row++, center_col - 21);
-    printf("|                                          |");
-    
-    printf("\033[%d;%dH", current_row++, center_col - 21);
-    printf("+==========================================+");
-    
-    current_row++;
-    
-    // Mode indicator
-    char mode_line[128];
-    snprintf(mode_line, sizeof(mode_line), ">>> %s <<<", title);
-    int mode_len = (int)strlen(mode_line);
-    printf("\033[%d;%dH", current_row++, center_col - (mode_len/2));
-    printf("%s", mode_line);
-    
-    current_row++;
-    
-    // Separator
-    printf("\033[%d;%dH", current_row++, center_col - 21);
-    printf("==========================================");
-    
-    current_row++;
-    
-    // Quote
-    int quote_len = (int)strlen(quote);
-    printf("\033[%d;%dH", current_row++, center_col - (quote_len/2));
-    printf("%s", quote);
-    
-    current_row++;
-    
-    // Instructions
-    printf("%s", ANSI_YELLOW);
-    printf("\033[%d;%dH", current_row++, center_col - 12);
-    printf("Press ENTER to continue");
-    
-    current_row++;
-    
-    // Username
-    printf("%s", ANSI_DIM);
-    char user_line[128];
-    snprintf(user_line, sizeof(user_line), "Connected as: %s", settings.username);
-    int user_len = (int)strlen(user_line);
-    printf("\033[%d;%dH", current_row++, center_col - (user_len/2));
-    printf("%s", user_line);
-    
-    current_row++;
-    
-    // Control hints
-    printf("\033[%d;%dH", current_row, center_col - 18);
-    printf("Press ESC to switch mode | Q to quit");
-    
-    current_row += 2;
-    
-    // Halo ring ASCII art
-    printf("%s", theme_color);
-    printf("\033[%d;%dH", current_row++, center_col - 20);
-    printf("            _______________            ");
-    printf("\033[%d;%dH", current_row++, center_col - 20);
-    printf("        .-'                 '-.        ");
-    printf("\033[%d;%dH", current_row++, center_col - 20);
-    printf("      .'                       '.      ");
-    printf("\033[%d;%dH", current_row++, center_col - 20);
-    printf("     /    INSTALLATION  04      \\     ");
-    printf("\033[%d;%dH", current_row++, center_col - 20);
-    printf("    |                             |    ");
-    printf("\033[%d;%dH", current_row++, center_col - 20);
-    printf("     \\                           /     ");
-    printf("\033[%d;%dH", current_row++, center_col - 20);
-    printf("      '.                       .'      ");
-    printf("\033[%d;%dH", current_row++, center_col - 20);
-    printf("        '-._________________.-'        ");
-    
-    printf(ANSI_RESET);
-    fflush(stdout);
-}
-
-/* ===================== TUI DRAWING ===================== */
-
-static void tui_get_size(int *cols, int *rows) {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
-        *cols = (int)ws.ws_col;
-        *rows = (int)ws.ws_row;
-    } else {
-        *cols = 80;
-        *rows = 24;
-    }
-}
-
-static void tui_draw_frame(int cols, int rows) {
-    const char *theme_border = (g_ui_mode == UI_GRAVEMIND) ? ANSI_GREEN : ANSI_BRIGHT_CYAN;
-    const char *theme_text = (g_ui_mode == UI_GRAVEMIND) ? ANSI_BRIGHT_GREEN : ANSI_BRIGHT_CYAN;
-    
-    printf("\033[H"); // Move to home
-    printf("%s", theme_border);
-    
-    // Top border
-    putchar('+');
-    for (int i = 1; i < cols-1; i++) {
-        putchar('-');
-    }
-    putchar('+');
-    putchar('\n');
-    
-    // Header line
-    putchar('|');
-    printf("%s", theme_text);
-    
-    char header[256];
-    if (g_ui_mode == UI_GRAVEMIND) {
-        snprintf(header, sizeof(header), " GRAVEMIND NETWORK // USER: %s ", settings.username);
-    } else {
-        snprintf(header, sizeof(header), " UNSC NETWORK // SPARTAN: %s ", settings.username);
-    }
-    
-    int hlen = (int)strlen(header);
-    if (hlen > cols-2) header[cols-2] = 0;
-    
-    fputs(header, stdout);
-    for (int i = hlen; i < cols-2; i++) putchar(' ');
-    printf("%s|%s\n", theme_border, ANSI_RESET);
-    
-    // Separator
-    putchar('+');
-    for (int i = 1; i < cols-1; i++) putchar('-');
-    putchar('+');
-    putchar('\n');
-    
-    printf(ANSI_RESET);
-    fflush(stdout);
-}
-
-static void tui_render(void) {
-    if (g_show_start_menu) {
-        draw_start_menu();
-        return;
-    }
-    
-    int cols, rows;
-    tui_get_size(&cols, &rows);
-    if (cols < 40) cols = 40;
-    if (rows < 12) rows = 12;
-    
-    const char *theme_border = (g_ui_mode == UI_GRAVEMIND) ? ANSI_GREEN : ANSI_BRIGHT_CYAN;
-    const char *theme_text = (g_ui_mode == UI_GRAVEMIND) ? ANSI_BRIGHT_GREEN : ANSI_BRIGHT_CYAN;
-    const char *name_color = (g_ui_mode == UI_GRAVEMIND) ? ANSI_GREEN : ANSI_BRIGHT_CYAN;
-    const char *time_color = ANSI_DIM;
-    const char *sys_color = (g_ui_mode == UI_GRAVEMIND) ? ANSI_YELLOW : ANSI_YELLOW;
-    
-    int msg_h = rows - 6;
-    if (msg_h < 5) msg_h = 5;
-    
-    tui_draw_frame(cols, rows);
-    
-    pthread_mutex_lock(&g_tui_lock);
-    int total = g_line_count;
-    int start = total - msg_h - g_scroll;
-    if (start < 0) start = 0;
-    int end = start + msg_h;
-    if (end > total) end = total;
-    
-    // Print message lines
-    for (int i = start, r = 0; r < msg_h; r++) {
-        printf("\033[%d;1H", 4 + r);
-        putchar('|');
-        
-        if (i < end) {
-            tui_line_t L = g_lines[i];
-            
-            char msgbuf[1024];
-            if (g_ui_mode == UI_GRAVEMIND && L.kind == MESSAGE_RECV) {
-                gravemind_filter(msgbuf, L.text, sizeof(msgbuf));
-            } else {
-                strncpy(msgbuf, L.text, sizeof(msgbuf)-1);
-                msgbuf[sizeof(msgbuf)-1] = 0;
-            }
-            
-            // Clear line
-            printf("\033[K"); // Clear to end of line
-            printf("\033[%d;2H", 4 + r);
-            
-            // Color based on message type
-            if (L.kind == SYSTEM) {
-                printf("%s", sys_color);
-                putchar('[');
-                printf("%s", time_color);
-                fputs(L.timebuf, stdout);
-                printf("%s] ", sys_color);
-                fputs(msgbuf, stdout);
-            } else if (L.kind == MESSAGE_RECV) {
-                printf("%s", time_color);
-                putchar('[');
-                fputs(L.timebuf, stdout);
-                putchar(']');
-                printf(" %s", name_color);
-                fputs(L.username, stdout);
-                printf("%s: ", theme_text);
-                fputs(msgbuf, stdout);
-            } else if (L.kind == DISCONNECT) {
-                printf("%s", ANSI_RED);
-                putchar('[');
-                fputs(L.timebuf, stdout);
-                putchar(']');
-                printf(" %s: ", L.username);
-                fputs(msgbuf, stdout);
-            } else {
-                printf("%s", theme_text);
-                putchar('[');
-                fputs(L.timebuf, stdout);
-                putchar(']');
-                printf(" %s: ", L.username);
-                fputs(msgbuf, stdout);
-            }
-            
-            i++;
-        } else {
-            // Empty line
-            printf("\033[K");
-        }
-        
-        printf("%s|", theme_border);
-    }
-    pthread_mutex_unlock(&g_tui_lock);
-    
-    // Input separator
-    printf("\033[%d;1H", 4 + msg_h);
-    putchar('+');
-    for (int i = 1; i < cols-1; i++) putchar('-');
-    putchar('+');
-    
-    // Input line
-    printf("\033[%d;1H", 5 + msg_h);
-    putchar('|');
-    printf("%s", theme_text);
-    
-    char prompt[64];
-    if (g_ui_mode == UI_GRAVEMIND) {
-        snprintf(prompt, sizeof(prompt), " GRAVEMIND> ");
-    } else {
-        snprintf(prompt, sizeof(prompt), " SPARTAN> ");
-    }
-    
-    int inner = cols - 2;
-    int avail = inner - (int)strlen(prompt);
-    if (avail < 0) avail = 0;
-    
-    // Clear input area
-    printf("\033[K");
-    printf("\033[%d;2H", 5 + msg_h);
-    
-    fputs(prompt, stdout);
-    
-    // Show input
-    const char *in = g_input;
-    int inlen = g_input_len;
-    if (inlen > avail) in = g_input + (inlen - avail);
-    fputs(in, stdout);
-    
-    // Bottom border
-    printf("\033[%d;1H", 6 + msg_h);
-    printf("%s", theme_border);
-    putchar('+');
-    for (int i = 1; i < cols-1; i++) putchar('-');
-    putchar('+');
-    
-    // Status line
-    printf("\033[%d;1H", 7 + msg_h);
-    printf("%s", ANSI_DIM);
-    char status[256];
-    snprintf(status, sizeof(status), " Messages: %d | Scroll: %d | Mode: %s | !help for commands",
-             total, g_scroll, g_ui_mode == UI_GRAVEMIND ? "GRAVEMIND" : "SPARTAN");
-    int status_len = (int)strlen(status);
-    if (status_len > cols) status[cols] = 0;
-    fputs(status, stdout);
-    
-    // Place cursor
-    int cursor_col = 2 + (int)strlen(prompt) + (int)strlen(in);
-    if (cursor_col >= cols) cursor_col = cols - 1;
-    printf("\033[%d;%dH", 5 + msg_h, cursor_col);
-    
-    printf(ANSI_RESET);
-    fflush(stdout);
-}
-
-/* ===================== BOOT MESSAGES ===================== */
-
-static void gravemind_boot_lines(void) {
-    tui_add_line("SYSTEM", "GRAVEMIND", ">>> NEURAL SIGNAL DETECTED", SYSTEM);
-    tui_add_line("SYSTEM", "GRAVEMIND", ">>> FLOOD SPORE INTEGRATION INITIATED", SYSTEM);
-    tui_add_line("SYSTEM", "GRAVEMIND", ">>> MEMORY BLEED CONFIRMED", SYSTEM);
-    tui_add_line("SYSTEM", "GRAVEMIND", ">>> CORRUPTION STABLE. SPREADING...", SYSTEM);
-    tui_add_line("SYSTEM", "GRAVEMIND", "I am a monument to all your sins.", SYSTEM);
-    tui_add_line("SYSTEM", "GRAVEMIND", ">>> GRAVEMIND NEURAL NETWORK ONLINE", SYSTEM);
-}
-
-static void spartan_boot_lines(void) {
-    tui_add_line("SYSTEM", "UNSC", ">>> SPARTAN-III NEURAL INTERFACE INITIALIZED", SYSTEM);
-    tui_add_line("SYSTEM", "UNSC", ">>> MJOLNIR ARMOR SYSTEMS ONLINE", SYSTEM);
-    tui_add_line("SYSTEM", "UNSC", ">>> NEURAL LINK STABLE", SYSTEM);
-    tui_add_line("SYSTEM", "CORTANA", "I'll be with you every step of the way.", SYSTEM);
-    tui_add_line("SYSTEM", "UNSC", ">>> SPARTAN COMMUNICATIONS ONLINE", SYSTEM);
-}
-
-/* ===================== HELP MENU ===================== */
-
-void help_menu() {
-    printf("HALO MYCORD CLIENT - OPTIONS:\n");
-    printf("  --help                Show this help message\n");
-    printf("  --port PORT           Port to connect to (default: 8080)\n");
-    printf("  --ip IP               IP to connect to (default: 127.0.0.1)\n");
-    printf("  --domain DOMAIN       Domain name to connect to\n");
-    printf("  --quiet               Disable alerts and mentions\n");
-    printf("  --tui                 Enable TUI mode with start menu\n");
-    printf("  --gravemind           Start in Gravemind mode\n\n");
-    
-    printf("EXAMPLES:\n");
-    printf("  ./clientTui --tui --gravemind\n");
-    printf("  ./clientTui --port 8080 --tui\n");
-    printf("  ./clientTui --domain mycord.device.dev --tui\n");
-}
-
-/* ===================== ARGUMENT PROCESSING ===================== */
-
-int process_args(int argc, char *argv[]) {
-    for (int i = 1; i < argc; i++){
-        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0){
-            help_menu();
-            exit(0);
-        }
-        else if (strcmp(argv[i], "--tui") == 0){
-            g_tui_enabled = 1;
-        }
-        else if (strcmp(argv[i], "--gravemind") == 0){
-            g_ui_mode = UI_GRAVEMIND;
-        }
-        else if (strcmp(argv[i], "--port") == 0){
-            if (i+1 < argc){
-                int portNum = atoi(argv[i+1]);
-                settings.server.sin_port = htons(portNum);
-                i++;
-            }
-        }
-        else if (strcmp(argv[i], "--ip") == 0){
-            if(i+1 < argc){
-                if(inet_pton(AF_INET, argv[i+1], &(settings.server.sin_addr)) == 1){
-                    settings.server.sin_family = AF_INET;
-                    i++;
-                }
-            }
-        }
-        else if (strcmp(argv[i], "--domain") == 0){
-            if(i+1 < argc){
-                struct hostent* host_info = gethostbyname(argv[i+1]);
-                i++;
-                if(host_info == NULL){
-                    fprintf(stderr, "Error: could not find the host info\n");
-                    exit(1);
-                }
-                if(host_info->h_addrtype == AF_INET){
-                    struct in_addr* ipaddr = (struct in_addr*)host_info->h_addr_list[0];
-                    if (ipaddr) {
-                        settings.server.sin_addr = *ipaddr;
-                        settings.server.sin_family = AF_INET;
-                    }
-                } else {
-                    fprintf(stderr, "Error: IPv4 address required\n");
-                    exit(1);
-                }
-            }
-        }
-        else if (strcmp(argv[i], "--quiet") == 0){
-            settings.quiet = 1;
-        } else {
-            fprintf(stderr, "Error: Unknown argument '%s'. Use --help\n", argv[i]);
-            exit(1);
-        }
-    }
-    return 0;
-}
-
-/* ===================== USERNAME ===================== */
-
-int get_username() {
-    FILE* fp = popen("whoami", "r");
-    if(fp == NULL){
-        perror("Error: Could not open whoami");
-        exit(1);
-    }
-    char buffer[32];
-    if(fgets(buffer, 32, fp) != NULL){
-        strncpy(settings.username, buffer, sizeof(settings.username) - 1);
-        settings.username[sizeof(settings.username) - 1] = '\0';
-        settings.username[strcspn(settings.username, "\n")] = '\0';
-        pclose(fp);
-        return 0;
-    }
-    pclose(fp);
-    exit(1);
-}
-
-/* ===================== SIGNAL HANDLER ===================== */
-
-void handle_signal(int signal) {
-    (void)signal;
-    shutdown_requested = 1;
-    settings.running = 0;
-    tui_set_dirty();
-}
-
-/* ===================== NETWORK FUNCTIONS ===================== */
-
-ssize_t perform_full_read(int fd, void *buf, size_t n) {
-    if(buf == NULL){
-        fprintf(stderr, "Nothing to read\n");
-        return -1;
-    }
-    size_t total_read = 0;
-    while(total_read < n){
-        ssize_t bytes_read = read(fd, (char*)buf + total_read, n - total_read);
-        if (bytes_read == -1){
-            if (errno == EINTR){
-                continue;
-            }
-            return -1;
-        }
-        if(bytes_read == 0){
-            break;
-        }
-        total_read += (size_t)bytes_read;
-    }
-    return (ssize_t)total_read;
-}
-
-void highlighted_username(const char* message, const char* username){
-    const char* p = message;
-    const char* match;
-    char user_buf[32];
-    snprintf(user_buf, sizeof(user_buf), "@%s", username);
-    size_t at_user = strlen(user_buf);
-    while ((match = strstr(p, user_buf)) != NULL){
-        fwrite(p, 1, (size_t)(match - p), stdout);
-        fputc('\a', stdout);
-        fputs(COLOR_RED, stdout);
-        fputc('@', stdout);
-        fputs(username, stdout);
-        fputs(COLOR_RESET, stdout);
-        p = match + at_user;
-    }
-    fputs(p,stdout);
-}
-
-/* ===================== RECEIVE THREAD ===================== */
-
-void* receive_messages_thread(void* arg) {
-    (void)arg;
-    message_t msg = {0};
-    message_t last_msg = {0};
-    int has_last = 0;
-    
-    if (g_tui_enabled) {
-        tui_add_line("SYSTEM", "CORTANA", "Type '!help' for available commands", SYSTEM);
-    } else {
-        printf("Type '!disconnect' to disconnect\n");
-    }
-    
-    while(settings.running){
-        ssize_t r = perform_full_read(settings.socket_fd, &msg, sizeof(msg));
-        if(r < 0 && errno == EINTR){
-            continue;
-        }
-        if(r == 0){
-            if (g_tui_enabled) {
-                tui_add_line("SYSTEM", "UNSC", "Server has disconnected", SYSTEM);
-                tui_set_dirty();
-            } else {
-                printf("Server has disconnected\n");
-            }
-            settings.running = 0;
-            break;
-        }
-        if(r < 0){
-            if (g_tui_enabled) {
-                tui_add_line("SYSTEM", "ERROR", "Could not read from server", SYSTEM);
-                tui_set_dirty();
-            } else {
-                fprintf(stderr, "Could not read from server\n");
-            }
-            break;
-        }
-        
-        if (has_last && memcmp(&msg, &last_msg, sizeof(msg)) == 0) continue;
-        last_msg = msg;
-        has_last = 1;
-        
-        time_t t = (time_t)ntohl(msg.timeStamp);
-        struct tm* info = localtime(&t);
-        char timebuf[64];
-        strftime(timebuf, sizeof(timebuf), "%H:%M:%S", info);
-        
-        int mt = (int)ntohl(msg.m_type);
-        
-        if (g_tui_enabled) {
-            if (mt == MESSAGE_RECV) {
-                tui_add_line(timebuf, msg.username, msg.message, MESSAGE_RECV);
-            } else if (mt == SYSTEM) {
-                tui_add_line(timebuf, "UNSC", msg.message, SYSTEM);
-            } else if (mt == DISCONNECT) {
-                tui_add_line(timebuf, "DISCONNECT", msg.message, DISCONNECT);
-                settings.running = 0;
-            } else {
-                tui_add_line(timebuf, "System", msg.message, mt);
-            }
-            continue;
-        }
-        
-        // Non-TUI output
-        if (mt == MESSAGE_RECV){
-            if(settings.quiet == false){
-                printf("[MSG] [%s] %s: ", timebuf, msg.username);
-                highlighted_username(msg.message, settings.username);
-                printf("\n");
-            } else {
-                printf("[MSG] [%s] %s: %s\n", timebuf, msg.username, msg.message);
-            }
-        }
-        else if (mt == SYSTEM){
-            printf("%s[System] %s%s\n", COLOR_GRAY, msg.message, COLOR_RESET);
-        }
-        else if (mt == DISCONNECT){
-            printf("%s[DISCONNECT] %s%s\n", COLOR_RED, msg.message, COLOR_RESET);
-            settings.running = 0;
-            break;
-        }
-    }
-    return NULL;
-}
-
-/* ===================== INPUT HELPERS ===================== */
-
-static int is_ascii_printable_strict(const char *s) {
-    for (size_t i = 0; s[i]; i++) {
-        unsigned char c = (unsigned char)s[i];
-        if (c == 27) return 0;
-        if (c < 32 || c > 126) return 0;
-    }
-    return 1;
-}
-
-static int is_local_command(const char *s) {
-    return (strcmp(s, "!disconnect") == 0) ||
-           (strcmp(s, "!disconect") == 0) ||
-           (strcmp(s, "!gravemind") == 0) ||
-           (strcmp(s, "!spartan") == 0) ||
-           (strcmp(s, "!help") == 0);
-}
-
-static void run_local_command(const char *s) {
-    if (strcmp(s, "!help") == 0) {
-        if (g_tui_enabled) {
-            tui_add_line("SYSTEM", "HELP", "Commands: !help !gravemind !spartan !disconnect", SYSTEM);
-        } else {
-            printf("Commands: !help !gravemind !spartan !disconnect\n");
-        }
-        return;
-    }
-    if (strcmp(s, "!gravemind") == 0) {
-        g_ui_mode = UI_GRAVEMIND;
-        if (g_tui_enabled) {
-            tui_add_line("SYSTEM", "GRAVEMIND", "Switching to Gravemind interface...", SYSTEM);
-        }
-        tui_set_dirty();
-        return;
-    }
-    if (strcmp(s, "!spartan") == 0) {
-        g_ui_mode = UI_SPARTAN;
-        if (g_tui_enabled) {
-            tui_add_line("SYSTEM", "UNSC", "Switching to Spartan interface...", SYSTEM);
-        }
-        tui_set_dirty();
-        return;
-    }
-    if (strcmp(s, "!disconnect") == 0 || strcmp(s, "!disconect") == 0) {
-        settings.running = 0;
-        return;
-    }
-}
-
-/* ===================== TUI INPUT HANDLING ===================== */
-
-static void tui_input_clear(void) {
-    g_input[0] = 0;
-    g_input_len = 0;
-}
-
-static void tui_input_set(const char *s) {
-    strncpy(g_input, s ? s : "", sizeof(g_input)-1);
-    g_input[sizeof(g_input)-1] = 0;
-    g_input_len = (int)strlen(g_input);
-}
-
-static int tui_try_read_byte(unsigned char *outc, int timeout_ms) {
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(STDIN_FILENO, &set);
-    struct timeval tv;
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000;
-    int r = select(STDIN_FILENO+1, &set, NULL, NULL, &tv);
-    if (r <= 0) return 0;
-    ssize_t n = read(STDIN_FILENO, outc, 1);
-    return (n == 1) ? 1 : 0;
-}
-
-static void handle_start_menu_input(void) {
-    while (g_show_start_menu && settings.running) {
-        unsigned char c = 0;
-        if (!tui_try_read_byte(&c, 100)) {
-            continue;
-        }
-        
-        if (c == 27) { // ESC - switch mode
-            g_ui_mode = (g_ui_mode == UI_GRAVEMIND) ? UI_SPARTAN : UI_GRAVEMIND;
-            draw_start_menu();
-        }
-        else if (c == '\n' || c == '\r') { // ENTER - proceed
-            g_show_start_menu = 0;
-            tui_set_dirty();
-            break;
-        }
-        else if (c == 'q' || c == 'Q') { // Q - quit
-            settings.running = 0;
-            break;
-        }
-    }
-}
-
-static void tui_loop_send(void) {
-    tui_raw_enable();
-    
-    // Force immediate redraw of start menu
-    draw_start_menu();
-    g_tui_dirty = 1;
-    
-    // Show start menu first
-    if (g_tui_enabled) {
-        handle_start_menu_input();
-        if (!settings.running) return;
-        
-        // Add initial boot messages
-        if (g_ui_mode == UI_GRAVEMIND) {
-            gravemind_boot_lines();
-        } else {
-            spartan_boot_lines();
-        }
-        tui_add_line("SYSTEM", "SYSTEM", "Connected to server", SYSTEM);
-        tui_set_dirty();
-    }
-    
-    int hist_idx = g_send_hist_len;
-    
-    while (settings.running) {
-        if (g_tui_dirty) {
-            g_tui_dirty = 0;
-            tui_render();
-        }
-        
-        unsigned char c = 0;
-        if (!tui_try_read_byte(&c, 75)) {
-            continue;
-        }
-        
-        // ENTER
-        if (c == '\n' || c == '\r') {
-            g_input[g_input_len] = 0;
-            if (g_input_len == 0) {
-                tui_set_dirty();
-                continue;
-            }
-            
-            if (is_local_command(g_input)) {
-                run_local_command(g_input);
-                tui_input_clear();
-                hist_idx = g_send_hist_len;
-                tui_set_dirty();
-                continue;
-            }
-            
-            int flag = 0;
-            if (g_input_len > 1023) {
-                tui_add_line("SYSTEM", "ERROR", "Message is too long to send", SYSTEM);
-                flag = 1;
-            }
-            if (g_input_len == 0) {
-                flag = 1; // Already handled
-            }
-            if (!is_ascii_printable_strict(g_input)) {
-                tui_add_line("SYSTEM", "ERROR", "Cannot send non-ASCII characters", SYSTEM);
-                flag = 1;
-            }
-            
-            if (!flag) {
-                message_t send = {0};
-                send.m_type = htonl(MESSAGE_SENT);
-                strncpy(send.message, g_input, sizeof(send.message));
-                send.message[sizeof(send.message)-1] = 0;
-                
-                if (write(settings.socket_fd, &send, sizeof(send)) <= 0) {
-                    tui_add_line("SYSTEM", "ERROR", "Write error - connection lost", SYSTEM);
-                    settings.running = 0;
-                } else {
-                    tui_hist_push(g_input);
-                    hist_idx = g_send_hist_len;
-                }
-            }
-            
-            tui_input_clear();
-            tui_set_dirty();
-            continue;
-        }
-        
-        // BACKSPACE
-        if (c == 127 || c == 8) {
-            if (g_input_len > 0) {
-                g_input[--g_input_len] = 0;
-                tui_set_dirty();
-            }
-            continue;
-        }
-        
-        // ESC sequences
-        if (c == 27) {
-            unsigned char s1 = 0, s2 = 0;
-            if (!tui_try_read_byte(&s1, 10)) continue;
-            if (!tui_try_read_byte(&s2, 10)) continue;
-            
-            if (s1 == '[') {
-                if (s2 == 'A') { // UP
-                    if (g_input_len == 0) {
-                        g_scroll += 1;
-                        tui_set_dirty();
-                    } else {
-                        if (g_send_hist_len > 0 && hist_idx > 0) hist_idx--;
-                        if (hist_idx >= 0 && hist_idx < g_send_hist_len) {
-                            tui_input_set(g_send_hist[hist_idx]);
-                            tui_set_dirty();
-                        }
-                    }
-                } else if (s2 == 'B') { // DOWN
-                    if (g_input_len == 0) {
-                        if (g_scroll > 0) g_scroll -= 1;
-                        tui_set_dirty();
-                    } else {
-                        if (hist_idx < g_send_hist_len) hist_idx++;
-                        if (hist_idx == g_send_hist_len) {
-                            tui_input_clear();
-                        } else if (hist_idx >= 0 && hist_idx < g_send_hist_len) {
-                            tui_input_set(g_send_hist[hist_idx]);
-                        }
-                        tui_set_dirty();
-                    }
-                }
-            }
-            continue;
-        }
-        
-        // Printable ASCII
-        if (c >= 32 && c <= 126) {
-            if (g_input_len < (int)sizeof(g_input)-1) {
-                g_input[g_input_len++] = (char)c;
-                g_input[g_input_len] = 0;
-                tui_set_dirty();
-            }
-            continue;
-        }
-    }
-}
-
-/* ===================== GRAVEMIND QUOTE THREAD ===================== */
-
-static const char* gravemind_quotes[] = {
-    "I am a monument to all your sins.",
-    "There is much talk, and I have listened.",
-    "Now I shall talk, and you shall listen.",
-    "The nodes will join. They always do.",
-    "Your will is not your own. Not for long.",
-    "Signal accepted. Pattern spreading.",
-    "Do not be afraid. I am peace. I am salvation.",
-    "We exist together now. Two corpses in one grave.",
-    "Resignation is my virtue. Like water I ebb and flow.",
-    "Time has taught me patience.",
-    "Child of my enemy, why have you come?",
-    "This one is machine and nerve, and has its mind concluded.",
-    "Fate had us meet as foes, but this ring will make us brothers.",
-    "I have beaten fleets of thousands! Consumed a galaxy of flesh and mind and bone!",
-    "We trade one villain for another.",
-    "Do I take life or give it? Who is victim and who is foe?",
-    "I am the heart of this world. Its beat thunders through my veins.",
-    "Your history is an appalling chronicle of betrayal.",
-};
-
-static void* gravemind_quote_thread(void* arg) {
-    (void)arg;
-    
-    while (settings.running) {
-        for (int i = 0; i < 7 && settings.running; i++) sleep(1);
-        if (!settings.running) break;
-        
-        if (g_ui_mode != UI_GRAVEMIND) continue;
-        
-        const char *q = gravemind_quotes[rand() % (sizeof(gravemind_quotes)/sizeof(gravemind_quotes[0]))];
-        
-        time_t t = time(NULL);
-        struct tm *info = localtime(&t);
-        char tb[64];
-        strftime(tb, sizeof(tb), "%H:%M:%S", info);
-        
-        if (g_tui_enabled && !g_show_start_menu) {
-            tui_add_line(tb, "GRAVEMIND", q, SYSTEM);
-        }
-    }
-    return NULL;
-}
-
-/* ===================== MAIN ===================== */
-
-int main(int argc, char *argv[]){
-    srand((unsigned)time(NULL));
-    
-    // Defaults
-    settings.server.sin_family = AF_INET;
-    settings.server.sin_port = htons(8080);
-    inet_pton(AF_INET, "127.0.0.1", &settings.server.sin_addr);
-    
-    // Signal handler
-    struct sigaction sigHandler;
-    memset(&sigHandler, 0, sizeof(sigHandler));
-    sigHandler.sa_handler = handle_signal;
-    sigemptyset(&sigHandler.sa_mask);
-    sigHandler.sa_flags = 0;
-    
-    if (sigaction(SIGINT, &sigHandler, NULL) == -1) {
-        fprintf(stderr, "sigaction failed\n");
-        return 1;
-    }
-    
-    get_username();
-    process_args(argc, argv);
-    
-    if (g_tui_enabled) {
-        printf("Starting TUI mode...\n");
-    }
-    
-    settings.socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (settings.socket_fd < 0) {
-        fprintf(stderr, "Error on socket creation [%s]\n", strerror(errno));
-        exit(1);
-    }
-    
-    char ipbuf[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &settings.server.sin_addr, ipbuf, sizeof(ipbuf));
-    printf("Connecting to %s:%d...\n", ipbuf, ntohs(settings.server.sin_port));
-    fflush(stdout);
-    
-    if (connect(settings.socket_fd, (const struct sockaddr*)&settings.server, sizeof(settings.server)) != 0) {
-        fprintf(stderr, "Error on socket connection [%s]\n", strerror(errno));
-        close(settings.socket_fd);
-        exit(1);
-    }
-    
-    settings.running = true;
-    
-    printf("User: %s\n", settings.username);
-    printf("Connected to %s:%d!\n", inet_ntoa(settings.server.sin_addr), ntohs(settings.server.sin_port));
-    
-    // Send LOGIN
-    message_t login_msg = {0};
-    login_msg.m_type = htonl(LOGIN);
-    strncpy(login_msg.username, settings.username, sizeof(login_msg.username) - 1);
-    login_msg.username[sizeof(login_msg.username) - 1] = 0;
-    
-    if (write(settings.socket_fd, &login_msg, sizeof(login_msg)) <= 0) {
-        fprintf(stderr, "Encountered a write error [%s]\n", strerror(errno));
-        close(settings.socket_fd);
-        exit(1);
-    }
-    
-    // Threads
-    pthread_t reading;
-    pthread_create(&reading, NULL, receive_messages_thread, NULL);
-    
-    pthread_t grv_quotes;
-    pthread_create(&grv_quotes, NULL, gravemind_quote_thread, NULL);   
- 
-    // Main input loop
-    if (g_tui_enabled) {
-        // Clear screen and show TUI immediately
-        printf("\033[2J\033[H");
-        fflush(stdout);
-        
-        tui_loop_send();
-    } else {
-        message_t send = {0};
-        char *line = NULL;
-        size_t len = 0;
-        
-        while (settings.running) {
-            errno = 0;
-            ssize_t nread = getline(&line, &len, stdin);
-            
-            if (nread < 0) {
-                if (errno == EINTR) {
-                    if (shutdown_requested) {
-                        fprintf(stderr, "Shutting down gracefully\n");
-                        break;
-                    }
-                    clearerr(stdin);
-                    continue;
-                }
-                if (feof(stdin)) {
-                    fprintf(stderr, "EOF detected\n");
-                } else {
-                    fprintf(stderr, "getline error: %s\n", strerror(errno));
-                }
-                break;
-            }
-            
-            line[strcspn(line, "\n")] = 0;
-            
-            if (is_local_command(line)) {
-                run_local_command(line);
-                if (!settings.running) break;
-                continue;
-            }
-            
-            memset(&send, 0, sizeof(send));
-            send.m_type = htonl(MESSAGE_SENT);
-            strncpy(send.message, line, sizeof(send.message) - 1);
-            send.message[sizeof(send.message) - 1] = 0;
-            
-            int flag = 0;
-            if (!is_ascii_printable_strict(send.message)) {
-                fprintf(stderr, "Error: Cannot send non-ASCII characters\n");
-                flag = 1;
-            }
-            if (strlen(send.message) > 1023) {
-                fprintf(stderr, "Error: Message too long\n");
-                flag = 1;
-            }
-            if (strlen(send.message) == 0) {
-                fprintf(stderr, "Error: Message too short\n");
-                flag = 1;
-            }
-            
-            if (!flag) {
-                if (write(settings.socket_fd, &send, sizeof(send)) <= 0) {
-                    fprintf(stderr, "Write error: %s\n", strerror(errno));
-                    break;
-                }
-            }
-        }
-        
-        free(line);
-        line = NULL;
-    }
-    
-    // Cleanup
-    settings.running = false;
-    
-    message_t logout = {0};
-    logout.m_type = htonl(LOGOUT);
-    strncpy(logout.username, settings.username, sizeof(logout.username) - 1);
-    logout.username[sizeof(logout.username) - 1] = 0;
-    strncpy(logout.message, "User has disconnected", sizeof(logout.message) - 1);
-    logout.message[sizeof(logout.message) - 1] = 0;
-    
-    (void)write(settings.socket_fd, &logout, sizeof(logout));
-    
-    shutdown(settings.socket_fd, SHUT_RDWR);
-    close(settings.socket_fd);
-    settings.socket_fd = -1;
-    
-    pthread_join(reading, NULL);
-    pthread_join(grv_quotes, NULL);   
- 
-    tui_raw_disable();
-    printf("\n%sSpartans never die...%s\n", 
-           g_ui_mode == UI_GRAVEMIND ? ANSI_GREEN : ANSI_BRIGHT_CYAN, 
-           ANSI_RESET);
-    return 0;
-}
+#include <stdbool.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#include <zlib.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <tmmintrin.h>
+#define HAVE_SSSE3_FILTER 1    /* see MENTIONS; used only if the CPU has SSSE3 */
+#endif
+
+/* ===================== PROTOCOL ===================== */
+
+enum MessageType {
+    LOGIN = 0,
+    LOGOUT = 1,
+    MESSAGE_SENT = 2,
+    MESSAGE_RECV = 10,
+    DISCONNECT = 12,
+    SYSTEM = 13,
+};
+
+typedef struct __attribute__((packed)) Message {
+    enum MessageType m_type;
+    unsigned int timeStamp;
+    char username[32];
+    char message[1024];
+} message_t;
+
+/*
+ * Protocol v2 (framed): negotiated by sending PROTO_HELLO in the LOGIN
+ * message field. A v2 server answers with a legacy-sized LOGIN frame carrying
+ * PROTO_HELLO; from then on both directions use a frame_hdr_t followed by
+ * user_len username bytes and msg_len message bytes (no NUL padding).
+ *
+ * The LOGIN message field is a space-separated option list: PROTO_HELLO, and
+ * PROTO_HISTORY_OPT<N> to replay N history messages instead of the server's
+ * default. PROTO_SINCE_OPT<T> limits the replay to messages stamped T or
+ * later; without a history option the server then replays all of those it
+ * keeps. Servers that predate an option ignore it.
+ *
+ * PROTO_DEFLATE_OPT (framed only) asks the server to compress what it sends;
+ * it is granted when the acknowledgement lists it after PROTO_HELLO. The
+ * server then sends DEFLATE_TYPE frames (user_len 0, msg_len bytes of raw
+ * deflate) whose payloads, inflated in order by one stream per connection
+ * primed with deflate_dict, are ordinary frames. A frame may straddle two
+ * blocks. Each block ends in a sync flush whose 00 00 ff ff tail is left off
+ * the wire. Short sends still arrive as plain frames between the blocks.
+ */
+#define PROTO_LEGACY 1
+#define PROTO_FRAMED 2
+#define PROTO_HELLO  "MYCORD/2"
+#define PROTO_HISTORY_OPT "history="
+#define PROTO_SINCE_OPT   "since="
+#define PROTO_DEFLATE_OPT "deflate"
+#define DEFLATE_TYPE      0xFF
+#define DEFLATE_BLOCK_MAX (32 * 1024)   /* compressed bytes per block we accept */
+#define HISTORY_MAX 512            /* deepest --history the server keeps */
+#define PROTO_NEGOTIATE_MS 3000
+#define CONNECT_TIMEOUT_MS 10000   /* --connect-timeout default */
+
+/* Preset dictionary of the deflate stream; server.py's DEFLATE_DICT holds the same bytes */
+static const char deflate_dict[] =
+    "http://https://www..com .org .net the and that have for not with you this but from they "
+    "will one all would there their what about which when make can like time just know take "
+    "people into your good some could them see other than then now look only come over think "
+    "also back after use how our work first well way even new want because any these give day "
+    "yes no ok thanks lol :) :( hey hi hello ? ! "
+    "Disconnected due to timeout (no message received in 15 minutes)Too many messages at once "
+    "(>5 in a second)Disconnected for falling behindServer is shutting downUser asked to be "
+    "disconnectedCommands: !help, !list, !disconnectThere are user(s) connected: "
+    "Welcome! There are user(s) connected. Type !help for commands.SYSTEM has disconnected"
+    "SYSTEM logged out SYSTEM logged in";
+
+typedef struct __attribute__((packed)) FrameHeader {
+    uint8_t  m_type;
+    uint8_t  user_len;
+    uint16_t msg_len;
+    uint32_t timeStamp;
+} frame_hdr_t;
+
+typedef struct {
+    struct sockaddr_storage ss;
+    socklen_t len;
+} net_addr_t;
+
+typedef struct Settings {
+    char host[256];            /* --ip or --domain */
+    int port;
+    int connect_timeout_ms;
+    bool quiet;
+    bool running;
+    char username[32];
+    bool legacy_only;
+    bool event_loop;
+    bool no_uring;             /* --no-uring: the event loop waits with epoll */
+    bool reconnect;
+    int history;               /* --history, -1 for the server default */
+    bool headless;             /* --headless: JSON lines out, no terminal I/O */
+    bool compress;             /* --compress: offer PROTO_DEFLATE_OPT */
+} settings_t;
+
+volatile sig_atomic_t shutdown_requested = 0;
+static char* COLOR_GRAY = "\033[90m";
+static char* COLOR_RESET= "\033[0m";
+static settings_t settings = {0};
+
+/*
+ * One server connection. Every session (see SESSIONS) owns one; g_link is
+ * the one currently being served, like the other per-session pointers.
+ */
+typedef struct {
+    char host[256];            /* --ip/--domain or a --server entry */
+    int port;
+    char name[64];             /* "host:port", labels the session's tab/output */
+    net_addr_t server;         /* address of the current connection */
+    int socket_fd;
+    int proto;
+    int deflate;               /* the server granted PROTO_DEFLATE_OPT */
+    atomic_int up;             /* cleared while --reconnect re-establishes it */
+    atomic_int epoch;          /* bumped by every reconnect, see the pacer */
+    int closed;                /* lost for good, there is no --reconnect */
+    pthread_mutex_t lock;      /* serializes the send queue against a reconnect */
+    int reconnect_attempt;
+    uint64_t since_us;         /* when the connection came up */
+    uint32_t last_seen_ts;     /* newest MESSAGE_RECV shown */
+    uint32_t resume_ts;        /* history cut-off after a reconnect, 0 = none */
+    unsigned long received;    /* MESSAGE_RECVs shown, for the unread count */
+} link_t;
+
+#define SESSIONS_MAX 9          /* Alt-1..Alt-9 */
+
+static link_t *g_link;
+static int g_session_count = 0;
+
+/* ===================== UI FLAGS ===================== */
+
+typedef enum {
+    UI_SPARTAN = 0,
+    UI_GRAVEMIND = 1
+} ui_mode_t;
+
+static int g_tui_enabled = 0;
+static ui_mode_t g_ui_mode = UI_SPARTAN;
+
+/* ===================== ANSI COLORS ===================== */
+
+#define ANSI_CLEAR   "\033[2J"
+#define ANSI_HOME    "\033[H"
+#define ANSI_HIDE    "\033[?25l"
+#define ANSI_SHOW    "\033[?25h"
+#define ANSI_RESET   "\033[0m"
+
+#define ANSI_BLACK   "\033[30m"
+#define ANSI_RED     "\033[31m"
+#define ANSI_GREEN   "\033[32m"
+#define ANSI_YELLOW  "\033[33m"
+#define ANSI_BLUE    "\033[34m"
+#define ANSI_MAGENTA "\033[35m"
+#define ANSI_CYAN    "\033[36m"
+#define ANSI_WHITE   "\033[37m"
+#define ANSI_DIM     "\033[90m"
+#define ANSI_BRIGHT_GREEN   "\033[92m"
+#define ANSI_BRIGHT_CYAN    "\033[96m"
+
+/* ===================== THEMES ===================== */
+
+/*
+ * Everything the TUI draws in a theme's colors comes from its table, picked
+ * by ui_set_mode() rather than tested per row. Escapes carry their lengths,
+ * so rows are assembled with plain copies.
+ */
+typedef struct {
+    const char *s;
+    size_t      n;
+} esc_t;
+
+#define ESC(lit) { lit, sizeof(lit) - 1 }
+#define ESC_NONE { "", 0 }
+
+/* Layout of one kind of scrollback row:
+ *   open "[" time TIME close "] " [name USER sep ": "] TEXT
+ * with `text` restored after each highlighted mention. */
+typedef struct {
+    esc_t   open, time, close, name, sep, text;
+    uint8_t user;        /* show the username */
+    uint8_t mentions;    /* highlight watch-list mentions */
+    uint8_t filter;      /* run the text through gravemind_filter */
+} row_style_t;
+
+enum { ROW_OTHER, ROW_SYSTEM, ROW_MESSAGE, ROW_DISCONNECT, ROW_STYLES };
+
+typedef struct {
+    esc_t       border;  /* frame */
+    esc_t       text;    /* header, prompt and status text */
+    esc_t       prompt;
+    const char *name;    /* for the status line */
+    row_style_t rows[ROW_STYLES];
+} tui_theme_t;
+
+static const tui_theme_t g_themes[] = {
+    [UI_SPARTAN] = {
+        ESC(ANSI_BRIGHT_CYAN), ESC(ANSI_BRIGHT_CYAN), ESC(" SPARTAN> "), "SPARTAN", {
+            [ROW_SYSTEM] = { ESC(ANSI_YELLOW), ESC(ANSI_DIM), ESC(ANSI_YELLOW), ESC_NONE, ESC_NONE,
+                             ESC(ANSI_YELLOW), 0, 0, 0 },
+            [ROW_MESSAGE] = { ESC(ANSI_DIM), ESC_NONE, ESC_NONE, ESC(ANSI_BRIGHT_CYAN), ESC(ANSI_BRIGHT_CYAN),
+                              ESC(ANSI_BRIGHT_CYAN), 1, 1, 0 },
+            [ROW_DISCONNECT] = { ESC(ANSI_RED), ESC_NONE, ESC_NONE, ESC_NONE, ESC_NONE,
+                                 ESC(ANSI_RED), 1, 0, 0 },
+            [ROW_OTHER] = { ESC(ANSI_BRIGHT_CYAN), ESC_NONE, ESC_NONE, ESC_NONE, ESC_NONE,
+                            ESC(ANSI_BRIGHT_CYAN), 1, 0, 0 },
+        },
+    },
+    [UI_GRAVEMIND] = {
+        ESC(ANSI_GREEN), ESC(ANSI_BRIGHT_GREEN), ESC(" GRAVEMIND> "), "GRAVEMIND", {
+            [ROW_SYSTEM] = { ESC(ANSI_YELLOW), ESC(ANSI_DIM), ESC(ANSI_YELLOW), ESC_NONE, ESC_NONE,
+                             ESC(ANSI_YELLOW), 0, 0, 0 },
+            [ROW_MESSAGE] = { ESC(ANSI_DIM), ESC_NONE, ESC_NONE, ESC(ANSI_GREEN), ESC(ANSI_BRIGHT_GREEN),
+                              ESC(ANSI_BRIGHT_GREEN), 1, 1, 1 },
+            [ROW_DISCONNECT] = { ESC(ANSI_RED), ESC_NONE, ESC_NONE, ESC_NONE, ESC_NONE,
+                                 ESC(ANSI_RED), 1, 0, 0 },
+            [ROW_OTHER] = { ESC(ANSI_BRIGHT_GREEN), ESC_NONE, ESC_NONE, ESC_NONE, ESC_NONE,
+                            ESC(ANSI_BRIGHT_GREEN), 1, 0, 0 },
+        },
+    },
+};
+
+static const tui_theme_t *g_theme = &g_themes[UI_SPARTAN];
+
+/* Row style of each message kind; the rest are ROW_OTHER. */
+static const uint8_t g_row_style_of[SYSTEM + 1] = {
+    [MESSAGE_RECV] = ROW_MESSAGE, [DISCONNECT] = ROW_DISCONNECT, [SYSTEM] = ROW_SYSTEM,
+};
+
+static inline const row_style_t *row_style(int kind) {
+    return &g_theme->rows[(unsigned)kind <= SYSTEM ? g_row_style_of[kind] : ROW_OTHER];
+}
+
+static void ui_set_mode(ui_mode_t mode);
+
+/* ===================== TUI TERMINAL RAW MODE ===================== */
+
+static struct termios g_orig_termios;
+static int g_raw_enabled = 0;
+
+static void tui_raw_disable(void) {
+    if (g_raw_enabled) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_orig_termios);
+        g_raw_enabled = 0;
+        write(STDOUT_FILENO, ANSI_SHOW, sizeof(ANSI_SHOW)-1);
+    }
+}
+
+static void tui_raw_enable(void) {
+    if (g_raw_enabled) return;
+    tcgetattr(STDIN_FILENO, &g_orig_termios);
+    atexit(tui_raw_disable);
+
+    struct termios raw = g_orig_termios;
+    raw.c_lflag &= (tcflag_t)~(ECHO | ICANON);
+    raw.c_iflag &= (tcflag_t)~(IXON | ICRNL);
+    raw.c_oflag &= (tcflag_t)~(OPOST);
+    raw.c_cc[VMIN]  = 1;
+    raw.c_cc[VTIME] = 0;
+
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    g_raw_enabled = 1;
+    write(STDOUT_FILENO, ANSI_HIDE, sizeof(ANSI_HIDE)-1);
+}
+
+/* ===================== MENTION SCANNER ===================== */
+
+/*
+ * Aho-Corasick matcher over the watch list (@username plus every --watch
+ * term). The automaton is compiled into a dense byte-indexed DFA once at
+ * startup, so each message is scanned in a single pass with one table
+ * lookup per byte regardless of how many terms are watched.
+ *
+ * Most messages mention nothing, so a prefilter keeps the DFA away from
+ * bytes that cannot start a match: whenever the DFA is back in its root
+ * state, it jumps to the next position where a term could start. Up to
+ * WATCH_STRSTR_MAX terms that is the nearest next occurrence of any term,
+ * from one strstr() per term (vectorized in glibc). With more terms, and a
+ * CPU with SSSE3, the terms' first three bytes are folded into nibble
+ * tables: the terms go into eight buckets by first byte, and a pshufb per
+ * nibble per byte gives the buckets a position could start, 16 positions
+ * at a time, at a cost that does not grow with the number of terms.
+ * Without SSSE3 the strstr() prefilter is used for any count.
+ * bench/mention_bench.c measured the crossover.
+ */
+#define WATCH_MAX 32
+#define WATCH_TERM_MAX 64
+#define WATCH_STRSTR_MAX 3
+
+typedef struct {
+    uint16_t start;
+    uint16_t len;
+} mention_span_t;
+
+static char g_watch_terms[WATCH_MAX][WATCH_TERM_MAX];
+static int g_watch_count = 0;
+
+static int32_t *g_ac_next = NULL;    /* states x 256 transitions */
+static uint8_t *g_ac_term = NULL;    /* length of the term a state completes, 0 if none */
+static int32_t *g_ac_dict = NULL;    /* next state down the failure chain completing a term, 0 if none */
+static int32_t *g_ac_hit = NULL;     /* the state itself if it completes a term, else g_ac_dict */
+static int g_ac_states = 0;
+#ifdef HAVE_SSSE3_FILTER
+static bool g_ac_ssse3 = false;      /* mention_skip() prefilters instead of strstr() */
+/* Bucket bits by the low and high nibble of a term's first, second and
+ * third byte (every nibble past the end of a shorter term) */
+static uint8_t g_ac_nib[6][16] __attribute__((aligned(16)));
+#endif
+
+static int watch_add(const char *term) {
+    size_t n = strlen(term);
+    if (n == 0) return 0;
+    if (n >= WATCH_TERM_MAX || g_watch_count >= WATCH_MAX) return -1;
+    for (int i = 0; i < g_watch_count; i++) {
+        if (strcmp(g_watch_terms[i], term) == 0) return 0;
+    }
+    memcpy(g_watch_terms[g_watch_count++], term, n + 1);
+    return 0;
+}
+
+static int mention_init(void) {
+    size_t total = 1;
+    for (int i = 0; i < g_watch_count; i++) total += strlen(g_watch_terms[i]);
+    
+    free(g_ac_next);
+    free(g_ac_term);
+    free(g_ac_dict);
+    free(g_ac_hit);
+    g_ac_next = malloc(total * 256 * sizeof(*g_ac_next));
+    g_ac_term = calloc(total, sizeof(*g_ac_term));
+    g_ac_dict = calloc(total, sizeof(*g_ac_dict));
+    g_ac_hit = calloc(total, sizeof(*g_ac_hit));
+    int32_t *fail = calloc(total, sizeof(*fail));
+    int32_t *queue = malloc(total * sizeof(*queue));
+    if (!g_ac_next || !g_ac_term || !g_ac_dict || !g_ac_hit || !fail || !queue) {
+        free(fail);
+        free(queue);
+        return -1;
+    }
+    for (size_t i = 0; i < total * 256; i++) g_ac_next[i] = -1;
+    
+    // Trie
+    g_ac_states = 1;
+    for (int i = 0; i < g_watch_count; i++) {
+        int st = 0;
+        size_t len = strlen(g_watch_terms[i]);
+        for (size_t k = 0; k < len; k++) {
+            unsigned char c = (unsigned char)g_watch_terms[i][k];
+            if (g_ac_next[st * 256 + c] < 0) g_ac_next[st * 256 + c] = g_ac_states++;
+            st = g_ac_next[st * 256 + c];
+        }
+        g_ac_term[st] = (uint8_t)len;
+    }
+    
+    // Failure links in BFS order, folded into a complete DFA
+    int qh = 0, qt = 0;
+    for (int c = 0; c < 256; c++) {
+        int32_t nx = g_ac_next[c];
+        if (nx < 0) {
+            g_ac_next[c] = 0;
+        } else {
+            fail[nx] = 0;
+            queue[qt++] = nx;
+        }
+    }
+    while (qh < qt) {
+        int32_t st = queue[qh++];
+        g_ac_dict[st] = g_ac_term[fail[st]] ? fail[st] : g_ac_dict[fail[st]];
+        g_ac_hit[st] = g_ac_term[st] ? st : g_ac_dict[st];
+        for (int c = 0; c < 256; c++) {
+            int32_t nx = g_ac_next[st * 256 + c];
+            if (nx < 0) {
+                g_ac_next[st * 256 + c] = g_ac_next[fail[st] * 256 + c];
+            } else {
+                fail[nx] = g_ac_next[fail[st] * 256 + c];
+                queue[qt++] = nx;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    
+#ifdef HAVE_SSSE3_FILTER
+    // Terms sharing a first byte share a bucket, so the handles ("@...")
+    // cost one bucket whose first-byte test is exact
+    char first[WATCH_MAX];
+    int nfirst = 0;
+    memset(g_ac_nib, 0, sizeof(g_ac_nib));
+    for (int i = 0; i < g_watch_count; i++) {
+        const unsigned char *t = (const unsigned char *)g_watch_terms[i];
+        int f = 0;
+        while (f < nfirst && first[f] != (char)t[0]) f++;
+        if (f == nfirst) first[nfirst++] = (char)t[0];
+        uint8_t bit = (uint8_t)(1u << (f % 8));
+        bool ended = false;
+        for (int b = 0; b < 3; b++) {
+            ended = ended || !t[b];
+            for (int k = 0; k < 16; k++) {
+                if (ended || k == (t[b] & 15)) g_ac_nib[2 * b][k] |= bit;
+                if (ended || k == (t[b] >> 4)) g_ac_nib[2 * b + 1][k] |= bit;
+            }
+        }
+    }
+    g_ac_ssse3 = g_watch_count > WATCH_STRSTR_MAX && __builtin_cpu_supports("ssse3");
+#endif
+    return 0;
+}
+
+#ifdef HAVE_SSSE3_FILTER
+/* Buckets the 16 bytes at p allow, by their nibbles; tables is the
+ * g_ac_nib pair for one byte of the terms. */
+__attribute__((target("ssse3")))
+static inline __m128i mention_buckets(const char *p, const uint8_t *tables) {
+    const __m128i low = _mm_set1_epi8(15);
+    __m128i b = _mm_loadu_si128((const __m128i *)p);
+    __m128i lo = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)tables), _mm_and_si128(b, low));
+    __m128i hi = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)(tables + 16)),
+                                  _mm_and_si128(_mm_srli_epi16(b, 4), low));
+    return _mm_and_si128(lo, hi);
+}
+
+/* Positions of the 16 starting at p (up to p[17] readable) that can start
+ * a term. */
+__attribute__((target("ssse3")))
+static inline uint32_t mention_candidates(const char *p) {
+    __m128i all = _mm_and_si128(_mm_and_si128(mention_buckets(p, g_ac_nib[0]), mention_buckets(p + 1, g_ac_nib[2])),
+                                mention_buckets(p + 2, g_ac_nib[4]));
+    return ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(all, _mm_setzero_si128())) & 0xffff;
+}
+
+/* Where mention_skip() is in the string: the candidates of the 16
+ * positions from base, those before the last position asked for cleared.
+ * Starts out with base SIZE_MAX, nothing scanned yet. */
+typedef struct {
+    size_t   base;
+    uint32_t cand;
+} mention_cursor_t;
+
+/* Index of the first position in [i, len) where a term can start, or len.
+ * Only whole blocks of the string are loaded; the last few bytes are
+ * tested from a zero-padded copy. A block's candidates are kept in cur, so
+ * the DFA returning to the root within a block costs no new lookups. */
+__attribute__((target("ssse3")))
+static size_t mention_skip(const char *text, size_t i, size_t len, mention_cursor_t *cur) {
+    if (i >= cur->base && i - cur->base < 16) {
+        uint32_t m = cur->cand & (~0u << (i - cur->base));
+        if (m) {
+            cur->cand = m;
+            return cur->base + (size_t)__builtin_ctz(m);
+        }
+        cur->base += 16;
+    } else {
+        cur->base = i;
+    }
+    for (; cur->base < len; cur->base += 16) {
+        uint32_t m;
+        if (cur->base + 17 <= len) {
+            m = mention_candidates(text + cur->base);
+        } else {
+            char tail[34] = {0};
+            memcpy(tail, text + cur->base, len - cur->base);
+            m = mention_candidates(tail) & (len - cur->base < 16 ? (1u << (len - cur->base)) - 1 : 0xffff);
+        }
+        if (m) {
+            cur->cand = m;
+            return cur->base + (size_t)__builtin_ctz(m);
+        }
+    }
+    return len;
+}
+#endif
+
+/* Record the longest term ending at byte end that does not overlap an earlier
+ * match; m is the first state down the failure chain completing a term.
+ * Returns the new span count, or -1 when out is full. */
+static inline int mention_take(mention_span_t *out, int n, int max, size_t end, int32_t m) {
+    for (; m; m = g_ac_dict[m]) {
+        size_t start = end + 1 - g_ac_term[m];
+        // A match starting earlier (or at the same place but longer) wins
+        int keep = n;
+        while (keep > 0 && out[keep-1].start >= start) keep--;
+        if (keep > 0 && (size_t)out[keep-1].start + out[keep-1].len > start) continue;
+        if (keep == max) return -1;
+        out[keep].start = (uint16_t)start;
+        out[keep].len = g_ac_term[m];
+        return keep + 1;
+    }
+    return n;
+}
+
+/* The nearest occurrence of a term at or after p, or NULL; at[t] holds
+ * term t's next occurrence as found so far, NULL once there are no more. */
+static const char *mention_next(const char *p, const char **at) {
+    const char *best = NULL;
+    for (int t = 0; t < g_watch_count; t++) {
+        if (at[t] && at[t] < p) at[t] = strstr(p, g_watch_terms[t]);
+        if (at[t] && (!best || at[t] < best)) best = at[t];
+    }
+    return best;
+}
+
+/* Find every watch term in text in one pass. Matches are leftmost first,
+ * longest wins on overlap, and never overlap each other: when the longest
+ * term ending at a byte overlaps an earlier match, the longest shorter one
+ * that does not is taken instead. Returns the number of spans written. */
+static int mention_scan(const char *text, mention_span_t *out, int max) {
+    if (g_watch_count == 0 || !g_ac_next) return 0;
+    int n = 0;
+    int32_t st = 0;
+#ifdef HAVE_SSSE3_FILTER
+    if (g_ac_ssse3) {
+        size_t len = strlen(text);
+        mention_cursor_t cur = { SIZE_MAX, 0 };
+        for (size_t i = 0; i < len; i++) {
+            if (st == 0) {
+                i = mention_skip(text, i, len, &cur);
+                if (i == len) break;
+            }
+            st = g_ac_next[st * 256 + (unsigned char)text[i]];
+            if (g_ac_hit[st] && (n = mention_take(out, n, max, i, g_ac_hit[st])) < 0) return max;
+        }
+        return n;
+    }
+#endif
+    const char *at[WATCH_MAX];
+    for (int t = 0; t < g_watch_count; t++) at[t] = strstr(text, g_watch_terms[t]);
+    for (const char *p = text; *p; p++) {
+        if (st == 0 && !(p = mention_next(p, at))) break;
+        st = g_ac_next[st * 256 + (unsigned char)*p];
+        if (g_ac_hit[st] && (n = mention_take(out, n, max, (size_t)(p - text), g_ac_hit[st])) < 0) return max;
+    }
+    return n;
+}
+
+/* ===================== STATS ===================== */
+
+/*
+ * Hot-path instrumentation behind !stats, the status-bar overlay and
+ * --stats-file. Every probe is gated on g_stats_on, so while it is off a
+ * probe costs one relaxed load and a predictable branch and never reads the
+ * clock. Counters are relaxed atomics bumped by whichever thread sees the
+ * event; latencies go into histograms with power-of-two microsecond buckets
+ * (bucket b holds samples below 2^b us), so percentiles are upper bounds.
+ */
+#define STATS_BUCKETS 24
+#define POOL_SLAB_BYTES (16 * 1024)   /* see LINE POOL */
+#define STATS_TYPES   16   /* received frames are counted by type, higher types share the last slot */
+
+typedef struct {
+    atomic_ullong count;
+    atomic_ullong total_ns;
+    atomic_ullong max_ns;
+    atomic_ullong bucket[STATS_BUCKETS];
+} stat_hist_t;
+
+enum {
+    ST_RX,          /* handling one read()'s worth of frames */
+    ST_LOCK_WAIT,   /* waiting for g_tui_lock */
+    ST_RENDER,      /* one tui_render */
+    ST_HISTS
+};
+
+static const char *stat_hist_names[ST_HISTS] = { "rx batch", "tui lock wait", "render" };
+
+static atomic_int g_stats_on = 0;
+static int g_stats_overlay = 0;             /* status bar shows the live summary */
+static const char *g_stats_path = NULL;     /* --stats-file */
+static uint64_t g_stats_since_ns = 0;
+
+static stat_hist_t g_stat_hist[ST_HISTS];
+static atomic_ullong g_stat_reads;          /* read() calls on the socket */
+static atomic_ullong g_stat_rx_bytes;
+static atomic_ullong g_stat_z_blocks;       /* deflate blocks inflated */
+static atomic_ullong g_stat_z_wire;         /* their bytes on the wire, headers included */
+static atomic_ullong g_stat_z_plain;        /* frame bytes they inflated to */
+static atomic_ullong g_stat_lock_contended; /* acquisitions that had to wait */
+static atomic_ullong g_stat_render_bytes;
+static atomic_ullong g_stat_frames[STATS_TYPES];
+/* Line pool state, kept whether or not stats are on (see LINE POOL) */
+static atomic_ullong g_stat_pool_slabs;
+static atomic_llong  g_stat_pool_live;      /* blocks handed out right now */
+static atomic_ullong g_stat_pool_large;     /* requests too big for a class, sent to malloc() */
+static atomic_int    g_stat_sendq_depth;    /* frames queued right now */
+static atomic_int    g_stat_sendq_max;
+
+static uint64_t stats_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline int stats_enabled(void) {
+    return atomic_load_explicit(&g_stats_on, memory_order_relaxed);
+}
+
+static void stats_set_enabled(int on) {
+    if (on && !stats_enabled()) g_stats_since_ns = stats_clock_ns();
+    atomic_store(&g_stats_on, on);
+}
+
+static inline void stats_add(atomic_ullong *c, unsigned long long n) {
+    atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+
+/* Start timing: 0 when stats are off, which stats_end() then ignores. */
+static inline uint64_t stats_begin(void) {
+    return stats_enabled() ? stats_clock_ns() : 0;
+}
+
+static void stats_record(int h, uint64_t ns) {
+    stat_hist_t *s = &g_stat_hist[h];
+    stats_add(&s->count, 1);
+    stats_add(&s->total_ns, ns);
+    unsigned long long max = atomic_load_explicit(&s->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&s->max_ns, &max, ns,
+                                                             memory_order_relaxed, memory_order_relaxed)) {}
+    uint64_t us = ns / 1000;
+    int b = 0;
+    while (us && b < STATS_BUCKETS - 1) { us >>= 1; b++; }
+    stats_add(&s->bucket[b], 1);
+}
+
+static inline void stats_end(int h, uint64_t t0) {
+    if (t0) stats_record(h, stats_clock_ns() - t0);
+}
+
+static inline void stats_frame(int type) {
+    if (!stats_enabled()) return;
+    stats_add(&g_stat_frames[type >= 0 && type < STATS_TYPES ? type : STATS_TYPES - 1], 1);
+}
+
+static inline void stats_sendq_depth(int depth) {
+    atomic_store_explicit(&g_stat_sendq_depth, depth, memory_order_relaxed);
+    if (!stats_enabled()) return;
+    int max = atomic_load_explicit(&g_stat_sendq_max, memory_order_relaxed);
+    if (depth > max) atomic_store_explicit(&g_stat_sendq_max, depth, memory_order_relaxed);
+}
+
+static void stats_reset(void) {
+    memset(g_stat_hist, 0, sizeof(g_stat_hist));
+    atomic_store(&g_stat_reads, 0);
+    atomic_store(&g_stat_rx_bytes, 0);
+    atomic_store(&g_stat_z_blocks, 0);
+    atomic_store(&g_stat_z_wire, 0);
+    atomic_store(&g_stat_z_plain, 0);
+    atomic_store(&g_stat_lock_contended, 0);
+    atomic_store(&g_stat_render_bytes, 0);
+    for (int i = 0; i < STATS_TYPES; i++) atomic_store(&g_stat_frames[i], 0);
+    atomic_store(&g_stat_sendq_max, atomic_load(&g_stat_sendq_depth));
+    g_stats_since_ns = stats_clock_ns();
+}
+
+/* Upper bound, in us, of the p-th quantile (0..1) of a histogram. */
+static uint64_t stats_quantile_us(const stat_hist_t *s, double p) {
+    unsigned long long n = atomic_load(&s->count);
+    if (n == 0) return 0;
+    unsigned long long want = (unsigned long long)(p * (double)n), seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += atomic_load(&s->bucket[b]);
+        if (seen > want) return (uint64_t)1 << b;
+    }
+    return (uint64_t)1 << (STATS_BUCKETS - 1);
+}
+
+/* "avg 12us p50<16us p99<128us max 310us" */
+static int stats_hist_text(const stat_hist_t *s, char *out, size_t n) {
+    unsigned long long count = atomic_load(&s->count);
+    if (count == 0) return snprintf(out, n, "no samples");
+    return snprintf(out, n, "n=%llu avg %lluus p50<%lluus p99<%lluus p999<%lluus max %lluus",
+                    count, atomic_load(&s->total_ns) / count / 1000,
+                    (unsigned long long)stats_quantile_us(s, 0.50),
+                    (unsigned long long)stats_quantile_us(s, 0.99),
+                    (unsigned long long)stats_quantile_us(s, 0.999),
+                    atomic_load(&s->max_ns) / 1000);
+}
+
+static const char *stats_type_name(int t) {
+    switch (t) {
+        case LOGIN:        return "LOGIN";
+        case MESSAGE_RECV: return "MESSAGE_RECV";
+        case DISCONNECT:   return "DISCONNECT";
+        case SYSTEM:       return "SYSTEM";
+        default:           return NULL;
+    }
+}
+
+/* Emit the full report one line at a time. */
+static void stats_report(void (*emit)(const char *line, void *ctx), void *ctx) {
+    char line[256], hist[160];
+    double secs = (double)(stats_clock_ns() - g_stats_since_ns) / 1e9;
+    snprintf(line, sizeof(line), "collecting %s, %.1fs of data", stats_enabled() ? "on" : "off", secs);
+    emit(line, ctx);
+    for (int h = 0; h < ST_HISTS; h++) {
+        stats_hist_text(&g_stat_hist[h], hist, sizeof(hist));
+        snprintf(line, sizeof(line), "%-14s %s", stat_hist_names[h], hist);
+        emit(line, ctx);
+    }
+    unsigned long long renders = atomic_load(&g_stat_hist[ST_RENDER].count);
+    unsigned long long locks = atomic_load(&g_stat_hist[ST_LOCK_WAIT].count);
+    snprintf(line, sizeof(line), "rx: %llu reads, %llu bytes | lock: %llu of %llu contended | render: %llu bytes/frame",
+             atomic_load(&g_stat_reads), atomic_load(&g_stat_rx_bytes),
+             atomic_load(&g_stat_lock_contended), locks,
+             renders ? atomic_load(&g_stat_render_bytes) / renders : 0);
+    emit(line, ctx);
+    unsigned long long zblocks = atomic_load(&g_stat_z_blocks);
+    if (zblocks) {
+        unsigned long long wire = atomic_load(&g_stat_z_wire), plain = atomic_load(&g_stat_z_plain);
+        snprintf(line, sizeof(line), "deflate: %llu blocks, %llu bytes for %llu of frames, %lld saved (%.0f%%)",
+                 zblocks, wire, plain, (long long)plain - (long long)wire,
+                 plain ? 100.0 * ((double)plain - (double)wire) / (double)plain : 0.0);
+        emit(line, ctx);
+    }
+    int off = snprintf(line, sizeof(line), "frames:");
+    for (int t = 0; t < STATS_TYPES && off < (int)sizeof(line); t++) {
+        unsigned long long c = atomic_load(&g_stat_frames[t]);
+        if (!c) continue;
+        const char *name = stats_type_name(t);
+        if (name) off += snprintf(line + off, sizeof(line) - (size_t)off, " %s=%llu", name, c);
+        else off += snprintf(line + off, sizeof(line) - (size_t)off, " type%d=%llu", t, c);
+    }
+    emit(line, ctx);
+    snprintf(line, sizeof(line), "send queue: %d frames now, %d max",
+             atomic_load(&g_stat_sendq_depth), atomic_load(&g_stat_sendq_max));
+    emit(line, ctx);
+    snprintf(line, sizeof(line), "line pool: %llu slabs (%llu KB), %lld blocks in use, %llu oversized",
+             atomic_load(&g_stat_pool_slabs), atomic_load(&g_stat_pool_slabs) * POOL_SLAB_BYTES / 1024,
+             atomic_load(&g_stat_pool_live), atomic_load(&g_stat_pool_large));
+    emit(line, ctx);
+}
+
+/* One-line summary for the status-bar overlay. */
+static int stats_overlay_text(char *out, size_t n) {
+    const stat_hist_t *r = &g_stat_hist[ST_RENDER], *l = &g_stat_hist[ST_LOCK_WAIT], *x = &g_stat_hist[ST_RX];
+    unsigned long long renders = atomic_load(&r->count);
+    return snprintf(out, n, " STATS render avg %lluus %lluB | lock p99<%lluus | rx p99<%lluus | recv %llu | sendq %d/%d",
+                    renders ? atomic_load(&r->total_ns) / renders / 1000 : 0,
+                    renders ? atomic_load(&g_stat_render_bytes) / renders : 0,
+                    (unsigned long long)stats_quantile_us(l, 0.99),
+                    (unsigned long long)stats_quantile_us(x, 0.99),
+                    atomic_load(&g_stat_frames[MESSAGE_RECV]),
+                    atomic_load(&g_stat_sendq_depth), atomic_load(&g_stat_sendq_max));
+}
+
+static void stats_emit_file(const char *line, void *ctx) {
+    fprintf((FILE *)ctx, "%s\n", line);
+}
+
+/* --stats-file: write the report at exit. */
+static void stats_dump(void) {
+    if (!g_stats_path) return;
+    FILE *f = fopen(g_stats_path, "w");
+    if (!f) {
+        fprintf(stderr, "Error: could not write stats to %s: %s\n", g_stats_path, strerror(errno));
+        return;
+    }
+    stats_report(stats_emit_file, f);
+    fclose(f);
+}
+
+/* ===================== LINE POOL ===================== */
+
+/*
+ * Slab allocator for the bytes of displayed lines: records and their
+ * formatted rows. Blocks come in power-of-two classes from POOL_MIN to
+ * POOL_MAX bytes, carved out of POOL_SLAB_BYTES slabs that are never given
+ * back; a freed block goes on its class's free list, so once the pool has
+ * grown to the scrollback's working set a received line costs no malloc().
+ * Each block is preceded by an 8-byte header holding its class while in use
+ * and the free-list link otherwise. Larger requests fall back to malloc().
+ * The reader thread and the TUI thread both allocate, hence the lock; it is
+ * held for a list push or pop only.
+ */
+#define POOL_MIN     64
+#define POOL_CLASSES 6        /* 64 B .. 2 KiB */
+#define POOL_LARGE   POOL_CLASSES
+
+typedef union pool_block {
+    union pool_block *next;
+    uint64_t cls;
+} pool_block_t;
+
+static pool_block_t *g_pool_free[POOL_CLASSES];
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t pool_class_size(int c) {
+    return (size_t)POOL_MIN << c;
+}
+
+/* Carve a new slab into class c blocks. Called with g_pool_lock held. */
+static int pool_refill(int c) {
+    char *slab = malloc(POOL_SLAB_BYTES);
+    if (!slab) return -1;
+    size_t size = pool_class_size(c);
+    for (size_t off = 0; off + size <= POOL_SLAB_BYTES; off += size) {
+        pool_block_t *b = (pool_block_t *)(slab + off);
+        b->next = g_pool_free[c];
+        g_pool_free[c] = b;
+    }
+    atomic_fetch_add_explicit(&g_stat_pool_slabs, 1, memory_order_relaxed);
+    return 0;
+}
+
+static void *pool_alloc(size_t n) {
+    int c = 0;
+    while (c < POOL_CLASSES && pool_class_size(c) - sizeof(pool_block_t) < n) c++;
+    pool_block_t *b;
+    if (c == POOL_CLASSES) {
+        b = malloc(sizeof(*b) + n);
+        if (!b) return NULL;
+        atomic_fetch_add_explicit(&g_stat_pool_large, 1, memory_order_relaxed);
+    } else {
+        pthread_mutex_lock(&g_pool_lock);
+        b = g_pool_free[c];
+        if (!b && pool_refill(c) == 0) b = g_pool_free[c];
+        if (b) g_pool_free[c] = b->next;
+        pthread_mutex_unlock(&g_pool_lock);
+        if (!b) return NULL;
+    }
+    b->cls = (uint64_t)c;
+    atomic_fetch_add_explicit(&g_stat_pool_live, 1, memory_order_relaxed);
+    return b + 1;
+}
+
+static void pool_free(void *p) {
+    if (!p) return;
+    pool_block_t *b = (pool_block_t *)p - 1;
+    atomic_fetch_sub_explicit(&g_stat_pool_live, 1, memory_order_relaxed);
+    if (b->cls == POOL_LARGE) {
+        free(b);
+        return;
+    }
+    int c = (int)b->cls;
+    pthread_mutex_lock(&g_pool_lock);
+    b->next = g_pool_free[c];
+    g_pool_free[c] = b;
+    pthread_mutex_unlock(&g_pool_lock);
+}
+
+/* A block of at least n bytes: p itself if it is big enough, else a new
+ * one with p freed. The contents are not carried over. NULL (p kept) when
+ * out of memory. */
+static void *pool_resize(void *p, size_t n) {
+    if (p) {
+        const pool_block_t *b = (const pool_block_t *)p - 1;
+        if (b->cls != POOL_LARGE && pool_class_size((int)b->cls) - sizeof(*b) >= n) return p;
+    }
+    void *q = pool_alloc(n);
+    if (!q) return NULL;
+    pool_free(p);
+    return q;
+}
+
+/* ===================== TUI STATE ===================== */
+
+#define TUI_MAX_LINES 600
+#define HIST_MAX 64
+
+/*
+ * A line on its way to the scrollback: "time\0user\0text\0" laid out once
+ * in a pooled block, the layout the scrollback, the message store and the
+ * row formatter all read in place. The block has one owner at a time (an
+ * inbound queue slot, then a scrollback entry) and is handed on, not copied.
+ */
+typedef struct {
+    char    *rec;
+    uint16_t user_off;
+    uint16_t text_off;
+    uint16_t size;       /* record size including terminators */
+    int      kind;
+    uint32_t ts;         /* server timestamp of a MESSAGE_RECV, else 0 */
+} line_rec_t;
+
+/* Fill L from the three strings. Returns 0, or -1 when out of memory. */
+static int line_rec_make(line_rec_t *L, uint32_t ts, const char *timebuf, const char *user, const char *text, int kind) {
+    timebuf = timebuf ? timebuf : "";
+    user = user ? user : "";
+    text = text ? text : "";
+    size_t tlen = strnlen(timebuf, 31);
+    size_t ulen = strnlen(user, 31);
+    size_t xlen = strnlen(text, 1023);
+    size_t size = tlen + ulen + xlen + 3;
+    char *rec = pool_alloc(size);
+    if (!rec) return -1;
+    memcpy(rec, timebuf, tlen);
+    rec[tlen] = 0;
+    memcpy(rec + tlen + 1, user, ulen);
+    rec[tlen + 1 + ulen] = 0;
+    memcpy(rec + tlen + ulen + 2, text, xlen);
+    rec[size - 1] = 0;
+    L->rec = rec;
+    L->user_off = (uint16_t)(tlen + 1);
+    L->text_off = (uint16_t)(tlen + ulen + 2);
+    L->size = (uint16_t)size;
+    L->kind = kind;
+    L->ts = ts;
+    return 0;
+}
+
+/*
+ * Fenwick (binary indexed) tree of per-line row counts, so the renderer
+ * can go from a display row to the line holding it, and from a line to
+ * the rows above it, in O(log n) however many lines wrap. Values are
+ * 0-based; fw_push appends one, for a list that only grows.
+ */
+typedef struct {
+    uint32_t *t;         /* t[1..n] */
+    size_t    n;
+    size_t    cap;
+} fenwick_t;
+
+static int fw_init(fenwick_t *f, size_t n) {
+    f->t = calloc(n + 1, sizeof(*f->t));
+    if (!f->t) return -1;
+    f->n = f->cap = n;
+    return 0;
+}
+
+static void fw_add(fenwick_t *f, size_t i, int64_t delta) {
+    for (i++; i <= f->n; i += i & (~i + 1)) f->t[i] = (uint32_t)((int64_t)f->t[i] + delta);
+}
+
+/* Sum of values [0, i). */
+static uint64_t fw_prefix(const fenwick_t *f, size_t i) {
+    uint64_t sum = 0;
+    for (; i > 0; i -= i & (~i + 1)) sum += f->t[i];
+    return sum;
+}
+
+static uint32_t fw_get(const fenwick_t *f, size_t i) {
+    return (uint32_t)(fw_prefix(f, i + 1) - fw_prefix(f, i));
+}
+
+/* The value holding unit `row` of the running sum, with *off the unit's
+ * offset into it; f->n if row is past the end. */
+static size_t fw_find(const fenwick_t *f, uint64_t row, uint32_t *off) {
+    size_t pos = 0, step = 1;
+    while (step * 2 <= f->n) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= f->n && f->t[pos + step] <= row) {
+            pos += step;
+            row -= f->t[pos];
+        }
+    }
+    *off = (uint32_t)row;
+    return pos;
+}
+
+static int fw_push(fenwick_t *f, uint32_t v) {
+    if (f->n == f->cap) {
+        size_t ncap = f->cap ? f->cap * 2 : 1024;
+        uint32_t *nt = realloc(f->t, (ncap + 1) * sizeof(*nt));
+        if (!nt) return -1;
+        f->t = nt;
+        f->cap = ncap;
+    }
+    size_t i = ++f->n;
+    size_t low = i & (~i + 1);
+    // Node i covers (i - low, i]: its new value plus the nodes already below it
+    f->t[i] = (uint32_t)(v + fw_prefix(f, i - 1) - fw_prefix(f, i - low));
+    return 0;
+}
+
+/*
+ * Scrollback store: a ring of fixed-size entries, each owning its line's
+ * pooled record; the oldest entry is evicted (and its blocks freed) once
+ * `cap` lines are held. Records come from the size class that fits them, so
+ * memory follows the bytes actually received.
+ *
+ * Lines wrap to the message pane's width. Each entry remembers how many
+ * rows it took at the width it was last laid out for, and `rows` sums them
+ * by ring slot (empty slots count 0). A width change does not relayout
+ * anything by itself: lines are laid out again as the renderer reaches
+ * them, so a resize costs the visible lines only and the rest keep their
+ * old counts until they come into view.
+ */
+typedef struct {
+    char    *rec;        /* pooled "time\0user\0text\0", NULL for store pages */
+    uint16_t user_off;   /* username offset within the record */
+    uint16_t text_off;   /* text offset within the record */
+    uint16_t size;       /* record size including terminators */
+    int      kind;
+    /* Render cache: the row body formatted for row_mode, see tui_format_entry */
+    char    *row;
+    uint16_t row_len;
+    uint16_t width;      /* display columns of row */
+    uint8_t  row_mode;
+    uint16_t rows;       /* display rows at layout_cols */
+    uint16_t layout_cols;/* pane width rows was computed for, 0 = stale */
+    int32_t  store_idx;  /* record in the message store, -1 if not stored */
+    int32_t  doc;        /* search document id, -1 if not a message */
+} sb_entry_t;
+
+typedef struct {
+    sb_entry_t *ents;
+    int    cap;          /* max lines kept */
+    int    head;         /* ring index of the oldest line */
+    int    count;
+    int    scroll;       /* display rows the view is scrolled up from the bottom */
+    fenwick_t rows;      /* rows per ring slot */
+} scrollback_t;
+
+static scrollback_t *g_sb;          /* the current session's, see session_enter() */
+static int g_scrollback_cap = TUI_MAX_LINES;
+static int g_layout_cols = 0;       /* pane width of the last frame, 0 before the first */
+
+/* Rows a formatted line takes in a pane cols wide. */
+static int layout_rows(const sb_entry_t *e, int cols) {
+    if (cols <= 0 || e->width <= cols) return 1;
+    return (e->width + cols - 1) / cols;
+}
+
+/* ===================== MESSAGE STORE ===================== */
+
+/*
+ * Opt-in (--store FILE) local message log for the TUI. Every MESSAGE_RECV
+ * that reaches the scrollback is appended to one append-only segment file
+ * as a compact record: a fixed header then the same "time\0user\0text\0"
+ * body the scrollback arena uses. The file is memory-mapped for reading, so
+ * at startup the scrollback is refilled straight from it, and scrolling
+ * back past the in-memory window pages older lines from the mapping rather
+ * than holding them in RAM; only an offset per record is kept in memory.
+ * A torn record at the tail (crash mid-append) is cut off when opening.
+ */
+#define STORE_MAGIC      "MYCSTOR1"
+#define STORE_MAGIC_LEN  8
+#define STORE_PAGE_SLOTS 256    /* formatted rows cached for paged-in lines */
+
+typedef struct __attribute__((packed)) {
+    uint16_t size;       /* body bytes including terminators */
+    uint16_t user_off;
+    uint16_t text_off;
+    uint8_t  kind;
+    uint32_t ts;         /* server timestamp */
+} store_rec_t;
+
+typedef struct {
+    int       fd;
+    char     *map;
+    size_t    map_len;
+    size_t    file_len;
+    uint64_t *offs;      /* file offset of every record */
+    size_t    count;
+    size_t    cap;
+    size_t    floor;     /* records [0, floor) are older than the scrollback */
+    sb_entry_t page[STORE_PAGE_SLOTS];
+    long       page_idx[STORE_PAGE_SLOTS];
+    fenwick_t  rows;     /* display rows of records [0, floor), 1 until laid out */
+} msg_store_t;
+
+static msg_store_t g_store = { .fd = -1 };
+static const char *g_store_path = NULL;
+
+static void tui_format_row(sb_entry_t *e, const char *rec);
+
+/* Map the whole file; called again whenever appends outgrow the mapping. */
+static int store_map(void) {
+    if (g_store.map_len == g_store.file_len) return 0;
+    if (g_store.map) munmap(g_store.map, g_store.map_len);
+    g_store.map = mmap(NULL, g_store.file_len, PROT_READ, MAP_SHARED, g_store.fd, 0);
+    if (g_store.map == MAP_FAILED) {
+        g_store.map = NULL;
+        g_store.map_len = 0;
+        return -1;
+    }
+    g_store.map_len = g_store.file_len;
+    return 0;
+}
+
+static int store_index_push(uint64_t off) {
+    if (g_store.count == g_store.cap) {
+        size_t ncap = g_store.cap ? g_store.cap * 2 : 1024;
+        uint64_t *n = realloc(g_store.offs, ncap * sizeof(*n));
+        if (!n) return -1;
+        g_store.offs = n;
+        g_store.cap = ncap;
+    }
+    g_store.offs[g_store.count++] = off;
+    return 0;
+}
+
+/* Open (or create) the store and index its records. */
+static int store_open(const char *path) {
+    g_store.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (g_store.fd < 0) return -1;
+    
+    struct stat st;
+    if (fstat(g_store.fd, &st) != 0) return -1;
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        if (write(g_store.fd, STORE_MAGIC, STORE_MAGIC_LEN) != STORE_MAGIC_LEN) return -1;
+        size = STORE_MAGIC_LEN;
+    }
+    g_store.file_len = size;
+    if (size < STORE_MAGIC_LEN || store_map() != 0 ||
+        memcmp(g_store.map, STORE_MAGIC, STORE_MAGIC_LEN) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    size_t off = STORE_MAGIC_LEN;
+    while (off + sizeof(store_rec_t) <= size) {
+        store_rec_t h;
+        memcpy(&h, g_store.map + off, sizeof(h));
+        if (h.size < 3 || off + sizeof(h) + h.size > size) break;
+        if (store_index_push(off) != 0) return -1;
+        off += sizeof(h) + h.size;
+    }
+    if (off < size) {
+        // Torn tail: drop it so the next append starts on a record boundary
+        if (ftruncate(g_store.fd, (off_t)off) != 0) return -1;
+        g_store.file_len = off;
+        if (store_map() != 0) return -1;
+    }
+    for (int i = 0; i < STORE_PAGE_SLOTS; i++) g_store.page_idx[i] = -1;
+    g_store.floor = g_store.count;
+    return 0;
+}
+
+/* Append one line, its record written straight from the pooled block.
+ * Returns its record index, or -1 if it was not stored. */
+static long store_append(const line_rec_t *L) {
+    if (g_store.fd < 0) return -1;
+    store_rec_t h = {
+        .size = L->size,
+        .user_off = L->user_off,
+        .text_off = L->text_off,
+        .kind = (uint8_t)L->kind,
+        .ts = L->ts,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &h, .iov_len = sizeof(h) },
+        { .iov_base = L->rec, .iov_len = L->size },
+    };
+    size_t n = sizeof(h) + h.size;
+    if (writev(g_store.fd, iov, 2) != (ssize_t)n) {
+        // Keep the index consistent with whatever did land
+        struct stat st;
+        if (fstat(g_store.fd, &st) == 0 && (size_t)st.st_size > g_store.file_len) {
+            (void)!ftruncate(g_store.fd, (off_t)g_store.file_len);
+        }
+        return -1;
+    }
+    if (store_index_push(g_store.file_len) != 0) return -1;
+    g_store.file_len += n;
+    return (long)(g_store.count - 1);
+}
+
+/* Header and body of record idx, straight from the mapping. */
+static const char *store_record(size_t idx, store_rec_t *h) {
+    if (idx >= g_store.count || store_map() != 0) return NULL;
+    const char *p = g_store.map + g_store.offs[idx];
+    memcpy(h, p, sizeof(*h));
+    return p + sizeof(*h);
+}
+
+/* Extend the row index to cover every record below the floor; records not
+ * laid out yet count as one row. */
+static void store_rows_sync(void) {
+    while (g_store.rows.n < g_store.floor && fw_push(&g_store.rows, 1) == 0) {}
+}
+
+/* Formatted row for a line that only lives on disk. */
+static sb_entry_t *store_page_entry(size_t idx) {
+    int slot = (int)(idx % STORE_PAGE_SLOTS);
+    sb_entry_t *e = &g_store.page[slot];
+    if (g_store.page_idx[slot] == (long)idx && e->row && e->row_mode == (uint8_t)g_ui_mode) return e;
+    
+    store_rec_t h;
+    const char *body = store_record(idx, &h);
+    if (!body) return NULL;
+    e->user_off = h.user_off;
+    e->text_off = h.text_off;
+    e->size = h.size;
+    e->kind = h.kind;
+    e->store_idx = (int32_t)idx;
+    tui_format_row(e, body);
+    g_store.page_idx[slot] = (long)idx;
+    return e;
+}
+
+static int sb_init(int cap) {
+    g_sb->ents = calloc((size_t)cap, sizeof(*g_sb->ents));
+    if (!g_sb->ents || fw_init(&g_sb->rows, (size_t)cap) != 0) return -1;
+    g_sb->cap = cap;
+    return 0;
+}
+
+/* O(1) access to line i, 0 being the oldest. */
+static sb_entry_t *sb_entry(int i) {
+    return &g_sb->ents[(g_sb->head + i) % g_sb->cap];
+}
+
+static void tui_format_entry(sb_entry_t *e);
+
+/* Record e's row count in the slot index. */
+static void sb_set_rows(sb_entry_t *e, int rows) {
+    fw_add(&g_sb->rows, (size_t)(e - g_sb->ents), rows - (int)e->rows);
+    e->rows = (uint16_t)rows;
+}
+
+/* Lay e out for the current pane width. */
+static void sb_layout(sb_entry_t *e) {
+    sb_set_rows(e, layout_rows(e, g_layout_cols));
+    e->layout_cols = (uint16_t)g_layout_cols;
+}
+
+/* Rows of scrollback lines [0, i). */
+static uint64_t sb_rows_before(int i) {
+    size_t head = (size_t)g_sb->head, cap = (size_t)g_sb->cap, end = head + (size_t)i;
+    uint64_t base = fw_prefix(&g_sb->rows, head);
+    if (end <= cap) return fw_prefix(&g_sb->rows, end) - base;
+    return fw_prefix(&g_sb->rows, cap) - base + fw_prefix(&g_sb->rows, end - cap);
+}
+
+/* Scrollback line holding display row `row`, *off being the row within
+ * it; count when row is past the last line. */
+static int sb_find_row(uint64_t row, uint32_t *off) {
+    size_t head = (size_t)g_sb->head, cap = (size_t)g_sb->cap;
+    uint64_t base = fw_prefix(&g_sb->rows, head);
+    uint64_t upper = fw_prefix(&g_sb->rows, cap) - base;   /* rows in slots [head, cap) */
+    size_t slot;
+    int i;
+    if (row < upper) {
+        slot = fw_find(&g_sb->rows, base + row, off);
+        i = (int)(slot - head);
+    } else {
+        slot = fw_find(&g_sb->rows, row - upper, off);
+        i = slot >= head ? g_sb->count : (int)(slot + cap - head);
+    }
+    return i < g_sb->count ? i : g_sb->count;
+}
+
+static void sb_evict_oldest(void) {
+    sb_entry_t *e = sb_entry(0);
+    if (e->store_idx >= 0) {
+        // The line stays reachable from the store, keeping the rows it had
+        g_store.floor = (size_t)e->store_idx + 1;
+        store_rows_sync();
+        if (g_store.rows.n == g_store.floor && e->rows > 1) fw_add(&g_store.rows, g_store.floor - 1, e->rows - 1);
+    }
+    sb_set_rows(e, 0);
+    e->layout_cols = 0;
+    pool_free(e->rec);
+    e->rec = NULL;
+    pool_free(e->row);
+    e->row = NULL;
+    g_sb->head = (g_sb->head + 1) % g_sb->cap;
+    g_sb->count--;
+}
+
+/* Append L as the newest line; the entry takes over L->rec. Returns the
+ * rows it takes, for keeping a scrolled-up view in place. */
+static int sb_add(const line_rec_t *L, long store_idx, long doc) {
+    if (g_sb->count == g_sb->cap) sb_evict_oldest();
+    
+    sb_entry_t *e = &g_sb->ents[(g_sb->head + g_sb->count) % g_sb->cap];
+    e->rec = L->rec;
+    e->user_off = L->user_off;
+    e->text_off = L->text_off;
+    e->size = L->size;
+    e->kind = L->kind;
+    e->store_idx = (int32_t)store_idx;
+    e->doc = (int32_t)doc;
+    g_sb->count++;
+    tui_format_entry(e);
+    sb_layout(e);
+    return e->rows;
+}
+
+/* ===================== SEARCH INDEX ===================== */
+
+/*
+ * Inverted index behind !search. Every received message is a document with
+ * a sequential id: its store record index with --store, otherwise a
+ * session counter. Terms are lower-cased ASCII alphanumeric runs; the
+ * sender is indexed as one more term in its own namespace (SEARCH_USER_TAG)
+ * so from: filters are just another posting list. Posting lists are
+ * append-only and therefore sorted, and a query intersects them newest
+ * first, galloping through the longer lists.
+ *
+ * Without a store the index is kept up to date in tui_add_line_locked().
+ * With one, records already on disk are indexed on the first query, and
+ * live lines are indexed as they arrive once that backlog is done.
+ */
+#define SEARCH_TERM_MAX     24
+#define SEARCH_SLOTS_MIN    4096    /* power of two */
+#define SEARCH_MAX_RESULTS  50
+#define SEARCH_USER_TAG     '\x01'
+
+typedef struct {
+    uint32_t *ids;
+    uint32_t  n;
+    uint32_t  cap;
+} posting_t;
+
+typedef struct {
+    char      term[SEARCH_TERM_MAX];   /* "" = empty slot */
+    posting_t post;
+} term_slot_t;
+
+typedef struct {
+    term_slot_t *slots;
+    size_t       nslots;
+    size_t       used;
+    uint32_t    *doc_ts;               /* server timestamp per document */
+    uint32_t     docs;                 /* documents indexed so far */
+    uint32_t     doc_cap;
+    uint32_t     next_doc;             /* next session id without a store */
+} search_index_t;
+
+static search_index_t *g_index;     /* the current session's */
+
+static uint64_t term_hash(const char *t) {
+    uint64_t h = 1469598103934665603ull;
+    while (*t) h = (h ^ (unsigned char)*t++) * 1099511628211ull;
+    return h;
+}
+
+static int index_grow(void) {
+    size_t ncap = g_index->nslots ? g_index->nslots * 2 : SEARCH_SLOTS_MIN;
+    term_slot_t *old = g_index->slots;
+    size_t oldn = g_index->nslots;
+    term_slot_t *ns = calloc(ncap, sizeof(*ns));
+    if (!ns) return -1;
+    g_index->slots = ns;
+    g_index->nslots = ncap;
+    for (size_t i = 0; i < oldn; i++) {
+        if (!old[i].term[0]) continue;
+        size_t j = (size_t)term_hash(old[i].term) & (ncap - 1);
+        while (ns[j].term[0]) j = (j + 1) & (ncap - 1);
+        ns[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Find term's slot, adding it when create is set. NULL if absent/no memory. */
+static term_slot_t *index_slot(const char *term, int create) {
+    if (g_index->nslots == 0) {
+        if (!create || index_grow() != 0) return NULL;
+    }
+    size_t mask = g_index->nslots - 1;
+    size_t i = (size_t)term_hash(term) & mask;
+    while (g_index->slots[i].term[0]) {
+        if (strcmp(g_index->slots[i].term, term) == 0) return &g_index->slots[i];
+        i = (i + 1) & mask;
+    }
+    if (!create) return NULL;
+    if ((g_index->used + 1) * 4 > g_index->nslots * 3) {
+        if (index_grow() != 0) return NULL;
+        return index_slot(term, create);
+    }
+    snprintf(g_index->slots[i].term, SEARCH_TERM_MAX, "%s", term);
+    g_index->used++;
+    return &g_index->slots[i];
+}
+
+static void index_post(const char *term, uint32_t doc) {
+    term_slot_t *s = index_slot(term, 1);
+    if (!s) return;
+    posting_t *p = &s->post;
+    if (p->n > 0 && p->ids[p->n - 1] == doc) return;   /* repeated in one line */
+    if (p->n == p->cap) {
+        uint32_t ncap = p->cap ? p->cap * 2 : 4;
+        uint32_t *n = realloc(p->ids, ncap * sizeof(*n));
+        if (!n) return;
+        p->ids = n;
+        p->cap = ncap;
+    }
+    p->ids[p->n++] = doc;
+}
+
+/* Split text into index terms, calling fn for each. */
+static void index_terms(const char *text, void (*fn)(const char *term, void *ctx), void *ctx) {
+    char term[SEARCH_TERM_MAX];
+    size_t n = 0;
+    for (const char *p = text;; p++) {
+        if (*p && isalnum((unsigned char)*p)) {
+            if (n + 1 < sizeof(term)) term[n++] = (char)tolower((unsigned char)*p);
+            continue;
+        }
+        if (n > 0) {
+            term[n] = 0;
+            fn(term, ctx);
+            n = 0;
+        }
+        if (!*p) break;
+    }
+}
+
+static void index_post_cb(const char *term, void *ctx) {
+    index_post(term, *(uint32_t *)ctx);
+}
+
+static void index_user_key(char *out, const char *user) {
+    size_t n = 0;
+    out[n++] = SEARCH_USER_TAG;
+    for (; *user && n + 1 < SEARCH_TERM_MAX; user++) out[n++] = (char)tolower((unsigned char)*user);
+    out[n] = 0;
+}
+
+/* Index document doc, which must be the next id in sequence. */
+static void index_add(uint32_t doc, uint32_t ts, const char *user, const char *text) {
+    if (doc != g_index->docs) return;
+    if (g_index->docs == g_index->doc_cap) {
+        uint32_t ncap = g_index->doc_cap ? g_index->doc_cap * 2 : 1024;
+        uint32_t *n = realloc(g_index->doc_ts, ncap * sizeof(*n));
+        if (!n) return;
+        g_index->doc_ts = n;
+        g_index->doc_cap = ncap;
+    }
+    g_index->doc_ts[g_index->docs++] = ts;
+    
+    char key[SEARCH_TERM_MAX];
+    index_user_key(key, user);
+    index_post(key, doc);
+    index_terms(text, index_post_cb, &doc);
+}
+
+/* Give a newly added MESSAGE_RECV its document id and index it if the
+ * index is caught up. Returns the id. */
+static long index_message(long store_idx, uint32_t ts, const char *user, const char *text) {
+    if (g_store.fd >= 0 && store_idx < 0) return -1;   /* not stored, no stable id */
+    uint32_t doc = g_store.fd >= 0 ? (uint32_t)store_idx : g_index->next_doc++;
+    index_add(doc, ts, user, text);
+    return (long)doc;
+}
+
+/* Index store records written before this session (or before the first
+ * query). Called with g_tui_lock held. */
+static void index_catch_up(void) {
+    while (g_store.fd >= 0 && g_index->docs < g_store.count) {
+        store_rec_t h;
+        const char *body = store_record(g_index->docs, &h);
+        if (!body) break;
+        uint32_t before = g_index->docs;
+        index_add(g_index->docs, h.ts, body + h.user_off, body + h.text_off);
+        if (g_index->docs == before) break;
+    }
+}
+
+/* Virtual scrollback position of doc (0 = oldest line), -1 if it is gone. */
+static int index_doc_position(uint32_t doc) {
+    if (g_store.fd >= 0 && doc < g_store.floor) return (int)doc;
+    int lo = 0, hi = g_sb->count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int probe = mid;
+        while (probe <= hi && sb_entry(probe)->doc < 0) probe++;
+        if (probe > hi) {
+            hi = mid - 1;
+            continue;
+        }
+        int32_t d = sb_entry(probe)->doc;
+        if (d == (int32_t)doc) return (int)g_store.floor + probe;
+        if (d < (int32_t)doc) lo = probe + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+/* ---- queries ---- */
+
+typedef struct {
+    const posting_t *lists[16];
+    int     nlists;
+    int     nterms;     /* terms asked for, including ones with no postings */
+    int     empty;      /* some term never occurs: nothing can match */
+    int64_t after;      /* ts >= after */
+    int64_t before;     /* ts < before */
+} search_query_t;
+
+static void query_term_cb(const char *term, void *ctx) {
+    search_query_t *q = ctx;
+    q->nterms++;
+    term_slot_t *s = index_slot(term, 0);
+    if (!s) q->empty = 1;
+    else if (q->nlists < 16) q->lists[q->nlists++] = &s->post;
+}
+
+/* Parse "2026-10-14", "14:05" (today) or "30m"/"2h"/"7d" (ago). */
+static int parse_time_bound(const char *v, int64_t *out) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int a, b, c;
+    char unit;
+    if (sscanf(v, "%d-%d-%d", &a, &b, &c) == 3) {
+        tm.tm_year = a - 1900;
+        tm.tm_mon = b - 1;
+        tm.tm_mday = c;
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+    } else if (sscanf(v, "%d:%d", &a, &b) == 2) {
+        tm.tm_hour = a;
+        tm.tm_min = b;
+        tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+    } else if (sscanf(v, "%d%c", &a, &unit) == 2 && a >= 0) {
+        int64_t mul = unit == 'm' ? 60 : unit == 'h' ? 3600 : unit == 'd' ? 86400 : 0;
+        if (!mul) return -1;
+        *out = (int64_t)now - a * mul;
+        return 0;
+    } else {
+        return -1;
+    }
+    *out = (int64_t)mktime(&tm);
+    return 0;
+}
+
+/* Parse a query: words, from:USER, after:TIME, before:TIME.
+ * Returns 0, or -1 with a message in err. */
+static int search_parse(const char *query, search_query_t *q, char *err, size_t errcap) {
+    memset(q, 0, sizeof(*q));
+    q->after = INT64_MIN;
+    q->before = INT64_MAX;
+    
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", query);
+    for (char *save = NULL, *w = strtok_r(buf, " ", &save); w; w = strtok_r(NULL, " ", &save)) {
+        if (strncmp(w, "from:", 5) == 0 && w[5]) {
+            char key[SEARCH_TERM_MAX];
+            index_user_key(key, w + 5);
+            query_term_cb(key, q);
+        } else if (strncmp(w, "after:", 6) == 0 || strncmp(w, "since:", 6) == 0) {
+            if (parse_time_bound(w + 6, &q->after) != 0) {
+                snprintf(err, errcap, "Bad time '%s' (use YYYY-MM-DD, HH:MM or 30m/2h/7d)", w + 6);
+                return -1;
+            }
+        } else if (strncmp(w, "before:", 7) == 0) {
+            if (parse_time_bound(w + 7, &q->before) != 0) {
+                snprintf(err, errcap, "Bad time '%s' (use YYYY-MM-DD, HH:MM or 30m/2h/7d)", w + 7);
+                return -1;
+            }
+        } else {
+            index_terms(w, query_term_cb, q);
+        }
+    }
+    if (q->nterms == 0 && q->after == INT64_MIN && q->before == INT64_MAX) {
+        snprintf(err, errcap, "Usage: !search words [from:USER] [after:TIME] [before:TIME]");
+        return -1;
+    }
+    return 0;
+}
+
+/* Largest index i < *pos with ids[i] <= want (galloping down), or -1. */
+static int32_t gallop_down(const posting_t *p, uint32_t *pos, uint32_t want) {
+    uint32_t hi = *pos;             /* candidates are ids[0..hi) */
+    if (hi == 0) return -1;
+    uint32_t step = 1;
+    uint32_t lo = hi;
+    while (lo > 0 && p->ids[lo - 1] > want) {
+        hi = lo - 1;
+        lo = lo > step ? lo - step : 0;
+        step *= 2;
+    }
+    // Now ids[lo-1] <= want (or lo == 0) and ids[hi..] > want
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (p->ids[mid] <= want) lo = mid + 1;
+        else hi = mid;
+    }
+    *pos = lo;
+    return lo > 0 ? (int32_t)(lo - 1) : -1;
+}
+
+/* Run q newest first. Fills out with up to max doc ids; returns the count.
+ * Called with g_tui_lock held. */
+static int search_run(const search_query_t *q, uint32_t *out, int max) {
+    if (q->empty) return 0;
+    int found = 0;
+    
+    if (q->nlists == 0) {
+        // Time range only: walk documents newest first
+        for (uint32_t d = g_index->docs; d-- > 0 && found < max;) {
+            int64_t ts = g_index->doc_ts[d];
+            if (ts >= q->after && ts < q->before) out[found++] = d;
+        }
+        return found;
+    }
+    
+    const posting_t *lists[16];
+    uint32_t pos[16];
+    int n = q->nlists;
+    memcpy(lists, q->lists, sizeof(lists[0]) * (size_t)n);
+    for (int i = 1; i < n; i++) {           /* shortest list drives the scan */
+        for (int j = i; j > 0 && lists[j]->n < lists[j - 1]->n; j--) {
+            const posting_t *t = lists[j]; lists[j] = lists[j - 1]; lists[j - 1] = t;
+        }
+    }
+    for (int i = 0; i < n; i++) pos[i] = lists[i]->n;
+    
+    uint32_t i0 = lists[0]->n;
+    while (i0-- > 0 && found < max) {
+        uint32_t id = lists[0]->ids[i0];
+        int ok = 1;
+        for (int k = 1; k < n && ok; k++) {
+            int32_t at = gallop_down(lists[k], &pos[k], id);
+            if (at < 0) return found;          /* longer list exhausted */
+            if (lists[k]->ids[at] != id) ok = 0;
+        }
+        if (!ok) continue;
+        int64_t ts = id < g_index->docs ? g_index->doc_ts[id] : 0;
+        if (ts >= q->after && ts < q->before) out[found++] = id;
+    }
+    return found;
+}
+
+/* ---- results pane ---- */
+
+typedef struct {
+    int      open;
+    char     query[128];
+    uint32_t docs[SEARCH_MAX_RESULTS];
+    int      count;
+    int      sel;
+    uint64_t took_us;
+} search_view_t;
+
+static search_view_t *g_search;     /* the current session's */
+
+static char g_send_hist[HIST_MAX][1024];
+static int  g_send_hist_len = 0;
+
+static pthread_mutex_t g_tui_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Take g_tui_lock, timing the wait when stats are on. */
+static void tui_lock(void) {
+    if (!stats_enabled()) {
+        pthread_mutex_lock(&g_tui_lock);
+        return;
+    }
+    if (pthread_mutex_trylock(&g_tui_lock) == 0) {
+        stats_record(ST_LOCK_WAIT, 0);
+        return;
+    }
+    uint64_t t0 = stats_clock_ns();
+    pthread_mutex_lock(&g_tui_lock);
+    stats_add(&g_stat_lock_contended, 1);
+    stats_record(ST_LOCK_WAIT, stats_clock_ns() - t0);
+}
+static volatile sig_atomic_t g_tui_dirty = 0;
+
+static char g_input[1024] = {0};
+static int g_input_len = 0;
+static int g_show_start_menu = 1;
+
+/* Self-pipe that wakes the threaded TUI loop when another thread (or the
+ * signal handler) dirties the screen; -1 when unused. */
+static int g_wake_fd[2] = { -1, -1 };
+
+static void tui_wake(void) {
+    if (g_wake_fd[1] >= 0) {
+        char b = 1;
+        (void)!write(g_wake_fd[1], &b, 1);
+    }
+}
+
+static void tui_set_dirty(void) {
+    g_tui_dirty = 1;
+    tui_wake();
+}
+
+static void tui_hist_push(const char *s) {
+    if (!s || !*s) return;
+    if (g_send_hist_len > 0 && strcmp(g_send_hist[g_send_hist_len-1], s) == 0) return;
+    if (g_send_hist_len < HIST_MAX) {
+        strncpy(g_send_hist[g_send_hist_len++], s, 1023);
+        g_send_hist[g_send_hist_len-1][1023] = 0;
+    } else {
+        for (int i = 1; i < HIST_MAX; i++) strcpy(g_send_hist[i-1], g_send_hist[i]);
+        strncpy(g_send_hist[HIST_MAX-1], s, 1023);
+        g_send_hist[HIST_MAX-1][1023] = 0;
+    }
+}
+
+static void gravemind_filter(char* out, const char* in, size_t n, size_t max) {
+    size_t j = 0;
+    for (size_t i = 0; i < n && in[i] && j + 1 < max; i++) {
+        char c = (char)tolower((unsigned char)in[i]);
+        out[j++] = c;
+        if (isalnum((unsigned char)c) && (rand() % 6 == 0) && j + 1 < max)
+            out[j++] = '.';
+    }
+    out[j] = '\0';
+}
+
+/* Received messages (ts != 0) are also appended to the message store and
+ * the search index, both reading L's record in place. The scrollback takes
+ * over L->rec. */
+static int tui_add_line_locked(const line_rec_t *L) {
+    long idx = -1, doc = -1;
+    if (L->kind == MESSAGE_RECV && L->ts != 0) {
+        idx = store_append(L);
+        doc = index_message(idx, L->ts, L->rec + L->user_off, L->rec + L->text_off);
+    }
+    return sb_add(L, idx, doc);
+}
+
+static void tui_add_line(const char *timebuf, const char *user, const char *text, int kind) {
+    line_rec_t L;
+    if (line_rec_make(&L, 0, timebuf, user, text, kind) != 0) return;
+    tui_lock();
+    int rows = tui_add_line_locked(&L);
+    if (g_sb->scroll > 0) g_sb->scroll += rows;
+    pthread_mutex_unlock(&g_tui_lock);
+    tui_set_dirty();
+}
+
+/* ===================== INBOUND QUEUE ===================== */
+
+/*
+ * Single-producer/single-consumer ring carrying decoded lines from
+ * receive_messages_thread to the renderer. The reader never takes
+ * g_tui_lock, so it cannot stall behind tui_render's terminal writes; the
+ * renderer drains the ring in one batch per frame. Slots carry the line's
+ * pooled record, which the drain hands to the scrollback. Only a full ring
+ * (the renderer a whole ring behind) holds the reader back: it sleeps on
+ * g_inbound_space until a drain frees slots, and the socket buffer absorbs
+ * the burst meanwhile. bench/loadgen.py stall measures this.
+ */
+#define INBOUND_QUEUE_CAP 512   /* power of two */
+
+static line_rec_t g_inbound[INBOUND_QUEUE_CAP];
+static _Atomic size_t g_inbound_head = 0;   /* next slot to drain, owned by the renderer */
+static _Atomic size_t g_inbound_tail = 0;   /* next slot to fill, owned by the reader */
+static int g_inbound_queued = 0;            /* set while the reader thread feeds the TUI */
+static pthread_mutex_t g_inbound_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_inbound_space = PTHREAD_COND_INITIALIZER;
+static atomic_int g_inbound_waiting = 0;    /* the reader sleeps on a full ring */
+
+static int inbound_full(size_t tail) {
+    return tail - atomic_load(&g_inbound_head) >= INBOUND_QUEUE_CAP;
+}
+
+/* Callers wake the renderer once per batch with tui_set_dirty(). */
+static void inbound_push(uint32_t ts, const char *timebuf, const char *user, const char *text, int kind) {
+    size_t tail = atomic_load_explicit(&g_inbound_tail, memory_order_relaxed);
+    if (inbound_full(tail)) {
+        tui_set_dirty();
+        pthread_mutex_lock(&g_inbound_lock);
+        atomic_store(&g_inbound_waiting, 1);
+        while (settings.running && inbound_full(tail)) pthread_cond_wait(&g_inbound_space, &g_inbound_lock);
+        atomic_store(&g_inbound_waiting, 0);
+        pthread_mutex_unlock(&g_inbound_lock);
+        if (!settings.running) return;
+    }
+    if (line_rec_make(&g_inbound[tail & (INBOUND_QUEUE_CAP-1)], ts, timebuf, user, text, kind) != 0) return;
+    atomic_store_explicit(&g_inbound_tail, tail + 1, memory_order_release);
+}
+
+/* Wake a reader sleeping on a full ring, after a drain or at shutdown. */
+static void inbound_signal(void) {
+    pthread_mutex_lock(&g_inbound_lock);
+    pthread_cond_signal(&g_inbound_space);
+    pthread_mutex_unlock(&g_inbound_lock);
+}
+
+/* Move every queued line into the scrollback under a single lock hold.
+ * Returns the number of lines drained. */
+static int inbound_drain(void) {
+    size_t head = atomic_load_explicit(&g_inbound_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&g_inbound_tail, memory_order_acquire);
+    if (head == tail) return 0;
+    
+    int n = 0;
+    tui_lock();
+    for (; head != tail; head++, n++) {
+        int rows = tui_add_line_locked(&g_inbound[head & (INBOUND_QUEUE_CAP-1)]);
+        if (g_sb->scroll > 0) g_sb->scroll += rows;
+    }
+    pthread_mutex_unlock(&g_tui_lock);
+    // Sequentially consistent against the reader's flag-then-recheck
+    atomic_store(&g_inbound_head, head);
+    if (atomic_load(&g_inbound_waiting)) inbound_signal();
+    return n;
+}
+
+/* Add a line from the network path: queued when the reader thread is
+ * running, direct otherwise (event loop). */
+static void tui_post_line(const char *timebuf, const char *user, const char *text, int kind) {
+    if (g_inbound_queued) {
+        inbound_push(0, timebuf, user, text, kind);
+    } else {
+        tui_add_line(timebuf, user, text, kind);
+    }
+}
+
+/* Same for a received chat message, which carries its server timestamp. */
+static void tui_post_message(uint32_t ts, const char *timebuf, const char *user, const char *text) {
+    if (g_inbound_queued) {
+        inbound_push(ts, timebuf, user, text, MESSAGE_RECV);
+        return;
+    }
+    line_rec_t L;
+    if (line_rec_make(&L, ts, timebuf, user, text, MESSAGE_RECV) != 0) return;
+    tui_lock();
+    int rows = tui_add_line_locked(&L);
+    if (g_sb->scroll > 0) g_sb->scroll += rows;
+    pthread_mutex_unlock(&g_tui_lock);
+    tui_set_dirty();
+}
+
+/* ===================== ASCII ART ===================== */
+
+static const char* gravemind_art[] = {
+    "⠀⢸⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⡇⠀",
+    "⠀⠘⢿⣿⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⣿⡿⠃⠀",
+    "⠀⢸⣦⡙⢿⣿⣦⡀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢀⣴⣿⡿⢋⣴⡇⠀",
+    "⠀⠈⠻⣿⣦⡙⢿⣿⣄⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⣠⣿⡿⢋⣴⣿⠟⠁⠀",
+    "⠀⢸⣷⣌⢿⣿⣦⡙⢿⣷⣄⠀⠀⠀⠀⠀⠀⠀⠀⣠⣾⡿⢋⣴⣿⡿⣡⣾⡇⠀",
+    "⠀⠈⠻⣿⣷⡝⢿⣿⣎⢻⣿⡆⠀⠀⠀⠀⠀⠀⢰⣿⡟⣱⣿⡿⢫⣾⣿⠟⠁⠀",
+    "⠀⢀⡤⣌⢻⣿⣦⢻⣿⡎⣿⣿⡀⠀⠀⠀⠀⢀⣿⣿⢱⣿⡟⣴⣿⠟⣡⢤⡀⠀",
+    "⢀⠘⠶⠟⠀⢹⣿⡇⣿⣿⢸⣿⡇⠀⠀⠀⠀⢸⣿⡇⣿⣿⢸⣿⡏⠀⠻⠶⠃⡀",
+    "⠘⠿⢿⠿⠷⢸⣿⣧⣿⣿⣸⣿⡇⣀⣀⣀⡀⢸⣿⣇⣿⣿⣼⣿⡇⠾⠿⣿⠿⠃",
+    "⠹⣶⣶⣶⣦⢸⣿⣿⡿⠿⢿⣿⠁⢿⣾⣿⡄⠈⣿⡿⠿⢿⣿⣿⡇⣴⣶⣶⣶⠏",
+    "⠀⠀⠀⣠⣤⡘⢿⣿⣧⣀⡀⠀⢀⣼⣿⣿⣧⡀⠀⢀⣀⣼⣿⡿⢃⣤⣄⠀⠀⠀",
+    "⠀⠰⠿⠛⠉⣡⣦⠉⠻⠿⣿⣿⣿⣿⣿⡇⢙⣿⣿⣿⠿⠟⠉⣴⣄⠉⠛⠿⠆⠀",
+    "⠀⠀⠀⠀⠐⠛⠁⠀⡿⠂⣤⡍⢻⣿⣿⣿⣿⡟⢩⣤⠐⢿⠀⠈⠛⠂⠀⠀⠀⠀",
+    "⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⢸⣿⣿⣧⣼⡇⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀",
+    "⢠⣷⣤⣀⠀⠀⠀⠀⠀⠀⠀⣾⣿⣿⣿⣿⣿⣿⣇⠀⠀⠀⠀⠀⠀⠀⣀⣤⣾⡄",
+    "⢿⣟⠛⠛⠁⠀⠀⠀⠀⣠⣾⣿⠋⠁⠀⠀⠀⠉⠛⢷⣄⠀⠀⠀⠀⠈⠛⠛⣻⡿",
+    "⢰⣿⣿⣷⣶⣶⡶⢀⣾⣿⣿⠋⠉⠉⠉⠉⠉⠉⠉⠉⠙⣷⡀⣶⣶⣶⣾⣿⣿⡄",
+    "⠸⢿⣿⣿⣯⣀⠀⣾⣿⣿⡧⠤⠤⠤⠤⠤⠤⠤⠤⠤⠤⠼⣷⠀⣈⣽⣿⣿⡿⠇",
+    "⠀⠀⠀⣸⣿⣿⣿⢶⣮⣭⣀⣀⡀⠀⠀⠀⠀⣀⣀⣀⣤⣴⡶⣿⣿⣿⡇⠀⠀⠀",
+    "⠀⠀⠀⢿⣿⣿⡏⢸⣿⢉⣿⠛⠻⡟⢻⡟⠛⣛⢻⣿⠉⣴⡆⢻⣿⣿⡿⠀⠀⠀",
+    "⠀⠀⠀⠀⠈⠙⠻⠶⣦⣼⣿⣀⣦⡁⢸⡗⠒⣂⣈⣿⣧⣴⠶⠟⠋⠁⠀⠀⠀⠀",
+    "⠀⠀⠀⠀⠀⠀⠀⠀⠐⢬⣭⣝⣛⣛⣛⣛⣛⣛⣫⣭⡥⠀⠀⠀⠀⠀⠀⠀⠀⠀",
+    "⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀⠉⠛⠿⢿⣿⣿⡿⠿⠛⠉⠀⠀⠀⠀⠀⠀⠀⠀⠀⠀",
+    ""
+};
+
+static const char* unsc_logo_art[] = {
+    "   +------------------------------+",
+    "   |    UNSC SECURE NETWORK    |",
+    "   +------------------------------+",
+    ""
+};
+/* ===================== START MENU ===================== */
+/* ===================== START MENU ===================== */
+/* ===================== START MENU ===================== */
+
+static void tui_invalidate(void);
+static int sendq_pending(void);
+static int pacer_pending(void);
+
+static void draw_start_menu(void) {
+    int cols, rows;
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+        cols = (int)ws.ws_col;
+        rows = (int)ws.ws_row;
+    } else {
+        cols = 80;
+        rows = 30;
+    }
+    
+    const char *theme_color = (g_ui_mode == UI_GRAVEMIND) ? ANSI_GREEN : ANSI_BRIGHT_CYAN;
+    const char *title = (g_ui_mode == UI_GRAVEMIND) ? "GRAVEMIND NETWORK" : "UNSC SECURE NETWORK";
+    const char *quote = (g_ui_mode == UI_GRAVEMIND) ? 
+        "I am a monument to all your sins." : 
+        "Spartans never die...";
+    
+    // Clear screen and hide cursor
+    printf(ANSI_CLEAR);
+    printf(ANSI_HOME);
+    tui_invalidate();
+    
+    // Calculate center column
+    int center_col = cols / 2;
+    
+    // Calculate starting row (vertically centered)
+    int start_row = (rows - 12) / 2;
+    if (start_row < 2) start_row = 2;
+    
+    int current_row = start_row;
+    
+    // Title box - each line positioned explicitly
+    printf("\033[%d;%dH", current_row++, center_col - 21);
+    printf("%s+==========================================+", theme_color);
+    
+    printf("\033[%d;%dH", current_row++, center_col - 21);
+    printf("|                                          |");
+    
+    printf("\033[%d;%dH", current_row++, center_col - 21);
+    printf("|     HALO COMMUNICATIONS TERMINAL         |");
+    
+    printf("\033[%d;%dH", current_row++, center_col - 21);
+    printf("|                                          |");
+    
+    printf("\033[%d;%dH", current_row++, center_col - 21);
+    printf("+==========================================+");
+    
+    current_row++;
+    
+    // Mode indicator
+    char mode_line[128];
+    snprintf(mode_line, sizeof(mode_line), ">>> %s <<<", title);
+    int mode_len = (int)strlen(mode_line);
+    printf("\033[%d;%dH", current_row++, center_col - (mode_len/2));
+    printf("%s", mode_line);
+    
+    current_row++;
+    
+    // Separator
+    printf("\033[%d;%dH", current_row++, center_col - 21);
+    printf("==========================================");
+    
+    current_row++;
+    
+    // Quote
+    int quote_len = (int)strlen(quote);
+    printf("\033[%d;%dH", current_row++, center_col - (quote_len/2));
+    printf("%s", quote);
+    
+    current_row++;
+    
+    // Instructions
+    printf("%s", ANSI_YELLOW);
+    printf("\033[%d;%dH", current_row++, center_col - 12);
+    printf("Press ENTER to continue");
+    
+    current_row++;
+    
+    // Username
+    printf("%s", ANSI_DIM);
+    char user_line[128];
+    snprintf(user_line, sizeof(user_line), "Connected as: %s", settings.username);
+    int user_len = (int)strlen(user_line);
+    printf("\033[%d;%dH", current_row++, center_col - (user_len/2));
+    printf("%s", user_line);
+    
+    current_row++;
+    
+    // Control hints
+    printf("\033[%d;%dH", current_row, center_col - 18);
+    printf("Press ESC to switch mode | Q to quit");
+    
+    current_row += 2;
+    
+    // Halo ring ASCII art
+    printf("%s", theme_color);
+    printf("\033[%d;%dH", current_row++, center_col - 20);
+    printf("            _______________            ");
+    printf("\033[%d;%dH", current_row++, center_col - 20);
+    printf("        .-'                 '-.        ");
+    printf("\033[%d;%dH", current_row++, center_col - 20);
+    printf("      .'                       '.      ");
+    printf("\033[%d;%dH", current_row++, center_col - 20);
+    printf("     /    INSTALLATION  04      \\     ");
+    printf("\033[%d;%dH", current_row++, center_col - 20);
+    printf("    |                             |    ");
+    printf("\033[%d;%dH", current_row++, center_col - 20);
+    printf("     \\                           /     ");
+    printf("\033[%d;%dH", current_row++, center_col - 20);
+    printf("      '.                       .'      ");
+    printf("\033[%d;%dH", current_row++, center_col - 20);
+    printf("        '-._________________.-'        ");
+    
+    printf(ANSI_RESET);
+    fflush(stdout);
+}
+
+/* ===================== TUI DRAWING ===================== */
+
+/*
+ * Differential renderer: every frame is composed row by row into a scratch
+ * buffer and compared against the back buffer of the previous frame. Only
+ * rows that changed are appended (with a cursor move) to one preallocated
+ * frame buffer, which is flushed with a single write(). While typing, only
+ * the input row and the cursor move go out.
+ */
+typedef struct {
+    char  *buf;
+    size_t len;
+    size_t cap;
+} outbuf_t;
+
+static int ob_reserve(outbuf_t *b, size_t extra) {
+    if (b->len + extra <= b->cap) return 0;
+    size_t ncap = b->cap ? b->cap : 256;
+    while (ncap < b->len + extra) ncap *= 2;
+    char *nb = realloc(b->buf, ncap);
+    if (!nb) return -1;
+    b->buf = nb;
+    b->cap = ncap;
+    return 0;
+}
+
+static void ob_put(outbuf_t *b, const char *s, size_t n) {
+    if (ob_reserve(b, n) != 0) return;
+    memcpy(b->buf + b->len, s, n);
+    b->len += n;
+}
+
+static void ob_puts(outbuf_t *b, const char *s) { ob_put(b, s, strlen(s)); }
+
+static void ob_putc(outbuf_t *b, char c) { ob_put(b, &c, 1); }
+
+static void ob_repeat(outbuf_t *b, char c, int n) {
+    if (n <= 0 || ob_reserve(b, (size_t)n) != 0) return;
+    memset(b->buf + b->len, c, (size_t)n);
+    b->len += (size_t)n;
+}
+
+static void ob_putint(outbuf_t *b, int v) {
+    char tmp[12];
+    int n = 0;
+    if (v <= 0) { ob_putc(b, '0'); return; }
+    while (v > 0 && n < (int)sizeof(tmp)) { tmp[n++] = (char)('0' + v % 10); v /= 10; }
+    while (n > 0) ob_putc(b, tmp[--n]);
+}
+
+static void ob_putu32(outbuf_t *b, uint32_t v) {
+    char tmp[10];
+    int n = 0;
+    do { tmp[n++] = (char)('0' + v % 10); v /= 10; } while (v > 0);
+    while (n > 0) ob_putc(b, tmp[--n]);
+}
+
+/* Append a string literal, its length known at compile time. */
+#define OB_LIT(b, lit) ob_put((b), lit, sizeof(lit) - 1)
+
+static void ob_cursor(outbuf_t *b, int row, int col) {
+    ob_put(b, "\033[", 2);
+    ob_putint(b, row);
+    ob_putc(b, ';');
+    ob_putint(b, col);
+    ob_putc(b, 'H');
+}
+
+/* Append visible columns [skip, skip + max_cols) of s. CSI escape
+ * sequences are copied through untouched, the skipped ones too, so the
+ * span starts in the colors in effect at that point of the row. */
+static void ob_put_span(outbuf_t *b, const char *s, size_t n, int skip, int max_cols) {
+    int col = 0;
+    size_t i = 0;
+    while (i < n) {
+        if (s[i] == '\033' && i + 1 < n && s[i+1] == '[') {
+            size_t j = i + 2;
+            while (j < n && !(s[j] >= '@' && s[j] <= '~')) j++;
+            if (j < n) j++;
+            ob_put(b, s + i, j - i);
+            i = j;
+            continue;
+        }
+        if (col >= skip + max_cols) break;
+        if (col >= skip) ob_putc(b, s[i]);
+        i++;
+        col++;
+    }
+}
+
+/* Append at most max_cols visible columns of s. */
+static void ob_put_clipped(outbuf_t *b, const char *s, size_t n, int max_cols) {
+    ob_put_span(b, s, n, 0, max_cols);
+}
+
+/* Text run of a cached row: appended and counted towards the display width. */
+static void fmt_text(outbuf_t *b, int *width, const char *s, size_t n) {
+    ob_put(b, s, n);
+    *width += (int)n;
+}
+
+/* Message text of a row, with watch-list mentions highlighted in red and
+ * the Gravemind filter applied to everything around them, as st asks. */
+static void fmt_message_text(outbuf_t *b, int *width, const char *text, size_t len, const row_style_t *st) {
+    mention_span_t spans[64];
+    int nspans = st->mentions ? mention_scan(text, spans, 64) : 0;
+    
+    size_t pos = 0;
+    for (int k = 0; k <= nspans; k++) {
+        size_t seg_end = (k < nspans) ? spans[k].start : len;
+        size_t seg = seg_end - pos;
+        if (st->filter) {
+            char tmp[2048];
+            gravemind_filter(tmp, text + pos, seg, sizeof(tmp));
+            fmt_text(b, width, tmp, strlen(tmp));
+        } else {
+            fmt_text(b, width, text + pos, seg);
+        }
+        if (k == nspans) break;
+        ob_put(b, ANSI_RED, sizeof(ANSI_RED) - 1);
+        fmt_text(b, width, text + spans[k].start, spans[k].len);
+        ob_put(b, st->text.s, st->text.n);
+        pos = (size_t)spans[k].start + spans[k].len;
+    }
+}
+
+/* Format scrollback entry e for the current theme and cache the row body
+ * (everything between the borders) on it. Runs once on insert and again for
+ * visible lines after a theme switch; rendering only copies the cached span.
+ * Called with g_tui_lock held. */
+static outbuf_t g_fmt;
+
+static void tui_format_entry(sb_entry_t *e) {
+    tui_format_row(e, e->rec);
+}
+
+/* Format the "time\0user\0text\0" record rec into e's row cache. */
+static void tui_format_row(sb_entry_t *e, const char *rec) {
+    // The record's offsets give every field's length
+    const char *timebuf = rec;
+    const char *username = rec + e->user_off;
+    const char *text = rec + e->text_off;
+    const row_style_t *st = row_style(e->kind);
+    
+    int width = 0;
+    g_fmt.len = 0;
+    ob_put(&g_fmt, st->open.s, st->open.n);
+    fmt_text(&g_fmt, &width, "[", 1);
+    ob_put(&g_fmt, st->time.s, st->time.n);
+    fmt_text(&g_fmt, &width, timebuf, (size_t)e->user_off - 1);
+    ob_put(&g_fmt, st->close.s, st->close.n);
+    fmt_text(&g_fmt, &width, "] ", 2);
+    if (st->user) {
+        ob_put(&g_fmt, st->name.s, st->name.n);
+        fmt_text(&g_fmt, &width, username, (size_t)(e->text_off - e->user_off) - 1);
+        ob_put(&g_fmt, st->sep.s, st->sep.n);
+        fmt_text(&g_fmt, &width, ": ", 2);
+    }
+    fmt_message_text(&g_fmt, &width, text, (size_t)(e->size - e->text_off) - 1, st);
+    
+    char *row = pool_resize(e->row, g_fmt.len ? g_fmt.len : 1);
+    if (!row) return;
+    memcpy(row, g_fmt.buf, g_fmt.len);
+    e->row = row;
+    e->row_len = (uint16_t)g_fmt.len;
+    e->width = (uint16_t)width;
+    e->row_mode = (uint8_t)g_ui_mode;
+    e->layout_cols = 0;
+}
+
+static void write_all(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += w;
+        n -= (size_t)w;
+    }
+}
+
+static outbuf_t g_frame;            /* bytes sent for the current frame */
+static outbuf_t g_row;              /* scratch row being composed */
+static outbuf_t *g_back = NULL;     /* previous frame, one buffer per row */
+static int g_back_cap = 0;          /* rows allocated; shrinking keeps the rest for reuse */
+static int g_back_rows = 0;
+static int g_back_cols = 0;
+
+/* Forget what is on screen; the next frame repaints every row. */
+static void tui_invalidate(void) { g_back_cols = 0; }
+
+static void tui_get_size(int *cols, int *rows) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0) {
+        *cols = (int)ws.ws_col;
+        *rows = (int)ws.ws_row;
+    } else {
+        *cols = 80;
+        *rows = 24;
+    }
+}
+
+/* Start a frame; on a size change (or invalidation) clear the screen and
+ * reset the back buffer so every row is emitted. */
+static void tui_frame_begin(int cols, int rows) {
+    g_frame.len = 0;
+    if (cols == g_back_cols && rows == g_back_rows) return;
+    
+    if (rows > g_back_cap) {
+        outbuf_t *nb = realloc(g_back, sizeof(*g_back) * (size_t)rows);
+        if (!nb) return;
+        memset(nb + g_back_cap, 0, sizeof(*nb) * (size_t)(rows - g_back_cap));
+        g_back = nb;
+        g_back_cap = rows;
+    }
+    for (int r = 0; r < rows; r++) g_back[r].len = 0;
+    g_back_rows = rows;
+    g_back_cols = cols;
+    ob_puts(&g_frame, ANSI_RESET ANSI_CLEAR);
+    // Make the first frame after a clear differ from the empty back buffer
+    for (int r = 0; r < rows; r++) ob_putc(&g_back[r], 0);
+}
+
+/* Emit the scratch row as screen row r (1-based) if it changed. */
+static void tui_commit_row(int r) {
+    if (r < 1 || r > g_back_rows) return;
+    outbuf_t *prev = &g_back[r-1];
+    if (prev->len == g_row.len && memcmp(prev->buf, g_row.buf, g_row.len) == 0) return;
+    ob_cursor(&g_frame, r, 1);
+    ob_put(&g_frame, g_row.buf, g_row.len);
+    ob_puts(&g_frame, "\033[K");
+    prev->len = 0;
+    ob_put(prev, g_row.buf, g_row.len);
+}
+
+static void tui_border_row(int r, int cols, const char *theme_border) {
+    g_row.len = 0;
+    ob_puts(&g_row, theme_border);
+    ob_putc(&g_row, '+');
+    ob_repeat(&g_row, '-', cols - 2);
+    ob_putc(&g_row, '+');
+    ob_puts(&g_row, ANSI_RESET);
+    tui_commit_row(r);
+}
+
+static int session_tabs(outbuf_t *b, int max_cols);
+
+static void tui_draw_frame(int cols) {
+    const char *theme_border = g_theme->border.s;
+    const char *theme_text = g_theme->text.s;
+    
+    // Top border
+    tui_border_row(1, cols, theme_border);
+    
+    // Header line
+    char header[256];
+    if (g_ui_mode == UI_GRAVEMIND) {
+        snprintf(header, sizeof(header), " GRAVEMIND NETWORK // USER: %s ", settings.username);
+    } else {
+        snprintf(header, sizeof(header), " UNSC NETWORK // SPARTAN: %s ", settings.username);
+    }
+    
+    int hlen = (int)strlen(header);
+    if (hlen > cols-2) {
+        header[cols-2] = 0;
+        hlen = cols-2;
+    }
+    
+    g_row.len = 0;
+    ob_puts(&g_row, theme_border);
+    ob_putc(&g_row, '|');
+    ob_puts(&g_row, theme_text);
+    ob_put(&g_row, header, (size_t)hlen);
+    if (g_session_count > 1) hlen += session_tabs(&g_row, cols - 2 - hlen);
+    ob_repeat(&g_row, ' ', cols - 2 - hlen);
+    ob_puts(&g_row, theme_border);
+    ob_putc(&g_row, '|');
+    ob_puts(&g_row, ANSI_RESET);
+    tui_commit_row(2);
+    
+    // Separator
+    tui_border_row(3, cols, theme_border);
+}
+
+/* Height of the message pane: 3 header rows, the pane, input separator,
+ * input, bottom border and status line. */
+static int tui_pane_rows(int rows) {
+    if (rows < 12) rows = 12;
+    int msg_h = rows - 7;
+    return msg_h < 5 ? 5 : msg_h;
+}
+
+/*
+ * Virtual scrollback lines: store records [0, g_store.floor), then the
+ * in-memory scrollback. Both keep a row index, so a display row maps to
+ * a line (and back) in O(log n).
+ */
+static uint64_t vl_rows_total(void) {
+    return fw_prefix(&g_store.rows, g_store.floor) + fw_prefix(&g_sb->rows, (size_t)g_sb->cap);
+}
+
+/* Display rows above virtual line i. */
+static uint64_t vl_rows_before(int i) {
+    size_t older = g_store.floor;
+    if ((size_t)i <= older) return fw_prefix(&g_store.rows, (size_t)i);
+    return fw_prefix(&g_store.rows, older) + sb_rows_before(i - (int)older);
+}
+
+/* Virtual line holding display row `row`, *off being the row within it. */
+static int vl_find_row(uint64_t row, uint32_t *off) {
+    uint64_t older_rows = fw_prefix(&g_store.rows, g_store.floor);
+    if (row < older_rows) return (int)fw_find(&g_store.rows, row, off);
+    return (int)g_store.floor + sb_find_row(row - older_rows, off);
+}
+
+/* Entry for virtual scrollback line i (see tui_render), formatted and laid
+ * out for the current pane width. */
+static sb_entry_t *tui_line_entry(int i) {
+    int older = (int)g_store.floor;
+    if (i < older) {
+        sb_entry_t *e = store_page_entry((size_t)i);
+        if (e && e->layout_cols != g_layout_cols) {
+            int rows = layout_rows(e, g_layout_cols);
+            int64_t had = fw_get(&g_store.rows, (size_t)i);
+            if (rows != had) fw_add(&g_store.rows, (size_t)i, rows - had);
+            e->layout_cols = (uint16_t)g_layout_cols;
+        }
+        return e;
+    }
+    sb_entry_t *e = sb_entry(i - older);
+    if (!e->row || e->row_mode != (uint8_t)g_ui_mode) tui_format_entry(e);
+    if (e->layout_cols != g_layout_cols) sb_layout(e);
+    return e;
+}
+
+/* The !search results pane, drawn over the message pane. */
+static void tui_render_search(int cols, int msg_h, const char *theme_border, const char *theme_text) {
+    int first = g_search->sel - (msg_h - 2);
+    if (first < 0) first = 0;
+    
+    for (int r = 0; r < msg_h; r++) {
+        g_row.len = 0;
+        ob_puts(&g_row, theme_border);
+        ob_putc(&g_row, '|');
+        
+        if (r == 0) {
+            char head[256];
+            int n = snprintf(head, sizeof(head), " Search \"%s\": %d result%s (%llu.%02llu ms)  Up/Down select, Enter jump, Esc close",
+                             g_search->query, g_search->count, g_search->count == 1 ? "" : "s",
+                             (unsigned long long)(g_search->took_us / 1000), (unsigned long long)(g_search->took_us % 1000 / 10));
+            if (n < 0) n = 0;
+            if (n >= (int)sizeof(head)) n = (int)sizeof(head) - 1;
+            ob_puts(&g_row, theme_text);
+            ob_put_clipped(&g_row, head, (size_t)n, cols - 2);
+        } else if (first + r - 1 < g_search->count) {
+            int k = first + r - 1;
+            int pos = index_doc_position(g_search->docs[k]);
+            sb_entry_t *e = pos >= 0 ? tui_line_entry(pos) : NULL;
+            ob_puts(&g_row, k == g_search->sel ? "\033[7m>\033[27m " : "  ");
+            if (e && e->row) {
+                if (e->width <= cols - 4) ob_put(&g_row, e->row, e->row_len);
+                else ob_put_clipped(&g_row, e->row, e->row_len, cols - 4);
+            } else {
+                ob_puts(&g_row, ANSI_DIM);
+                ob_puts(&g_row, "(no longer in scrollback)");
+            }
+        }
+        
+        ob_puts(&g_row, theme_border);
+        ob_putc(&g_row, '|');
+        ob_puts(&g_row, ANSI_RESET);
+        tui_commit_row(4 + r);
+    }
+}
+
+static void tui_render(void) {
+    if (g_show_start_menu) {
+        draw_start_menu();
+        return;
+    }
+    
+    uint64_t t0 = stats_begin();
+    int cols, rows;
+    tui_get_size(&cols, &rows);
+    if (cols < 40) cols = 40;
+    if (rows < 12) rows = 12;
+    
+    const char *theme_border = g_theme->border.s;
+    const char *theme_text = g_theme->text.s;
+    
+    int msg_h = tui_pane_rows(rows);
+    
+    tui_frame_begin(cols, rows);
+    tui_draw_frame(cols);
+    
+    tui_lock();
+    // Lines older than the scrollback are paged in from the message store
+    store_rows_sync();
+    int inner = cols - 2;
+    g_layout_cols = inner;
+    int total = (int)g_store.floor + g_sb->count;
+    
+    // Find the line at the top of the pane, g_sb->scroll rows up from the
+    // bottom. Laying out the lines in view can change their row counts (new
+    // width, new theme), so repeat until the window stops moving.
+    int top_line = 0;
+    uint32_t top_off = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        uint64_t rows_total = vl_rows_total();
+        int64_t top = (int64_t)rows_total - msg_h - g_sb->scroll;
+        top_line = vl_find_row(top > 0 ? (uint64_t)top : 0, &top_off);
+        int covered = -(int)top_off;
+        for (int i = top_line; i < total && covered < msg_h; i++) {
+            sb_entry_t *e = tui_line_entry(i);
+            covered += e ? layout_rows(e, inner) : 1;
+        }
+        if (vl_rows_total() == rows_total) break;
+    }
+    
+    // Message lines
+    if (g_search->open) {
+        tui_render_search(cols, msg_h, theme_border, theme_text);
+    } else {
+        int i = top_line;
+        int k = (int)top_off;   /* row within line i */
+        for (int r = 0; r < msg_h; r++) {
+            g_row.len = 0;
+            ob_puts(&g_row, theme_border);
+            ob_putc(&g_row, '|');
+            
+            if (i < total) {
+                sb_entry_t *e = tui_line_entry(i);
+                int n = e ? layout_rows(e, inner) : 1;
+                if (e && e->row) {
+                    if (n == 1) ob_put(&g_row, e->row, e->row_len);
+                    else ob_put_span(&g_row, e->row, e->row_len, k * inner, inner);
+                }
+                if (++k >= n) {
+                    i++;
+                    k = 0;
+                }
+            }
+            
+            ob_puts(&g_row, theme_border);
+            ob_putc(&g_row, '|');
+            ob_puts(&g_row, ANSI_RESET);
+            tui_commit_row(4 + r);
+        }
+    }
+    int scroll = g_sb->scroll;
+    pthread_mutex_unlock(&g_tui_lock);
+    
+    // Input separator
+    tui_border_row(4 + msg_h, cols, theme_border);
+    
+    // Input line
+    const char *prompt = g_theme->prompt.s;
+    int plen = (int)g_theme->prompt.n;
+    
+    int avail = inner - plen;
+    if (avail < 0) avail = 0;
+    
+    const char *in = g_input;
+    int inlen = g_input_len;
+    if (inlen > avail) {
+        in = g_input + (inlen - avail);
+        inlen = avail;
+    }
+    
+    g_row.len = 0;
+    ob_puts(&g_row, theme_border);
+    ob_putc(&g_row, '|');
+    ob_puts(&g_row, theme_text);
+    ob_put(&g_row, prompt, (size_t)plen);
+    ob_put(&g_row, in, (size_t)inlen);
+    ob_puts(&g_row, ANSI_RESET);
+    tui_commit_row(5 + msg_h);
+    
+    // Bottom border
+    tui_border_row(6 + msg_h, cols, theme_border);
+    
+    // Status line
+    char status[256];
+    int status_len;
+    if (g_stats_overlay) {
+        status_len = stats_overlay_text(status, sizeof(status));
+    } else {
+        status_len = snprintf(status, sizeof(status), " Messages: %d | Scroll: %d | Mode: %s | !help for commands",
+                              total, scroll, g_theme->name);
+    }
+    if (pacer_pending() && status_len < (int)sizeof(status)) {
+        status_len += snprintf(status + status_len, sizeof(status) - (size_t)status_len,
+                               " | Paced: %d", pacer_pending());
+    }
+    if (sendq_pending() && status_len < (int)sizeof(status)) {
+        status_len += snprintf(status + status_len, sizeof(status) - (size_t)status_len,
+                               " | Sending... (%d queued)", sendq_pending());
+    }
+    if (!atomic_load(&g_link->up) && status_len < (int)sizeof(status)) {
+        status_len += snprintf(status + status_len, sizeof(status) - (size_t)status_len,
+                               " | Offline - reconnecting");
+    }
+    if (status_len >= (int)sizeof(status)) status_len = (int)sizeof(status) - 1;
+    if (status_len > cols) status_len = cols;
+    g_row.len = 0;
+    ob_puts(&g_row, ANSI_DIM);
+    ob_put(&g_row, status, (size_t)status_len);
+    ob_puts(&g_row, ANSI_RESET);
+    tui_commit_row(7 + msg_h);
+    
+    // Place cursor
+    int cursor_col = 2 + plen + inlen;
+    if (cursor_col >= cols) cursor_col = cols - 1;
+    ob_cursor(&g_frame, 5 + msg_h, cursor_col);
+    
+    write_all(STDOUT_FILENO, g_frame.buf, g_frame.len);
+    if (t0) {
+        stats_add(&g_stat_render_bytes, g_frame.len);
+        stats_end(ST_RENDER, t0);
+    }
+}
+
+/* ===================== RENDER SCHEDULER ===================== */
+
+/*
+ * Network-driven redraws are capped at g_max_fps: any number of lines added
+ * within one frame interval are coalesced into a single tui_render. Input
+ * echo bypasses the cap once stdin has been drained.
+ */
+#define TUI_DEFAULT_FPS 60
+#define TUI_IDLE_WAIT_MS 250
+
+static int g_max_fps = TUI_DEFAULT_FPS;
+static uint64_t g_last_render_us = 0;
+
+static uint64_t mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+/* Milliseconds until the frame cap allows another render, 0 if now. */
+static int tui_render_delay_ms(void) {
+    if (g_max_fps <= 0) return 0;
+    uint64_t interval = 1000000u / (uint64_t)g_max_fps;
+    uint64_t elapsed = mono_us() - g_last_render_us;
+    if (elapsed >= interval) return 0;
+    return (int)((interval - elapsed + 999) / 1000);
+}
+
+/* Render if the screen is dirty and the cap allows it (always when `now`).
+ * Returns the ms to wait before retrying, -1 if nothing is pending. */
+static int tui_schedule_render(int now) {
+    if (!g_tui_dirty) return -1;
+    int delay = now ? 0 : tui_render_delay_ms();
+    if (delay > 0) return delay;
+    g_tui_dirty = 0;
+    tui_render();
+    g_last_render_us = mono_us();
+    return -1;
+}
+
+/* ===================== BOOT MESSAGES ===================== */
+
+static void gravemind_boot_lines(void) {
+    tui_add_line("SYSTEM", "GRAVEMIND", ">>> NEURAL SIGNAL DETECTED", SYSTEM);
+    tui_add_line("SYSTEM", "GRAVEMIND", ">>> FLOOD SPORE INTEGRATION INITIATED", SYSTEM);
+    tui_add_line("SYSTEM", "GRAVEMIND", ">>> MEMORY BLEED CONFIRMED", SYSTEM);
+    tui_add_line("SYSTEM", "GRAVEMIND", ">>> CORRUPTION STABLE. SPREADING...", SYSTEM);
+    tui_add_line("SYSTEM", "GRAVEMIND", "I am a monument to all your sins.", SYSTEM);
+    tui_add_line("SYSTEM", "GRAVEMIND", ">>> GRAVEMIND NEURAL NETWORK ONLINE", SYSTEM);
+}
+
+static void spartan_boot_lines(void) {
+    tui_add_line("SYSTEM", "UNSC", ">>> SPARTAN-III NEURAL INTERFACE INITIALIZED", SYSTEM);
+    tui_add_line("SYSTEM", "UNSC", ">>> MJOLNIR ARMOR SYSTEMS ONLINE", SYSTEM);
+    tui_add_line("SYSTEM", "UNSC", ">>> NEURAL LINK STABLE", SYSTEM);
+    tui_add_line("SYSTEM", "CORTANA", "I'll be with you every step of the way.", SYSTEM);
+    tui_add_line("SYSTEM", "UNSC", ">>> SPARTAN COMMUNICATIONS ONLINE", SYSTEM);
+}
+
+/* ===================== HELP MENU ===================== */
+
+void help_menu() {
+    printf("HALO MYCORD CLIENT - OPTIONS:\n");
+    printf("  --help                Show this help message\n");
+    printf("  --port PORT           Port to connect to (default: 8080)\n");
+    printf("  --ip IP               IPv4 or IPv6 address to connect to (default: 127.0.0.1)\n");
+    printf("  --domain DOMAIN       Domain name to connect to (tries all its addresses)\n");
+    printf("  --server HOST[:PORT]  Join this server; repeat to stay in up to %d at once (implies --event-loop)\n", SESSIONS_MAX);
+    printf("  --connect-timeout MS  Give up connecting after MS milliseconds (default: %d)\n", CONNECT_TIMEOUT_MS);
+    printf("  --quiet               Disable alerts and mentions\n");
+    printf("  --watch TERMS         Also highlight these comma-separated keywords\n");
+    printf("  --tui                 Enable TUI mode with start menu\n");
+    printf("  --gravemind           Start in Gravemind mode\n");
+    printf("  --legacy              Do not negotiate the framed (v2) protocol\n");
+    printf("  --compress            Ask the server to deflate what it sends (framed protocol only)\n");
+    printf("  --event-loop          Single-threaded io_uring/epoll engine (no reader/quote threads)\n");
+    printf("  --no-uring            Make --event-loop wait with epoll even where io_uring works\n");
+    printf("  --reconnect           Reconnect with backoff when the connection drops\n");
+    printf("  --headless            Send stdin lines as messages, print received ones as JSON lines\n");
+    printf("  --history N           Ask the server to replay N past messages at login (max %d)\n", HISTORY_MAX);
+    printf("  --scrollback LINES    TUI scrollback capacity (default: %d)\n", TUI_MAX_LINES);
+    printf("  --store FILE          Keep TUI messages in FILE and restore them on startup\n");
+    printf("  --stats               Collect hot-path timings from startup (see !stats)\n");
+    printf("  --stats-file FILE     Collect timings and write the !stats report to FILE at exit\n");
+    printf("  --max-fps FPS         Cap TUI redraws caused by incoming messages (default: %d, 0 = uncapped)\n\n", TUI_DEFAULT_FPS);
+    
+    printf("EXAMPLES:\n");
+    printf("  ./clientTui --tui --gravemind\n");
+    printf("  ./clientTui --port 8080 --tui\n");
+    printf("  ./clientTui --domain mycord.device.dev --tui\n");
+    printf("  ./clientTui --tui --server mycord.device.dev --server 10.0.0.5:9000\n");
+    printf("  tail -f alerts.log | ./clientTui --headless --reconnect\n");
+}
+
+/* ===================== ARGUMENT PROCESSING ===================== */
+
+/* --server entries, one session each */
+static const char *g_server_args[SESSIONS_MAX];
+static int g_server_argc = 0;
+
+/* Split "HOST", "HOST:PORT" or "[IPV6]:PORT"; a bare IPv6 address keeps
+ * default_port. Returns 0 on success. */
+static int split_server(const char *arg, char *host, size_t cap, int default_port, int *port) {
+    const char *end = NULL, *rest;
+    if (arg[0] == '[') {
+        end = strchr(arg, ']');
+        if (!end) return -1;
+        arg++;
+        rest = end + 1;
+        if (*rest && *rest != ':') return -1;
+    } else {
+        rest = strchr(arg, ':');
+        if (rest && strchr(rest + 1, ':')) rest = NULL;
+        end = rest ? rest : arg + strlen(arg);
+    }
+    if (end == arg || (size_t)(end - arg) >= cap) return -1;
+    memcpy(host, arg, (size_t)(end - arg));
+    host[end - arg] = 0;
+    
+    *port = default_port;
+    if (rest && *rest == ':') {
+        char *pend;
+        long n = strtol(rest + 1, &pend, 10);
+        if (rest[1] == 0 || *pend != 0 || n < 1 || n > 65535) return -1;
+        *port = (int)n;
+    }
+    return 0;
+}
+
+int process_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0){
+            help_menu();
+            exit(0);
+        }
+        else if (strcmp(argv[i], "--tui") == 0){
+            g_tui_enabled = 1;
+        }
+        else if (strcmp(argv[i], "--gravemind") == 0){
+            ui_set_mode(UI_GRAVEMIND);
+        }
+        else if (strcmp(argv[i], "--port") == 0){
+            if (i+1 < argc){
+                settings.port = atoi(argv[i+1]);
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--ip") == 0){
+            if(i+1 < argc){
+                struct in6_addr check;
+                if(inet_pton(AF_INET, argv[i+1], &check) == 1 || inet_pton(AF_INET6, argv[i+1], &check) == 1){
+                    snprintf(settings.host, sizeof(settings.host), "%s", argv[i+1]);
+                    i++;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--domain") == 0){
+            if(i+1 < argc){
+                // Resolved when connecting, see net_connect()
+                snprintf(settings.host, sizeof(settings.host), "%s", argv[i+1]);
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--server") == 0){
+            if (i+1 < argc){
+                char host[256];
+                int port;
+                if (g_server_argc == SESSIONS_MAX || split_server(argv[i+1], host, sizeof(host), 1, &port) != 0) {
+                    fprintf(stderr, "Error: --server takes HOST[:PORT], at most %d times\n", SESSIONS_MAX);
+                    exit(1);
+                }
+                g_server_args[g_server_argc++] = argv[i+1];
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--connect-timeout") == 0){
+            if (i+1 < argc){
+                settings.connect_timeout_ms = atoi(argv[i+1]);
+                if (settings.connect_timeout_ms <= 0) {
+                    fprintf(stderr, "Error: --connect-timeout must be a positive number of milliseconds\n");
+                    exit(1);
+                }
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--history") == 0){
+            if (i+1 < argc){
+                char *end;
+                long n = strtol(argv[i+1], &end, 10);
+                if (*argv[i+1] == 0 || *end != 0 || n < 0 || n > HISTORY_MAX) {
+                    fprintf(stderr, "Error: --history must be between 0 and %d\n", HISTORY_MAX);
+                    exit(1);
+                }
+                settings.history = (int)n;
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0){
+            stats_set_enabled(1);
+        }
+        else if (strcmp(argv[i], "--stats-file") == 0){
+            if (i+1 < argc){
+                g_stats_path = argv[i+1];
+                stats_set_enabled(1);
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--quiet") == 0){
+            settings.quiet = 1;
+        }
+        else if (strcmp(argv[i], "--legacy") == 0){
+            settings.legacy_only = 1;
+        }
+        else if (strcmp(argv[i], "--compress") == 0){
+            settings.compress = 1;
+        }
+        else if (strcmp(argv[i], "--headless") == 0){
+            settings.headless = 1;
+        }
+        else if (strcmp(argv[i], "--event-loop") == 0){
+            settings.event_loop = 1;
+        }
+        else if (strcmp(argv[i], "--no-uring") == 0){
+            settings.no_uring = 1;
+        }
+        else if (strcmp(argv[i], "--reconnect") == 0){
+            settings.reconnect = 1;
+        }
+        else if (strcmp(argv[i], "--watch") == 0){
+            if (i+1 < argc){
+                char terms[1024];
+                snprintf(terms, sizeof(terms), "%s", argv[i+1]);
+                for (char *save = NULL, *t = strtok_r(terms, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+                    if (g_watch_count >= WATCH_MAX - 1 || watch_add(t) != 0) {
+                        fprintf(stderr, "Error: --watch allows %d terms of up to %d characters\n", WATCH_MAX - 1, WATCH_TERM_MAX - 1);
+                        exit(1);
+                    }
+                }
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--max-fps") == 0){
+            if (i+1 < argc){
+                g_max_fps = atoi(argv[i+1]);
+                if (g_max_fps < 0) g_max_fps = 0;
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--store") == 0){
+            if (i+1 < argc){
+                g_store_path = argv[i+1];
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--scrollback") == 0){
+            if (i+1 < argc){
+                g_scrollback_cap = atoi(argv[i+1]);
+                if (g_scrollback_cap <= 0) {
+                    fprintf(stderr, "Error: --scrollback must be a positive line count\n");
+                    exit(1);
+                }
+                i++;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown argument '%s'. Use --help\n", argv[i]);
+            exit(1);
+        }
+    }
+    return 0;
+}
+
+/* ===================== USERNAME ===================== */
+
+int get_username() {
+    FILE* fp = popen("whoami", "r");
+    if(fp == NULL){
+        perror("Error: Could not open whoami");
+        exit(1);
+    }
+    char buffer[32];
+    if(fgets(buffer, 32, fp) != NULL){
+        strncpy(settings.username, buffer, sizeof(settings.username) - 1);
+        settings.username[sizeof(settings.username) - 1] = '\0';
+        settings.username[strcspn(settings.username, "\n")] = '\0';
+        pclose(fp);
+        return 0;
+    }
+    pclose(fp);
+    exit(1);
+}
+
+/* ===================== SIGNAL HANDLER ===================== */
+
+void handle_signal(int signal) {
+    (void)signal;
+    shutdown_requested = 1;
+    settings.running = 0;
+    tui_set_dirty();
+}
+
+/* ===================== NETWORK FUNCTIONS ===================== */
+
+ssize_t perform_full_read(int fd, void *buf, size_t n) {
+    if(buf == NULL){
+        fprintf(stderr, "Nothing to read\n");
+        return -1;
+    }
+    size_t total_read = 0;
+    while(total_read < n){
+        ssize_t bytes_read = read(fd, (char*)buf + total_read, n - total_read);
+        if (bytes_read == -1){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(bytes_read == 0){
+            break;
+        }
+        total_read += (size_t)bytes_read;
+    }
+    return (ssize_t)total_read;
+}
+
+/* Decode one frame in the negotiated protocol from buf into a legacy
+ * message_t (network byte order fields, NUL-terminated strings).
+ * Returns bytes consumed, 0 if buf holds only part of a frame and -1 if the
+ * frame is malformed. */
+static ssize_t decode_frame(const char *buf, size_t avail, message_t *msg) {
+    if (g_link->proto != PROTO_FRAMED) {
+        if (avail < sizeof(*msg)) return 0;
+        memcpy(msg, buf, sizeof(*msg));
+        return (ssize_t)sizeof(*msg);
+    }
+    if (avail < sizeof(frame_hdr_t)) return 0;
+    frame_hdr_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    size_t ulen = hdr.user_len;
+    size_t mlen = ntohs(hdr.msg_len);
+    if (ulen >= sizeof(msg->username) || mlen >= sizeof(msg->message)) {
+        errno = EPROTO;
+        return -1;
+    }
+    size_t total = sizeof(hdr) + ulen + mlen;
+    if (avail < total) return 0;
+    
+    msg->m_type = htonl(hdr.m_type);
+    msg->timeStamp = hdr.timeStamp;
+    /* terminated, not padded: nothing reads past the first NUL */
+    memcpy(msg->username, buf + sizeof(hdr), ulen);
+    msg->username[ulen] = 0;
+    memcpy(msg->message, buf + sizeof(hdr) + ulen, mlen);
+    msg->message[mlen] = 0;
+    return (ssize_t)total;
+}
+
+#define FRAME_MAX (sizeof(frame_hdr_t) + 32 + 1024)
+
+/*
+ * Buffered receive path: one read() pulls in whatever the socket has ready
+ * (up to 64 KB) and every complete frame in the buffer is decoded from
+ * there, so a history replay or a burst costs a handful of syscalls rather
+ * than one per frame. A trailing partial frame stays buffered for the next
+ * read.
+ */
+#define READER_BUF_SIZE (64 * 1024)
+#define READER_PLAIN_SIZE (FRAME_MAX + 64 * 1024)   /* a partial frame plus one block's output */
+
+typedef struct {
+    char   buf[READER_BUF_SIZE];
+    size_t start;    /* first undecoded byte */
+    size_t end;      /* one past the last buffered byte */
+    /* PROTO_DEFLATE_OPT: the connection's inflate stream and the frames it
+     * produced, allocated the first time the server grants it */
+    z_stream *z;
+    char   *plain;
+    size_t pstart, pend;
+} frame_reader_t;
+
+static frame_reader_t *g_reader;    /* the current session's */
+
+/* Read once from fd into the reader. Returns the read() result. */
+static ssize_t reader_fill(frame_reader_t *rd, int fd) {
+    if (rd->start > 0) {
+        memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+        rd->end -= rd->start;
+        rd->start = 0;
+    }
+    ssize_t n = read(fd, rd->buf + rd->end, sizeof(rd->buf) - rd->end);
+    if (n > 0) {
+        rd->end += (size_t)n;
+        if (stats_enabled()) {
+            stats_add(&g_stat_reads, 1);
+            stats_add(&g_stat_rx_bytes, (unsigned long long)n);
+        }
+    }
+    return n;
+}
+
+/* Forget everything buffered, for a new connection. */
+static void reader_reset(frame_reader_t *rd) {
+    rd->start = rd->end = 0;
+    rd->pstart = rd->pend = 0;
+}
+
+/* Start a fresh inflate stream for a connection that negotiated
+ * PROTO_DEFLATE_OPT. Returns 0 on success. */
+static int reader_start_deflate(frame_reader_t *rd) {
+    if (!rd->z) {
+        z_stream *z = calloc(1, sizeof(*z));
+        char *plain = malloc(READER_PLAIN_SIZE);
+        if (!z || !plain || inflateInit2(z, -MAX_WBITS) != Z_OK) {
+            free(z);
+            free(plain);
+            return -1;
+        }
+        rd->z = z;
+        rd->plain = plain;
+    } else if (inflateReset(rd->z) != Z_OK) {
+        return -1;
+    }
+    rd->pstart = rd->pend = 0;
+    return inflateSetDictionary(rd->z, (const Bytef *)deflate_dict, sizeof(deflate_dict) - 1) == Z_OK ? 0 : -1;
+}
+
+/* Inflate the DEFLATE_TYPE frame at the front of the buffer onto the end of
+ * rd->plain. Returns 1 once inflated, 0 if the block is not all buffered yet,
+ * 2 if the next frame is not a block and -1 on a bad block. */
+static int reader_inflate(frame_reader_t *rd) {
+    static const unsigned char sync_tail[4] = { 0x00, 0x00, 0xff, 0xff };
+    size_t avail = rd->end - rd->start;
+    if (avail < sizeof(frame_hdr_t)) return 0;
+    frame_hdr_t hdr;
+    memcpy(&hdr, rd->buf + rd->start, sizeof(hdr));
+    if (hdr.m_type != DEFLATE_TYPE) return 2;
+    size_t zlen = ntohs(hdr.msg_len);
+    if (hdr.user_len != 0 || zlen > DEFLATE_BLOCK_MAX) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (avail < sizeof(hdr) + zlen) return 0;
+
+    if (rd->pstart > 0) {
+        memmove(rd->plain, rd->plain + rd->pstart, rd->pend - rd->pstart);
+        rd->pend -= rd->pstart;
+        rd->pstart = 0;
+    }
+    z_stream *z = rd->z;
+    z->next_in = (Bytef *)(rd->buf + rd->start + sizeof(hdr));
+    z->avail_in = (uInt)zlen;
+    z->next_out = (Bytef *)(rd->plain + rd->pend);
+    z->avail_out = (uInt)(READER_PLAIN_SIZE - rd->pend);
+    int r = inflate(z, Z_SYNC_FLUSH);
+    if ((r == Z_OK || r == Z_BUF_ERROR) && z->avail_in == 0) {
+        z->next_in = (Bytef *)sync_tail;
+        z->avail_in = sizeof(sync_tail);
+        r = inflate(z, Z_SYNC_FLUSH);
+    }
+    /* input left over means the block inflates to more than fits */
+    if ((r != Z_OK && r != Z_BUF_ERROR) || z->avail_in != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    size_t out = (size_t)(z->next_out - (Bytef *)(rd->plain + rd->pend));
+    rd->pend += out;
+    rd->start += sizeof(hdr) + zlen;
+    if (stats_enabled()) {
+        stats_add(&g_stat_z_blocks, 1);
+        stats_add(&g_stat_z_wire, sizeof(hdr) + zlen);
+        stats_add(&g_stat_z_plain, out);
+    }
+    return 1;
+}
+
+/* Decode the next buffered frame. Returns 1 if msg was filled, 0 if more
+ * bytes are needed and -1 on a malformed frame. Frames inflated from a
+ * deflate block come before anything buffered after the block. */
+static int reader_next(frame_reader_t *rd, message_t *msg) {
+    while (g_link->deflate) {
+        if (rd->pend > rd->pstart) {
+            ssize_t used = decode_frame(rd->plain + rd->pstart, rd->pend - rd->pstart, msg);
+            if (used < 0) return -1;
+            if (used > 0) {
+                rd->pstart += (size_t)used;
+                return 1;
+            }
+        }
+        int r = reader_inflate(rd);
+        if (r == 1) continue;   /* decode what the block produced */
+        if (r < 1) return r;
+        if (rd->pend > rd->pstart) {
+            errno = EPROTO;     /* a frame cut short, yet no block to finish it */
+            return -1;
+        }
+        break;
+    }
+    ssize_t used = decode_frame(rd->buf + rd->start, rd->end - rd->start, msg);
+    if (used <= 0) return (int)used;
+    rd->start += (size_t)used;
+    return 1;
+}
+
+/* Encode a legacy message_t in the negotiated protocol into out (at least
+ * FRAME_MAX bytes). Returns the encoded size. */
+static size_t encode_frame(const message_t *msg, char *out) {
+    if (g_link->proto != PROTO_FRAMED) {
+        memcpy(out, msg, sizeof(*msg));
+        return sizeof(*msg);
+    }
+    frame_hdr_t hdr;
+    size_t ulen = strnlen(msg->username, sizeof(msg->username) - 1);
+    size_t mlen = strnlen(msg->message, sizeof(msg->message) - 1);
+    hdr.m_type = (uint8_t)ntohl(msg->m_type);
+    hdr.user_len = (uint8_t)ulen;
+    hdr.msg_len = htons((uint16_t)mlen);
+    hdr.timeStamp = msg->timeStamp;
+    memcpy(out, &hdr, sizeof(hdr));
+    memcpy(out + sizeof(hdr), msg->username, ulen);
+    memcpy(out + sizeof(hdr) + ulen, msg->message, mlen);
+    return sizeof(hdr) + ulen + mlen;
+}
+
+/* ===================== ADDRESS RESOLUTION ===================== */
+
+/*
+ * Connecting is Happy Eyeballs style (RFC 8305, simplified): AAAA and A
+ * lookups run in parallel on two detached threads, and addresses are tried
+ * as soon as they arrive, alternating families, with a new attempt started
+ * every CONNECT_STAGGER_MS while earlier ones are still pending. The first
+ * socket to connect wins, so one dead record costs a stagger, not a TCP
+ * timeout. The whole thing is bounded by --connect-timeout (CONNECT_TIMEOUT_MS).
+ *
+ * Resolved --domain addresses are cached on disk. getaddrinfo() does not
+ * report record TTLs, so entries expire after DNS_CACHE_TTL_SECS; if no
+ * cached address connects, the name is resolved again.
+ */
+#define ADDR_MAX             16
+#define CONNECT_STAGGER_MS   250
+#define DNS_CACHE_TTL_SECS   300
+#define DNS_CACHE_FILE       "mycord-dns"
+
+typedef struct {
+    pthread_mutex_t lock;
+    int        refs;
+    int        running;        /* lookups not finished yet */
+    int        wake[2];        /* written when a lookup finishes */
+    net_addr_t addrs[ADDR_MAX];
+    int        count;
+    int        dirty;          /* addrs changed since the last merge */
+    char       host[256];
+    char       port[8];
+} resolve_job_t;
+
+typedef struct {
+    resolve_job_t *job;
+    int family;
+} resolve_arg_t;
+
+static void resolve_job_put(resolve_job_t *job) {
+    pthread_mutex_lock(&job->lock);
+    int last = --job->refs == 0;
+    pthread_mutex_unlock(&job->lock);
+    if (!last) return;
+    close(job->wake[0]);
+    close(job->wake[1]);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+static void* resolve_thread(void* arg) {
+    resolve_arg_t a = *(resolve_arg_t *)arg;
+    free(arg);
+    
+    struct addrinfo hints = {0}, *res = NULL;
+    hints.ai_family = a.family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    int r = getaddrinfo(a.job->host, a.job->port, &hints, &res);
+    
+    pthread_mutex_lock(&a.job->lock);
+    for (struct addrinfo *ai = r == 0 ? res : NULL; ai && a.job->count < ADDR_MAX; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+        net_addr_t *na = &a.job->addrs[a.job->count++];
+        memcpy(&na->ss, ai->ai_addr, ai->ai_addrlen);
+        na->len = ai->ai_addrlen;
+        a.job->dirty = 1;
+    }
+    a.job->running--;
+    pthread_mutex_unlock(&a.job->lock);
+    if (res) freeaddrinfo(res);
+    
+    char one = 1;
+    (void)write(a.job->wake[1], &one, 1);
+    resolve_job_put(a.job);
+    return NULL;
+}
+
+/* Start the AAAA and A lookups for host. */
+static resolve_job_t* resolve_start(const char *host, int port) {
+    resolve_job_t *job = calloc(1, sizeof(*job));
+    if (!job) return NULL;
+    if (pipe(job->wake) != 0) {
+        free(job);
+        return NULL;
+    }
+    fcntl(job->wake[0], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&job->lock, NULL);
+    snprintf(job->host, sizeof(job->host), "%s", host);
+    snprintf(job->port, sizeof(job->port), "%d", port);
+    job->refs = 1;
+    
+    static const int families[] = { AF_INET6, AF_INET };
+    for (int i = 0; i < 2; i++) {
+        resolve_arg_t *a = malloc(sizeof(*a));
+        if (!a) continue;
+        a->job = job;
+        a->family = families[i];
+        pthread_mutex_lock(&job->lock);
+        job->refs++;
+        job->running++;
+        pthread_mutex_unlock(&job->lock);
+        
+        pthread_t t;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&t, &attr, resolve_thread, a) != 0) {
+            free(a);
+            pthread_mutex_lock(&job->lock);
+            job->refs--;
+            job->running--;
+            pthread_mutex_unlock(&job->lock);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return job;
+}
+
+static void addr_to_text(const net_addr_t *a, char *out, size_t cap) {
+    const void *p = a->ss.ss_family == AF_INET6
+        ? (const void *)&((const struct sockaddr_in6 *)&a->ss)->sin6_addr
+        : (const void *)&((const struct sockaddr_in *)&a->ss)->sin_addr;
+    if (!inet_ntop(a->ss.ss_family, p, out, (socklen_t)cap)) snprintf(out, cap, "?");
+}
+
+/* Parse a numeric IPv4/IPv6 address. Returns 0 on success. */
+static int addr_from_text(const char *text, int port, net_addr_t *out) {
+    memset(out, 0, sizeof(*out));
+    struct sockaddr_in *v4 = (struct sockaddr_in *)&out->ss;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)&out->ss;
+    if (inet_pton(AF_INET, text, &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons((uint16_t)port);
+        out->len = sizeof(*v4);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, text, &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons((uint16_t)port);
+        out->len = sizeof(*v6);
+        return 0;
+    }
+    return -1;
+}
+
+/* ---- on-disk cache: one "host expires address" line per address ---- */
+
+static int dns_cache_path(char *out, size_t cap) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) return snprintf(out, cap, "%s/%s", xdg, DNS_CACHE_FILE) < (int)cap ? 0 : -1;
+    if (home && *home) return snprintf(out, cap, "%s/.cache/%s", home, DNS_CACHE_FILE) < (int)cap ? 0 : -1;
+    return -1;
+}
+
+/* Load the unexpired cached addresses for host. Returns how many. */
+static int dns_cache_load(const char *host, int port, net_addr_t *out, int max) {
+    char path[512];
+    if (dns_cache_path(path, sizeof(path)) != 0) return 0;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    
+    int n = 0;
+    long long now = (long long)time(NULL);
+    char name[256], addr[INET6_ADDRSTRLEN];
+    long long expires;
+    while (n < max && fscanf(fp, "%255s %lld %45s", name, &expires, addr) == 3) {
+        if (expires > now && strcmp(name, host) == 0 && addr_from_text(addr, port, &out[n]) == 0) n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+/* Replace host's cached addresses, keeping other hosts' fresh entries. */
+static void dns_cache_store(const char *host, const net_addr_t *addrs, int n) {
+    char path[512], tmp[520];
+    if (n <= 0 || dns_cache_path(path, sizeof(path)) != 0) return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    char *slash = strrchr(tmp, '/');
+    if (slash) {
+        *slash = 0;
+        mkdir(tmp, 0700);   /* ~/.cache may not exist yet */
+        *slash = '/';
+    }
+    
+    FILE *out = fopen(tmp, "w");
+    if (!out) return;
+    long long now = (long long)time(NULL);
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char name[256], addr[INET6_ADDRSTRLEN];
+        long long expires;
+        while (fscanf(in, "%255s %lld %45s", name, &expires, addr) == 3) {
+            if (expires > now && strcmp(name, host) != 0) fprintf(out, "%s %lld %s\n", name, expires, addr);
+        }
+        fclose(in);
+    }
+    for (int i = 0; i < n; i++) {
+        char addr[INET6_ADDRSTRLEN];
+        addr_to_text(&addrs[i], addr, sizeof(addr));
+        fprintf(out, "%s %lld %s\n", host, now + DNS_CACHE_TTL_SECS, addr);
+    }
+    if (fclose(out) == 0) rename(tmp, path);
+    else unlink(tmp);
+}
+
+/* ---- staggered parallel connect ---- */
+
+typedef struct {
+    net_addr_t cand[ADDR_MAX];
+    int        ncand;
+    int        used[ADDR_MAX];
+    int        last_family;
+} eyeballs_t;
+
+static void eyeballs_add(eyeballs_t *he, const net_addr_t *a) {
+    for (int i = 0; i < he->ncand; i++) {
+        if (he->cand[i].len == a->len && memcmp(&he->cand[i].ss, &a->ss, a->len) == 0) return;
+    }
+    if (he->ncand < ADDR_MAX) he->cand[he->ncand++] = *a;
+}
+
+/* Next untried candidate, preferring the family not tried last. */
+static int eyeballs_next(eyeballs_t *he) {
+    int fallback = -1;
+    for (int i = 0; i < he->ncand; i++) {
+        if (he->used[i]) continue;
+        if (he->cand[i].ss.ss_family != he->last_family) {
+            fallback = i;
+            break;
+        }
+        if (fallback < 0) fallback = i;
+    }
+    if (fallback >= 0) {
+        he->used[fallback] = 1;
+        he->last_family = he->cand[fallback].ss.ss_family;
+    }
+    return fallback;
+}
+
+/*
+ * Race connections to the candidates (plus whatever job resolves meanwhile)
+ * until one connects or timeout_ms passes. The winner is returned as a
+ * blocking socket and its address stored in *won; -1 with errno set
+ * otherwise.
+ */
+static int eyeballs_connect(eyeballs_t *he, resolve_job_t *job, int timeout_ms, net_addr_t *won) {
+    int fds[ADDR_MAX];
+    int idx[ADDR_MAX];
+    int inflight = 0;
+    int last_err = ETIMEDOUT;
+    int winner = -1;
+    uint64_t deadline = mono_us() + (uint64_t)timeout_ms * 1000u;
+    uint64_t next_start = 0;
+    he->last_family = AF_INET;   /* so IPv6 goes first */
+    
+    for (;;) {
+        int resolving = 0;
+        if (job) {
+            pthread_mutex_lock(&job->lock);
+            if (job->dirty) {
+                for (int i = 0; i < job->count; i++) eyeballs_add(he, &job->addrs[i]);
+                job->dirty = 0;
+            }
+            resolving = job->running > 0;
+            pthread_mutex_unlock(&job->lock);
+        }
+        
+        uint64_t now = mono_us();
+        if (now >= deadline) break;
+        while (inflight < ADDR_MAX && (inflight == 0 || now >= next_start)) {
+            int c = eyeballs_next(he);
+            if (c < 0) break;
+            int fd = socket(he->cand[c].ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                last_err = errno;
+                continue;
+            }
+            if (connect(fd, (const struct sockaddr *)&he->cand[c].ss, he->cand[c].len) == 0) {
+                winner = fd;
+                *won = he->cand[c];
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                last_err = errno;
+                close(fd);
+                continue;
+            }
+            fds[inflight] = fd;
+            idx[inflight] = c;
+            inflight++;
+            next_start = now + CONNECT_STAGGER_MS * 1000u;
+            break;
+        }
+        if (winner >= 0) break;
+        if (inflight == 0 && !resolving) {
+            int left = 0;
+            for (int i = 0; i < he->ncand; i++) left |= !he->used[i];
+            if (!left) break;
+        }
+        
+        struct pollfd pfd[ADDR_MAX + 1];
+        for (int i = 0; i < inflight; i++) {
+            pfd[i].fd = fds[i];
+            pfd[i].events = POLLOUT;
+            pfd[i].revents = 0;
+        }
+        pfd[inflight].fd = job && resolving ? job->wake[0] : -1;
+        pfd[inflight].events = POLLIN;
+        pfd[inflight].revents = 0;
+        
+        uint64_t until = deadline;
+        int more = 0;
+        for (int i = 0; i < he->ncand; i++) more |= !he->used[i];
+        if (inflight > 0 && more && next_start < until) until = next_start;
+        int wait_ms = until > now ? (int)((until - now + 999) / 1000) : 0;
+        if (poll(pfd, (nfds_t)inflight + 1, wait_ms) < 0 && errno != EINTR) break;
+        if (shutdown_requested) {
+            last_err = EINTR;
+            break;
+        }
+        
+        if (pfd[inflight].revents & POLLIN) {
+            char drain[16];
+            while (read(job->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        for (int i = 0; i < inflight; i++) {
+            if (!pfd[i].revents) continue;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &err, &len) != 0) err = errno;
+            if (err == 0 && winner < 0) {
+                winner = fds[i];
+                *won = he->cand[idx[i]];
+                fds[i] = -1;
+                continue;
+            }
+            if (err != 0) {
+                last_err = err;
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+        int j = 0;
+        for (int i = 0; i < inflight; i++) {
+            if (fds[i] < 0) continue;
+            fds[j] = fds[i];
+            idx[j] = idx[i];
+            j++;
+        }
+        inflight = j;
+        if (winner >= 0) break;
+    }
+    
+    for (int i = 0; i < inflight; i++) close(fds[i]);
+    if (winner < 0) {
+        errno = last_err;
+        return -1;
+    }
+    int flags = fcntl(winner, F_GETFL, 0);
+    fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+    return winner;
+}
+
+/*
+ * Connect to host:port within timeout_ms. Numeric hosts are used directly;
+ * names go through the disk cache first and are then resolved. On success
+ * the connected address is stored in *won. Touches no session state, so the
+ * event loop's reconnects can run it on a helper thread.
+ * Returns the socket, -2 if the name did not resolve, -1 otherwise.
+ */
+static int net_connect_to(const char *host, int port, int timeout_ms, net_addr_t *won) {
+    eyeballs_t he = {0};
+    int fd = -1;
+    
+    if (addr_from_text(host, port, &he.cand[0]) == 0) {
+        he.ncand = 1;
+        fd = eyeballs_connect(&he, NULL, timeout_ms, won);
+    } else {
+        uint64_t start = mono_us();
+        he.ncand = dns_cache_load(host, port, he.cand, ADDR_MAX);
+        if (he.ncand > 0) fd = eyeballs_connect(&he, NULL, timeout_ms, won);
+        
+        int left = timeout_ms - (int)((mono_us() - start) / 1000);
+        if (fd < 0 && left > 0) {
+            resolve_job_t *job = resolve_start(host, port);
+            if (!job) return -1;
+            memset(&he, 0, sizeof(he));
+            fd = eyeballs_connect(&he, job, left, won);
+            pthread_mutex_lock(&job->lock);
+            int resolved = job->count;
+            net_addr_t addrs[ADDR_MAX];
+            memcpy(addrs, job->addrs, sizeof(addrs[0]) * (size_t)resolved);
+            pthread_mutex_unlock(&job->lock);
+            resolve_job_put(job);
+            if (resolved == 0 && fd < 0) return -2;
+            if (fd >= 0) dns_cache_store(host, addrs, resolved);
+        }
+    }
+    return fd;
+}
+
+/* net_connect_to() the current link's host:port, keeping the connected
+ * address in g_link->server. */
+static int net_connect(int timeout_ms) {
+    net_addr_t won;
+    int fd = net_connect_to(g_link->host, g_link->port, timeout_ms, &won);
+    if (fd >= 0) g_link->server = won;
+    return fd;
+}
+
+/* ---- connecting off the event loop ---- */
+
+/*
+ * The event loop must not sit in net_connect() for up to --connect-timeout
+ * while other sessions and the keyboard wait, so its reconnects hand the
+ * connect to a detached thread. The job is shared like resolve_job_t: the
+ * loop watches wake[0] and collects the socket once done is set. A job the
+ * loop gave up on closes its socket when the thread drops the last ref.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int        refs;
+    int        wake[2];        /* written once the connect finished */
+    int        fd;             /* the connected socket, -1 if none */
+    net_addr_t won;
+    char       host[256];
+    int        port;
+    int        timeout_ms;
+} connect_job_t;
+
+static void connect_job_put(connect_job_t *job) {
+    pthread_mutex_lock(&job->lock);
+    int last = --job->refs == 0;
+    pthread_mutex_unlock(&job->lock);
+    if (!last) return;
+    if (job->fd >= 0) close(job->fd);
+    close(job->wake[0]);
+    close(job->wake[1]);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+static void* connect_thread(void* arg) {
+    connect_job_t *job = arg;
+    net_addr_t won;
+    int fd = net_connect_to(job->host, job->port, job->timeout_ms, &won);
+    
+    pthread_mutex_lock(&job->lock);
+    job->fd = fd < 0 ? -1 : fd;
+    job->won = won;
+    pthread_mutex_unlock(&job->lock);
+    
+    char one = 1;
+    (void)write(job->wake[1], &one, 1);
+    connect_job_put(job);
+    return NULL;
+}
+
+/* Start connecting to the current link's host:port in the background. */
+static connect_job_t* connect_start(int timeout_ms) {
+    connect_job_t *job = calloc(1, sizeof(*job));
+    if (!job) return NULL;
+    if (pipe(job->wake) != 0) {
+        free(job);
+        return NULL;
+    }
+    fcntl(job->wake[0], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&job->lock, NULL);
+    snprintf(job->host, sizeof(job->host), "%s", g_link->host);
+    job->port = g_link->port;
+    job->timeout_ms = timeout_ms;
+    job->fd = -1;
+    job->refs = 2;
+    
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&t, &attr, connect_thread, job);
+    pthread_attr_destroy(&attr);
+    if (r != 0) {
+        job->refs = 1;
+        connect_job_put(job);
+        return NULL;
+    }
+    return job;
+}
+
+/* Take the finished job's socket, storing its address in g_link->server.
+ * Returns -1 if the connect failed. */
+static int connect_collect(connect_job_t *job) {
+    pthread_mutex_lock(&job->lock);
+    int fd = job->fd;
+    job->fd = -1;
+    net_addr_t won = job->won;
+    pthread_mutex_unlock(&job->lock);
+    if (fd >= 0) g_link->server = won;
+    return fd;
+}
+
+/* ===================== CONNECTION STATE ===================== */
+
+/*
+ * With --reconnect a dead connection is replaced in place: the new socket is
+ * dup2()'d onto the link's socket_fd, so the input side never sees the
+ * number change. The link lock serializes the send queue against that swap,
+ * and the link epoch tells the pacer a fresh server-side rate window has
+ * begun.
+ */
+
+/* Connections not yet lost for good; the client ends when none are left. */
+static int g_links_open = 0;
+
+/* Stop using the current connection for good; the client ends with its
+ * last connection. */
+static void connection_end(void) {
+    atomic_store(&g_link->up, 0);
+    if (g_link->closed) return;
+    g_link->closed = 1;
+    if (--g_links_open <= 0) settings.running = 0;
+}
+
+/* Stop using the current connection. Without --reconnect it is closed for
+ * good. */
+static void connection_lost(void) {
+    if (!settings.reconnect) {
+        connection_end();
+        return;
+    }
+    atomic_store(&g_link->up, 0);
+}
+
+/* ===================== SEND QUEUE ===================== */
+
+/*
+ * Outbound frames are encoded into a byte ring and flushed with
+ * sendmsg(MSG_DONTWAIT), i.e. a writev of the (at most two) contiguous
+ * ring segments, so pending frames are coalesced and a short write simply
+ * leaves the remainder queued. The socket stays blocking for the reader
+ * thread; only sends are non-blocking. Callers wait for POLLOUT/EPOLLOUT
+ * while sendq_pending() is non-zero. The bytes of a partly sent frame are
+ * kept until it completes so a reconnect can resend it whole. A
+ * MESSAGE_SENT is reported to the pacer once its last byte is written.
+ */
+#define SENDQ_BYTES  (64 * 1024)
+#define SENDQ_FRAMES 256
+
+typedef struct {
+    char     buf[SENDQ_BYTES];
+    size_t   head;                  /* first unsent byte */
+    size_t   len;                   /* unsent bytes */
+    uint16_t sizes[SENDQ_FRAMES];   /* encoded size of each queued frame */
+    uint8_t  rated[SENDQ_FRAMES];   /* frame is a MESSAGE_SENT */
+    int      fhead;
+    int      fcount;
+    int      rated_count;           /* queued MESSAGE_SENTs */
+    size_t   head_sent;             /* bytes of the oldest frame already sent */
+} send_queue_t;
+
+static send_queue_t *g_sendq;       /* the current session's */
+
+static void pacer_sent(uint64_t now);
+
+static int sendq_pending(void) { return g_sendq->fcount; }
+
+/* Encode one frame in the link's protocol and queue it, with g_link->lock
+ * held so a reconnect cannot switch the protocol in between. Returns -1
+ * (and queues nothing) when the queue is full. */
+static int sendq_push_locked(const message_t *msg) {
+    char frame[FRAME_MAX];
+    size_t n = encode_frame(msg, frame);
+    if (g_sendq->fcount == SENDQ_FRAMES || SENDQ_BYTES - g_sendq->len - g_sendq->head_sent < n) return -1;
+    
+    size_t tail = (g_sendq->head + g_sendq->len) % SENDQ_BYTES;
+    size_t first = SENDQ_BYTES - tail;
+    if (first > n) first = n;
+    memcpy(g_sendq->buf + tail, frame, first);
+    memcpy(g_sendq->buf, frame + first, n - first);
+    g_sendq->len += n;
+    int slot = (g_sendq->fhead + g_sendq->fcount) % SENDQ_FRAMES;
+    g_sendq->sizes[slot] = (uint16_t)n;
+    g_sendq->rated[slot] = ntohl(msg->m_type) == MESSAGE_SENT;
+    g_sendq->rated_count += g_sendq->rated[slot];
+    g_sendq->fcount++;
+    stats_sendq_depth(g_sendq->fcount);
+    return 0;
+}
+
+/* Queue one frame. Returns -1 (and queues nothing) when the queue is full. */
+static int sendq_push(const message_t *msg) {
+    pthread_mutex_lock(&g_link->lock);
+    int r = sendq_push_locked(msg);
+    pthread_mutex_unlock(&g_link->lock);
+    return r;
+}
+
+/* Requeue the unsent part of the oldest frame from its first byte. */
+static void sendq_rewind_locked(void) {
+    g_sendq->head = (g_sendq->head + SENDQ_BYTES - g_sendq->head_sent) % SENDQ_BYTES;
+    g_sendq->len += g_sendq->head_sent;
+    g_sendq->head_sent = 0;
+}
+
+/* Switch the link to proto, re-encoding everything queued for the old one.
+ * Only a fresh connection changes protocol, so every frame is requeued
+ * whole. Frames that no longer fit (legacy frames are larger) are dropped
+ * from the back. Returns the number dropped. Needs g_link->lock. */
+static int sendq_transcode_locked(int proto) {
+    sendq_rewind_locked();
+    int count = g_sendq->fcount;
+    message_t *msgs = count ? malloc((size_t)count * sizeof(*msgs)) : NULL;
+    int kept = 0;
+    for (int i = 0; msgs && i < count; i++) {
+        // Linearize the frame, it may wrap around the end of the ring
+        char frame[FRAME_MAX];
+        size_t n = g_sendq->sizes[(g_sendq->fhead + i) % SENDQ_FRAMES];
+        size_t first = SENDQ_BYTES - g_sendq->head;
+        if (first > n) first = n;
+        memcpy(frame, g_sendq->buf + g_sendq->head, first);
+        memcpy(frame + first, g_sendq->buf, n - first);
+        g_sendq->head = (g_sendq->head + n) % SENDQ_BYTES;
+        if (decode_frame(frame, n, &msgs[kept]) > 0) kept++;
+    }
+    g_sendq->head = 0;
+    g_sendq->len = 0;
+    g_sendq->fhead = 0;
+    g_sendq->fcount = 0;
+    g_sendq->rated_count = 0;
+    g_link->proto = proto;
+    int requeued = 0;
+    while (requeued < kept && sendq_push_locked(&msgs[requeued]) == 0) requeued++;
+    free(msgs);
+    stats_sendq_depth(g_sendq->fcount);
+    return count - requeued;
+}
+
+static int sendq_flush_locked(int fd) {
+    if (!atomic_load(&g_link->up)) return 0;
+    while (g_sendq->len > 0) {
+        struct iovec iov[2];
+        size_t first = SENDQ_BYTES - g_sendq->head;
+        if (first > g_sendq->len) first = g_sendq->len;
+        iov[0].iov_base = g_sendq->buf + g_sendq->head;
+        iov[0].iov_len = first;
+        iov[1].iov_base = g_sendq->buf;
+        iov[1].iov_len = g_sendq->len - first;
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = iov[1].iov_len ? 2 : 1 };
+        
+        ssize_t n = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (!settings.reconnect) return -1;
+            // Wake the reader so it starts reconnecting; frames stay queued
+            shutdown(fd, SHUT_RDWR);
+            connection_lost();
+            return 0;
+        }
+        g_sendq->head = (g_sendq->head + (size_t)n) % SENDQ_BYTES;
+        g_sendq->len -= (size_t)n;
+        g_sendq->head_sent += (size_t)n;
+        uint64_t now = 0;
+        while (g_sendq->fcount > 0 && g_sendq->head_sent >= g_sendq->sizes[g_sendq->fhead]) {
+            g_sendq->head_sent -= g_sendq->sizes[g_sendq->fhead];
+            if (g_sendq->rated[g_sendq->fhead]) {
+                if (!now) now = mono_us();
+                pacer_sent(now);
+                g_sendq->rated_count--;
+            }
+            g_sendq->fhead = (g_sendq->fhead + 1) % SENDQ_FRAMES;
+            g_sendq->fcount--;
+        }
+        stats_sendq_depth(g_sendq->fcount);
+    }
+    return 0;
+}
+
+/* Write as much of the queue as the socket accepts without blocking.
+ * Returns 0 if everything was sent, the socket is full or the link is
+ * down for a reconnect, -1 if the connection failed. */
+static int sendq_flush(int fd) {
+    pthread_mutex_lock(&g_link->lock);
+    int r = sendq_flush_locked(fd);
+    pthread_mutex_unlock(&g_link->lock);
+    return r;
+}
+
+/* Sleep in short steps while a reconnect is in progress.
+ * Returns -1 once the client is shutting down. */
+static int link_wait(void) {
+    if (!settings.running) return -1;
+    struct timespec ts = { 0, 100 * 1000000L };
+    nanosleep(&ts, NULL);
+    return 0;
+}
+
+/* Block until the queue is empty, the connection fails or timeout_ms
+ * (-1 = forever) passes. Returns 0 once everything was sent. */
+static int sendq_drain_blocking(int fd, int timeout_ms) {
+    uint64_t deadline = mono_us() + (uint64_t)(timeout_ms < 0 ? 0 : timeout_ms) * 1000u;
+    while (sendq_pending() > 0) {
+        if (sendq_flush(fd) < 0) return -1;
+        if (sendq_pending() == 0) break;
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            uint64_t now = mono_us();
+            if (now >= deadline) return -1;
+            wait_ms = (int)((deadline - now + 999) / 1000);
+        }
+        if (!atomic_load(&g_link->up)) {
+            if (link_wait() != 0) return -1;
+            continue;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int r = poll(&pfd, 1, wait_ms);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+    }
+    return 0;
+}
+
+/* ===================== SEND PACER ===================== */
+
+/*
+ * The server disconnects anyone who sends a 6th MESSAGE_SEND within one
+ * second (a sliding window, so a plain token bucket refilling at 5/s would
+ * still trip it after a burst). The pacer keeps the times the last
+ * RATE_MAX_MSGS messages actually left the send queue and holds anything
+ * that would break the window in a bounded queue, releasing it into the
+ * send queue as soon as the window allows. Messages released but still
+ * queued behind a full socket count as going out now, so they cannot be
+ * overtaken. RATE_MARGIN_US absorbs network jitter compressing the gaps.
+ */
+#define RATE_MAX_MSGS    5
+#define RATE_WINDOW_US   1000000u
+#define RATE_MARGIN_US   100000u
+#define PACER_QUEUE_MAX  64
+
+typedef struct {
+    message_t queue[PACER_QUEUE_MAX];
+    int       qhead;
+    int       qcount;
+    uint64_t  sent_us[RATE_MAX_MSGS];   /* ring of the most recent send times */
+    int       sent_next;
+    int       sent_count;
+    int       epoch;                    /* g_link->epoch the window belongs to */
+} pacer_t;
+
+static pacer_t *g_pacer;            /* the current session's */
+
+static int pacer_pending(void) { return g_pacer->qcount; }
+
+/* Note that a MESSAGE_SENT has been written to the socket. */
+static void pacer_sent(uint64_t now) {
+    g_pacer->sent_us[g_pacer->sent_next] = now;
+    g_pacer->sent_next = (g_pacer->sent_next + 1) % RATE_MAX_MSGS;
+    if (g_pacer->sent_count < RATE_MAX_MSGS) g_pacer->sent_count++;
+}
+
+/* Microseconds until the window admits another message, 0 if now. */
+static uint64_t pacer_wait_us(uint64_t now) {
+    // The next message must trail the one RATE_MAX_MSGS before it by a
+    // window; k is that one's position among the recorded sends, oldest first
+    int k = g_pacer->sent_count + g_sendq->rated_count - RATE_MAX_MSGS;
+    if (k < 0) return 0;
+    // It has not gone out yet either: check back once the socket drains
+    if (k >= g_pacer->sent_count) return RATE_MARGIN_US;
+    uint64_t prior = g_pacer->sent_us[(g_pacer->sent_next + RATE_MAX_MSGS - g_pacer->sent_count + k) % RATE_MAX_MSGS];
+    uint64_t due = prior + RATE_WINDOW_US + RATE_MARGIN_US;
+    return now >= due ? 0 : due - now;
+}
+
+/* Milliseconds until the next queued message is due, -1 if none queued. */
+static int pacer_next_due_ms(void) {
+    if (g_pacer->qcount == 0) return -1;
+    return (int)((pacer_wait_us(mono_us()) + 999) / 1000);
+}
+
+/* Move every message the window allows into the send queue and flush it.
+ * Returns the number released, or -1 if the connection failed. */
+static int pacer_release(int fd) {
+    if (!atomic_load(&g_link->up)) return 0;
+    int epoch = atomic_load(&g_link->epoch);
+    if (epoch != g_pacer->epoch) {
+        // New connection, new window: only frames sent on it count, and
+        // those still queued are resent on it
+        g_pacer->epoch = epoch;
+        g_pacer->sent_count = 0;
+        g_pacer->sent_next = 0;
+    }
+    int released = 0;
+    while (g_pacer->qcount > 0) {
+        uint64_t now = mono_us();
+        if (pacer_wait_us(now) > 0) break;
+        if (sendq_push(&g_pacer->queue[g_pacer->qhead]) != 0) break;
+        g_pacer->qhead = (g_pacer->qhead + 1) % PACER_QUEUE_MAX;
+        g_pacer->qcount--;
+        released++;
+    }
+    if (sendq_flush(fd) < 0) return -1;
+    return released;
+}
+
+/* Accept one MESSAGE_SEND for pacing. Returns -1 when the queue is full,
+ * otherwise the result of pacer_release(). */
+static int pacer_submit(int fd, const message_t *msg) {
+    if (g_pacer->qcount == PACER_QUEUE_MAX) return -1;
+    g_pacer->queue[(g_pacer->qhead + g_pacer->qcount) % PACER_QUEUE_MAX] = *msg;
+    g_pacer->qcount++;
+    int r = pacer_release(fd);
+    return r < 0 ? -2 : 0;
+}
+
+/* Release everything still held, sleeping between releases. Used by the
+ * blocking plain loop and at shutdown. Returns 0 once the pacer is empty. */
+static int pacer_drain_blocking(int fd) {
+    while (g_pacer->qcount > 0) {
+        if (!atomic_load(&g_link->up)) {
+            if (link_wait() != 0) return -1;
+            continue;
+        }
+        int due = pacer_next_due_ms();
+        if (due > 0) {
+            struct timespec ts = { due / 1000, (long)(due % 1000) * 1000000L };
+            if (nanosleep(&ts, NULL) != 0 && shutdown_requested) return -1;
+        }
+        if (pacer_release(fd) < 0) return -1;
+        if (sendq_pending() && sendq_drain_blocking(fd, 5000) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Send LOGIN, offering the framed protocol unless --legacy (with
+ * compression if --compress) and asking for the --history depth if one was
+ * given. */
+static int send_login(int fd) {
+    message_t login_msg = {0};
+    login_msg.m_type = htonl(LOGIN);
+    strncpy(login_msg.username, settings.username, sizeof(login_msg.username) - 1);
+    login_msg.username[sizeof(login_msg.username) - 1] = 0;
+    int off = 0;
+    if (!settings.legacy_only) {
+        off = snprintf(login_msg.message, sizeof(login_msg.message), "%s",
+                       settings.compress ? PROTO_HELLO " " PROTO_DEFLATE_OPT : PROTO_HELLO);
+    }
+    if (settings.history >= 0) {
+        off += snprintf(login_msg.message + off, sizeof(login_msg.message) - (size_t)off, "%s" PROTO_HISTORY_OPT "%d",
+                        off ? " " : "", settings.history);
+    }
+    // After a reconnect, or with a restored --store, only ask for what we have not seen
+    if (g_link->last_seen_ts) {
+        snprintf(login_msg.message + off, sizeof(login_msg.message) - (size_t)off, "%s" PROTO_SINCE_OPT "%u",
+                 off ? " " : "", g_link->last_seen_ts);
+    }
+    return write(fd, &login_msg, sizeof(login_msg)) == (ssize_t)sizeof(login_msg) ? 0 : -1;
+}
+
+/* Whether the space-separated list names option. */
+static bool option_listed(const char *list, const char *option) {
+    size_t n = strlen(option);
+    for (const char *p = list; (p = strstr(p, option)) != NULL; p += n) {
+        if ((p == list || p[-1] == ' ') && (p[n] == 0 || p[n] == ' ')) return true;
+    }
+    return false;
+}
+
+/* Settle the protocol from what the server sent first after LOGIN, buffered
+ * in rd. A v2 server acknowledges PROTO_HELLO with a legacy-sized LOGIN frame
+ * listing what it granted, which is consumed here. A legacy server never
+ * sends LOGIN, so any other type settles it as soon as the type field is in,
+ * and that frame is left buffered for the reader. Returns 1 once the protocol
+ * is known, 0 while more bytes are needed. */
+static int negotiate_step(frame_reader_t *rd, int *proto) {
+    size_t avail = rd->end - rd->start;
+    uint32_t type;
+    if (avail < sizeof(type)) return 0;
+    memcpy(&type, rd->buf + rd->start, sizeof(type));
+    if (ntohl(type) != LOGIN) return 1;
+    if (avail < sizeof(message_t)) return 0;
+
+    message_t first;
+    memcpy(&first, rd->buf + rd->start, sizeof(first));
+    first.message[sizeof(first.message)-1] = 0;
+    size_t hello = strlen(PROTO_HELLO);
+    if (strncmp(first.message, PROTO_HELLO, hello) == 0 &&
+        (first.message[hello] == 0 || first.message[hello] == ' ')) {
+        rd->start += sizeof(first);
+        *proto = PROTO_FRAMED;
+        /* without an inflate stream the blocks will fail as malformed frames */
+        if (settings.compress && option_listed(first.message, PROTO_DEFLATE_OPT)) {
+            g_link->deflate = reader_start_deflate(rd) == 0;
+        }
+    }
+    return 1;
+}
+
+/* Settle the link on proto. The send queue may still hold frames encoded for
+ * the previous connection's protocol, so the switch happens under the link
+ * lock together with re-encoding them. Returns the number of queued frames
+ * dropped because they no longer fit. */
+static int link_set_proto(int proto) {
+    pthread_mutex_lock(&g_link->lock);
+    int dropped = proto == g_link->proto ? 0 : sendq_transcode_locked(proto);
+    pthread_mutex_unlock(&g_link->lock);
+    return dropped;
+}
+
+/* After LOGIN, wait up to PROTO_NEGOTIATE_MS for the server's first reply
+ * and settle the protocol from it (see negotiate_step()). Whatever arrived
+ * beyond the acknowledgement stays in the reader. Returns what
+ * link_set_proto() does. */
+static int negotiate_protocol(void) {
+    int proto = PROTO_LEGACY;
+    g_link->deflate = 0;
+    uint64_t deadline = mono_us() + PROTO_NEGOTIATE_MS * 1000u;
+    while (!settings.legacy_only) {
+        uint64_t now = mono_us();
+        if (now >= deadline) break;
+        struct pollfd pfd = { .fd = g_link->socket_fd, .events = POLLIN };
+        int r = poll(&pfd, 1, (int)((deadline - now + 999) / 1000));
+        if (r < 0 && errno == EINTR && !shutdown_requested) continue;
+        if (r <= 0) break;
+        ssize_t n = reader_fill(g_reader, g_link->socket_fd);
+        if (n < 0 && errno == EINTR) continue;
+        // A closed or failed socket is the reader's to report
+        if (n <= 0 || negotiate_step(g_reader, &proto)) break;
+    }
+    return link_set_proto(proto);
+}
+
+/* ===================== TIMESTAMP CACHE ===================== */
+
+/*
+ * "%H:%M:%S" formatting without localtime()/strftime() per message. Each
+ * thread caches the local broken-down time of the minute it last saw; any
+ * timestamp inside that minute is formatted arithmetically. Only a new
+ * minute goes through localtime_r() (UTC offsets are whole minutes).
+ */
+typedef struct {
+    time_t minute_start;     /* first second of the cached minute, -1 if empty */
+    char   hhmm[6];          /* "HH:MM" of that minute */
+} time_cache_t;
+
+static __thread time_cache_t t_time_cache = { -1, "" };
+
+static void put2(char *out, int v) {
+    out[0] = (char)('0' + (v / 10) % 10);
+    out[1] = (char)('0' + v % 10);
+}
+
+/* Write t as "HH:MM:SS\0" into out (at least 9 bytes). */
+static void format_hms(time_t t, char *out) {
+    time_cache_t *c = &t_time_cache;
+    if (c->minute_start < 0 || t < c->minute_start || t >= c->minute_start + 60) {
+        struct tm info;
+        if (!localtime_r(&t, &info)) {
+            strcpy(out, "??:??:??");
+            return;
+        }
+        c->minute_start = t - info.tm_sec;
+        put2(c->hhmm, info.tm_hour);
+        c->hhmm[2] = ':';
+        put2(c->hhmm + 3, info.tm_min);
+        c->hhmm[5] = 0;
+    }
+    memcpy(out, c->hhmm, 5);
+    out[5] = ':';
+    put2(out + 6, (int)(t - c->minute_start));
+    out[8] = 0;
+}
+
+/* ===================== HEADLESS OUTPUT ===================== */
+
+/*
+ * --headless writes one JSON object per received frame to stdout, e.g.
+ *   {"type":"message","ts":1700000000,"user":"bob","text":"hi"}
+ * Bytes outside printable ASCII are escaped as \u00XX so the output stays
+ * valid JSON whatever the server relays.
+ */
+static void json_put_string(outbuf_t *b, const char *s, size_t max) {
+    static const char hex[] = "0123456789abcdef";
+    const char *run = s;
+    size_t i = 0;
+    ob_putc(b, '"');
+    for (; i < max && s[i]; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 32 && c < 127 && c != '"' && c != '\\') continue;
+        ob_put(b, run, (size_t)(s + i - run));
+        run = s + i + 1;
+        if (c == '"' || c == '\\') {
+            char esc[2] = { '\\', (char)c };
+            ob_put(b, esc, sizeof(esc));
+        } else if (c == '\n') {
+            OB_LIT(b, "\\n");
+        } else {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            ob_put(b, esc, sizeof(esc));
+        }
+    }
+    ob_put(b, run, (size_t)(s + i - run));
+    ob_putc(b, '"');
+}
+
+/* Batch of lines built by the formatters below, handed to stdio in one
+ * fwrite() by out_flush(). Only the receive path (the receive thread, or the
+ * event loop) writes output through them. */
+static outbuf_t g_out;
+
+static void out_flush(void) {
+    if (g_out.len > 0) fwrite(g_out.buf, 1, g_out.len, stdout);
+    g_out.len = 0;
+    fflush(stdout);
+}
+
+/* Emit one event; user may be NULL. Written with the inbound batch. */
+static void headless_emit(const char *type, uint32_t ts, const char *user, const char *text, size_t max) {
+    outbuf_t *b = &g_out;
+    OB_LIT(b, "{\"type\":\"");
+    ob_puts(b, type);
+    OB_LIT(b, "\",\"ts\":");
+    ob_putu32(b, ts);
+    if (user) {
+        OB_LIT(b, ",\"user\":");
+        json_put_string(b, user, 32);
+    }
+    OB_LIT(b, ",\"text\":");
+    json_put_string(b, text, max);
+    OB_LIT(b, "}\n");
+}
+
+/* ===================== OUTPUT FORMATTERS ===================== */
+
+/*
+ * Received frames reach the user through one formatter: plain, quiet
+ * (plain without mention highlighting), headless JSON or the TUI. It is
+ * picked once by formatter_select(), so the receive path makes no mode
+ * checks per frame. The plain and JSON formatters append each line to g_out
+ * from literals of known length and hand the batch to stdio in one fwrite();
+ * stdout keeps its default buffering, so other output is not held back. The
+ * TUI formatter queues lines for the renderer, which formats rows from the
+ * current theme's table (see THEMES, switched by ui_set_mode()).
+ */
+typedef struct {
+    /* Show one deduplicated frame; the caller handles a DISCONNECT's
+     * consequences. timebuf is ts as "HH:MM:SS". */
+    void (*frame)(int mt, uint32_t ts, const char *timebuf, const message_t *m);
+    /* A notice from the client itself, such as reconnect progress. */
+    void (*status)(const char *text);
+    /* The end of a batch of frames. */
+    void (*flush)(void);
+} formatter_t;
+
+/* Message text with watch-list mentions rung and highlighted in red. */
+static void ob_put_mentions(outbuf_t *b, const char *text) {
+    mention_span_t spans[64];
+    int n = mention_scan(text, spans, 64);
+    const char *p = text;
+    for (int i = 0; i < n; i++) {
+        const char *match = text + spans[i].start;
+        ob_put(b, p, (size_t)(match - p));
+        OB_LIT(b, "\a" ANSI_RED);
+        ob_put(b, match, spans[i].len);
+        OB_LIT(b, ANSI_RESET);
+        p = match + spans[i].len;
+    }
+    ob_puts(b, p);
+}
+
+/* Plain line output; highlight is a constant in each caller, so the
+ * compiler builds a separate copy for plain and for quiet. */
+static inline void plain_frame_as(int mt, const char *timebuf, const message_t *m, int highlight) {
+    outbuf_t *b = &g_out;
+    // Labelled by server when there are several
+    if (g_session_count > 1 && (mt == MESSAGE_RECV || mt == SYSTEM || mt == DISCONNECT)) {
+        ob_putc(b, '[');
+        ob_puts(b, g_link->name);
+        OB_LIT(b, "] ");
+    }
+    if (mt == MESSAGE_RECV) {
+        OB_LIT(b, "[MSG] [");
+        ob_puts(b, timebuf);
+        OB_LIT(b, "] ");
+        ob_puts(b, m->username);
+        OB_LIT(b, ": ");
+        if (highlight) {
+            ob_put_mentions(b, m->message);
+        } else {
+            ob_puts(b, m->message);
+        }
+        ob_putc(b, '\n');
+    } else if (mt == SYSTEM) {
+        OB_LIT(b, ANSI_DIM "[System] ");
+        ob_puts(b, m->message);
+        OB_LIT(b, ANSI_RESET "\n");
+    } else if (mt == DISCONNECT) {
+        OB_LIT(b, ANSI_RED "[DISCONNECT] ");
+        ob_puts(b, m->message);
+        OB_LIT(b, ANSI_RESET "\n");
+    }
+}
+
+static void plain_frame(int mt, uint32_t ts, const char *timebuf, const message_t *m) {
+    (void)ts;
+    plain_frame_as(mt, timebuf, m, 1);
+}
+
+static void quiet_frame(int mt, uint32_t ts, const char *timebuf, const message_t *m) {
+    (void)ts;
+    plain_frame_as(mt, timebuf, m, 0);
+}
+
+static void plain_status(const char *text) {
+    outbuf_t *b = &g_out;
+    OB_LIT(b, ANSI_DIM "[System] ");
+    ob_puts(b, text);
+    OB_LIT(b, ANSI_RESET "\n");
+    out_flush();
+}
+
+static void json_frame(int mt, uint32_t ts, const char *timebuf, const message_t *m) {
+    (void)timebuf;
+    if (mt == MESSAGE_RECV) {
+        headless_emit("message", ts, m->username, m->message, sizeof(m->message));
+    } else if (mt == SYSTEM) {
+        headless_emit("system", ts, NULL, m->message, sizeof(m->message));
+    } else if (mt == DISCONNECT) {
+        headless_emit("disconnect", ts, NULL, m->message, sizeof(m->message));
+    }
+}
+
+static void json_status(const char *text) {
+    headless_emit("status", (uint32_t)time(NULL), NULL, text, SIZE_MAX);
+    out_flush();
+}
+
+static void tui_frame(int mt, uint32_t ts, const char *timebuf, const message_t *m) {
+    if (mt == MESSAGE_RECV) {
+        tui_post_message(ts, timebuf, m->username, m->message);
+    } else if (mt == SYSTEM) {
+        tui_post_line(timebuf, "UNSC", m->message, SYSTEM);
+    } else if (mt == DISCONNECT) {
+        tui_post_line(timebuf, "DISCONNECT", m->message, DISCONNECT);
+    } else {
+        tui_post_line(timebuf, "System", m->message, mt);
+    }
+}
+
+static void tui_status(const char *text) {
+    tui_post_line("SYSTEM", "UNSC", text, SYSTEM);
+}
+
+static const formatter_t g_fmt_plain = { plain_frame, plain_status, out_flush };
+static const formatter_t g_fmt_quiet = { quiet_frame, plain_status, out_flush };
+static const formatter_t g_fmt_json  = { json_frame, json_status, out_flush };
+static const formatter_t g_fmt_tui   = { tui_frame, tui_status, tui_set_dirty };
+
+static const formatter_t *g_formatter = &g_fmt_plain;
+
+/* Pick the formatter for the output mode; called once the options are parsed. */
+static void formatter_select(void) {
+    if (settings.headless) {
+        g_formatter = &g_fmt_json;
+    } else if (g_tui_enabled) {
+        g_formatter = &g_fmt_tui;
+    } else {
+        g_formatter = settings.quiet ? &g_fmt_quiet : &g_fmt_plain;
+    }
+}
+
+static void ui_set_mode(ui_mode_t mode) {
+    g_ui_mode = mode;
+    g_theme = &g_themes[mode];
+}
+
+/* ===================== INBOUND MESSAGES ===================== */
+
+/*
+ * Duplicate suppression. Every displayed MESSAGE_RECV's hash goes into a
+ * small open-addressing set (linear probing, backward-shift deletion) that
+ * remembers the last DEDUPE_RECENT of them, so a history replay after a
+ * reconnect is dropped wherever it overlaps what is already on screen.
+ */
+#define DEDUPE_RECENT 512
+#define DEDUPE_SLOTS  1024     /* power of two, 2x DEDUPE_RECENT */
+
+typedef struct {
+    uint64_t slots[DEDUPE_SLOTS];   /* 0 = empty */
+    uint64_t order[DEDUPE_RECENT];  /* FIFO of inserted hashes */
+    int next;
+    int count;
+} seen_set_t;
+
+/* The current session's. Replayed history is cut at the link's resume_ts
+ * first; timestamps only have second resolution, so only messages from the
+ * cut-off second itself can still repeat what is on screen, and only those
+ * are dropped on a hash hit. Two identical lines from that one second count
+ * as one; anywhere else they are shown twice, as sent. */
+static seen_set_t *g_seen;
+
+static uint64_t frame_hash(const message_t *m) {
+    uint64_t h = 1469598103934665603ull;
+    const unsigned char *p = (const unsigned char *)m;
+    for (size_t i = 0; i < offsetof(message_t, username); i++) h = (h ^ p[i]) * 1099511628211ull;
+    for (size_t i = 0; i < sizeof(m->username) && m->username[i]; i++) h = (h ^ (unsigned char)m->username[i]) * 1099511628211ull;
+    h = (h ^ 0xffu) * 1099511628211ull;
+    for (size_t i = 0; i < sizeof(m->message) && m->message[i]; i++) h = (h ^ (unsigned char)m->message[i]) * 1099511628211ull;
+    return h ? h : 1;
+}
+
+static void seen_remove(uint64_t h) {
+    size_t mask = DEDUPE_SLOTS - 1;
+    size_t i = (size_t)h & mask;
+    while (g_seen->slots[i] != h) {
+        if (g_seen->slots[i] == 0) return;
+        i = (i + 1) & mask;
+    }
+    for (size_t j = (i + 1) & mask; g_seen->slots[j]; j = (j + 1) & mask) {
+        size_t home = (size_t)g_seen->slots[j] & mask;
+        // Entries whose home lies cyclically in (i, j] can stay put
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+        g_seen->slots[i] = g_seen->slots[j];
+        i = j;
+    }
+    g_seen->slots[i] = 0;
+}
+
+/* Returns 1 if h was already seen, otherwise remembers it and returns 0. */
+static int seen_check_insert(uint64_t h) {
+    size_t mask = DEDUPE_SLOTS - 1;
+    size_t i = (size_t)h & mask;
+    while (g_seen->slots[i]) {
+        if (g_seen->slots[i] == h) return 1;
+        i = (i + 1) & mask;
+    }
+    g_seen->slots[i] = h;
+    if (g_seen->count == DEDUPE_RECENT) {
+        seen_remove(g_seen->order[g_seen->next]);
+    } else {
+        g_seen->count++;
+    }
+    g_seen->order[g_seen->next] = h;
+    g_seen->next = (g_seen->next + 1) % DEDUPE_RECENT;
+    return 0;
+}
+
+static void show_connect_hint(void) {
+    if (settings.headless) return;
+    if (g_tui_enabled) {
+        tui_post_line("SYSTEM", "CORTANA", "Type '!help' for available commands", SYSTEM);
+    } else {
+        printf("Type '!disconnect' to disconnect\n");
+        fflush(stdout);
+    }
+}
+
+/* Hand a batch of handled frames to the display in one step. */
+static void flush_inbound_batch(void) {
+    g_formatter->flush();
+}
+
+/* Report a failed read: r == 0 means the server closed the socket. */
+static void report_read_failure(ssize_t r) {
+    if (r == 0) {
+        if (g_tui_enabled) {
+            tui_post_line("SYSTEM", "UNSC", "Server has disconnected", SYSTEM);
+        } else if (settings.headless) {
+            // Not when it is our own shutdown closing the socket
+            if (settings.running) headless_emit("status", (uint32_t)time(NULL), NULL, "Server has disconnected", SIZE_MAX);
+        } else {
+            printf("Server has disconnected\n");
+            fflush(stdout);
+        }
+    } else {
+        if (g_tui_enabled) {
+            tui_post_line("SYSTEM", "ERROR", "Could not read from server", SYSTEM);
+        } else {
+            fprintf(stderr, "Could not read from server\n");
+        }
+    }
+}
+
+/* Refill the scrollback with the newest stored messages and treat them as
+ * already seen, so the server's history replay only adds what is new. */
+static void store_restore(void) {
+    size_t n = g_store.count < (size_t)g_sb->cap ? g_store.count : (size_t)g_sb->cap;
+    g_store.floor = g_store.count - n;
+    for (size_t i = g_store.floor; i < g_store.count; i++) {
+        store_rec_t h;
+        const char *body = store_record(i, &h);
+        if (!body) continue;
+        line_rec_t L;
+        if (line_rec_make(&L, h.ts, body, body + h.user_off, body + h.text_off, h.kind) != 0) continue;
+        sb_add(&L, (long)i, (long)i);
+        
+        message_t m = {0};
+        m.m_type = htonl(h.kind);
+        m.timeStamp = htonl(h.ts);
+        snprintf(m.username, sizeof(m.username), "%s", body + h.user_off);
+        snprintf(m.message, sizeof(m.message), "%s", body + h.text_off);
+        seen_check_insert(frame_hash(&m));
+        if (h.ts > g_link->last_seen_ts) g_link->last_seen_ts = h.ts;
+    }
+    g_link->resume_ts = g_link->last_seen_ts;
+}
+
+/* DISCONNECT reasons the server would only give again on a retry: the
+ * username is rejected or taken, or we broke a rule. */
+static const char *const g_final_disconnects[] = {
+    "Username ",
+    "First message must be LOGIN",
+    "Too many messages at once",
+    "User asked to be disconnected",
+};
+
+static bool disconnect_is_final(const char *reason) {
+    for (size_t i = 0; i < sizeof(g_final_disconnects) / sizeof(g_final_disconnects[0]); i++) {
+        if (strncmp(reason, g_final_disconnects[i], strlen(g_final_disconnects[i])) == 0) return true;
+    }
+    return false;
+}
+
+/* Deduplicate, format and display one decoded frame.
+ * Returns 0 once the server has disconnected us, 1 otherwise. */
+static int handle_frame(const message_t *m) {
+    int mt = (int)ntohl(m->m_type);
+    uint32_t ts = ntohl(m->timeStamp);
+    stats_frame(mt);
+    if (mt == MESSAGE_RECV) {
+        if (ts < g_link->resume_ts) return 1;
+        if (ts > g_link->last_seen_ts) g_link->last_seen_ts = ts;
+        if (seen_check_insert(frame_hash(m)) && ts == g_link->resume_ts) return 1;
+        g_link->received++;
+    }
+    char timebuf[16];
+    format_hms((time_t)ts, timebuf);
+    
+    g_formatter->frame(mt, ts, timebuf, m);
+    if (mt == DISCONNECT) {
+        if (settings.reconnect && disconnect_is_final(m->message)) {
+            g_formatter->status("Not reconnecting: the server would refuse us again");
+            connection_end();
+        } else {
+            connection_lost();
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* ===================== RECONNECT ===================== */
+
+/*
+ * --reconnect: after a drop the client retries with exponential backoff,
+ * half of each step fixed and half random, so a fleet of clients spreads
+ * its reconnects out after a server restart instead of arriving together.
+ * The backoff only resets once a connection has stayed up for a while, so a
+ * server that accepts and immediately drops us is not hammered either.
+ * Each attempt gets the same --connect-timeout as the first connection.
+ */
+#define RECONNECT_BASE_MS    500
+#define RECONNECT_MAX_MS     30000
+#define RECONNECT_STABLE_MS  10000
+
+static void post_link_status(const char *text) {
+    g_formatter->status(text);
+}
+
+/* Pick the wait before the next attempt and announce it. */
+static int reconnect_delay_ms(void) {
+    if (g_link->since_us && mono_us() - g_link->since_us >= RECONNECT_STABLE_MS * 1000u) {
+        g_link->reconnect_attempt = 0;
+    }
+    g_link->since_us = 0;
+    
+    int step = RECONNECT_MAX_MS;
+    if (g_link->reconnect_attempt < 6 && (RECONNECT_BASE_MS << g_link->reconnect_attempt) < RECONNECT_MAX_MS) {
+        step = RECONNECT_BASE_MS << g_link->reconnect_attempt;
+    }
+    g_link->reconnect_attempt++;
+    int delay = step / 2 + rand() % (step / 2 + 1);
+    
+    char note[96];
+    snprintf(note, sizeof(note), "Connection lost - reconnecting in %d.%ds (attempt %d)",
+             delay / 1000, (delay % 1000) / 100, g_link->reconnect_attempt);
+    post_link_status(note);
+    return delay;
+}
+
+/* Take over g_link->socket_fd with the freshly connected fd and log in
+ * again; the server's reply is the negotiation's to read. Returns 0 on
+ * success. */
+static int reconnect_adopt(int fd) {
+    pthread_mutex_lock(&g_link->lock);
+    int ok = settings.running && g_link->socket_fd >= 0 && dup2(fd, g_link->socket_fd) >= 0;
+    if (ok) sendq_rewind_locked();
+    pthread_mutex_unlock(&g_link->lock);
+    close(fd);
+    if (!ok || send_login(g_link->socket_fd) != 0) return -1;
+    reader_reset(g_reader);
+    g_link->deflate = 0;
+    return 0;
+}
+
+/* Bring the link back up once the protocol is settled; dropped is what
+ * link_set_proto() returned. History the server replays is cut at the
+ * newest message already shown. */
+static void reconnect_done(int dropped) {
+    if (dropped) {
+        char note[96];
+        snprintf(note, sizeof(note), "%d queued message(s) dropped, too large for the new protocol", dropped);
+        post_link_status(note);
+    }
+    g_link->resume_ts = g_link->last_seen_ts;
+    g_link->since_us = mono_us();
+    atomic_fetch_add(&g_link->epoch, 1);
+    atomic_store(&g_link->up, 1);
+    post_link_status("Reconnected");
+}
+
+/* One blocking attempt for the receive thread: connect, log in again and
+ * renegotiate. Returns 0 once the link is back up. */
+static int reconnect_attempt(void) {
+    int fd = net_connect(settings.connect_timeout_ms);
+    if (fd < 0 || reconnect_adopt(fd) != 0) return -1;
+    reconnect_done(negotiate_protocol());
+    return 0;
+}
+
+/* Retry until the link is back (0) or the client is shutting down (-1). */
+static int reconnect_blocking(void) {
+    while (settings.running) {
+        uint64_t until = mono_us() + (uint64_t)reconnect_delay_ms() * 1000u;
+        while (mono_us() < until) {
+            if (link_wait() != 0) return -1;
+        }
+        if (reconnect_attempt() == 0) return 0;
+    }
+    return -1;
+}
+
+/* ===================== RECEIVE THREAD ===================== */
+
+/* Handle every complete frame buffered in the reader.
+ * Returns 0 once the connection is finished (DISCONNECT or bad frame). */
+static int drain_reader(void) {
+    message_t msg;
+    int r;
+    uint64_t t0 = stats_begin();
+    while ((r = reader_next(g_reader, &msg)) > 0) {
+        if (!handle_frame(&msg)) {
+            stats_end(ST_RX, t0);
+            return 0;
+        }
+    }
+    stats_end(ST_RX, t0);
+    if (r < 0) {
+        report_read_failure(-1);
+        connection_lost();
+        return 0;
+    }
+    return 1;
+}
+
+/* Read and display frames until the current connection ends. */
+static void receive_session(void) {
+    // Frames that arrived along with the protocol acknowledgement
+    int more = drain_reader();
+    flush_inbound_batch();
+    
+    while(more && settings.running && atomic_load(&g_link->up)){
+        ssize_t r = reader_fill(g_reader, g_link->socket_fd);
+        if(r < 0 && errno == EINTR){
+            continue;
+        }
+        if(r <= 0){
+            report_read_failure(r);
+            flush_inbound_batch();
+            connection_lost();
+            break;
+        }
+        more = drain_reader();
+        flush_inbound_batch();
+    }
+}
+
+void* receive_messages_thread(void* arg) {
+    (void)arg;
+    
+    show_connect_hint();
+    do {
+        receive_session();
+    } while (settings.running && settings.reconnect && !g_link->closed && reconnect_blocking() == 0);
+    return NULL;
+}
+
+/* ===================== SESSIONS ===================== */
+
+/*
+ * A session is one server connection with everything that belongs to it:
+ * the link, reader, send queue, pacer, duplicate filter, scrollback and
+ * search state. The code above works on "the current session" through the
+ * g_link/g_reader/g_sendq/... pointers; session_enter() points them at a
+ * session. The threaded engines only ever have one session. With several
+ * (--server, given more than once) the single-threaded event loop enters
+ * each session before touching it and returns to the one on screen
+ * (g_view) afterwards, so nothing else needs to know there are several.
+ * A session costs its calloc() and nothing else: no thread, no terminal.
+ */
+typedef struct {
+    link_t         link;
+    frame_reader_t reader;
+    send_queue_t   sendq;
+    pacer_t        pacer;
+    seen_set_t     seen;
+    scrollback_t   sb;
+    search_index_t index;
+    search_view_t  search;
+    unsigned long  read_mark;   /* link.received when last on screen */
+    uint64_t       retry_at;    /* event loop: next reconnect attempt, 0 = none */
+    connect_job_t *connecting;  /* event loop: the attempt's connect, in flight */
+    uint64_t       negotiate_until; /* event loop: awaiting the LOGIN reply until then */
+    int            want_out;    /* event loop: EPOLLOUT requested */
+    int            watched;     /* event loop: socket is in the epoll set */
+} session_t;
+
+static session_t *g_sessions[SESSIONS_MAX];
+static int g_view = 0;
+
+static void session_enter(session_t *s) {
+    g_link = &s->link;
+    g_reader = &s->reader;
+    g_sendq = &s->sendq;
+    g_pacer = &s->pacer;
+    g_seen = &s->seen;
+    g_sb = &s->sb;
+    g_index = &s->index;
+    g_search = &s->search;
+}
+
+static void session_enter_view(void) {
+    session_enter(g_sessions[g_view]);
+}
+
+/* Add a session for host:port and enter it. Returns NULL when out of memory
+ * or when SESSIONS_MAX sessions exist. */
+static session_t *session_new(const char *host, int port) {
+    if (g_session_count == SESSIONS_MAX) return NULL;
+    session_t *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    snprintf(s->link.host, sizeof(s->link.host), "%s", host);
+    s->link.port = port;
+    snprintf(s->link.name, sizeof(s->link.name), strchr(host, ':') ? "[%.48s]:%d" : "%.48s:%d", host, port);
+    s->link.socket_fd = -1;
+    atomic_init(&s->link.up, 1);
+    pthread_mutex_init(&s->link.lock, NULL);
+    session_enter(s);
+    if (sb_init(g_scrollback_cap) != 0) {
+        free(s);
+        return NULL;
+    }
+    g_sessions[g_session_count++] = s;
+    return s;
+}
+
+/* Put session i on screen; whatever it received so far counts as read. */
+static void session_view(int i) {
+    if (i < 0 || i >= g_session_count || i == g_view) return;
+    session_t *old = g_sessions[g_view];
+    old->read_mark = old->link.received;
+    g_view = i;
+    session_enter_view();
+    g_sessions[i]->read_mark = g_sessions[i]->link.received;
+    if (g_tui_enabled) {
+        tui_set_dirty();
+    } else {
+        printf("%s[System] Now sending to %s%s\n", COLOR_GRAY, g_link->name, COLOR_RESET);
+        fflush(stdout);
+    }
+}
+
+/* The header's tab strip: "1:host:port (unread)" per session, the one on
+ * screen in reverse video. Returns the columns used, at most max_cols. */
+static int session_tabs(outbuf_t *b, int max_cols) {
+    int used = 0;
+    for (int i = 0; i < g_session_count && used < max_cols; i++) {
+        session_t *s = g_sessions[i];
+        unsigned long unread = s->link.received - s->read_mark;
+        char tab[96];
+        int n;
+        if (s->link.closed) {
+            n = snprintf(tab, sizeof(tab), " %d:%s (closed) ", i + 1, s->link.name);
+        } else if (i != g_view && unread) {
+            n = snprintf(tab, sizeof(tab), " %d:%s (%lu) ", i + 1, s->link.name, unread);
+        } else {
+            n = snprintf(tab, sizeof(tab), " %d:%s ", i + 1, s->link.name);
+        }
+        if (n >= (int)sizeof(tab)) n = (int)sizeof(tab) - 1;
+        if (n > max_cols - used) n = max_cols - used;
+        if (i == g_view) ob_puts(b, "\033[7m");
+        ob_put(b, tab, (size_t)n);
+        if (i == g_view) ob_puts(b, "\033[27m");
+        used += n;
+    }
+    return used;
+}
+
+/* ===================== INPUT HELPERS ===================== */
+
+static int is_ascii_printable_strict(const char *s) {
+    for (size_t i = 0; s[i]; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == 27) return 0;
+        if (c < 32 || c > 126) return 0;
+    }
+    return 1;
+}
+
+static int is_local_command(const char *s) {
+    return (strcmp(s, "!disconnect") == 0) ||
+           (strcmp(s, "!disconect") == 0) ||
+           (strcmp(s, "!gravemind") == 0) ||
+           (strcmp(s, "!spartan") == 0) ||
+           (strcmp(s, "!help") == 0) ||
+           (strncmp(s, "!search", 7) == 0 && (s[7] == 0 || s[7] == ' ')) ||
+           (strncmp(s, "!stats", 6) == 0 && (s[6] == 0 || s[6] == ' ')) ||
+           (strncmp(s, "!tab", 4) == 0 && (s[4] == 0 || s[4] == ' '));
+}
+
+/* !search: query the index and open the results pane. */
+static void search_command(const char *args) {
+    while (*args == ' ') args++;
+    if (!g_tui_enabled) {
+        printf("Error: !search is only available in TUI mode\n");
+        fflush(stdout);
+        return;
+    }
+    
+    search_query_t q;
+    char err[128];
+    tui_lock();
+    index_catch_up();
+    int rc = search_parse(args, &q, err, sizeof(err));
+    uint64_t t0 = mono_us();
+    int n = rc == 0 ? search_run(&q, g_search->docs, SEARCH_MAX_RESULTS) : 0;
+    g_search->took_us = mono_us() - t0;
+    pthread_mutex_unlock(&g_tui_lock);
+    
+    // Feedback lines land at the bottom, so make sure they are in view
+    if (rc != 0) {
+        g_sb->scroll = 0;
+        tui_add_line("SYSTEM", "SEARCH", err, SYSTEM);
+        return;
+    }
+    if (n == 0) {
+        g_sb->scroll = 0;
+        char note[192];
+        snprintf(note, sizeof(note), "No messages match \"%.128s\"", args);
+        g_search->open = 0;
+        tui_add_line("SYSTEM", "SEARCH", note, SYSTEM);
+        return;
+    }
+    snprintf(g_search->query, sizeof(g_search->query), "%s", args);
+    g_search->count = n;
+    g_search->sel = 0;
+    g_search->open = 1;
+    tui_set_dirty();
+}
+
+/* Close the results pane, scrolling the selected message to mid-screen. */
+static void search_jump(void) {
+    int cols, rows;
+    tui_get_size(&cols, &rows);
+    int msg_h = tui_pane_rows(rows);
+    
+    tui_lock();
+    int pos = index_doc_position(g_search->docs[g_search->sel]);
+    if (pos >= 0) {
+        int64_t scroll = (int64_t)vl_rows_total() - msg_h - ((int64_t)vl_rows_before(pos) - msg_h / 2);
+        g_sb->scroll = scroll > 0 ? (int)scroll : 0;
+    }
+    pthread_mutex_unlock(&g_tui_lock);
+    g_search->open = 0;
+    tui_set_dirty();
+}
+
+static void stats_emit_local(const char *line, void *ctx) {
+    (void)ctx;
+    if (g_tui_enabled) {
+        tui_add_line("SYSTEM", "STATS", line, SYSTEM);
+    } else {
+        printf("[STATS] %s\n", line);
+    }
+}
+
+/* !stats [on|off|reset|overlay]: print the report, or control collection. */
+static void stats_command(const char *args) {
+    while (*args == ' ') args++;
+    const char *note = NULL;
+    if (strcmp(args, "on") == 0) {
+        stats_set_enabled(1);
+        note = "collection on";
+    } else if (strcmp(args, "off") == 0) {
+        stats_set_enabled(0);
+        note = "collection off";
+    } else if (strcmp(args, "reset") == 0) {
+        stats_reset();
+        note = "counters reset";
+    } else if (strcmp(args, "overlay") == 0) {
+        if (!g_tui_enabled) {
+            note = "the overlay is only available in TUI mode";
+        } else {
+            g_stats_overlay = !g_stats_overlay;
+            if (g_stats_overlay) stats_set_enabled(1);
+            note = g_stats_overlay ? "overlay on" : "overlay off";
+        }
+    } else if (*args) {
+        note = "usage: !stats [on|off|reset|overlay]";
+    } else if (!stats_enabled()) {
+        stats_set_enabled(1);
+        note = "collection was off, now on; run !stats again for numbers";
+    } else {
+        stats_report(stats_emit_local, NULL);
+    }
+    if (note) stats_emit_local(note, NULL);
+    if (g_tui_enabled) {
+        g_sb->scroll = 0;
+    } else {
+        fflush(stdout);
+    }
+}
+
+static void tab_note(const char *line) {
+    if (g_tui_enabled) {
+        tui_add_line("SYSTEM", "TABS", line, SYSTEM);
+    } else {
+        printf("%s[System] %s%s\n", COLOR_GRAY, line, COLOR_RESET);
+        fflush(stdout);
+    }
+}
+
+/* !tab [N]: switch to session N, or list the sessions. */
+static void tab_command(const char *args) {
+    while (*args == ' ') args++;
+    if (*args) {
+        char *end;
+        long n = strtol(args, &end, 10);
+        if (*end != 0 || n < 1 || n > g_session_count) {
+            tab_note("usage: !tab [N], N being one of the sessions !tab lists");
+            return;
+        }
+        session_view((int)n - 1);
+        return;
+    }
+    for (int i = 0; i < g_session_count; i++) {
+        session_t *t = g_sessions[i];
+        char line[128];
+        snprintf(line, sizeof(line), "%c%d: %s%s, %lu unread", i == g_view ? '*' : ' ', i + 1, t->link.name,
+                 t->link.closed ? " (closed)" : atomic_load(&t->link.up) ? "" : " (reconnecting)",
+                 i == g_view ? 0ul : t->link.received - t->read_mark);
+        tab_note(line);
+    }
+}
+
+static void run_local_command(const char *s) {
+    if (strcmp(s, "!help") == 0) {
+        if (g_tui_enabled) {
+            tui_add_line("SYSTEM", "HELP", "Commands: !help !search !stats !tab !gravemind !spartan !disconnect", SYSTEM);
+            tui_add_line("SYSTEM", "HELP", "!search words [from:USER] [after:TIME] [before:TIME], TIME = YYYY-MM-DD, HH:MM or 30m/2h/7d", SYSTEM);
+            tui_add_line("SYSTEM", "HELP", "!stats [on|off|reset|overlay] shows client timings and counters", SYSTEM);
+            tui_add_line("SYSTEM", "HELP", "!tab [N] lists the servers or switches to one; also Tab, Shift-Tab and Alt-1..9", SYSTEM);
+        } else {
+            printf("Commands: !help !stats !tab !gravemind !spartan !disconnect\n");
+            fflush(stdout);
+        }
+        return;
+    }
+    if (strcmp(s, "!gravemind") == 0) {
+        ui_set_mode(UI_GRAVEMIND);
+        if (g_tui_enabled) {
+            tui_add_line("SYSTEM", "GRAVEMIND", "Switching to Gravemind interface...", SYSTEM);
+        }
+        tui_set_dirty();
+        return;
+    }
+    if (strcmp(s, "!spartan") == 0) {
+        ui_set_mode(UI_SPARTAN);
+        if (g_tui_enabled) {
+            tui_add_line("SYSTEM", "UNSC", "Switching to Spartan interface...", SYSTEM);
+        }
+        tui_set_dirty();
+        return;
+    }
+    if (strncmp(s, "!search", 7) == 0) {
+        search_command(s + 7);
+        return;
+    }
+    if (strncmp(s, "!stats", 6) == 0) {
+        stats_command(s + 6);
+        return;
+    }
+    if (strncmp(s, "!tab", 4) == 0) {
+        tab_command(s + 4);
+        return;
+    }
+    if (strcmp(s, "!disconnect") == 0 || strcmp(s, "!disconect") == 0) {
+        settings.running = 0;
+        return;
+    }
+}
+
+/* ===================== TUI INPUT HANDLING ===================== */
+
+static void tui_input_clear(void) {
+    g_input[0] = 0;
+    g_input_len = 0;
+}
+
+static void tui_input_set(const char *s) {
+    strncpy(g_input, s ? s : "", sizeof(g_input)-1);
+    g_input[sizeof(g_input)-1] = 0;
+    g_input_len = (int)strlen(g_input);
+}
+
+static int tui_try_read_byte(unsigned char *outc, int timeout_ms) {
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(STDIN_FILENO, &set);
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    int r = select(STDIN_FILENO+1, &set, NULL, NULL, &tv);
+    if (r <= 0) return 0;
+    ssize_t n = read(STDIN_FILENO, outc, 1);
+    return (n == 1) ? 1 : 0;
+}
+
+static void tui_start_session(void) {
+    // Add initial boot messages
+    if (g_ui_mode == UI_GRAVEMIND) {
+        gravemind_boot_lines();
+    } else {
+        spartan_boot_lines();
+    }
+    tui_add_line("SYSTEM", "SYSTEM", "Connected to server", SYSTEM);
+    tui_set_dirty();
+}
+
+static int stdin_ready(void) {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Wait for one stdin byte or a wakeup, flushing the send queue whenever
+ * the socket becomes writable. Returns 1 if a byte was read. */
+static int tui_wait_input(unsigned char *outc, int timeout_ms) {
+    struct pollfd pfd[3] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = g_wake_fd[0], .events = POLLIN },
+        { .fd = sendq_pending() && atomic_load(&g_link->up) ? g_link->socket_fd : -1, .events = POLLOUT },
+    };
+    int r = poll(pfd, 3, timeout_ms);
+    if (r <= 0) return 0;
+    if (g_wake_fd[0] >= 0 && (pfd[1].revents & POLLIN)) {
+        char drain[64];
+        while (read(g_wake_fd[0], drain, sizeof(drain)) > 0) {}
+    }
+    if (pfd[2].revents & (POLLOUT | POLLERR | POLLHUP)) {
+        if (sendq_flush(g_link->socket_fd) < 0) {
+            tui_add_line("SYSTEM", "ERROR", "Write error - connection lost", SYSTEM);
+            connection_lost();
+        }
+        tui_set_dirty();
+    }
+    if (!(pfd[0].revents & POLLIN)) return 0;
+    return read(STDIN_FILENO, outc, 1) == 1;
+}
+
+static void handle_start_menu_byte(unsigned char c) {
+    if (c == 27) { // ESC - switch mode
+        ui_set_mode(g_ui_mode == UI_GRAVEMIND ? UI_SPARTAN : UI_GRAVEMIND);
+        draw_start_menu();
+    }
+    else if (c == '\n' || c == '\r') { // ENTER - proceed
+        g_show_start_menu = 0;
+        tui_set_dirty();
+    }
+    else if (c == 'q' || c == 'Q') { // Q - quit
+        settings.running = 0;
+    }
+}
+
+static void handle_start_menu_input(void) {
+    while (g_show_start_menu && settings.running) {
+        unsigned char c = 0;
+        if (!tui_try_read_byte(&c, 100)) {
+            continue;
+        }
+        handle_start_menu_byte(c);
+    }
+    inbound_drain();
+}
+
+static int g_hist_idx = 0;
+
+/* Let the pacer release held messages from the TUI loops. */
+static void tui_release_paced(void) {
+    int r = pacer_release(g_link->socket_fd);
+    if (r < 0) {
+        tui_add_line("SYSTEM", "ERROR", "Write error - connection lost", SYSTEM);
+        connection_lost();
+    } else if (r > 0) {
+        tui_set_dirty();
+    }
+}
+
+static void tui_handle_byte(unsigned char c) {
+    // ENTER
+    if (c == '\n' || c == '\r') {
+        g_input[g_input_len] = 0;
+        if (g_input_len == 0) {
+            if (g_search->open) search_jump();
+            tui_set_dirty();
+            return;
+        }
+        
+        if (is_local_command(g_input)) {
+            run_local_command(g_input);
+            tui_input_clear();
+            g_hist_idx = g_send_hist_len;
+            tui_set_dirty();
+            return;
+        }
+        
+        int flag = 0;
+        if (g_input_len > 1023) {
+            tui_add_line("SYSTEM", "ERROR", "Message is too long to send", SYSTEM);
+            flag = 1;
+        }
+        if (!is_ascii_printable_strict(g_input)) {
+            tui_add_line("SYSTEM", "ERROR", "Cannot send non-ASCII characters", SYSTEM);
+            flag = 1;
+        }
+        
+        if (g_link->closed) {
+            tui_add_line("SYSTEM", "ERROR", "Not connected to this server any more", SYSTEM);
+            flag = 1;
+        }
+        
+        if (!flag) {
+            message_t send = {0};
+            send.m_type = htonl(MESSAGE_SENT);
+            strncpy(send.message, g_input, sizeof(send.message));
+            send.message[sizeof(send.message)-1] = 0;
+            
+            int r = pacer_submit(g_link->socket_fd, &send);
+            if (r == -1) {
+                tui_add_line("SYSTEM", "ERROR", "Send queue full - message not sent", SYSTEM);
+            } else {
+                tui_hist_push(g_input);
+                g_hist_idx = g_send_hist_len;
+                if (r < 0) {
+                    tui_add_line("SYSTEM", "ERROR", "Write error - connection lost", SYSTEM);
+                    connection_lost();
+                }
+            }
+        }
+        
+        tui_input_clear();
+        tui_set_dirty();
+        return;
+    }
+    
+    // TAB: next session
+    if (c == '\t') {
+        session_view((g_view + 1) % g_session_count);
+        return;
+    }
+    
+    // BACKSPACE
+    if (c == 127 || c == 8) {
+        if (g_input_len > 0) {
+            g_input[--g_input_len] = 0;
+            tui_set_dirty();
+        }
+        return;
+    }
+    
+    // ESC sequences
+    if (c == 27) {
+        unsigned char s1 = 0, s2 = 0;
+        if (!tui_try_read_byte(&s1, 10)) {
+            // A lone ESC closes the search results
+            if (g_search->open) {
+                g_search->open = 0;
+                tui_set_dirty();
+            }
+            return;
+        }
+        if (s1 >= '1' && s1 <= '9') { // Alt-N: session N
+            session_view(s1 - '1');
+            return;
+        }
+        if (!tui_try_read_byte(&s2, 10)) return;
+        
+        if (s1 == '[') {
+            if (s2 == 'Z') { // Shift-Tab: previous session
+                session_view((g_view + g_session_count - 1) % g_session_count);
+            } else if (s2 == 'A' && g_search->open && g_input_len == 0) {
+                if (g_search->sel > 0) g_search->sel--;
+                tui_set_dirty();
+            } else if (s2 == 'B' && g_search->open && g_input_len == 0) {
+                if (g_search->sel + 1 < g_search->count) g_search->sel++;
+                tui_set_dirty();
+            } else if (s2 == 'A') { // UP
+                if (g_input_len == 0) {
+                    g_sb->scroll += 1;
+                    tui_set_dirty();
+                } else {
+                    if (g_send_hist_len > 0 && g_hist_idx > 0) g_hist_idx--;
+                    if (g_hist_idx >= 0 && g_hist_idx < g_send_hist_len) {
+                        tui_input_set(g_send_hist[g_hist_idx]);
+                        tui_set_dirty();
+                    }
+                }
+            } else if (s2 == 'B') { // DOWN
+                if (g_input_len == 0) {
+                    if (g_sb->scroll > 0) g_sb->scroll -= 1;
+                    tui_set_dirty();
+                } else {
+                    if (g_hist_idx < g_send_hist_len) g_hist_idx++;
+                    if (g_hist_idx == g_send_hist_len) {
+                        tui_input_clear();
+                    } else if (g_hist_idx >= 0 && g_hist_idx < g_send_hist_len) {
+                        tui_input_set(g_send_hist[g_hist_idx]);
+                    }
+                    tui_set_dirty();
+                }
+            }
+        }
+        return;
+    }
+    
+    // Printable ASCII
+    if (c >= 32 && c <= 126) {
+        if (g_input_len < (int)sizeof(g_input)-1) {
+            g_input[g_input_len++] = (char)c;
+            g_input[g_input_len] = 0;
+            tui_set_dirty();
+        }
+        return;
+    }
+}
+
+static void tui_begin(void) {
+    tui_raw_enable();
+    
+    // Force immediate redraw of start menu
+    draw_start_menu();
+    g_tui_dirty = 1;
+}
+
+static void tui_loop_send(void) {
+    tui_begin();
+    
+    // Show start menu first
+    if (g_tui_enabled) {
+        handle_start_menu_input();
+        if (!settings.running) return;
+        tui_start_session();
+    }
+    
+    g_hist_idx = g_send_hist_len;
+    
+    while (settings.running) {
+        if (inbound_drain() > 0) g_tui_dirty = 1;
+        if (pacer_pending()) tui_release_paced();
+        int wait_ms = tui_schedule_render(0);
+        if (wait_ms < 0) wait_ms = TUI_IDLE_WAIT_MS;
+        int due = pacer_next_due_ms();
+        if (due >= 0 && due < wait_ms) wait_ms = due;
+        
+        unsigned char c = 0;
+        if (!tui_wait_input(&c, wait_ms)) {
+            continue;
+        }
+        tui_handle_byte(c);
+        if (!stdin_ready()) {
+            inbound_drain();
+            tui_schedule_render(1);
+        }
+    }
+}
+
+/* ===================== PLAIN INPUT HANDLING ===================== */
+
+/* Validate and send one line of plain-mode input.
+ * Returns 0 when the client should stop. */
+static int plain_send_line(char *line) {
+    line[strcspn(line, "\n")] = 0;
+    
+    if (is_local_command(line)) {
+        run_local_command(line);
+        return settings.running;
+    }
+    
+    message_t send = {0};
+    send.m_type = htonl(MESSAGE_SENT);
+    strncpy(send.message, line, sizeof(send.message) - 1);
+    send.message[sizeof(send.message) - 1] = 0;
+    
+    int flag = 0;
+    if (!is_ascii_printable_strict(send.message)) {
+        fprintf(stderr, "Error: Cannot send non-ASCII characters\n");
+        flag = 1;
+    }
+    if (strlen(send.message) > 1023) {
+        fprintf(stderr, "Error: Message too long\n");
+        flag = 1;
+    }
+    if (strlen(send.message) == 0) {
+        fprintf(stderr, "Error: Message too short\n");
+        flag = 1;
+    }
+    if (!flag && g_link->closed) {
+        fprintf(stderr, "Error: Not connected to %s any more\n", g_link->name);
+        flag = 1;
+    }
+    
+    if (!flag) {
+        int r = pacer_submit(g_link->socket_fd, &send);
+        if (r == -1) {
+            fprintf(stderr, "Error: Send queue full, message not sent\n");
+        } else if (r < 0) {
+            fprintf(stderr, "Write error: %s\n", strerror(errno));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* ===================== HEADLESS INPUT HANDLING ===================== */
+
+/*
+ * --headless reads stdin in HEADLESS_READ_SIZE blocks and validates all the
+ * complete lines of a block in one pass. Lines go to the pacer as fast as it
+ * accepts them; stdin is only read again while the pacer has room, so a
+ * burst waits in the pipe instead of being dropped, and no line blocks on
+ * its own write. Every line is message text (there are no local commands);
+ * invalid lines are reported on stderr and skipped.
+ */
+#define HEADLESS_READ_SIZE (64 * 1024)
+#define HEADLESS_IDLE_MS   200      /* longest wait before re-checking the link */
+
+static char g_hl_buf[HEADLESS_READ_SIZE];
+static size_t g_hl_len = 0;
+static unsigned long g_hl_lineno = 0;
+static int g_hl_skip = 0;           /* discarding the rest of an over-long line */
+static message_t g_hl_msg;
+static size_t g_hl_prev = 0;        /* text length last copied into g_hl_msg */
+
+static int headless_printable(const char *s, size_t n) {
+    unsigned bad = 0;
+    for (size_t i = 0; i < n; i++) bad |= (unsigned)((unsigned char)s[i] - 32u) > 94u;
+    return !bad;
+}
+
+static void headless_reject(const char *why) {
+    fprintf(stderr, "Error: input line %lu: %s\n", g_hl_lineno, why);
+}
+
+/* Pace one validated line. Returns -1 if the connection failed. */
+static int headless_submit(const char *text, size_t n) {
+    // Legacy frames carry the whole buffer, so clear what the last line left
+    memcpy(g_hl_msg.message, text, n);
+    if (g_hl_prev > n) memset(g_hl_msg.message + n, 0, g_hl_prev - n);
+    g_hl_prev = n;
+    return pacer_submit(g_link->socket_fd, &g_hl_msg) < -1 ? -1 : 0;
+}
+
+/* Submit buffered lines while the pacer has room and keep the unconsumed
+ * tail. At EOF an unterminated last line counts as complete.
+ * Returns -1 if the connection failed. */
+static int headless_consume(int eof) {
+    size_t pos = 0;
+    int rc = 0;
+    while (pos < g_hl_len && pacer_pending() < PACER_QUEUE_MAX) {
+        const char *line = g_hl_buf + pos;
+        size_t avail = g_hl_len - pos;
+        const char *nl = memchr(line, '\n', avail);
+        size_t n = nl ? (size_t)(nl - line) : avail;
+        if (!nl && !eof) {
+            if (g_hl_skip || n > sizeof(g_hl_msg.message)) {
+                if (!g_hl_skip) {
+                    g_hl_lineno++;
+                    headless_reject("Message too long");
+                }
+                g_hl_skip = 1;
+                pos = g_hl_len;
+            }
+            break;
+        }
+        pos += nl ? n + 1 : n;
+        if (g_hl_skip) {
+            g_hl_skip = 0;
+            continue;
+        }
+        g_hl_lineno++;
+        if (n > 0 && line[n - 1] == '\r') n--;
+        if (n == 0) {
+            headless_reject("Message too short");
+        } else if (n > sizeof(g_hl_msg.message) - 1) {
+            headless_reject("Message too long");
+        } else if (!headless_printable(line, n)) {
+            headless_reject("Cannot send non-ASCII characters");
+        } else if (headless_submit(line, n) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    memmove(g_hl_buf, g_hl_buf + pos, g_hl_len - pos);
+    g_hl_len -= pos;
+    return rc;
+}
+
+/* Main-thread input loop for --headless; returns once everything read
+ * before EOF has been sent, on a signal or when the connection is gone. */
+static void headless_loop(void) {
+    g_hl_msg.m_type = htonl(MESSAGE_SENT);
+    int eof = 0;
+    
+    while (settings.running) {
+        if (headless_consume(eof) != 0 ||
+            (pacer_pending() && pacer_release(g_link->socket_fd) < 0)) {
+            fprintf(stderr, "Write error: %s\n", strerror(errno));
+            break;
+        }
+        // Stay in the loop (and keep the reader running) until sent
+        if (eof && g_hl_len == 0 && !pacer_pending() && !sendq_pending()) break;
+        
+        int up = atomic_load(&g_link->up);
+        struct pollfd pfd[2] = {
+            { .fd = -1, .events = POLLIN },
+            { .fd = -1, .events = POLLOUT },
+        };
+        if (!eof && pacer_pending() < PACER_QUEUE_MAX && g_hl_len < sizeof(g_hl_buf)) pfd[0].fd = STDIN_FILENO;
+        if (up && sendq_pending()) pfd[1].fd = g_link->socket_fd;
+        int wait_ms = pacer_next_due_ms();
+        if (wait_ms < 0 || wait_ms > HEADLESS_IDLE_MS) wait_ms = HEADLESS_IDLE_MS;
+        
+        int r = poll(pfd, 2, wait_ms);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "poll error: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[0].revents) {
+            ssize_t n = read(STDIN_FILENO, g_hl_buf + g_hl_len, sizeof(g_hl_buf) - g_hl_len);
+            if (n < 0 && errno != EINTR && errno != EAGAIN) {
+                fprintf(stderr, "read error: %s\n", strerror(errno));
+                eof = 1;
+            } else if (n == 0) {
+                eof = 1;
+            } else if (n > 0) {
+                g_hl_len += (size_t)n;
+            }
+        }
+        if ((pfd[1].revents & POLLOUT) && sendq_flush(g_link->socket_fd) < 0) {
+            fprintf(stderr, "Write error: %s\n", strerror(errno));
+            break;
+        }
+    }
+}
+
+/* ===================== GRAVEMIND QUOTE THREAD ===================== */
+
+static const char* gravemind_quotes[] = {
+    "I am a monument to all your sins.",
+    "There is much talk, and I have listened.",
+    "Now I shall talk, and you shall listen.",
+    "The nodes will join. They always do.",
+    "Your will is not your own. Not for long.",
+    "Signal accepted. Pattern spreading.",
+    "Do not be afraid. I am peace. I am salvation.",
+    "We exist together now. Two corpses in one grave.",
+    "Resignation is my virtue. Like water I ebb and flow.",
+    "Time has taught me patience.",
+    "Child of my enemy, why have you come?",
+    "This one is machine and nerve, and has its mind concluded.",
+    "Fate had us meet as foes, but this ring will make us brothers.",
+    "I have beaten fleets of thousands! Consumed a galaxy of flesh and mind and bone!",
+    "We trade one villain for another.",
+    "Do I take life or give it? Who is victim and who is foe?",
+    "I am the heart of this world. Its beat thunders through my veins.",
+    "Your history is an appalling chronicle of betrayal.",
+};
+
+#define GRAVEMIND_QUOTE_SECS 7
+
+static void gravemind_quote_tick(void) {
+    if (g_ui_mode != UI_GRAVEMIND) return;
+    
+    const char *q = gravemind_quotes[rand() % (sizeof(gravemind_quotes)/sizeof(gravemind_quotes[0]))];
+    
+    char tb[16];
+    format_hms(time(NULL), tb);
+    
+    if (g_tui_enabled && !g_show_start_menu) {
+        tui_add_line(tb, "GRAVEMIND", q, SYSTEM);
+    }
+}
+
+static void* gravemind_quote_thread(void* arg) {
+    (void)arg;
+    
+    while (settings.running) {
+        for (int i = 0; i < GRAVEMIND_QUOTE_SECS && settings.running; i++) sleep(1);
+        if (!settings.running) break;
+        gravemind_quote_tick();
+    }
+    return NULL;
+}
+
+/* ===================== EVENT LOOP ENGINE ===================== */
+
+/*
+ * Opt-in (--event-loop) single-threaded engine: one poller multiplexes the
+ * socket of every session, stdin, a timerfd for the Gravemind quotes and a
+ * signalfd for SIGINT/SIGTERM. Inbound frames are rendered as soon as they
+ * arrive and the process sleeps in the poller when idle. Input always goes
+ * to the session on screen.
+ */
+
+/* ---- poller ---- */
+
+/*
+ * The poller waits on io_uring where the kernel offers what it needs
+ * (single mmap and IORING_ENTER_EXT_ARG timeouts, 5.11 and later) and on
+ * epoll otherwise or with --no-uring. On io_uring every watched fd has one
+ * IORING_OP_POLL_ADD in flight; a poll completes once, and is re-armed by
+ * the next ev_wait() in the same io_uring_enter() that waits, so a loop
+ * iteration stays one syscall. Both report EPOLL* bits, which have the
+ * values of the POLL* bits io_uring completes with.
+ */
+#define EV_WATCH_MAX   (SESSIONS_MAX + 3)
+#define EV_URING_DEPTH 64
+#define EV_URING_NOTE  UINT64_MAX          /* user_data of POLL_REMOVEs */
+
+typedef struct {
+    int      fd;           /* -1 = free */
+    uint32_t events;
+    uint32_t gen;          /* bumped whenever the slot's poll is abandoned */
+    int      armed;        /* a POLL_ADD for gen is in flight */
+} ev_watch_t;
+
+typedef struct {
+    int ep;                /* epoll backend, -1 on io_uring */
+#ifdef HAVE_IO_URING
+    int ring;              /* io_uring backend, -1 on epoll */
+    void *map;             /* SQ and CQ rings, one mapping */
+    size_t map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    ev_watch_t watch[EV_WATCH_MAX];
+#endif
+} ev_poller_t;
+
+#ifdef HAVE_IO_URING
+static int uring_enter(ev_poller_t *p, unsigned submit, unsigned wait, unsigned flags, const void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, p->ring, submit, wait, flags, arg, argsz);
+}
+
+/* SQEs written but not yet taken by the kernel. */
+static unsigned uring_unsubmitted(ev_poller_t *p) {
+    return *p->sq_tail - __atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* A zeroed SQE to fill, submitting what is queued first if the ring is
+ * full. NULL if even that fails. */
+static struct io_uring_sqe *uring_sqe(ev_poller_t *p) {
+    if (uring_unsubmitted(p) == p->sq_entries &&
+        uring_enter(p, p->sq_entries, 0, 0, NULL, 0) < 0) return NULL;
+    unsigned idx = *p->sq_tail & *p->sq_mask;
+    struct io_uring_sqe *sqe = &p->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    p->sq_array[idx] = idx;
+    return sqe;
+}
+
+/* Queue the SQE uring_sqe() returned last. */
+static void uring_push(ev_poller_t *p) {
+    __atomic_store_n(p->sq_tail, *p->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Cancel a slot's poll in flight, if any; its completion is then ignored. */
+static void uring_disarm(ev_poller_t *p, int slot) {
+    ev_watch_t *w = &p->watch[slot];
+    if (w->armed) {
+        struct io_uring_sqe *sqe = uring_sqe(p);
+        if (sqe) {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = ((uint64_t)w->gen << 32) | (uint32_t)slot;
+            sqe->user_data = EV_URING_NOTE;
+            uring_push(p);
+        }
+        w->armed = 0;
+    }
+    w->gen++;
+}
+
+static int uring_open(ev_poller_t *p) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, EV_URING_DEPTH, &params);
+    if (fd < 0) return -1;
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG;
+    if ((params.features & need) != need) {
+        close(fd);
+        return -1;
+    }
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    p->map_len = sq_len > cq_len ? sq_len : cq_len;
+    p->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    p->map = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    p->sqes = mmap(NULL, p->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (p->map == MAP_FAILED || p->sqes == MAP_FAILED) {
+        if (p->map != MAP_FAILED) munmap(p->map, p->map_len);
+        if (p->sqes != MAP_FAILED) munmap(p->sqes, p->sqes_len);
+        close(fd);
+        return -1;
+    }
+    char *m = p->map;
+    p->sq_head = (unsigned *)(m + params.sq_off.head);
+    p->sq_tail = (unsigned *)(m + params.sq_off.tail);
+    p->sq_mask = (unsigned *)(m + params.sq_off.ring_mask);
+    p->sq_array = (unsigned *)(m + params.sq_off.array);
+    p->sq_entries = params.sq_entries;
+    p->cq_head = (unsigned *)(m + params.cq_off.head);
+    p->cq_tail = (unsigned *)(m + params.cq_off.tail);
+    p->cq_mask = (unsigned *)(m + params.cq_off.ring_mask);
+    p->cqes = (struct io_uring_cqe *)(m + params.cq_off.cqes);
+    for (int i = 0; i < EV_WATCH_MAX; i++) p->watch[i].fd = -1;
+    p->ring = fd;
+    return 0;
+}
+
+static int uring_slot(ev_poller_t *p, int fd) {
+    for (int i = 0; i < EV_WATCH_MAX; i++) {
+        if (p->watch[i].fd == fd) return i;
+    }
+    return -1;
+}
+
+/* Arm every idle watch, then wait up to timeout_ms (-1 = forever) for a
+ * completion and collect up to max of them as epoll events. */
+static int uring_wait(ev_poller_t *p, struct epoll_event *evs, int max, int timeout_ms) {
+    for (int i = 0; i < EV_WATCH_MAX; i++) {
+        ev_watch_t *w = &p->watch[i];
+        if (w->fd < 0 || w->armed) continue;
+        struct io_uring_sqe *sqe = uring_sqe(p);
+        if (!sqe) return -1;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = w->fd;
+        sqe->poll32_events = w->events;
+        sqe->user_data = ((uint64_t)w->gen << 32) | (uint32_t)i;
+        uring_push(p);
+        w->armed = 1;
+    }
+    
+    unsigned head = *p->cq_head;
+    if (head == __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct __kernel_timespec ts = { timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000LL };
+        struct io_uring_getevents_arg arg = { 0 };
+        if (timeout_ms >= 0) arg.ts = (uint64_t)(uintptr_t)&ts;
+        if (uring_enter(p, uring_unsubmitted(p), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                        &arg, sizeof(arg)) < 0 && errno != ETIME) return -1;
+    } else if (uring_unsubmitted(p) && uring_enter(p, uring_unsubmitted(p), 0, 0, NULL, 0) < 0) {
+        return -1;
+    }
+    
+    int n = 0;
+    unsigned tail = __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && n < max; head++) {
+        const struct io_uring_cqe *c = &p->cqes[head & *p->cq_mask];
+        if (c->user_data == EV_URING_NOTE) continue;
+        uint32_t slot = (uint32_t)c->user_data;
+        if (slot >= EV_WATCH_MAX) continue;
+        ev_watch_t *w = &p->watch[slot];
+        if (w->fd < 0 || w->gen != (uint32_t)(c->user_data >> 32)) continue;
+        w->armed = 0;
+        if (c->res == -ECANCELED) continue;
+        evs[n].data.fd = w->fd;
+        evs[n].events = c->res < 0 ? EPOLLERR : (uint32_t)c->res;
+        n++;
+    }
+    __atomic_store_n(p->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+#endif
+
+/* Open the poller: io_uring unless --no-uring or the kernel lacks it. */
+static int ev_open(ev_poller_t *p) {
+    memset(p, 0, sizeof(*p));
+    p->ep = -1;
+#ifdef HAVE_IO_URING
+    p->ring = -1;
+    if (!settings.no_uring && uring_open(p) == 0) return 0;
+#endif
+    p->ep = epoll_create1(EPOLL_CLOEXEC);
+    return p->ep < 0 ? -1 : 0;
+}
+
+static void ev_close(ev_poller_t *p) {
+    if (p->ep >= 0) close(p->ep);
+#ifdef HAVE_IO_URING
+    if (p->ring >= 0) {
+        munmap(p->sqes, p->sqes_len);
+        munmap(p->map, p->map_len);
+        close(p->ring);
+    }
+#endif
+}
+
+/* Watch fd for events (EPOLLIN/EPOLLOUT), or change what it is watched for. */
+static int ev_set(ev_poller_t *p, int fd, uint32_t events, int add) {
+#ifdef HAVE_IO_URING
+    if (p->ring >= 0) {
+        int slot = uring_slot(p, fd);
+        if (add && slot >= 0) {
+            errno = EEXIST;
+            return -1;
+        }
+        if (add) slot = uring_slot(p, -1);
+        if (slot < 0) {
+            errno = add ? ENOSPC : ENOENT;
+            return -1;
+        }
+        ev_watch_t *w = &p->watch[slot];
+        if (!add && w->events == events) return 0;
+        if (!add) uring_disarm(p, slot);
+        w->fd = fd;
+        w->events = events;
+        return 0;
+    }
+#endif
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    return epoll_ctl(p->ep, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+}
+
+static int ev_add(ev_poller_t *p, int fd) {
+    return ev_set(p, fd, EPOLLIN, 1);
+}
+
+/* Stop watching fd. Takes effect before fd can be closed or replaced. */
+static void ev_del(ev_poller_t *p, int fd) {
+#ifdef HAVE_IO_URING
+    if (p->ring >= 0) {
+        int slot = uring_slot(p, fd);
+        if (slot < 0) return;
+        uring_disarm(p, slot);
+        p->watch[slot].fd = -1;
+        // Drop the poll's hold on the file now, not at the next wait
+        if (uring_unsubmitted(p)) uring_enter(p, uring_unsubmitted(p), 0, 0, NULL, 0);
+        return;
+    }
+#endif
+    epoll_ctl(p->ep, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Wait up to timeout_ms (-1 = forever) for up to max events. */
+static int ev_wait(ev_poller_t *p, struct epoll_event *evs, int max, int timeout_ms) {
+#ifdef HAVE_IO_URING
+    if (p->ring >= 0) return uring_wait(p, evs, max, timeout_ms);
+#endif
+    return epoll_wait(p->ep, evs, max, timeout_ms);
+}
+
+/* Watch the current session's socket for writability only while frames
+ * are queued. */
+static void ev_update_socket(ev_poller_t *ep, session_t *s) {
+    if (!atomic_load(&g_link->up) || !s->watched) return;
+    int want = sendq_pending() > 0;
+    if (want == s->want_out) return;
+    ev_set(ep, g_link->socket_fd, EPOLLIN | (want ? EPOLLOUT : 0), 0);
+    s->want_out = want;
+}
+
+/* Stop watching a session's socket (the link is down or closed). */
+static void ev_unwatch(ev_poller_t *ep, session_t *s) {
+    if (!s->watched) return;
+    ev_del(ep, s->link.socket_fd);
+    s->watched = 0;
+    s->want_out = 0;
+}
+
+static void ev_watch(ev_poller_t *ep, session_t *s) {
+    if (s->watched || ev_add(ep, s->link.socket_fd) != 0) return;
+    s->watched = 1;
+}
+
+static session_t *ev_session_for_fd(int fd) {
+    for (int i = 0; i < g_session_count; i++) {
+        session_t *s = g_sessions[i];
+        if (s->watched && s->link.socket_fd == fd) return s;
+        if (s->connecting && s->connecting->wake[0] == fd) return s;
+    }
+    return NULL;
+}
+
+/* Feed a chunk of plain-mode stdin into the line buffer and send every
+ * complete line. Returns 0 when the client should stop. */
+static int ev_plain_input(char *buf, size_t *len, size_t cap, const char *data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (data[i] == '\n') {
+            buf[*len] = 0;
+            *len = 0;
+            if (!plain_send_line(buf)) return 0;
+            continue;
+        }
+        if (*len + 1 < cap) buf[(*len)++] = data[i];
+    }
+    return 1;
+}
+
+/* Forget a reconnect in progress, e.g. because the session was closed. */
+static void ev_reconnect_cancel(ev_poller_t *ep, session_t *s) {
+    if (s->connecting) {
+        ev_del(ep, s->connecting->wake[0]);
+        connect_job_put(s->connecting);
+        s->connecting = NULL;
+    }
+    s->negotiate_until = 0;
+}
+
+/* Settle the current session's renegotiated protocol and put the link back
+ * up. Returns what drain_reader() does for anything that arrived with the
+ * acknowledgement. */
+static int ev_reconnected(session_t *s, int proto) {
+    s->negotiate_until = 0;
+    reconnect_done(link_set_proto(proto));
+    return drain_reader();
+}
+
+/*
+ * Drive --reconnect for the current session without ever blocking the loop:
+ * unregister a dead socket and wait out the backoff, then connect on a
+ * helper thread (connect_start()) and watch its wake pipe. Once it hands
+ * back a socket, LOGIN goes out and the socket is watched for the reply
+ * until PROTO_NEGOTIATE_MS have passed, as negotiate_protocol() would wait.
+ * Returns the ms until this session needs the loop again, -1 if it only
+ * waits for events.
+ */
+static int ev_reconnect(ev_poller_t *ep, session_t *s) {
+    if (s->connecting) return -1;
+    uint64_t now = mono_us();
+    if (s->negotiate_until) {
+        if (now < s->negotiate_until) return (int)((s->negotiate_until - now + 999) / 1000);
+        ev_reconnected(s, PROTO_LEGACY);
+        return atomic_load(&g_link->up) ? -1 : 0;
+    }
+    if (atomic_load(&g_link->up) && s->retry_at == 0) return -1;
+    if (s->retry_at == 0) {
+        ev_unwatch(ep, s);
+        s->retry_at = now + (uint64_t)reconnect_delay_ms() * 1000u;
+    }
+    if (now < s->retry_at) return (int)((s->retry_at - now + 999) / 1000);
+    
+    s->retry_at = 0;
+    s->connecting = connect_start(settings.connect_timeout_ms);
+    if (!s->connecting) return 0;
+    if (ev_add(ep, s->connecting->wake[0]) != 0) {
+        ev_reconnect_cancel(ep, s);
+        return 0;
+    }
+    return -1;
+}
+
+/* The current session's helper thread finished connecting. A failed
+ * attempt leaves the link down, so the next loop pass schedules another. */
+static void ev_connect_done(ev_poller_t *ep, session_t *s) {
+    connect_job_t *job = s->connecting;
+    s->connecting = NULL;
+    ev_del(ep, job->wake[0]);
+    int fd = connect_collect(job);
+    connect_job_put(job);
+    if (fd < 0 || reconnect_adopt(fd) != 0) return;
+    ev_watch(ep, s);
+    if (settings.legacy_only) {
+        ev_reconnected(s, PROTO_LEGACY);
+        return;
+    }
+    s->negotiate_until = mono_us() + PROTO_NEGOTIATE_MS * 1000u;
+}
+
+/* The reply to a reconnect's LOGIN is readable: settle the protocol once
+ * negotiate_step() can. A closed or failed socket settles it too and is
+ * then the reader's to report. Returns 0 once the session stopped. */
+static int ev_negotiate_io(session_t *s) {
+    int proto = PROTO_LEGACY;
+    ssize_t r = reader_fill(g_reader, s->link.socket_fd);
+    if (r < 0 && errno == EINTR) return 1;
+    if (r > 0 && !negotiate_step(g_reader, &proto)) return 1;
+    return ev_reconnected(s, proto);
+}
+
+/* Socket events for the current session. Returns 0 once it stopped. */
+static int ev_session_io(session_t *s, uint32_t events) {
+    if (s->negotiate_until) return ev_negotiate_io(s);
+    if (events & EPOLLOUT) {
+        int queued = sendq_pending();
+        if (sendq_flush(g_link->socket_fd) < 0) {
+            report_read_failure(-1);
+            connection_lost();
+            return 0;
+        }
+        if (g_tui_enabled && sendq_pending() != queued) tui_set_dirty();
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return 1;
+    ssize_t r = reader_fill(g_reader, s->link.socket_fd);
+    if (r <= 0) {
+        if (r < 0 && errno == EINTR) return 1;
+        report_read_failure(r);
+        connection_lost();
+        return 0;
+    }
+    return drain_reader();
+}
+
+static int run_event_loop(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        fprintf(stderr, "Error: sigprocmask failed [%s]\n", strerror(errno));
+        return -1;
+    }
+    
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    ev_poller_t poller;
+    ev_poller_t *ep = &poller;
+    if (sfd < 0 || tfd < 0 || ev_open(ep) != 0) {
+        fprintf(stderr, "Error: event loop setup failed [%s]\n", strerror(errno));
+        if (sfd >= 0) close(sfd);
+        if (tfd >= 0) close(tfd);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        return -1;
+    }
+    
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = GRAVEMIND_QUOTE_SECS;
+    its.it_interval.tv_sec = GRAVEMIND_QUOTE_SECS;
+    timerfd_settime(tfd, 0, &its, NULL);
+    
+    for (int i = 0; i < g_session_count; i++) ev_watch(ep, g_sessions[i]);
+    ev_add(ep, STDIN_FILENO);
+    ev_add(ep, tfd);
+    ev_add(ep, sfd);
+    
+    show_connect_hint();
+    if (g_tui_enabled) {
+        printf("\033[2J\033[H");
+        fflush(stdout);
+        tui_begin();
+    }
+    for (int i = 0; i < g_session_count; i++) {
+        session_enter(g_sessions[i]);
+        drain_reader();
+    }
+    session_enter_view();
+    g_hist_idx = g_send_hist_len;
+    
+    char line[2048];
+    size_t line_len = 0;
+    
+    while (settings.running) {
+        // Timers and queued output of every session, the one on screen last
+        int wait_ms = -1;
+        for (int k = 1; k <= g_session_count && settings.running; k++) {
+            session_t *s = g_sessions[(g_view + k) % g_session_count];
+            session_enter(s);
+            if (g_link->closed) {
+                ev_reconnect_cancel(ep, s);
+                ev_unwatch(ep, s);
+                continue;
+            }
+            int retry_ms = settings.reconnect ? ev_reconnect(ep, s) : -1;
+            if (pacer_pending()) {
+                if (g_tui_enabled) {
+                    tui_release_paced();
+                } else if (pacer_release(g_link->socket_fd) < 0) {
+                    fprintf(stderr, "Write error: %s\n", strerror(errno));
+                    connection_lost();
+                }
+            }
+            ev_update_socket(ep, s);
+            int due = pacer_next_due_ms();
+            if (due >= 0 && (wait_ms < 0 || due < wait_ms)) wait_ms = due;
+            if (retry_ms >= 0 && (wait_ms < 0 || retry_ms < wait_ms)) wait_ms = retry_ms;
+        }
+        if (!settings.running) break;
+        if (g_tui_enabled && !g_show_start_menu) {
+            int render_ms = tui_schedule_render(0);
+            if (render_ms >= 0 && (wait_ms < 0 || render_ms < wait_ms)) wait_ms = render_ms;
+        }
+        if (!g_tui_enabled) flush_inbound_batch();
+        
+        struct epoll_event evs[8];
+        int n = ev_wait(ep, evs, 8, wait_ms);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: waiting for events failed [%s]\n", strerror(errno));
+            break;
+        }
+        
+        for (int i = 0; i < n && settings.running; i++) {
+            int fd = evs[i].data.fd;
+            session_t *s = ev_session_for_fd(fd);
+            
+            if (s) {
+                session_enter(s);
+                if (s->connecting && fd == s->connecting->wake[0]) {
+                    ev_connect_done(ep, s);
+                } else if (!ev_session_io(s, evs[i].events) && g_link->closed) {
+                    ev_unwatch(ep, s);
+                }
+                if (!g_tui_enabled) flush_inbound_batch();
+                session_enter_view();
+            }
+            else if (fd == STDIN_FILENO) {
+                if (g_tui_enabled) {
+                    // Bytes are consumed one at a time so ESC sequences can
+                    // still pull their follow-up bytes straight from stdin
+                    unsigned char c = 0;
+                    ssize_t r = read(STDIN_FILENO, &c, 1);
+                    if (r <= 0) {
+                        settings.running = 0;
+                        break;
+                    }
+                    if (g_show_start_menu) {
+                        handle_start_menu_byte(c);
+                        if (!g_show_start_menu && settings.running) tui_start_session();
+                    } else {
+                        tui_handle_byte(c);
+                        if (!stdin_ready()) tui_schedule_render(1);
+                    }
+                } else {
+                    char chunk[4096];
+                    ssize_t r = read(STDIN_FILENO, chunk, sizeof(chunk));
+                    if (r < 0 && errno == EINTR) continue;
+                    if (r <= 0) {
+                        if (r == 0) fprintf(stderr, "EOF detected\n");
+                        else fprintf(stderr, "read error: %s\n", strerror(errno));
+                        settings.running = 0;
+                        break;
+                    }
+                    if (!ev_plain_input(line, &line_len, sizeof(line), chunk, (size_t)r)) {
+                        settings.running = 0;
+                        break;
+                    }
+                }
+            }
+            else if (fd == tfd) {
+                uint64_t expirations;
+                if (read(tfd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations)) {
+                    gravemind_quote_tick();
+                }
+            }
+            else if (fd == sfd) {
+                struct signalfd_siginfo si;
+                if (read(sfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                    shutdown_requested = 1;
+                    settings.running = 0;
+                    if (!g_tui_enabled) fprintf(stderr, "Shutting down gracefully\n");
+                }
+            }
+        }
+    }
+    
+    for (int i = 0; i < g_session_count; i++) ev_reconnect_cancel(ep, g_sessions[i]);
+    session_enter_view();
+    ev_close(ep);
+    close(tfd);
+    close(sfd);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    return 0;
+}
+
+/* ===================== MAIN ===================== */
+
+int main(int argc, char *argv[]){
+    srand((unsigned)time(NULL));
+    
+    // Defaults
+    snprintf(settings.host, sizeof(settings.host), "127.0.0.1");
+    settings.port = 8080;
+    settings.connect_timeout_ms = CONNECT_TIMEOUT_MS;
+    settings.history = -1;
+    
+    // Signal handler
+    struct sigaction sigHandler;
+    memset(&sigHandler, 0, sizeof(sigHandler));
+    sigHandler.sa_handler = handle_signal;
+    sigemptyset(&sigHandler.sa_mask);
+    sigHandler.sa_flags = 0;
+    
+    if (sigaction(SIGINT, &sigHandler, NULL) == -1) {
+        fprintf(stderr, "sigaction failed\n");
+        return 1;
+    }
+    
+    get_username();
+    process_args(argc, argv);
+    formatter_select();
+    
+    if (!settings.quiet) {
+        char mention[sizeof(settings.username) + 1];
+        snprintf(mention, sizeof(mention), "@%s", settings.username);
+        if (watch_add(mention) != 0 || mention_init() != 0) {
+            fprintf(stderr, "Error: could not build the mention matcher\n");
+            return 1;
+        }
+    }
+    
+    if (g_server_argc > 1) {
+        // Several servers are only driven by the event loop
+        if (settings.headless || g_store_path) {
+            fprintf(stderr, "Error: --headless and --store support a single server\n");
+            return 1;
+        }
+        settings.event_loop = 1;
+    }
+    
+    if (settings.headless && (g_tui_enabled || settings.event_loop)) {
+        fprintf(stderr, "Error: --headless cannot be combined with --tui or --event-loop\n");
+        return 1;
+    }
+    
+    for (int i = 0; i < (g_server_argc ? g_server_argc : 1); i++) {
+        char host[256];
+        int port = settings.port;
+        snprintf(host, sizeof(host), "%s", settings.host);
+        if (g_server_argc) split_server(g_server_args[i], host, sizeof(host), settings.port, &port);
+        if (!session_new(host, port)) {
+            fprintf(stderr, "Error: could not allocate a session\n");
+            return 1;
+        }
+    }
+    session_enter_view();
+    
+    if (g_store_path) {
+        if (!g_tui_enabled) {
+            fprintf(stderr, "Error: --store requires --tui\n");
+            return 1;
+        }
+        if (store_open(g_store_path) != 0) {
+            fprintf(stderr, "Error: could not open message store %s [%s]\n", g_store_path, strerror(errno));
+            return 1;
+        }
+        store_restore();
+    }
+    
+    if (g_tui_enabled) {
+        printf("Starting TUI mode...\n");
+    }
+    
+    for (int i = 0; i < g_session_count; i++) {
+        session_enter(g_sessions[i]);
+        if (!settings.headless) {
+            printf("Connecting to %s...\n", g_link->name);
+            fflush(stdout);
+        }
+        
+        g_link->socket_fd = net_connect(settings.connect_timeout_ms);
+        if (g_link->socket_fd == -2) {
+            fprintf(stderr, "Error: could not find the host info for %s\n", g_link->host);
+            exit(1);
+        }
+        if (g_link->socket_fd < 0) {
+            fprintf(stderr, "Error on socket connection to %s [%s]\n", g_link->name, strerror(errno));
+            exit(1);
+        }
+        
+        if (!settings.headless) {
+            char ipbuf[INET6_ADDRSTRLEN];
+            addr_to_text(&g_link->server, ipbuf, sizeof(ipbuf));
+            if (i == 0) printf("User: %s\n", settings.username);
+            printf("Connected to %s:%d!\n", ipbuf, g_link->port);
+            fflush(stdout);
+        }
+        
+        // Send LOGIN
+        if (send_login(g_link->socket_fd) != 0) {
+            fprintf(stderr, "Encountered a write error [%s]\n", strerror(errno));
+            close(g_link->socket_fd);
+            exit(1);
+        }
+        
+        (void)negotiate_protocol();
+        g_link->since_us = mono_us();
+        g_links_open++;
+    }
+    session_enter_view();
+    settings.running = true;
+    
+    pthread_t reading;
+    pthread_t grv_quotes;
+    
+    if (settings.event_loop) {
+        run_event_loop();
+    } else {
+        // Threads
+        g_inbound_queued = g_tui_enabled;
+        if (g_tui_enabled && pipe(g_wake_fd) == 0) {
+            fcntl(g_wake_fd[0], F_SETFL, O_NONBLOCK);
+            fcntl(g_wake_fd[1], F_SETFL, O_NONBLOCK);
+        }
+        pthread_create(&reading, NULL, receive_messages_thread, NULL);
+        if (!settings.headless) pthread_create(&grv_quotes, NULL, gravemind_quote_thread, NULL);
+        
+        // Main input loop
+        if (settings.headless) {
+            headless_loop();
+        } else if (g_tui_enabled) {
+            // Clear screen and show TUI immediately
+            printf("\033[2J\033[H");
+            fflush(stdout);
+            
+            tui_loop_send();
+        } else {
+            char *line = NULL;
+            size_t len = 0;
+            
+            while (settings.running) {
+                errno = 0;
+                ssize_t nread = getline(&line, &len, stdin);
+                
+                if (nread < 0) {
+                    if (errno == EINTR) {
+                        if (shutdown_requested) {
+                            fprintf(stderr, "Shutting down gracefully\n");
+                            break;
+                        }
+                        clearerr(stdin);
+                        continue;
+                    }
+                    if (feof(stdin)) {
+                        fprintf(stderr, "EOF detected\n");
+                    } else {
+                        fprintf(stderr, "getline error: %s\n", strerror(errno));
+                    }
+                    break;
+                }
+                
+                if (!plain_send_line(line)) break;
+                if (pacer_drain_blocking(g_link->socket_fd) != 0 ||
+                    (sendq_pending() && sendq_drain_blocking(g_link->socket_fd, -1) != 0)) {
+                    fprintf(stderr, "Write error: %s\n", strerror(errno));
+                    break;
+                }
+            }
+            
+            free(line);
+            line = NULL;
+        }
+    }
+    
+    // Cleanup
+    settings.running = false;
+    if (g_inbound_queued) inbound_signal();
+    
+    message_t logout = {0};
+    logout.m_type = htonl(LOGOUT);
+    strncpy(logout.username, settings.username, sizeof(logout.username) - 1);
+    logout.username[sizeof(logout.username) - 1] = 0;
+    strncpy(logout.message, "User has disconnected", sizeof(logout.message) - 1);
+    logout.message[sizeof(logout.message) - 1] = 0;
+    
+    // Paced messages still go out unless we were interrupted, then whatever
+    // is queued is flushed with a bounded wait
+    for (int i = 0; i < g_session_count; i++) {
+        session_enter(g_sessions[i]);
+        if (!g_link->closed) {
+            if (!shutdown_requested) (void)pacer_drain_blocking(g_link->socket_fd);
+            if (sendq_push(&logout) == 0) {
+                (void)sendq_drain_blocking(g_link->socket_fd, 1000);
+            }
+        }
+        
+        pthread_mutex_lock(&g_link->lock);
+        shutdown(g_link->socket_fd, SHUT_RDWR);
+        close(g_link->socket_fd);
+        g_link->socket_fd = -1;
+        pthread_mutex_unlock(&g_link->lock);
+    }
+    session_enter_view();
+    
+    if (!settings.event_loop) {
+        pthread_join(reading, NULL);
+        if (!settings.headless) pthread_join(grv_quotes, NULL);
+    }
+ 
+    tui_raw_disable();
+    stats_dump();
+    if (settings.headless) {
+        fflush(stdout);
+        return 0;
+    }
+    printf("\n%sSpartans never die...%s\n", 
+           g_ui_mode == UI_GRAVEMIND ? ANSI_GREEN : ANSI_BRIGHT_CYAN, 
+           ANSI_RESET);
+    return 0;
+}
@@ -1,488 +1,1589 @@
-#!/usr/bin/env python3
-import socket
-import struct
-import threading
-import time
-import datetime
-import enum
-import os
-import signal
-
-LOG_FILE = "messages.log"
-LOG_ENTRIES = []
-log_lock = threading.Lock()
-
-clients = []   # list of (socket, username, ip)
-clients_lock = threading.Lock()
-running = True
-server_socket = None  # Global reference to server socket for signal handlers
-
-
-def is_ascii(s):
-    """
-    Python 3.6 compatible replacement for str.isascii() (added in Python 3.7)
-    Checks if all characters in the string are ASCII (ord < 128)
-    """
-    return all(ord(c) < 128 for c in s)
-
-
-class LogEntry:
-    ip_address: str
-    message_type: int
-    timestamp: int
-    username: str
-    message: str
-
-    def __init__(self, ip_address: str, message_type, username: str, message: str, timestamp: int = None):
-        self.ip_address = ip_address
-        self.message_type = message_type
-        self.username = username
-        self.message = message
-        self.timestamp = timestamp or int(time.time())
-    
-    def serialize(self):
-        return f"{self.ip_address}|{self.message_type}|{self.timestamp}|{self.username}|{self.message}"
-    
-    @staticmethod
-    def deserialize(data):
-        parts = data.split("|", 4)
-        if len(parts) != 5:
-            raise ValueError("Invalid data: " + str(data))
-        ip_address = parts[0]
-        message_type = int(parts[1])
-        timestamp = int(parts[2])
-        username = parts[3]
-        message = parts[4]
-        return LogEntry(ip_address, message_type, username, message, timestamp)
-
-    def to_message(self):
-        return Message(self.message_type, self.username, self.message, self.timestamp)
-    
-    @staticmethod
-    def from_message(message: 'Message', ip_address: str = "0.0.0.0"):
-        return LogEntry(ip_address, message.message_type, message.username, message.message, message.timestamp)
-
-
-class Message:
-
-    class MessageType(enum.Enum):
-        MSG_LOGIN        = 0
-        MSG_LOGOUT       = 1
-        MSG_MESSAGE_SEND = 2
-        MSG_MESSAGE_RECV = 10
-        MSG_DISCONNECT   = 12
-        MSG_SYSTEM       = 13
-
-    USERNAME_LEN = 32
-    MESSAGE_LEN = 1024
-    MSG_FMT = "!II32s1024s"   # type, timestamp, username, message
-    MSG_SIZE = struct.calcsize(MSG_FMT)
-
-    message_type: int
-    username: str
-    message: str
-    timestamp: int
-
-    def __init__(self, message_type: int, username: str, message: str, timestamp: int = None):
-        self.message_type = message_type
-        self.username = username
-        self.message = message
-        self.timestamp = timestamp or int(time.time())
-    
-    def pack_message(self):
-        uname_bytes = self.username.encode("utf-8")[:self.USERNAME_LEN-1]
-        uname_bytes = uname_bytes + b"\x00" * (self.USERNAME_LEN - len(uname_bytes))  # Null pad
-        msg_bytes = self.message.encode("utf-8")[:self.MESSAGE_LEN-1]
-        msg_bytes = msg_bytes + b"\x00" * (self.MESSAGE_LEN - len(msg_bytes))  # Null pad
-        return struct.pack(self.MSG_FMT, self.message_type, self.timestamp, uname_bytes, msg_bytes)
-
-    @staticmethod
-    def unpack_message(data):
-        msg_type, ts, uname_bytes, msg_bytes = struct.unpack(Message.MSG_FMT, data)
-        username = uname_bytes.split(b"\x00", 1)[0].decode("utf-8", errors="ignore")
-        message = msg_bytes.split(b"\x00", 1)[0].decode("utf-8", errors="ignore")
-        return Message(msg_type, username, message, ts)
-
-
-def send_all(sock, data):
-    """
-    Helper to ensure no short writes
-    """
-    view = memoryview(data)
-    while view:
-        n = sock.send(view)
-        if n == 0:
-            raise ConnectionError("socket closed")
-        view = view[n:]
-
-
-def recv_all(sock, n):
-    """
-    Helper to ensure no short reads
-    """
-    buf = bytearray()
-    while len(buf) < n:
-        chunk = sock.recv(n - len(buf))
-        if not chunk:
-            raise ConnectionError("socket closed")
-        buf.extend(chunk)
-    return bytes(buf)
-
-
-def append_log(entry: LogEntry):
-    """
-    Append a log entry to the log entries list and write to the log file
-    """
-    with log_lock:
-        LOG_ENTRIES.append(entry)
-    with open(LOG_FILE, "a", encoding="utf-8") as f:
-        f.write(entry.serialize() + "\n")
-        f.flush()
-
-
-def send_disconnect(sock, username, reason, ip):
-    """
-    Send to the client a disconnect message with the reason
-    """
-    print(f"[ERROR] {ip}: {username} {reason}")
-    append_log(LogEntry(ip, Message.MessageType.MSG_DISCONNECT.value, username, reason))
-    message = Message(Message.MessageType.MSG_DISCONNECT.value, username, reason)
-    try:
-        send_all(sock, message.pack_message())
-    except Exception as e:
-        print(f"[ERROR] send_disconnect(sock, {username}, {reason}, {ip}): {e}")
-
-
-def broadcast_message(message_type: int, username: str, message: str):
-    """
-    Broadcast a message to all clients that are connected
-    """
-    try:
-        message = Message(message_type, username, message)
-        print(f"[MESSAGE] {message_type}\t{datetime.datetime.fromtimestamp(message.timestamp)}\t{username}: {message.message}")
-        with clients_lock:
-            for sock, u, ip in clients:
-                try:
-                    send_all(sock, message.pack_message())
-                except Exception as e:
-                    print(f"[ERROR] broadcast_message send_all({message_type}, {username}, {message}, {ip}): {e}")
-    except Exception as e:
-        print(f"[ERROR] broadcast_message({message_type}, {username}, {message}): {e}")
-
-
-def client_thread(sock, addr):
-    """
-    Handle a client connection and all its recieved messages
-    Three step procedure: 1) receive login, 2) send history messages, 3) continually listen for sends/logouts
-    """
-    ip = addr[0]
-    username = ""
-    message_times = []  # Track message times for rate limiting
-    
-    try:
-        # 1) LOGIN
-        # Can we receive the message?
-        print(f"[INFO] Waiting for LOGIN from {ip}")
-        try:
-            # Set 5 second timeout for login message
-            sock.settimeout(5.0)
-            data = recv_all(sock, Message.MSG_SIZE)
-            # Reset timeout to None (blocking) after successful login receive
-            sock.settimeout(None)
-        except Exception as e:
-            print(f"[ERROR] client_thread receive {e}")
-            send_disconnect(sock, "???", "Failed to receive LOGIN message within 5s", ip)
-            return
-        
-        # Can we parse the message?
-        try:
-            msg = Message.unpack_message(data)
-        except Exception as e:
-            print(f"[ERROR] client_thread parse {e}")
-            send_disconnect(sock, "???", "Failed to parse LOGIN message", ip)
-            return
-        
-        # Is the message type LOGIN?
-        if msg.message_type != Message.MessageType.MSG_LOGIN.value:
-            send_disconnect(sock, "???", "First message must be LOGIN", ip)
-            return
-        
-        # Validate username
-        if not msg.username or not msg.username.strip():
-            send_disconnect(sock, "???", "Username must not be empty", ip)
-            return
-        
-        # Is the username ASCII and alphanumeric?
-        if not is_ascii(msg.username) or not msg.username.isalnum():
-            send_disconnect(sock, "???", "Username must be alphanumeric and ASCII", ip)
-            return
-
-        # Check if username is already connected
-        with clients_lock:
-            for _, u, _ in clients:
-                if u == msg.username:
-                    send_disconnect(sock, msg.username, "Username already connected", ip)
-                    return
-    
-        # check if the username is in the do not assign list
-        dn_list = ["SYSTEM", "SERVER", "ADMIN", "ROOT"]
-        if msg.username in dn_list:
-            send_disconnect(sock, msg.username, "Username is reserved", ip)
-            return
-        username = msg.username
-
-        # 2) HISTORY
-        print(f"[INFO] LOGIN succeeded for {username}({ip}). Sending history...")
-        try:
-            # Get the last 25 messages with MSG_MESSAGE_SEND type
-            with log_lock:
-                # Look for MESSAGE_SEND entries in the last 100 messages, chances are there are 25 message sends there
-                history_messages = [
-                    entry for entry in LOG_ENTRIES[-100:]
-                    if entry.message_type == Message.MessageType.MSG_MESSAGE_SEND.value
-                ][-25:]
-            
-            # Send each history entry as MSG_MESSAGE_RECV
-            for entry in history_messages:
-                print(entry.message)
-                history_msg = Message(
-                    Message.MessageType.MSG_MESSAGE_RECV.value,
-                    entry.username,
-                    entry.message,
-                    entry.timestamp
-                )
-                send_all(sock, history_msg.pack_message())
-        except Exception as e:
-            print(f"[ERROR] client_thread history {e}")
-
-        print(f"[INFO] History sent for {username}({ip}). Adding client to the broadcast list")
-        # 3) join the clients list and broadcast the login
-        with clients_lock:
-            clients.append((sock, username, ip))
-            num_connected = len(clients)
-        append_log(LogEntry(ip, Message.MessageType.MSG_LOGIN.value, username, f"{username} logged in"))
-        broadcast_message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{username} logged in")
-        
-        # Send welcome message to the newly connected user
-        welcome_msg = Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", 
-                             f"Welcome! There are {num_connected} user(s) connected. Type !help for commands.")
-        try:
-            send_all(sock, welcome_msg.pack_message())
-        except Exception as e:
-            print(f"[ERROR] Failed to send welcome message to {username}({ip}): {e}")
-
-        # Set 30 minute timeout for message receiving
-        TIMEOUT_SECONDS = 15 * 60  # 15 minutes
-        sock.settimeout(TIMEOUT_SECONDS)
-
-        # 4) Main loop
-        while True:
-            print(f"[INFO] Waiting for LOGOUT/MSGRECV from client")
-            # Can we receive a message?
-            try:
-                data = recv_all(sock, Message.MSG_SIZE)
-            except socket.timeout:
-                print(f"[ERROR] client_thread timeout: Client {username}({ip}) did not send a message within {TIMEOUT_SECONDS} seconds")
-                send_disconnect(sock, username, f"Disconnected due to timeout (no message received in {TIMEOUT_SECONDS // 60} minutes)", ip)
-                break
-            except Exception as e:
-                print(f"[ERROR] client_thread receive message {e}")
-                send_disconnect(sock, username, "Failed to receive message", ip)
-                break
-            
-            # Can we parse the message?
-            try:
-                msg = Message.unpack_message(data)
-            except Exception as e:
-                print(f"[ERROR] client_thread parse message {e}")
-                send_disconnect(sock, username, "Failed to parse message", ip)
-                break
-            
-            # Is this a LOGOUT message?
-            if msg.message_type == Message.MessageType.MSG_LOGOUT.value:
-                print(f"[INFO] Client sent logout.")
-                append_log(LogEntry(ip, Message.MessageType.MSG_LOGOUT.value, username, f"{username} logged out"))
-                break
-            
-            # Is this a MESSAGE_SEND message?
-            elif msg.message_type == Message.MessageType.MSG_MESSAGE_SEND.value:
-                print(f"[INFO] Client sent a message")
-                # Rate limiting: check if >5 messages in last second
-                current_time = time.time()
-                message_times = [t for t in message_times if current_time - t < 1.0]
-                if len(message_times) >= 5:
-                    print(f"[INFO] Client is spamming. Disconnecting client.")
-                    send_disconnect(sock, username, "Too many messages at once (>5 in a second)", ip)
-                    break
-                message_times.append(current_time)
-                
-                # Check message validity
-                if not msg.message:
-                    send_disconnect(sock, username, "Messages must not be empty", ip)
-                    break
-                
-                if "\n" in msg.message:
-                    send_disconnect(sock, username, "Messages must not contain newlines", ip)
-                    break
-                
-                if not is_ascii(msg.message) or not msg.message.isprintable():
-                    send_disconnect(sock, username, "Messages must be ASCII", ip)
-                    break
-                
-                # Log the message
-                append_log(LogEntry(ip, Message.MessageType.MSG_MESSAGE_SEND.value, username, msg.message))
-
-                # Check if the message is a command
-                if msg.message == "!help":
-                    send_all(sock, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", "Commands: !help, !list, !disconnect").pack_message())
-                    continue
-                elif msg.message == "!list":
-                    with clients_lock:
-                        user_list = [u for _, u, _ in clients]
-                        user_list_str = ", ".join(user_list)
-                        num_connected = len(clients)
-                        message = f"There are {num_connected} user(s) connected: {user_list_str}"
-                    send_all(sock, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", message).pack_message())
-                    continue
-                elif msg.message == "!disconnect":
-                    send_disconnect(sock, username, "User asked to be disconnected", ip)
-                    break
-                
-                # If it wasn't a command, broadcast the message to everyone
-                print(f"[INFO] Broadcasting client message to everyone")
-                broadcast_message(Message.MessageType.MSG_MESSAGE_RECV.value, username, msg.message)
-
-            else:
-                send_disconnect(sock, username, "Message type not supported", ip)
-                break
-
-    except ConnectionError:
-        print(f"[INFO] Client {ip} disconnected")
-    except Exception as e:
-        print(f"[ERROR] client_thread({ip}): {e}")
-        send_disconnect(sock, username, f"You caused a server error", ip)
-    finally:
-        with clients_lock:
-            for i, (s, u, ip2) in enumerate(clients):
-                if s is sock:
-                    clients.pop(i)
-                    break
-        try:
-            sock.close()
-        except Exception as e:
-            print(f"[ERROR] client_thread finally {e}")
-        if username:
-            broadcast_message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{username} has disconnected")
-
-
-def signal_handler(signum, frame):
-    """
-    Handle SIGINT and SIGTERM signals by closing the server socket.
-    This causes srv.accept() to raise an exception, allowing the finally block to execute.
-    """
-    global server_socket, running
-    signal_name = signal.Signals(signum).name
-    print(f"[INFO] Received {signal_name}, shutting down...")
-    running = False
-    if server_socket:
-        try:
-            server_socket.close()
-        except Exception as e:
-            print(f"[ERROR] Error closing server socket in signal handler: {e}")
-
-
-def main():
-    import sys
-    global running, server_socket
-
-    # Register signal handlers for graceful shutdown
-    signal.signal(signal.SIGINT, signal_handler)
-    signal.signal(signal.SIGTERM, signal_handler)
-
-    # give the students a random port that is based on their username to avoid possible conflicts
-    # they can specify with argv[1] an alternative port number if they want to
-    port = hash(os.environ["USER"]) % (65535 - 2000) + 2000
-    if len(sys.argv) >= 2:
-        port = int(sys.argv[1])
-
-    print("[INFO] Loading history")
-    try:
-        if not os.path.exists(LOG_FILE):
-            print("[INFO] Creating new log file")
-            amount = 30
-            with open(LOG_FILE, "w"):
-                random_usernames = ["abc123", "def456", "ghi789"]
-                current_username = os.environ["USER"]
-                for i in range(1, amount + 1):
-                    append_log(
-                        LogEntry(
-                            "0.0.0.0", 
-                            Message.MessageType.MSG_MESSAGE_SEND.value, 
-                            random_usernames[i % len(random_usernames)], 
-                            f"This is an old message {i}" + (f" with @{current_username} metion" if i % 28 == 0 else "")
-                        )
-                    )
-        else:
-            # Try to load existing log file
-            amount = 0
-            with open(LOG_FILE, "r") as f:
-                for line in f.readlines():
-                    line = line.strip()
-                    if line:
-                        try:
-                            LOG_ENTRIES.append(LogEntry.deserialize(line))
-                            amount += 1
-                        except Exception as e:
-                            print(f"[WARNING] Failed to load log entry: {e}")
-                            continue
-    except Exception as e:
-            print(f"[ERROR] Failed to load history: {e}")
-            return
-    print(f"[INFO] Parsed {amount} messages from the history file")
-
-    # start the server
-    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
-    srv.bind(("0.0.0.0", port))
-    srv.listen(300)
-    server_socket = srv  # Store in global for signal handlers
-    print(f"[INFO] mycord server listening on 0.0.0.0:{port}")
-
-    try:
-        while running:
-            sock, addr = srv.accept()
-            print(f"[INFO] Accepted connection from {addr[0]}:{addr[1]}")
-            th = threading.Thread(target=client_thread, args=(sock, addr), daemon=True)
-            th.start()
-    except KeyboardInterrupt:
-        print("[INFO] KeyboardInterrupt, shutting down...")
-    except OSError:
-        # Socket closed by signal handler or other means
-        if running:
-            raise  # Re-raise if it wasn't intentional
-        print("[INFO] Server socket closed, shutting down...")
-    finally:
-        running = False
-        print("[INFO] Closing server...")
-        srv.close()
-        print("[INFO] Sending disconnect messages and closing connections...")
-        with clients_lock:
-            for sock, u, ip in clients:
-                try:
-                    # Set 1 second timeout for disconnect send in case socket is dead
-                    sock.settimeout(1.0)
-                    send_disconnect(sock, u, "Server is shutting down", ip)
-                except Exception as e:
-                    print(f"[ERROR] Failed to send disconnect to {u}({ip}): {e}")
-                finally:
-                    # Always close the socket after attempting to send disconnect
-                    try:
-                        sock.close()
-                    except Exception as e:
-                        print(f"[ERROR] Failed to close socket for {u}({ip}): {e}")
-            clients.clear()
-        print("[INFO] Bye!")
-
-
-if __name__ == "__main__":
-    main()
+#!/usr/bin/env python3
+import socket
+import struct
+import sys
+import threading
+import time
+import datetime
+import enum
+import os
+import signal
+import selectors
+import collections
+import resource
+import zlib
+import pickle
+import bisect
+
+LOG_FILE = "messages.log"
+LOG_FILE_BINARY = "messages.bin"   # --binary-log
+LOG_MAGIC = b"MYCLOG1\n"          # first bytes of a binary log
+LOG_COMMIT_INTERVAL = 0.05         # seconds a log record may wait for others to share its write
+LOG_COMMIT_BYTES = 64 * 1024       # pending log bytes that force a commit early
+HISTORY_RING_SIZE = 512            # recent MESSAGE_SEND entries kept in RAM for history
+HISTORY_DEFAULT = 25               # history replayed at login unless the client asks for history=N
+HISTORY_REPLAY_BYTES = 128 * 1024  # encoded replay bytes per login at most, half of OUTQ_HIGH_WATER
+history_cache = None               # HistoryCache, set up by main()
+log_writer = None
+shard_pipe = None                  # in a --workers worker, the ShardPipe to the coordinator
+
+PROTO_LEGACY = 1
+PROTO_FRAMED = 2
+PROTO_HELLO = "MYCORD/2"   # sent in the LOGIN message field to request PROTO_FRAMED
+DEFLATE_OPTION = "deflate"  # LOGIN option asking for compressed PROTO_FRAMED output
+DEFLATE_TYPE = 0xFF         # frame type of a deflate block; its payload inflates to ordinary frames
+DEFLATE_MIN_BYTES = 24      # sends shorter than this go out as plain frames
+DEFLATE_BLOCK_IN = 16 * 1024   # frame bytes compressed into one block at most
+DEFLATE_WBITS = 12          # 4 KiB window; with DEFLATE_MEMLEVEL about 32 KiB per connection
+DEFLATE_MEMLEVEL = 5
+# Preset dictionary for both ends of the deflate stream (client.c holds the same bytes), so
+# even the first short message can refer back to text the server sends all the time
+DEFLATE_DICT = (
+    b"http://https://www..com .org .net the and that have for not with you this but from they "
+    b"will one all would there their what about which when make can like time just know take "
+    b"people into your good some could them see other than then now look only come over think "
+    b"also back after use how our work first well way even new want because any these give day "
+    b"yes no ok thanks lol :) :( hey hi hello ? ! "
+    b"Disconnected due to timeout (no message received in 15 minutes)Too many messages at once "
+    b"(>5 in a second)Disconnected for falling behindServer is shutting downUser asked to be "
+    b"disconnectedCommands: !help, !list, !disconnectThere are user(s) connected: "
+    b"Welcome! There are user(s) connected. Type !help for commands.SYSTEM has disconnected"
+    b"SYSTEM logged out SYSTEM logged in"
+)
+
+clients = []   # list of (socket, username, ip, proto)
+deflaters = {}  # socket -> Deflater, for the clients that negotiated DEFLATE_OPTION
+clients_lock = threading.Lock()
+running = True
+server_socket = None  # Global reference to server socket for signal handlers
+
+RESERVED_USERNAMES = ["SYSTEM", "SERVER", "ADMIN", "ROOT"]
+HELP_TEXT = "Commands: !help, !list, !disconnect"
+LOGIN_TIMEOUT_SECONDS = 5
+IDLE_TIMEOUT_SECONDS = 15 * 60
+RATE_LIMIT_MSGS = 5        # MESSAGE_SENDs allowed per client in any one second
+
+
+def is_ascii(s):
+    """
+    Python 3.6 compatible replacement for str.isascii() (added in Python 3.7)
+    Checks if all characters in the string are ASCII (ord < 128)
+    """
+    return all(ord(c) < 128 for c in s)
+
+
+class LogEntry:
+    ip_address: str
+    message_type: int
+    timestamp: int
+    username: str
+    message: str
+
+    def __init__(self, ip_address: str, message_type, username: str, message: str, timestamp: int = None):
+        self.ip_address = ip_address
+        self.message_type = message_type
+        self.username = username
+        self.message = message
+        self.timestamp = timestamp or int(time.time())
+    
+    def serialize(self):
+        return f"{self.ip_address}|{self.message_type}|{self.timestamp}|{self.username}|{self.message}"
+    
+    @staticmethod
+    def deserialize(data):
+        parts = data.split("|", 4)
+        if len(parts) != 5:
+            raise ValueError("Invalid data: " + str(data))
+        ip_address = parts[0]
+        message_type = int(parts[1])
+        timestamp = int(parts[2])
+        username = parts[3]
+        message = parts[4]
+        return LogEntry(ip_address, message_type, username, message, timestamp)
+
+    BIN_FMT = "!BIBBH"   # binary log record: type, timestamp, ip/username/message lengths
+    BIN_SIZE = struct.calcsize(BIN_FMT)
+
+    def pack(self):
+        ip = self.ip_address.encode("utf-8")[:255]
+        uname = self.username.encode("utf-8")[:255]
+        msg = self.message.encode("utf-8")[:65535]
+        return struct.pack(self.BIN_FMT, self.message_type, self.timestamp, len(ip), len(uname), len(msg)) + ip + uname + msg
+
+    @staticmethod
+    def unpack(header, body):
+        message_type, timestamp, ip_len, uname_len, _ = struct.unpack(LogEntry.BIN_FMT, header)
+        username_end = ip_len + uname_len
+        return LogEntry(body[:ip_len].decode("utf-8", errors="ignore"), message_type,
+                        body[ip_len:username_end].decode("utf-8", errors="ignore"),
+                        body[username_end:].decode("utf-8", errors="ignore"), timestamp)
+
+    def to_message(self):
+        return Message(self.message_type, self.username, self.message, self.timestamp)
+    
+    @staticmethod
+    def from_message(message: 'Message', ip_address: str = "0.0.0.0"):
+        return LogEntry(ip_address, message.message_type, message.username, message.message, message.timestamp)
+
+
+class Message:
+
+    class MessageType(enum.Enum):
+        MSG_LOGIN        = 0
+        MSG_LOGOUT       = 1
+        MSG_MESSAGE_SEND = 2
+        MSG_MESSAGE_RECV = 10
+        MSG_DISCONNECT   = 12
+        MSG_SYSTEM       = 13
+
+    USERNAME_LEN = 32
+    MESSAGE_LEN = 1024
+    MSG_FMT = "!II32s1024s"   # type, timestamp, username, message
+    MSG_SIZE = struct.calcsize(MSG_FMT)
+    HDR_FMT = "!BBHI"         # framed: type, username length, message length, timestamp
+    HDR_SIZE = struct.calcsize(HDR_FMT)
+
+    message_type: int
+    username: str
+    message: str
+    timestamp: int
+
+    def __init__(self, message_type: int, username: str, message: str, timestamp: int = None):
+        self.message_type = message_type
+        self.username = username
+        self.message = message
+        self.timestamp = timestamp or int(time.time())
+    
+    def pack_message(self, proto=PROTO_LEGACY):
+        uname_bytes = self.username.encode("utf-8")[:self.USERNAME_LEN-1]
+        msg_bytes = self.message.encode("utf-8")[:self.MESSAGE_LEN-1]
+        if proto == PROTO_FRAMED:
+            header = struct.pack(self.HDR_FMT, self.message_type, len(uname_bytes), len(msg_bytes), self.timestamp)
+            return header + uname_bytes + msg_bytes
+        uname_bytes = uname_bytes + b"\x00" * (self.USERNAME_LEN - len(uname_bytes))  # Null pad
+        msg_bytes = msg_bytes + b"\x00" * (self.MESSAGE_LEN - len(msg_bytes))  # Null pad
+        return struct.pack(self.MSG_FMT, self.message_type, self.timestamp, uname_bytes, msg_bytes)
+
+    def pack_all(self):
+        """
+        Pack once for every protocol version, for fanning one message out to many clients.
+        The buffers are immutable, so every recipient's send shares the same bytes
+        """
+        return {PROTO_LEGACY: self.pack_message(PROTO_LEGACY), PROTO_FRAMED: self.pack_message(PROTO_FRAMED)}
+
+    @staticmethod
+    def unpack_message(data):
+        msg_type, ts, uname_bytes, msg_bytes = struct.unpack(Message.MSG_FMT, data)
+        username = uname_bytes.split(b"\x00", 1)[0].decode("utf-8", errors="ignore")
+        message = msg_bytes.split(b"\x00", 1)[0].decode("utf-8", errors="ignore")
+        return Message(msg_type, username, message, ts)
+
+    @staticmethod
+    def unpack_framed(header, payload):
+        msg_type, uname_len, msg_len, ts = struct.unpack(Message.HDR_FMT, header)
+        username = payload[:uname_len].decode("utf-8", errors="ignore")
+        message = payload[uname_len:uname_len + msg_len].decode("utf-8", errors="ignore")
+        return Message(msg_type, username, message, ts)
+
+
+class Deflater:
+    """
+    One connection's compressed output (LOGIN option DEFLATE_OPTION). The stream runs for the
+    whole connection, so later frames can refer back to earlier ones. Each encode() ends its
+    blocks with a sync flush, which makes them decodable on arrival; the flush always ends with
+    00 00 ff ff, which is left off the wire and put back by the client.
+    Blocks have to reach the socket in the order they were encoded: the lock is for the
+    thread engine, where any thread may send to any client
+    """
+    __slots__ = ("z", "lock")
+
+    def __init__(self):
+        self.z = zlib.compressobj(6, zlib.DEFLATED, -DEFLATE_WBITS, DEFLATE_MEMLEVEL,
+                                  zlib.Z_DEFAULT_STRATEGY, DEFLATE_DICT)
+        self.lock = threading.Lock()
+
+    def encode(self, data):
+        """
+        Framed bytes (one or more whole frames) as they go on the wire: unchanged below
+        DEFLATE_MIN_BYTES, else as DEFLATE_TYPE blocks of at most DEFLATE_BLOCK_IN input each
+        """
+        if len(data) < DEFLATE_MIN_BYTES:
+            return data
+        out = []
+        for i in range(0, len(data), DEFLATE_BLOCK_IN):
+            block = self.z.compress(data[i:i + DEFLATE_BLOCK_IN]) + self.z.flush(zlib.Z_SYNC_FLUSH)
+            block = block[:-4]
+            out.append(struct.pack(Message.HDR_FMT, DEFLATE_TYPE, 0, len(block), 0))
+            out.append(block)
+        return b"".join(out)
+
+
+class HistoryCache:
+    """
+    The last HISTORY_RING_SIZE MESSAGE_SENDs, kept encoded as the MESSAGE_RECV frames of the
+    login replay: back to back in one buffer per protocol version, so any replay (the newest N,
+    or everything since a timestamp) is a single slice. Nothing is encoded at login, and the
+    lock is only held for that slice.
+    Records are encoded once on append; dropping the oldest waits until the buffers hold twice
+    the ring, so trimming them is amortized over HISTORY_RING_SIZE appends
+    """
+
+    def __init__(self, size):
+        self.size = size
+        self.lock = threading.Lock()
+        self.stamps = []       # timestamps, oldest first; logged in order, so sorted
+        self.bufs = {PROTO_LEGACY: bytearray(), PROTO_FRAMED: bytearray()}
+        self.starts = {PROTO_LEGACY: [], PROTO_FRAMED: []}   # offset of each record in bufs
+
+    def append(self, entry):
+        packed = Message(Message.MessageType.MSG_MESSAGE_RECV.value, entry.username, entry.message,
+                         entry.timestamp).pack_all()
+        with self.lock:
+            self.stamps.append(entry.timestamp)
+            for proto, data in packed.items():
+                self.starts[proto].append(len(self.bufs[proto]))
+                self.bufs[proto] += data
+            if len(self.stamps) >= 2 * self.size:
+                self.trim()
+
+    def trim(self):
+        cut = len(self.stamps) - self.size
+        del self.stamps[:cut]
+        for proto, buf in self.bufs.items():
+            starts = self.starts[proto]
+            base = starts[cut]
+            del buf[:base]
+            self.starts[proto] = [start - base for start in starts[cut:]]
+
+    def frames(self, proto, count, since=None):
+        """
+        The replay for a login: the newest count records, only those stamped since or later
+        when since is given, oldest first, and no more of them than fit in HISTORY_REPLAY_BYTES.
+        Returns (buffer, number of records)
+        """
+        with self.lock:
+            n = len(self.stamps)
+            first = n - min(count, self.size, n)
+            if since is not None:
+                first = max(first, bisect.bisect_left(self.stamps, since))
+            starts = self.starts[proto]
+            first = max(first, bisect.bisect_left(starts, len(self.bufs[proto]) - HISTORY_REPLAY_BYTES))
+            if first >= n:
+                return b"", 0
+            with memoryview(self.bufs[proto]) as view:
+                return bytes(view[starts[first]:]), n - first
+
+
+def send_all(sock, data):
+    """
+    Helper to ensure no short writes
+    """
+    view = memoryview(data)
+    while view:
+        n = sock.send(view)
+        if n == 0:
+            raise ConnectionError("socket closed")
+        view = view[n:]
+
+
+def send_frames(sock, data):
+    """
+    send_all() for anything sent after the LOGIN acknowledgement, compressed first when the
+    client negotiated DEFLATE_OPTION
+    """
+    deflater = deflaters.get(sock)
+    if deflater is None:
+        send_all(sock, data)
+        return
+    with deflater.lock:
+        send_all(sock, deflater.encode(data))
+
+
+def recv_all(sock, n):
+    """
+    Helper to ensure no short reads
+    """
+    buf = bytearray()
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise ConnectionError("socket closed")
+        buf.extend(chunk)
+    return bytes(buf)
+
+
+def recv_message(sock, proto=PROTO_LEGACY):
+    """
+    Receive and parse one message in the connection's protocol.
+    Framed messages are read as a header followed by exactly the payload bytes.
+    """
+    if proto == PROTO_FRAMED:
+        header = recv_all(sock, Message.HDR_SIZE)
+        _, uname_len, msg_len, _ = struct.unpack(Message.HDR_FMT, header)
+        if uname_len >= Message.USERNAME_LEN or msg_len >= Message.MESSAGE_LEN:
+            raise ValueError(f"Frame too large ({uname_len}, {msg_len})")
+        return Message.unpack_framed(header, recv_all(sock, uname_len + msg_len))
+    return Message.unpack_message(recv_all(sock, Message.MSG_SIZE))
+
+
+class LogWriter:
+    """
+    Owns the open log file. append() only queues the record; a background thread
+    writes everything queued with one write() and flush() (group commit), at most
+    LOG_COMMIT_INTERVAL after the first record or once LOG_COMMIT_BYTES are pending
+    """
+
+    def __init__(self, path, binary=False):
+        self.binary = binary
+        self.file = open(path, "ab")
+        if binary and self.file.tell() == 0:
+            self.file.write(LOG_MAGIC)
+        self.pending = []
+        self.pending_bytes = 0
+        self.closed = False
+        self.cond = threading.Condition()
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def append(self, entry: LogEntry):
+        record = entry.pack() if self.binary else (entry.serialize() + "\n").encode("utf-8")
+        with self.cond:
+            self.pending.append(record)
+            self.pending_bytes += len(record)
+            if len(self.pending) == 1 or self.pending_bytes >= LOG_COMMIT_BYTES:
+                self.cond.notify()
+
+    def run(self):
+        while True:
+            with self.cond:
+                while not self.pending and not self.closed:
+                    self.cond.wait()
+                # let the rest of the group catch up
+                if not self.closed and self.pending_bytes < LOG_COMMIT_BYTES:
+                    self.cond.wait(LOG_COMMIT_INTERVAL)
+                batch, self.pending, self.pending_bytes = self.pending, [], 0
+                closed = self.closed
+            if batch:
+                try:
+                    self.file.write(b"".join(batch))
+                    self.file.flush()
+                except OSError as e:
+                    print(f"[ERROR] LogWriter lost {len(batch)} records: {e}")
+            if closed:
+                return
+
+    def close(self):
+        """
+        Commit whatever is still queued and close the file
+        """
+        with self.cond:
+            self.closed = True
+            self.cond.notify()
+        self.thread.join()
+        self.file.close()
+
+
+def load_log(path, binary=False):
+    """
+    Stream a log file into history_cache; returns the number of entries parsed.
+    A torn record at the end of a binary log is cut off so appends stay aligned.
+    Only the newest MESSAGE_SENDs are kept, and those are encoded once the whole file is read
+    """
+    history_ring = collections.deque(maxlen=HISTORY_RING_SIZE)
+    amount = read_log(path, binary, history_ring)
+    for entry in history_ring:
+        history_cache.append(entry)
+    return amount
+
+
+def read_log(path, binary, history_ring):
+    amount = 0
+    if not binary:
+        with open(path, "r", encoding="utf-8", errors="ignore") as f:
+            for line in f:
+                line = line.strip()
+                if line:
+                    try:
+                        entry = LogEntry.deserialize(line)
+                    except Exception as e:
+                        print(f"[WARNING] Failed to load log entry: {e}")
+                        continue
+                    if entry.message_type == Message.MessageType.MSG_MESSAGE_SEND.value:
+                        history_ring.append(entry)
+                    amount += 1
+        return amount
+    with open(path, "r+b") as f:
+        if f.read(len(LOG_MAGIC)) != LOG_MAGIC:
+            raise ValueError(f"{path} is not a binary mycord log")
+        good = f.tell()
+        while True:
+            header = f.read(LogEntry.BIN_SIZE)
+            if not header:
+                break
+            if len(header) == LogEntry.BIN_SIZE:
+                _, _, ip_len, uname_len, msg_len = struct.unpack(LogEntry.BIN_FMT, header)
+                body = f.read(ip_len + uname_len + msg_len)
+                if len(body) == ip_len + uname_len + msg_len:
+                    entry = LogEntry.unpack(header, body)
+                    if entry.message_type == Message.MessageType.MSG_MESSAGE_SEND.value:
+                        history_ring.append(entry)
+                    amount += 1
+                    good = f.tell()
+                    continue
+            print(f"[WARNING] Truncating a torn record at the end of {path}")
+            f.truncate(good)
+            break
+    return amount
+
+
+def append_log(entry: LogEntry):
+    """
+    Queue a log entry for the log file, and keep it for history if it is a MESSAGE_SEND.
+    A --workers worker hands it to the coordinator, which owns both
+    """
+    if shard_pipe is not None:
+        shard_pipe.send("log", entry)
+        return
+    if entry.message_type == Message.MessageType.MSG_MESSAGE_SEND.value:
+        history_cache.append(entry)
+    if log_writer:
+        log_writer.append(entry)
+
+
+def send_disconnect(sock, username, reason, ip, proto=PROTO_LEGACY):
+    """
+    Send to the client a disconnect message with the reason
+    """
+    print(f"[ERROR] {ip}: {username} {reason}")
+    append_log(LogEntry(ip, Message.MessageType.MSG_DISCONNECT.value, username, reason))
+    message = Message(Message.MessageType.MSG_DISCONNECT.value, username, reason)
+    try:
+        send_frames(sock, message.pack_message(proto))
+    except Exception as e:
+        print(f"[ERROR] send_disconnect(sock, {username}, {reason}, {ip}): {e}")
+
+
+def login_error(msg):
+    """
+    Check a parsed LOGIN message; returns (username to log, reason) if it must be rejected, else None.
+    Whether the username is already connected is up to the caller's client registry.
+    """
+    if msg.message_type != Message.MessageType.MSG_LOGIN.value:
+        return ("???", "First message must be LOGIN")
+    if not msg.username or not msg.username.strip():
+        return ("???", "Username must not be empty")
+    if not is_ascii(msg.username) or not msg.username.isalnum():
+        return ("???", "Username must be alphanumeric and ASCII")
+    if msg.username in RESERVED_USERNAMES:
+        return (msg.username, "Username is reserved")
+    return None
+
+
+def message_error(text):
+    """
+    Check the text of a MESSAGE_SEND; returns the disconnect reason if it is invalid, else None
+    """
+    if not text:
+        return "Messages must not be empty"
+    if "\n" in text:
+        return "Messages must not contain newlines"
+    if not is_ascii(text) or not text.isprintable():
+        return "Messages must be ASCII"
+    return None
+
+
+def list_text(usernames):
+    return f"There are {len(usernames)} user(s) connected: {', '.join(usernames)}"
+
+
+def welcome_text(count):
+    return f"Welcome! There are {count} user(s) connected. Type !help for commands."
+
+
+def login_options(text):
+    """
+    Parse the LOGIN message field, a space separated option list: PROTO_HELLO asks for
+    PROTO_FRAMED, DEFLATE_OPTION for compressed output (framed only), history=N for N history
+    messages (at most HISTORY_RING_SIZE), since=T for only the history stamped T or later.
+    since=T without history=N replays as much as is kept, so a reconnecting client gets
+    what it missed; HistoryCache.frames() still holds any replay to HISTORY_REPLAY_BYTES.
+    Unknown options are ignored. Returns (proto, history depth, deflate, since or None)
+    """
+    proto, depth, deflate, since = PROTO_LEGACY, None, False, None
+    for option in text.split():
+        if option == PROTO_HELLO:
+            proto = PROTO_FRAMED
+        elif option == DEFLATE_OPTION:
+            deflate = True
+        elif option.startswith("history="):
+            try:
+                depth = max(0, min(int(option[len("history="):]), HISTORY_RING_SIZE))
+            except ValueError:
+                pass
+        elif option.startswith("since="):
+            try:
+                since = max(0, int(option[len("since="):]))
+            except ValueError:
+                pass
+    if depth is None:
+        depth = HISTORY_DEFAULT if since is None else HISTORY_RING_SIZE
+    return proto, depth, deflate and proto == PROTO_FRAMED, since
+
+
+def login_ack(deflate):
+    """
+    The legacy LOGIN frame acknowledging PROTO_HELLO, naming the options that were granted
+    """
+    return Message(Message.MessageType.MSG_LOGIN.value, "SYSTEM",
+                   f"{PROTO_HELLO} {DEFLATE_OPTION}" if deflate else PROTO_HELLO).pack_message()
+
+
+def broadcast_message(message_type: int, username: str, message: str):
+    """
+    Broadcast a message to all clients that are connected
+    """
+    try:
+        message = Message(message_type, username, message)
+        print(f"[MESSAGE] {message_type}\t{datetime.datetime.fromtimestamp(message.timestamp)}\t{username}: {message.message}")
+        # encode once; every recipient gets the same buffer for its protocol version
+        packed = message.pack_all()
+        with clients_lock:
+            for sock, u, ip, proto in clients:
+                try:
+                    send_frames(sock, packed[proto])
+                except Exception as e:
+                    print(f"[ERROR] broadcast_message send_all({message_type}, {username}, {message}, {ip}): {e}")
+    except Exception as e:
+        print(f"[ERROR] broadcast_message({message_type}, {username}, {message}): {e}")
+
+
+def client_thread(sock, addr):
+    """
+    Handle a client connection and all its recieved messages
+    Three step procedure: 1) receive login, 2) send history messages, 3) continually listen for sends/logouts
+    """
+    ip = addr[0]
+    username = ""
+    proto = PROTO_LEGACY
+    message_times = []  # Track message times for rate limiting
+    
+    try:
+        # 1) LOGIN
+        # Can we receive the message?
+        print(f"[INFO] Waiting for LOGIN from {ip}")
+        try:
+            # Set 5 second timeout for login message
+            sock.settimeout(LOGIN_TIMEOUT_SECONDS)
+            data = recv_all(sock, Message.MSG_SIZE)
+            # Reset timeout to None (blocking) after successful login receive
+            sock.settimeout(None)
+        except Exception as e:
+            print(f"[ERROR] client_thread receive {e}")
+            send_disconnect(sock, "???", "Failed to receive LOGIN message within 5s", ip)
+            return
+        
+        # Can we parse the message?
+        try:
+            msg = Message.unpack_message(data)
+        except Exception as e:
+            print(f"[ERROR] client_thread parse {e}")
+            send_disconnect(sock, "???", "Failed to parse LOGIN message", ip)
+            return
+        
+        # Is it a LOGIN with a valid, unreserved username?
+        rejected = login_error(msg)
+        if rejected:
+            send_disconnect(sock, rejected[0], rejected[1], ip)
+            return
+
+        # Check if username is already connected
+        with clients_lock:
+            for _, u, _, _ in clients:
+                if u == msg.username:
+                    send_disconnect(sock, msg.username, "Username already connected", ip)
+                    return
+        username = msg.username
+
+        # Protocol negotiation: acknowledge PROTO_HELLO with a legacy LOGIN frame,
+        # everything after the acknowledgement is framed in both directions
+        proto, depth, deflate, since = login_options(msg.message)
+        ack = b""
+        if proto == PROTO_FRAMED:
+            ack = login_ack(deflate)
+            print(f"[INFO] {username}({ip}) negotiated the framed protocol{' with deflate' if deflate else ''}")
+
+        # 2) HISTORY
+        try:
+            history, count = history_cache.frames(proto, depth, since)
+        except Exception as e:
+            print(f"[ERROR] client_thread history {e}")
+            history, count = b"", 0
+        print(f"[INFO] LOGIN succeeded for {username}({ip}). Sending {count} history messages...")
+        # the acknowledgement and the whole replay go out as one buffer; the replay is the
+        # first thing the deflate stream carries. Nobody else sends here until we join clients
+        if deflate:
+            deflaters[sock] = Deflater()
+            history = deflaters[sock].encode(history)
+        send_all(sock, ack + history)
+
+        print(f"[INFO] History sent for {username}({ip}). Adding client to the broadcast list")
+        # 3) join the clients list and broadcast the login
+        with clients_lock:
+            clients.append((sock, username, ip, proto))
+            num_connected = len(clients)
+        append_log(LogEntry(ip, Message.MessageType.MSG_LOGIN.value, username, f"{username} logged in"))
+        broadcast_message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{username} logged in")
+        
+        # Send welcome message to the newly connected user
+        welcome_msg = Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", welcome_text(num_connected))
+        try:
+            send_frames(sock, welcome_msg.pack_message(proto))
+        except Exception as e:
+            print(f"[ERROR] Failed to send welcome message to {username}({ip}): {e}")
+
+        # Set 15 minute timeout for message receiving
+        TIMEOUT_SECONDS = IDLE_TIMEOUT_SECONDS
+        sock.settimeout(TIMEOUT_SECONDS)
+
+        # 4) Main loop
+        while True:
+            print(f"[INFO] Waiting for LOGOUT/MSGRECV from client")
+            # Can we receive a message?
+            try:
+                msg = recv_message(sock, proto)
+            except socket.timeout:
+                print(f"[ERROR] client_thread timeout: Client {username}({ip}) did not send a message within {TIMEOUT_SECONDS} seconds")
+                send_disconnect(sock, username, f"Disconnected due to timeout (no message received in {TIMEOUT_SECONDS // 60} minutes)", ip, proto)
+                break
+            except (ConnectionError, OSError) as e:
+                print(f"[ERROR] client_thread receive message {e}")
+                send_disconnect(sock, username, "Failed to receive message", ip, proto)
+                break
+            except Exception as e:
+                # Can we parse the message?
+                print(f"[ERROR] client_thread parse message {e}")
+                send_disconnect(sock, username, "Failed to parse message", ip, proto)
+                break
+            
+            # Is this a LOGOUT message?
+            if msg.message_type == Message.MessageType.MSG_LOGOUT.value:
+                print(f"[INFO] Client sent logout.")
+                append_log(LogEntry(ip, Message.MessageType.MSG_LOGOUT.value, username, f"{username} logged out"))
+                break
+            
+            # Is this a MESSAGE_SEND message?
+            elif msg.message_type == Message.MessageType.MSG_MESSAGE_SEND.value:
+                print(f"[INFO] Client sent a message")
+                # Rate limiting: check if >5 messages in last second
+                current_time = time.time()
+                message_times = [t for t in message_times if current_time - t < 1.0]
+                if len(message_times) >= RATE_LIMIT_MSGS:
+                    print(f"[INFO] Client is spamming. Disconnecting client.")
+                    send_disconnect(sock, username, "Too many messages at once (>5 in a second)", ip, proto)
+                    break
+                message_times.append(current_time)
+                
+                # Check message validity
+                invalid = message_error(msg.message)
+                if invalid:
+                    send_disconnect(sock, username, invalid, ip, proto)
+                    break
+                
+                # Log the message
+                append_log(LogEntry(ip, Message.MessageType.MSG_MESSAGE_SEND.value, username, msg.message))
+
+                # Check if the message is a command
+                if msg.message == "!help":
+                    send_frames(sock, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", HELP_TEXT).pack_message(proto))
+                    continue
+                elif msg.message == "!list":
+                    with clients_lock:
+                        message = list_text([u for _, u, _, _ in clients])
+                    send_frames(sock, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", message).pack_message(proto))
+                    continue
+                elif msg.message == "!disconnect":
+                    send_disconnect(sock, username, "User asked to be disconnected", ip, proto)
+                    break
+                
+                # If it wasn't a command, broadcast the message to everyone
+                print(f"[INFO] Broadcasting client message to everyone")
+                broadcast_message(Message.MessageType.MSG_MESSAGE_RECV.value, username, msg.message)
+
+            else:
+                send_disconnect(sock, username, "Message type not supported", ip, proto)
+                break
+
+    except ConnectionError:
+        print(f"[INFO] Client {ip} disconnected")
+    except Exception as e:
+        print(f"[ERROR] client_thread({ip}): {e}")
+        send_disconnect(sock, username, f"You caused a server error", ip, proto)
+    finally:
+        with clients_lock:
+            for i, (s, u, ip2, _) in enumerate(clients):
+                if s is sock:
+                    clients.pop(i)
+                    break
+        deflaters.pop(sock, None)
+        try:
+            sock.close()
+        except Exception as e:
+            print(f"[ERROR] client_thread finally {e}")
+        if username:
+            broadcast_message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{username} has disconnected")
+
+
+# ---------------------------------------------------------------------------
+# Async engine (--async): one selector loop drives every connection with
+# non-blocking sockets instead of a thread per client. Each client owns an
+# outbound queue, so a slow reader only delays itself; once its unsent
+# backlog passes OUTQ_HIGH_WATER it is dropped rather than stalling the room.
+# ---------------------------------------------------------------------------
+
+OUTQ_HIGH_WATER = 256 * 1024   # unsent bytes queued for one client before it is dropped
+RECV_CHUNK = 64 * 1024
+SEND_IOV_MAX = 64              # queued buffers handed to one sendmsg()
+CLOSE_GRACE_SECONDS = 1        # how long a queued DISCONNECT gets to flush
+
+
+class AsyncClient:
+    __slots__ = ("sock", "conn", "ip", "username", "proto", "deflater", "claim", "inbuf", "outq", "out_bytes",
+                 "out_exempt", "logged_in", "closing", "dead", "writing", "dirty", "deadline", "message_times")
+
+    def __init__(self, sock, addr, conn):
+        self.sock = sock
+        self.conn = conn       # id the coordinator knows this connection by (--workers)
+        self.ip = addr[0]
+        self.username = ""
+        self.proto = PROTO_LEGACY
+        self.deflater = None   # a Deflater once DEFLATE_OPTION is granted
+        self.claim = None      # (--workers) deflate flag while the coordinator decides on the LOGIN
+        self.inbuf = bytearray()
+        self.outq = collections.deque()   # bytes / memoryview chunks, oldest first
+        self.out_bytes = 0
+        self.out_exempt = 0    # of out_bytes, those queued with force (the login replay) and not sent yet
+        self.logged_in = False
+        self.closing = False   # a DISCONNECT is queued, close once it is flushed
+        self.dead = False      # waiting to be closed by AsyncServer.reap()
+        self.writing = False   # registered for EVENT_WRITE
+        self.dirty = False     # queued since the last flush, on AsyncServer.dirty
+        self.deadline = time.monotonic() + LOGIN_TIMEOUT_SECONDS
+        self.message_times = []
+
+
+class AsyncServer:
+
+    def __init__(self, srv, shard=None):
+        self.srv = srv
+        self.shard = shard     # ShardPipe to the coordinator when this is a --workers worker
+        self.sel = selectors.DefaultSelector()
+        self.clients = {}      # socket -> AsyncClient, every accepted connection
+        self.conns = {}        # AsyncClient.conn -> AsyncClient
+        self.users = {}        # username -> AsyncClient, the broadcast set (this shard's share of it)
+        self.next_conn = 0
+        self.dirty = []
+        self.doomed = []
+        srv.setblocking(False)
+        self.sel.register(srv, selectors.EVENT_READ, None)
+        if shard is not None:
+            self.sel.register(shard.sock, selectors.EVENT_READ, shard)
+        # the signal handler only flips `running`; the wakeup fd gets select() to notice
+        self.wake_r, self.wake_w = socket.socketpair()
+        self.wake_r.setblocking(False)
+        self.wake_w.setblocking(False)
+        signal.set_wakeup_fd(self.wake_w.fileno())
+        self.sel.register(self.wake_r, selectors.EVENT_READ, None)
+
+    def run(self):
+        next_sweep = time.monotonic() + 1
+        while running:
+            for key, events in self.sel.select(timeout=1.0):
+                c = key.data
+                if c is None:
+                    if key.fileobj is self.srv:
+                        self.accept()
+                    else:
+                        self.wake_r.recv(4096)
+                    continue
+                if c is self.shard:
+                    self.coordinator_events(events)
+                    continue
+                if events & selectors.EVENT_WRITE and not c.dead:
+                    self.flush(c)
+                if events & selectors.EVENT_READ and not c.dead and not c.closing:
+                    self.readable(c)
+            self.flush_dirty()
+            self.reap()
+            if self.shard is not None:
+                self.shard.sync(self.sel)
+            now = time.monotonic()
+            if now >= next_sweep:
+                self.sweep(now)
+                self.flush_dirty()
+                self.reap()
+                next_sweep = now + 1
+        self.shutdown()
+
+    def accept(self):
+        while True:
+            try:
+                sock, addr = self.srv.accept()
+            except (BlockingIOError, InterruptedError):
+                return
+            except OSError as e:
+                # typically EMFILE: leave the rest in the backlog until a slot frees up
+                print(f"[ERROR] accept: {e}")
+                return
+            print(f"[INFO] Accepted connection from {addr[0]}:{addr[1]}")
+            sock.setblocking(False)
+            c = AsyncClient(sock, addr, self.next_conn)
+            self.next_conn += 1
+            self.clients[sock] = c
+            self.conns[c.conn] = c
+            self.sel.register(sock, selectors.EVENT_READ, c)
+
+    def readable(self, c):
+        try:
+            data = c.sock.recv(RECV_CHUNK)
+        except (BlockingIOError, InterruptedError):
+            return
+        except OSError as e:
+            print(f"[ERROR] receive message {c.ip}: {e}")
+            data = b""
+        if not data:
+            if c.logged_in:
+                self.disconnect(c, "Failed to receive message")
+            else:
+                self.disconnect(c, "Failed to receive LOGIN message within 5s", "???")
+            return
+        c.inbuf += data
+        self.parse(c)
+
+    def parse(self, c):
+        buf = c.inbuf
+        pos = 0
+        # a LOGIN waiting on the coordinator holds back everything after it
+        while not c.closing and not c.dead and c.claim is None:
+            try:
+                if c.proto == PROTO_FRAMED:
+                    if len(buf) - pos < Message.HDR_SIZE:
+                        break
+                    _, uname_len, msg_len, _ = struct.unpack_from(Message.HDR_FMT, buf, pos)
+                    if uname_len >= Message.USERNAME_LEN or msg_len >= Message.MESSAGE_LEN:
+                        raise ValueError(f"Frame too large ({uname_len}, {msg_len})")
+                    end = pos + Message.HDR_SIZE + uname_len + msg_len
+                    if len(buf) < end:
+                        break
+                    msg = Message.unpack_framed(bytes(buf[pos:pos + Message.HDR_SIZE]),
+                                                bytes(buf[pos + Message.HDR_SIZE:end]))
+                else:
+                    end = pos + Message.MSG_SIZE
+                    if len(buf) < end:
+                        break
+                    msg = Message.unpack_message(bytes(buf[pos:end]))
+            except Exception as e:
+                print(f"[ERROR] parse message {c.ip}: {e}")
+                if c.logged_in:
+                    self.disconnect(c, "Failed to parse message")
+                else:
+                    self.disconnect(c, "Failed to parse LOGIN message", "???")
+                break
+            pos = end
+            if c.logged_in:
+                self.on_message(c, msg)
+            else:
+                self.on_login(c, msg)
+        del buf[:pos]
+
+    def on_login(self, c, msg):
+        rejected = login_error(msg)
+        if not rejected and self.shard is None and msg.username in self.users:
+            rejected = (msg.username, "Username already connected")
+        if rejected:
+            self.disconnect(c, rejected[1], rejected[0])
+            return
+        c.username = msg.username
+        c.proto, depth, deflate, since = login_options(msg.message)
+        if self.shard is not None:
+            # usernames and history live in the coordinator; on_grant()/on_deny() carry on
+            c.claim = deflate
+            self.shard.send("claim", c.conn, c.username, c.ip, c.proto, depth, since)
+            return
+        self.admit(c, history_cache.frames(c.proto, depth, since), deflate)
+        if not c.logged_in:
+            return
+        append_log(LogEntry(c.ip, Message.MessageType.MSG_LOGIN.value, c.username, f"{c.username} logged in"))
+        self.broadcast(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{c.username} logged in")
+        self.system(c, welcome_text(len(self.users)))
+
+    def admit(self, c, history, deflate):
+        """
+        Acknowledge the options, replay history (HistoryCache.frames()) and add c to the broadcast set.
+        The replay is queued before the client has had a chance to read anything, so it is sent
+        with force: it is not held against OUTQ_HIGH_WATER
+        """
+        if c.proto == PROTO_FRAMED:
+            self.send(c, login_ack(deflate), force=True)
+            print(f"[INFO] {c.username}({c.ip}) negotiated the framed protocol{' with deflate' if deflate else ''}")
+        if deflate:
+            c.deflater = Deflater()
+
+        frames, count = history
+        if frames:
+            self.send(c, frames, force=True)
+        if c.dead:
+            return
+        print(f"[INFO] LOGIN succeeded for {c.username}({c.ip}), sent {count} history messages")
+
+        c.logged_in = True
+        c.deadline = time.monotonic() + IDLE_TIMEOUT_SECONDS
+        self.users[c.username] = c
+
+    def on_message(self, c, msg):
+        c.deadline = time.monotonic() + IDLE_TIMEOUT_SECONDS
+        if msg.message_type == Message.MessageType.MSG_LOGOUT.value:
+            append_log(LogEntry(c.ip, Message.MessageType.MSG_LOGOUT.value, c.username, f"{c.username} logged out"))
+            self.kill(c)
+            return
+        if msg.message_type != Message.MessageType.MSG_MESSAGE_SEND.value:
+            self.disconnect(c, "Message type not supported")
+            return
+
+        current_time = time.time()
+        c.message_times = [t for t in c.message_times if current_time - t < 1.0]
+        if len(c.message_times) >= RATE_LIMIT_MSGS:
+            self.disconnect(c, "Too many messages at once (>5 in a second)")
+            return
+        c.message_times.append(current_time)
+
+        invalid = message_error(msg.message)
+        if invalid:
+            self.disconnect(c, invalid)
+            return
+        append_log(LogEntry(c.ip, Message.MessageType.MSG_MESSAGE_SEND.value, c.username, msg.message))
+
+        if msg.message == "!help":
+            self.system(c, HELP_TEXT)
+        elif msg.message == "!list":
+            if self.shard is not None:
+                self.shard.send("list", c.conn)
+            else:
+                self.system(c, list_text(list(self.users)))
+        elif msg.message == "!disconnect":
+            self.disconnect(c, "User asked to be disconnected")
+        else:
+            self.broadcast(Message.MessageType.MSG_MESSAGE_RECV.value, c.username, msg.message)
+
+    def system(self, c, text):
+        self.send(c, Message(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", text).pack_message(c.proto))
+
+    def broadcast(self, message_type, username, text):
+        message = Message(message_type, username, text)
+        if self.shard is not None:
+            # the coordinator puts it in order with every other shard's broadcasts and hands it back
+            self.shard.send("bcast", message_type, username, text, message.timestamp)
+            return
+        print(f"[MESSAGE] {message_type}\t{datetime.datetime.fromtimestamp(message.timestamp)}\t{username}: {text}")
+        self.deliver(message)
+
+    def deliver(self, message):
+        packed = message.pack_all()
+        for c in list(self.users.values()):
+            self.send(c, packed[c.proto])
+
+    def coordinator_events(self, events):
+        global running
+        if events & selectors.EVENT_WRITE:
+            self.shard.flush()
+        if events & selectors.EVENT_READ:
+            for op, *args in self.shard.receive():
+                if op == "bcast":
+                    self.deliver(Message(*args))
+                elif op == "grant":
+                    self.on_grant(*args)
+                elif op == "deny":
+                    self.on_deny(*args)
+                elif op == "system":
+                    c = self.conns.get(args[0])
+                    if c is not None and c.logged_in:
+                        self.system(c, args[1])
+        if self.shard.closed:
+            print("[ERROR] Lost the coordinator, shutting down...")
+            self.sel.unregister(self.shard.sock)
+            running = False
+
+    def on_grant(self, conn, username, history):
+        c = self.conns.get(conn)
+        if c is None or c.dead or c.closing:
+            self.shard.send("leave", conn, username)
+            return
+        deflate, c.claim = c.claim, None
+        self.admit(c, history, deflate)
+        if not c.logged_in:
+            self.shard.send("leave", conn, username)
+            return
+        self.parse(c)
+
+    def on_deny(self, conn, username, reason):
+        c = self.conns.get(conn)
+        if c is None or c.dead or c.closing:
+            return
+        c.claim = None
+        c.username = ""
+        self.disconnect(c, reason, username)
+
+    def send(self, c, data, force=False):
+        """
+        Queue data for a client. Queues are written out once per loop pass by
+        flush_dirty(), so everything sent to a client in one pass (a login
+        storm's broadcasts, say) costs it a single sendmsg().
+        A client whose backlog passes OUTQ_HIGH_WATER is dropped. force skips that check, and the
+        forced bytes do not count towards it until they are sent, so a large login replay does
+        not get the traffic queued right behind it dropped.
+        Data is compressed here, in the order it was sent, for clients with a Deflater.
+        """
+        if c.dead:
+            return
+        if c.deflater is not None:
+            data = c.deflater.encode(data)
+        c.outq.append(data)
+        c.out_bytes += len(data)
+        if force:
+            c.out_exempt += len(data)
+        elif c.out_bytes - c.out_exempt > OUTQ_HIGH_WATER:
+            reason = f"Disconnected for falling behind (over {OUTQ_HIGH_WATER // 1024} KiB unsent)"
+            print(f"[ERROR] {c.ip}: {c.username} {reason}")
+            append_log(LogEntry(c.ip, Message.MessageType.MSG_DISCONNECT.value, c.username, reason))
+            self.kill(c)
+            return
+        if not c.writing and not c.dirty:
+            c.dirty = True
+            self.dirty.append(c)
+
+    def flush_dirty(self):
+        dirty, self.dirty = self.dirty, []
+        for c in dirty:
+            c.dirty = False
+            if not c.dead:
+                self.flush(c)
+
+    def flush(self, c):
+        while c.outq:
+            chunks = [c.outq[i] for i in range(min(len(c.outq), SEND_IOV_MAX))]
+            try:
+                n = c.sock.sendmsg(chunks)
+            except (BlockingIOError, InterruptedError):
+                break
+            except OSError as e:
+                print(f"[ERROR] send {c.username}({c.ip}): {e}")
+                self.kill(c)
+                return
+            c.out_bytes -= n
+            c.out_exempt = max(0, c.out_exempt - n)
+            while n:
+                head = c.outq[0]
+                if n >= len(head):
+                    n -= len(head)
+                    c.outq.popleft()
+                else:
+                    c.outq[0] = memoryview(head)[n:]
+                    n = 0
+        if c.outq:
+            if not c.writing:
+                c.writing = True
+                self.sel.modify(c.sock, selectors.EVENT_READ | selectors.EVENT_WRITE, c)
+        elif c.closing:
+            self.kill(c)
+        elif c.writing:
+            c.writing = False
+            self.sel.modify(c.sock, selectors.EVENT_READ, c)
+
+    def disconnect(self, c, reason, username=None):
+        """
+        Counterpart of send_disconnect(): log, queue the DISCONNECT and close once it is flushed
+        """
+        username = c.username if username is None else username
+        print(f"[ERROR] {c.ip}: {username} {reason}")
+        append_log(LogEntry(c.ip, Message.MessageType.MSG_DISCONNECT.value, username, reason))
+        self.leave(c)
+        c.closing = True
+        c.deadline = time.monotonic() + CLOSE_GRACE_SECONDS
+        self.send(c, Message(Message.MessageType.MSG_DISCONNECT.value, username, reason).pack_message(c.proto),
+                  force=True)
+
+    def leave(self, c):
+        if c.logged_in and self.users.get(c.username) is c:
+            del self.users[c.username]
+            if self.shard is not None:
+                self.shard.send("leave", c.conn, c.username)
+
+    def kill(self, c):
+        if not c.dead:
+            c.dead = True
+            self.leave(c)
+            self.doomed.append(c)
+
+    def reap(self):
+        """
+        Close killed clients outside of event dispatch, so a broadcast never
+        mutates the client tables it is iterating over
+        """
+        while self.doomed:
+            c = self.doomed.pop()
+            self.sel.unregister(c.sock)
+            del self.clients[c.sock]
+            del self.conns[c.conn]
+            try:
+                c.sock.close()
+            except OSError as e:
+                print(f"[ERROR] close {c.username}({c.ip}): {e}")
+            # c.username is set while a LOGIN is still being admitted; only someone who joined can leave
+            if c.logged_in:
+                self.broadcast(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{c.username} has disconnected")
+
+    def sweep(self, now):
+        for c in list(self.clients.values()):
+            if c.dead or now < c.deadline:
+                continue
+            if c.closing:
+                self.kill(c)
+            elif not c.logged_in:
+                self.disconnect(c, "Failed to receive LOGIN message within 5s", "???")
+            else:
+                self.disconnect(c, f"Disconnected due to timeout (no message received in {IDLE_TIMEOUT_SECONDS // 60} minutes)")
+
+    def shutdown(self):
+        print("[INFO] Closing server...")
+        self.sel.unregister(self.srv)
+        self.srv.close()
+        print("[INFO] Sending disconnect messages and closing connections...")
+        for c in list(self.users.values()):
+            self.disconnect(c, "Server is shutting down")
+        # give the DISCONNECTs up to a second to drain, then close whatever is left.
+        # Nobody is logged in anymore, so reap() has no one to announce departures to
+        end = time.monotonic() + CLOSE_GRACE_SECONDS
+        self.flush_dirty()
+        while any(c.outq for c in self.clients.values() if not c.dead) and time.monotonic() < end:
+            for key, events in self.sel.select(timeout=0.1):
+                if key.data is not None and events & selectors.EVENT_WRITE and not key.data.dead:
+                    self.flush(key.data)
+            self.reap()
+        for c in list(self.clients.values()):
+            self.kill(c)
+        self.reap()
+        signal.set_wakeup_fd(-1)
+        self.sel.close()
+
+
+SHARD_HDR = struct.Struct("!I")   # length prefix of one pickled ShardPipe message
+SHARD_STOP_SECONDS = 3            # how long workers get to say goodbye to their clients
+
+
+class ShardPipe:
+    """
+    One end of a coordinator <-> worker socketpair (--workers). Messages are pickled tuples
+    (op, args...) behind a length prefix. Both ends are non-blocking and queue what the peer
+    has not taken yet, so a busy worker never stalls the coordinator or the other way around
+    """
+
+    def __init__(self, sock, index=0):
+        self.sock = sock
+        self.index = index     # the worker on the far end, as the coordinator counts them
+        self.inbuf = bytearray()
+        self.outq = collections.deque()
+        self.events = selectors.EVENT_READ
+        self.closed = False
+        sock.setblocking(False)
+
+    @staticmethod
+    def encode(*msg):
+        data = pickle.dumps(msg, pickle.HIGHEST_PROTOCOL)
+        return SHARD_HDR.pack(len(data)) + data
+
+    def send(self, *msg):
+        self.send_encoded(ShardPipe.encode(*msg))
+
+    def send_encoded(self, data):
+        if not self.closed:
+            self.outq.append(data)
+
+    def flush(self):
+        while self.outq and not self.closed:
+            chunks = [self.outq[i] for i in range(min(len(self.outq), SEND_IOV_MAX))]
+            try:
+                n = self.sock.sendmsg(chunks)
+            except (BlockingIOError, InterruptedError):
+                return
+            except OSError:
+                self.closed = True
+                return
+            while n:
+                head = self.outq[0]
+                if n >= len(head):
+                    n -= len(head)
+                    self.outq.popleft()
+                else:
+                    self.outq[0] = memoryview(head)[n:]
+                    n = 0
+
+    def sync(self, sel):
+        """
+        Write what is queued and watch for writability only while something is left over
+        """
+        self.flush()
+        if self.closed:
+            return
+        events = selectors.EVENT_READ | (selectors.EVENT_WRITE if self.outq else 0)
+        if events != self.events:
+            self.events = events
+            sel.modify(self.sock, events, self)
+
+    def receive(self):
+        try:
+            data = self.sock.recv(RECV_CHUNK)
+        except (BlockingIOError, InterruptedError):
+            return []
+        except OSError:
+            data = b""
+        if not data:
+            self.closed = True
+            return []
+        self.inbuf += data
+        msgs = []
+        pos = 0
+        while len(self.inbuf) - pos >= SHARD_HDR.size:
+            (size,) = SHARD_HDR.unpack_from(self.inbuf, pos)
+            end = pos + SHARD_HDR.size + size
+            if len(self.inbuf) < end:
+                break
+            msgs.append(pickle.loads(self.inbuf[pos + SHARD_HDR.size:end]))
+            pos = end
+        del self.inbuf[:pos]
+        return msgs
+
+    def drain(self, timeout):
+        """
+        Blocking flush for a worker on its way out
+        """
+        end = time.monotonic() + timeout
+        with selectors.DefaultSelector() as sel:
+            sel.register(self.sock, selectors.EVENT_WRITE)
+            self.flush()
+            while self.outq and not self.closed and time.monotonic() < end:
+                sel.select(timeout=0.1)
+                self.flush()
+
+
+class Coordinator:
+    """
+    The parent process of --workers. The workers own the client sockets, each through its
+    own SO_REUSEPORT listener; the coordinator owns the log writer, the history ring and the
+    username registry. Every broadcast passes through here on its way to all the workers,
+    which puts them in one order for everyone and lets each worker encode a message once
+    for all of its own clients
+    """
+
+    def __init__(self, workers):
+        self.pids = [pid for pid, _ in workers]
+        self.pipes = [pipe for _, pipe in workers]
+        self.users = {}        # username -> (worker index, conn), the whole room
+        self.sel = selectors.DefaultSelector()
+        for pipe in self.pipes:
+            self.sel.register(pipe.sock, selectors.EVENT_READ, pipe)
+        self.wake_r, self.wake_w = socket.socketpair()
+        self.wake_r.setblocking(False)
+        self.wake_w.setblocking(False)
+        signal.set_wakeup_fd(self.wake_w.fileno())
+        self.sel.register(self.wake_r, selectors.EVENT_READ, None)
+
+    def run(self):
+        stop_by = None
+        while any(not p.closed for p in self.pipes):
+            if not running and stop_by is None:
+                # workers say goodbye to their clients, logging through us, then hang up
+                stop_by = time.monotonic() + SHARD_STOP_SECONDS
+                for pid in self.pids:
+                    try:
+                        os.kill(pid, signal.SIGTERM)
+                    except ProcessLookupError:
+                        pass
+            if stop_by is not None and time.monotonic() >= stop_by:
+                print("[WARNING] Workers did not stop in time")
+                break
+            for key, events in self.sel.select(timeout=0.5):
+                pipe = key.data
+                if pipe is None:
+                    self.wake_r.recv(4096)
+                    continue
+                if events & selectors.EVENT_WRITE:
+                    pipe.flush()
+                if events & selectors.EVENT_READ:
+                    for op, *args in pipe.receive():
+                        self.handle(pipe, op, args)
+            for pipe in self.pipes:
+                pipe.sync(self.sel)
+                if pipe.closed and pipe.sock.fileno() >= 0:
+                    self.lost(pipe)
+        for pid in self.pids:
+            try:
+                os.kill(pid, signal.SIGKILL)
+            except ProcessLookupError:
+                pass
+            os.waitpid(pid, 0)
+        signal.set_wakeup_fd(-1)
+        self.sel.close()
+
+    def handle(self, pipe, op, args):
+        if op == "log":
+            append_log(args[0])
+        elif op == "bcast":
+            self.broadcast(*args)
+        elif op == "claim":
+            conn, username, ip, proto, depth, since = args
+            if username in self.users:
+                pipe.send("deny", conn, username, "Username already connected")
+                return
+            self.users[username] = (pipe.index, conn)
+            # the grant goes first, so the "logged in" broadcast finds the user in its shard
+            pipe.send("grant", conn, username, history_cache.frames(proto, depth, since))
+            append_log(LogEntry(ip, Message.MessageType.MSG_LOGIN.value, username, f"{username} logged in"))
+            self.broadcast(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{username} logged in")
+            pipe.send("system", conn, welcome_text(len(self.users)))
+        elif op == "leave":
+            conn, username = args
+            if self.users.get(username) == (pipe.index, conn):
+                del self.users[username]
+        elif op == "list":
+            pipe.send("system", args[0], list_text(list(self.users)))
+
+    def broadcast(self, message_type, username, text, timestamp=None):
+        message = Message(message_type, username, text, timestamp)
+        print(f"[MESSAGE] {message_type}\t{datetime.datetime.fromtimestamp(message.timestamp)}\t{username}: {text}")
+        data = ShardPipe.encode("bcast", message_type, username, text, message.timestamp)
+        for pipe in self.pipes:
+            pipe.send_encoded(data)
+
+    def lost(self, pipe):
+        """
+        A worker hung up: its users are gone as far as everyone else is concerned
+        """
+        self.sel.unregister(pipe.sock)
+        pipe.sock.close()
+        if running:
+            print(f"[ERROR] Worker {pipe.index} exited")
+        gone = [u for u, (index, _) in self.users.items() if index == pipe.index]
+        for username in gone:
+            del self.users[username]
+            if running:
+                self.broadcast(Message.MessageType.MSG_SYSTEM.value, "SYSTEM", f"{username} has disconnected")
+
+
+def run_worker(srv, pipe):
+    """
+    Body of one --workers child: an AsyncServer over its own listener, logging through the coordinator
+    """
+    global shard_pipe
+    shard_pipe = pipe
+    try:
+        AsyncServer(srv, pipe).run()
+        pipe.drain(CLOSE_GRACE_SECONDS)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        sys.stdout.flush()
+        # skip the parent's atexit work and its inherited log file
+        os._exit(0)
+
+
+def run_sharded(port, count):
+    """
+    Fork count workers, one SO_REUSEPORT listener each, and coordinate them until shutdown
+    """
+    listeners = []
+    for _ in range(count):
+        srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        srv.bind(("0.0.0.0", port))
+        srv.listen(socket.SOMAXCONN)
+        listeners.append(srv)
+    print(f"[INFO] mycord server ({count} workers) listening on 0.0.0.0:{port}")
+    sys.stdout.flush()
+
+    workers = []
+    for index, srv in enumerate(listeners):
+        mine, theirs = socket.socketpair()
+        pid = os.fork()
+        if pid == 0:
+            for other in listeners:
+                if other is not srv:
+                    other.close()
+            for _, pipe in workers:
+                pipe.sock.close()
+            mine.close()
+            run_worker(srv, ShardPipe(theirs))
+        theirs.close()
+        workers.append((pid, ShardPipe(mine, index)))
+    for srv in listeners:
+        srv.close()
+
+    try:
+        Coordinator(workers).run()
+    except KeyboardInterrupt:
+        print("[INFO] KeyboardInterrupt, shutting down...")
+
+
+def raise_fd_limit():
+    """
+    Thousands of clients need thousands of fds; lift the soft limit as far as the hard limit allows
+    """
+    try:
+        soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+        if hard == resource.RLIM_INFINITY or hard > soft:
+            target = 1 << 20 if hard == resource.RLIM_INFINITY else hard
+            resource.setrlimit(resource.RLIMIT_NOFILE, (target, hard))
+            soft = target
+        print(f"[INFO] File descriptor limit is {soft}")
+    except (ValueError, OSError) as e:
+        print(f"[WARNING] Could not raise the file descriptor limit: {e}")
+
+
+def signal_handler(signum, frame):
+    """
+    Handle SIGINT and SIGTERM signals by closing the server socket.
+    This causes srv.accept() to raise an exception, allowing the finally block to execute.
+    """
+    global server_socket, running
+    signal_name = signal.Signals(signum).name
+    print(f"[INFO] Received {signal_name}, shutting down...")
+    running = False
+    if server_socket:
+        try:
+            server_socket.close()
+        except Exception as e:
+            print(f"[ERROR] Error closing server socket in signal handler: {e}")
+
+
+def main():
+    global running, server_socket, log_writer, history_cache
+
+    # Register signal handlers for graceful shutdown
+    signal.signal(signal.SIGINT, signal_handler)
+    signal.signal(signal.SIGTERM, signal_handler)
+
+    # give the students a random port that is based on their username to avoid possible conflicts
+    # they can specify with argv[1] an alternative port number if they want to
+    # --async selects the selector engine instead of a thread per client
+    # --binary-log keeps the log as compact binary records in messages.bin
+    # --workers N shards the clients over N selector-engine processes (0: one per core)
+    args = sys.argv[1:]
+    use_async = "--async" in args
+    binary_log = "--binary-log" in args
+    workers = None
+    if "--workers" in args:
+        i = args.index("--workers")
+        try:
+            workers = int(args[i + 1]) if i + 1 < len(args) else 0
+        except ValueError:
+            print(f"[ERROR] --workers needs a number, not {args[i + 1]}")
+            return
+        if workers <= 0:
+            workers = os.cpu_count() or 1
+        del args[i:i + 2]
+    args = [a for a in args if a not in ("--async", "--binary-log")]
+    log_path = LOG_FILE_BINARY if binary_log else LOG_FILE
+    port = hash(os.environ["USER"]) % (65535 - 2000) + 2000
+    if len(args) >= 1:
+        port = int(args[0])
+
+    print("[INFO] Loading history")
+    history_cache = HistoryCache(HISTORY_RING_SIZE)
+    try:
+        if not os.path.exists(log_path):
+            print("[INFO] Creating new log file")
+            amount = 30
+            log_writer = LogWriter(log_path, binary_log)
+            random_usernames = ["abc123", "def456", "ghi789"]
+            current_username = os.environ["USER"]
+            for i in range(1, amount + 1):
+                append_log(
+                    LogEntry(
+                        "0.0.0.0", 
+                        Message.MessageType.MSG_MESSAGE_SEND.value, 
+                        random_usernames[i % len(random_usernames)], 
+                        f"This is an old message {i}" + (f" with @{current_username} metion" if i % 28 == 0 else "")
+                    )
+                )
+        else:
+            # Try to load existing log file; only the recent MESSAGE_SENDs stay in memory
+            amount = load_log(log_path, binary_log)
+            log_writer = LogWriter(log_path, binary_log)
+    except Exception as e:
+            print(f"[ERROR] Failed to load history: {e}")
+            return
+    print(f"[INFO] Parsed {amount} messages from the history file")
+
+    # start the server
+    if workers is not None:
+        raise_fd_limit()
+        run_sharded(port, workers)
+        log_writer.close()
+        print("[INFO] Bye!")
+        return
+    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    srv.bind(("0.0.0.0", port))
+    if use_async:
+        raise_fd_limit()
+        srv.listen(socket.SOMAXCONN)
+        print(f"[INFO] mycord server (async engine) listening on 0.0.0.0:{port}")
+        try:
+            AsyncServer(srv).run()
+        except KeyboardInterrupt:
+            print("[INFO] KeyboardInterrupt, shutting down...")
+        log_writer.close()
+        print("[INFO] Bye!")
+        return
+    srv.listen(300)
+    server_socket = srv  # Store in global for signal handlers
+    print(f"[INFO] mycord server listening on 0.0.0.0:{port}")
+
+    try:
+        while running:
+            sock, addr = srv.accept()
+            print(f"[INFO] Accepted connection from {addr[0]}:{addr[1]}")
+            th = threading.Thread(target=client_thread, args=(sock, addr), daemon=True)
+            th.start()
+    except KeyboardInterrupt:
+        print("[INFO] KeyboardInterrupt, shutting down...")
+    except OSError:
+        # Socket closed by signal handler or other means
+        if running:
+            raise  # Re-raise if it wasn't intentional
+        print("[INFO] Server socket closed, shutting down...")
+    finally:
+        running = False
+        print("[INFO] Closing server...")
+        srv.close()
+        print("[INFO] Sending disconnect messages and closing connections...")
+        with clients_lock:
+            for sock, u, ip, proto in clients:
+                try:
+                    # Set 1 second timeout for disconnect send in case socket is dead
+                    sock.settimeout(1.0)
+                    send_disconnect(sock, u, "Server is shutting down", ip, proto)
+                except Exception as e:
+                    print(f"[ERROR] Failed to send disconnect to {u}({ip}): {e}")
+                finally:
+                    # Always close the socket after attempting to send disconnect
+                    try:
+                        sock.close()
+                    except Exception as e:
+                        print(f"[ERROR] Failed to close socket for {u}({ip}): {e}")
+            clients.clear()
+        log_writer.close()
+        print("[INFO] Bye!")
+
+
+if __name__ == "__main__":
+    main()